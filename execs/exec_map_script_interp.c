@@ -11,6 +11,23 @@
 #include "exported.h"
 
 #include "sb2_execs.h"
+#include "rule_tree_rpc.h"
+#include "sb2_stat.h"
+
+/* Write the message that the exec policy wants to see
+ * when a script is started (if any) */
+void exec_log_script_interpreter(exec_policy_handle_t eph)
+{
+	const char	*log_level;
+
+	log_level = EXEC_POLICY_GET_STRING(eph, script_log_level);
+	if (log_level) {
+		const char	*log_message;
+
+		log_message = EXEC_POLICY_GET_STRING(eph, script_log_message);
+		SB_LOG(sblog_level_name_to_number(log_level), "%s", log_message);
+	}
+}
 
 /* A very straightforward conversion from Lua:
  *
@@ -32,7 +49,6 @@ int exec_map_script_interpreter(
 	const char **new_exec_policy_p,
 	char	   **mapped_interpreter_p)
 {
-	const char		*log_level = NULL;
 	uint32_t /*FIXME*/	rule_list_offs = 0;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: interp=%s, interp_arg=%s policy=%s ", __func__,
@@ -43,13 +59,7 @@ int exec_map_script_interpreter(
 
 	(void)mapped_script_filename; /* not used */
 
-	log_level = EXEC_POLICY_GET_STRING(eph, script_log_level);
-	if (log_level) {
-		const char	*log_message;
-
-		log_message = EXEC_POLICY_GET_STRING(eph, script_log_message);
-		SB_LOG(sblog_level_name_to_number(log_level), "%s", log_message);
-	}
+	exec_log_script_interpreter(eph);
 
 	if (EXEC_POLICY_GET_BOOLEAN(eph, script_deny_exec)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: denied, returns -1", __func__);
@@ -90,4 +100,202 @@ int exec_map_script_interpreter(
 	return(2);
 }
 
+/* ---------- Script interpreter cache ----------
+ * Builds run the same scripts (libtool, config.status, ...) again
+ * and again, so results of the interpreter mapping are stored to
+ * the rule tree by sb2d, with the script's dev+ino as the key.
+ * An entry is valid if the script has not been changed (mtime, size)
+ * and the mapping had the same inputs (the "context hash" covers
+ * everything except environment variables and the file system;
+ * results which depended on those are not cached, see
+ * mapping_result_is_volatile in struct sb2context).
+ * The file system is checked when an entry is used: The mapped
+ * interpreter must still be the same file, and the symlinks that
+ * were followed while mapping it must still point to the same places.
+*/
+
+/* FNV-1a; NULL and "" are different. */
+static uint64_t hash_string(uint64_t h, const char *str)
+{
+	if (!str) {
+		h ^= 0xFF;
+		return(h * 0x100000001B3ULL);
+	}
+	do {
+		h ^= (unsigned char)*str;
+		h *= 0x100000001B3ULL;
+	} while (*str++);
+	return(h);
+}
+
+/* Hash the current destinations of the symlinks in "followed_symlinks"
+ * (host paths, each followed by '\n').
+ * returns 0 if OK, negative if some of them is not a symlink anymore */
+static int hash_followed_symlinks(const char *followed_symlinks,
+	uint64_t *hash_p)
+{
+	uint64_t	h = 0xCBF29CE484222325ULL;
+	char		path[PATH_MAX + 1];
+	char		link_dest[PATH_MAX + 1];
+	const char	*cp = followed_symlinks;
+
+	while (cp && *cp) {
+		const char	*nl = strchr(cp, '\n');
+		size_t		len;
+		int		link_len;
+
+		if (!nl) return(-1);
+		len = nl - cp;
+		if (len > PATH_MAX) return(-1);
+		memcpy(path, cp, len);
+		path[len] = '\0';
+		link_len = readlink_nomap(path, link_dest, PATH_MAX);
+		if (link_len <= 0) return(-1);
+		link_dest[link_len] = '\0';
+		h = hash_string(h, path);
+		h = hash_string(h, link_dest);
+		cp = nl + 1;
+	}
+	*hash_p = h;
+	return(0);
+}
+
+/* returns 0 if "id" was initialized, negative if the script can't be cached */
+int exec_init_script_interp_id(
+	scriptinterp_id_t	*id,
+	const struct binary_info *info,
+	const char *exec_policy_name,
+	const char *interpreter,
+	const char *interp_arg,
+	const char *orig_script_filename)
+{
+	uint64_t	h = 0xCBF29CE484222325ULL;
+
+	memset(id, 0, sizeof(*id));
+	if (!info || (!info->dev && !info->ino)) return(-1);
+
+	if (interpreter && (*interpreter != '/')) {
+		/* relative interpreter; the result depends on CWD */
+		char	*virtual_cwd = sbox_virtual_cwd_for_getcwd();
+
+		if (!virtual_cwd) return(-1);
+		h = hash_string(h, virtual_cwd);
+		free(virtual_cwd);
+	}
+
+	id->scriptinterp_dev = info->dev;
+	id->scriptinterp_ino = info->ino;
+	id->scriptinterp_mtime_sec = info->mtime_sec;
+	id->scriptinterp_mtime_nsec = info->mtime_nsec;
+	id->scriptinterp_size = info->size;
+
+	h = hash_string(h, exec_policy_name);
+	h = hash_string(h, interpreter);
+	h = hash_string(h, interp_arg);
+	h = hash_string(h, orig_script_filename);
+	h = hash_string(h, sbox_binary_name);
+	h = hash_string(h, sbox_active_exec_policy_name);
+	h = hash_string(h, sbox_session_mode);
+	h = hash_string(h, sbox_chroot_path);
+	h = hash_string(h, getenv("SBOX_REDIRECT_IGNORE"));
+	h = hash_string(h, getenv("SBOX_REDIRECT_FORCE"));
+	id->scriptinterp_context_hash = h;
+	return(0);
+}
+
+/* returns 0 and an allocated *mapped_interpreter_p if found */
+int exec_find_cached_script_interpreter(
+	scriptinterp_id_t *id,
+	char **mapped_interpreter_p,
+	const char **new_exec_policy_p)
+{
+	scriptinterp_id_t	cached_id;
+	const char	*mapped_interpreter = NULL;
+	const char	*followed_symlinks = NULL;
+	struct stat64	statbuf;
+	uint64_t	symlinks_hash = 0;
+
+	if (!id->scriptinterp_dev && !id->scriptinterp_ino) return(-1);
+	if (ruletree_find_scriptinterp(id, &cached_id, &mapped_interpreter,
+	    new_exec_policy_p, &followed_symlinks) < 0)
+		return(-1);
+
+	if ((real_stat64(mapped_interpreter, &statbuf) < 0) ||
+	    (cached_id.scriptinterp_interp_dev != (uint64_t)statbuf.st_dev) ||
+	    (cached_id.scriptinterp_interp_ino != (uint64_t)statbuf.st_ino) ||
+	    (hash_followed_symlinks(followed_symlinks, &symlinks_hash) < 0) ||
+	    (cached_id.scriptinterp_symlinks_hash != symlinks_hash)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: '%s' has changed, not used", __func__,
+			mapped_interpreter);
+		return(-1);
+	}
+	id->scriptinterp_flags = cached_id.scriptinterp_flags;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: '%s' policy=%s", __func__,
+		mapped_interpreter,
+		(*new_exec_policy_p ? *new_exec_policy_p : "NULL"));
+	*mapped_interpreter_p = strdup(mapped_interpreter);
+	return(0);
+}
+
+void exec_begin_script_interpreter_mapping(void)
+{
+	struct sb2context *sb2ctx = get_sb2context();
+
+	sb2ctx->mapping_result_is_volatile = 0;
+	sb2ctx->track_followed_symlinks = 1;
+	if (sb2ctx->followed_symlinks) {
+		free(sb2ctx->followed_symlinks);
+		sb2ctx->followed_symlinks = NULL;
+	}
+	release_sb2context(sb2ctx);
+}
+
+/* Stops tracking; returns the followed symlinks (an allocated
+ * string or NULL) to the caller. */
+char *exec_end_script_interpreter_mapping(int *is_volatile_p)
+{
+	struct sb2context *sb2ctx = get_sb2context();
+	char	*followed_symlinks;
+
+	if (is_volatile_p) *is_volatile_p = sb2ctx->mapping_result_is_volatile;
+	sb2ctx->track_followed_symlinks = 0;
+	followed_symlinks = sb2ctx->followed_symlinks;
+	sb2ctx->followed_symlinks = NULL;
+	release_sb2context(sb2ctx);
+	return(followed_symlinks);
+}
+
+void exec_cache_script_interpreter(
+	scriptinterp_id_t *id,
+	int set_argv0,
+	const char *mapped_interpreter,
+	const char *new_exec_policy)
+{
+	int	is_volatile = 0;
+	char	*followed_symlinks;
+	struct stat64	statbuf;
+
+	followed_symlinks = exec_end_script_interpreter_mapping(&is_volatile);
+	if (!id->scriptinterp_dev && !id->scriptinterp_ino) goto out;
 
+	if (is_volatile) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: volatile result, not cached",
+			__func__);
+		goto out;
+	}
+	if ((real_stat64(mapped_interpreter, &statbuf) < 0) ||
+	    (hash_followed_symlinks(followed_symlinks,
+		&id->scriptinterp_symlinks_hash) < 0)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: can't validate '%s', not cached",
+			__func__, mapped_interpreter);
+		goto out;
+	}
+	id->scriptinterp_interp_dev = statbuf.st_dev;
+	id->scriptinterp_interp_ino = statbuf.st_ino;
+	id->scriptinterp_flags = set_argv0 ? RULETREE_SCRIPTINTERP_SET_ARGV0 : 0;
+	ruletree_rpc__set_script_interpreter(id, mapped_interpreter,
+		new_exec_policy, followed_symlinks);
+    out:
+	if (followed_symlinks) free(followed_symlinks);
+}
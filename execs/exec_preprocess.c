@@ -311,7 +311,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 						"%s: remove argv[%d], '%s'",
 						__func__, k, str);
 				} else {
-					new_argv[i] = strdup((*argv)[k]);
+					new_argv[i] = (*argv)[k];
 					SB_LOG(SB_LOGLEVEL_DEBUG,
 						"%s: argv[%d]='%s'",
 						__func__, i, new_argv[i]);
@@ -323,7 +323,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		int k;
 		/* nothing to remove, copy old argv */
 		for (k = 1; k < orig_argc; i++, k++) {
-			new_argv[i] = strdup((*argv)[k]);
+			new_argv[i] = (*argv)[k];
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"%s: move argv[%d] -> argv[%d], '%s'",
 				__func__, k, i, new_argv[i]);
@@ -375,9 +375,10 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 			"%s: num.env.vars = %d, allocate +2",
 			__func__, orig_envc);
 		new_envp = (char **)calloc(orig_envc + 2 + 1, sizeof(char *));
-		/* copy old env. */
+		/* copy old env. Elements are never modified in place,
+		 * so the strings can be shared (copy-on-write) */
 		for (k = 0; k < orig_envc; k++) {
-			new_envp[k] = strdup((*envp)[k]);
+			new_envp[k] = (*envp)[k];
 		}
 		new_envp[orig_envc] = strdup("SBOX_DISABLE_MAPPING=1");
 		new_envp[orig_envc+1] = strdup("SBOX_DISABLE_ARGVENVP=1");
@@ -70,6 +70,16 @@ struct binary_info {
 
 	char *pt_interp;
 	int has_capabilities; /* flag */
+
+	/* identity of the file, for the script interpreter cache */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint64_t size;
+
+	/* the "#!" line of a script (NUL-terminated, without '\n') */
+	char *hashbang;
 };
 
 #define exec_policy_handle_is_valid(eph) ((eph).exec_policy_offset != 0)
@@ -115,6 +125,27 @@ extern int exec_map_script_interpreter(
 	const char **new_exec_policy_p, 
         char       **mapped_interpreter_p);
 
+extern void exec_log_script_interpreter(exec_policy_handle_t eph);
+
+extern int exec_init_script_interp_id(
+	scriptinterp_id_t	*id,
+	const struct binary_info *info,
+	const char *exec_policy_name,
+	const char *interpreter,
+	const char *interp_arg,
+	const char *orig_script_filename);
+extern int exec_find_cached_script_interpreter(
+	scriptinterp_id_t *id,
+	char **mapped_interpreter_p,
+	const char **new_exec_policy_p);
+extern void exec_begin_script_interpreter_mapping(void);
+extern char *exec_end_script_interpreter_mapping(int *is_volatile_p);
+extern void exec_cache_script_interpreter(
+	scriptinterp_id_t *id,
+	int set_argv0,
+	const char *mapped_interpreter,
+	const char *new_exec_policy);
+
 extern int exec_postprocess_native_executable(
         const char *exec_policy_name,
         char **mapped_file,
@@ -107,7 +107,7 @@
 
 #include <sys/utsname.h>
 #include <sys/user.h>
-#include <sys/mman.h>
+#include <byteswap.h>
 
 #include <config.h>
 #include <sb2.h>
@@ -299,13 +299,106 @@ static int elf_hdr_match(const char *region, uint16_t match, int ei_data)
 	return 0;
 }
 
-static enum binary_type inspect_elf_binary(const char *region,
-	struct binary_info *info)
+/* ELF fields in the file's byte order => host byte order */
+#define ELF_U16(v, swap) ((swap) ? bswap_16(v) : (v))
+#define ELF_U32(v, swap) ((swap) ? bswap_32(v) : (v))
+#define ELF_U64(v, swap) ((swap) ? bswap_64(v) : (v))
+
+/* Find PT_INTERP without mapping the file: The program header table
+ * is read in small pieces to a buffer in the stack, and after that
+ * only the interpreter string is read. Works with both ELF classes
+ * and byte orders.
+ * Returns 1 if PT_INTERP was found (and copied to info->pt_interp),
+ * 0 if there isn't one (static binary), and -1 if the headers are
+ * broken.
+*/
+static int read_elf_pt_interp(int fd, const char *ehdr_buf,
+	uint64_t file_size, struct binary_info *info)
 {
-	assert(region != NULL);
+	int	is_64 = (ehdr_buf[EI_CLASS] == ELFCLASS64);
+	int	swap = (ehdr_buf[EI_DATA] != HOST_ELF_DATA);
+	uint64_t phoff;
+	size_t	phentsize, phnum, min_phentsize;
+	char	phbuf[16 * sizeof(Elf64_Phdr)];
+	char	interp[SBOX_MAXPATH];
+	size_t	i, j, n;
+
+	if (is_64) {
+		const Elf64_Ehdr *eh = (const Elf64_Ehdr *)ehdr_buf;
+
+		phoff = ELF_U64(eh->e_phoff, swap);
+		phentsize = ELF_U16(eh->e_phentsize, swap);
+		phnum = ELF_U16(eh->e_phnum, swap);
+		min_phentsize = sizeof(Elf64_Phdr);
+	} else if (ehdr_buf[EI_CLASS] == ELFCLASS32) {
+		const Elf32_Ehdr *eh = (const Elf32_Ehdr *)ehdr_buf;
+
+		phoff = ELF_U32(eh->e_phoff, swap);
+		phentsize = ELF_U16(eh->e_phentsize, swap);
+		phnum = ELF_U16(eh->e_phnum, swap);
+		min_phentsize = sizeof(Elf32_Phdr);
+	} else {
+		return(-1);
+	}
+
+	if (phnum == 0) return(0);
+	if ((phentsize < min_phentsize) || (phentsize > sizeof(phbuf)) ||
+	    (phoff > file_size) || (phnum * phentsize > file_size - phoff))
+		return(-1);
+
+	for (i = 0; i < phnum; i += n) {
+		n = sizeof(phbuf) / phentsize;
+		if (n > phnum - i) n = phnum - i;
+		if (pread(fd, phbuf, n * phentsize, phoff + i * phentsize) !=
+		    (ssize_t)(n * phentsize))
+			return(-1);
+
+		for (j = 0; j < n; j++) {
+			const char *ph = phbuf + j * phentsize;
+			uint64_t p_offset, p_filesz;
+
+			if (is_64) {
+				const Elf64_Phdr *ph64 = (const Elf64_Phdr *)ph;
+
+				if (ELF_U32(ph64->p_type, swap) != PT_INTERP)
+					continue;
+				p_offset = ELF_U64(ph64->p_offset, swap);
+				p_filesz = ELF_U64(ph64->p_filesz, swap);
+			} else {
+				const Elf32_Phdr *ph32 = (const Elf32_Phdr *)ph;
+
+				if (ELF_U32(ph32->p_type, swap) != PT_INTERP)
+					continue;
+				p_offset = ELF_U32(ph32->p_offset, swap);
+				p_filesz = ELF_U32(ph32->p_filesz, swap);
+			}
+			if ((p_filesz == 0) || (p_filesz >= sizeof(interp)) ||
+			    (p_offset > file_size) ||
+			    (p_filesz > file_size - p_offset))
+				return(-1);
+			if (pread(fd, interp, p_filesz, p_offset) !=
+			    (ssize_t)p_filesz)
+				return(-1);
+			interp[p_filesz] = '\0';
+
+			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %d-bit ELF, PT_INTERP='%s'",
+				__func__, (is_64 ? 64 : 32), interp);
+			if (info) info->pt_interp = strdup(interp);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+static enum binary_type inspect_elf_binary(int fd, const char *ehdr_buf,
+	uint64_t file_size, struct binary_info *info)
+{
+	int	is_host_binary = 0;
+
+	assert(ehdr_buf != NULL);
 
 	/* check for hashbang */
-	if (region[EI_MAG0] == '#' && region[EI_MAG1] == '!')
+	if (ehdr_buf[EI_MAG0] == '#' && ehdr_buf[EI_MAG1] == '!')
 		return (BIN_HASHBANG);
 
 	/*
@@ -315,57 +408,35 @@ static enum binary_type inspect_elf_binary(const char *region,
 	 * it is statically linked.
 	 */
 #ifdef HOST_ELF_MACHINE_32
-	if (elf_hdr_match(region, HOST_ELF_MACHINE_32, HOST_ELF_DATA)) {
-		Elf32_Ehdr *eh = (Elf32_Ehdr *)region;
-		Elf32_Phdr *ph;
-		size_t ph_entsize = eh->e_phentsize;
-		int i;
-
-		if (info) {
-			info->machine = eh->e_machine;
-			info->data = eh->e_ident[EI_DATA];
-		}
-
-		for (i = 0; i < eh->e_phnum; i++) {
-			ph = (Elf32_Phdr *)
-			    (region + eh->e_phoff + (i * ph_entsize));
-			if (ph->p_type == PT_INTERP) {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 32-bit ELF, PT_INTERP='%s'",
-					__func__, region + ph->p_offset);
-				info->pt_interp = strdup(region + ph->p_offset);
-				return (BIN_HOST_DYNAMIC);
-			}
-		}
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 32-bit ELF, static", __func__);
-		return (BIN_HOST_STATIC);
-	}
+	if (elf_hdr_match(ehdr_buf, HOST_ELF_MACHINE_32, HOST_ELF_DATA))
+		is_host_binary = 1;
 #endif
 #ifdef HOST_ELF_MACHINE_64
-	if (elf_hdr_match(region, HOST_ELF_MACHINE_64, HOST_ELF_DATA)) {
-		Elf64_Ehdr *eh = (Elf64_Ehdr *)region;
-		Elf64_Phdr *ph;
-		size_t ph_entsize = eh->e_phentsize;
-		int i;
+	if (elf_hdr_match(ehdr_buf, HOST_ELF_MACHINE_64, HOST_ELF_DATA))
+		is_host_binary = 1;
+#endif
+	if (is_host_binary) {
+		const Elf32_Ehdr *eh = (const Elf32_Ehdr *)ehdr_buf;
 
 		if (info) {
 			info->machine = eh->e_machine;
 			info->data = eh->e_ident[EI_DATA];
 		}
 
-		for (i = 0; i < eh->e_phnum; i++) {
-			ph = (Elf64_Phdr *)
-			    (region + eh->e_phoff + (i * ph_entsize));
-			if (ph->p_type == PT_INTERP) {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 64-bit ELF, PT_INTERP='%s'",
-					__func__, region + ph->p_offset);
-				info->pt_interp = strdup(region + ph->p_offset);
-				return (BIN_HOST_DYNAMIC);
-			}
+		switch (read_elf_pt_interp(fd, ehdr_buf, file_size, info)) {
+		case 1:
+			return (BIN_HOST_DYNAMIC);
+		case 0:
+			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %d-bit ELF, static",
+				__func__,
+				(ehdr_buf[EI_CLASS] == ELFCLASS64 ? 64 : 32));
+			return (BIN_HOST_STATIC);
+		default:
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: broken ELF program headers", __func__);
+			break;
 		}
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: 64-bit ELF, static", __func__);
-		return (BIN_HOST_STATIC);
 	}
-#endif
 	/* could not identify as host binary */
 	return (BIN_UNKNOWN);
 }
@@ -378,7 +449,8 @@ static enum binary_type inspect_binary(const char *filename,
 	enum binary_type retval;
 	int fd, j;
 	struct stat64 status;
-	char *region;
+	char ehdr_buf[sizeof(Elf64_Ehdr)];
+	ssize_t ehdr_len;
 	unsigned int ei_data;
 	uint16_t e_machine;
 
@@ -467,6 +539,11 @@ static enum binary_type inspect_binary(const char *filename,
 		info->mode = status.st_mode;
 		info->uid = status.st_uid;
 		info->gid = status.st_gid;
+		info->dev = status.st_dev;
+		info->ino = status.st_ino;
+		info->mtime_sec = status.st_mtim.tv_sec;
+		info->mtime_nsec = status.st_mtim.tv_nsec;
+		info->size = status.st_size;
 	}
 
 	if (!S_ISREG(status.st_mode) && !S_ISLNK(status.st_mode)) {
@@ -483,19 +560,41 @@ static enum binary_type inspect_binary(const char *filename,
 		goto _out_close;
 	}
 
-	region = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!region) {
+	/* Read only the headers; mapping the whole file would be
+	 * expensive for huge binaries (cc1plus etc) */
+	memset(ehdr_buf, 0, sizeof(ehdr_buf));
+	ehdr_len = pread(fd, ehdr_buf, sizeof(ehdr_buf), 0);
+	if (ehdr_len < 4) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"%s: mmap failed => out", __func__);
+			"%s: read failed => out", __func__);
 		goto _out_close;
 	}
 
-	retval = inspect_elf_binary(region, info);
+	retval = inspect_elf_binary(fd, ehdr_buf, status.st_size, info);
 	switch (retval) {
 	case BIN_HASHBANG:
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: script => out", __func__);
-		goto _out_munmap;
+		if (info) {
+			/* keep the first line, prepare_hashbang()
+			 * doesn't need to read the file again.
+			 * Usually it fits to ehdr_buf. */
+			char	line[SBOX_MAXPATH];
+			const char *cp = ehdr_buf;
+			ssize_t	line_len = ehdr_len;
+			ssize_t	len;
+
+			if (!memchr(ehdr_buf, '\n', ehdr_len) &&
+			    (status.st_size > ehdr_len)) {
+				line_len = pread(fd, line, sizeof(line) - 1, 0);
+				cp = line;
+			}
+			for (len = 0; len < line_len; len++)
+				if (cp[len] == '\n' || cp[len] == '\0')
+					break;
+			info->hashbang = strndup(cp, len);
+		}
+		goto _out_close;
 	case BIN_HOST_STATIC:
 	case BIN_HOST_DYNAMIC:
 		/* host binary. First check if it has capabilities:
@@ -522,14 +621,14 @@ static enum binary_type inspect_binary(const char *filename,
 				SB_LOG(SB_LOGLEVEL_DEBUG,
 					"%s: has capabilities (%s)",
 					__func__, filename);
-				info->has_capabilities = 1;
+				if (info) info->has_capabilities = 1;
 			}
 		}
 		/* lets go out of here */
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: host binary => out (%s)", __func__,
-			(info->pt_interp ? info->pt_interp: ""));
-		goto _out_munmap;
+			(info && info->pt_interp ? info->pt_interp: ""));
+		goto _out_close;
 
 	default:
 		break;
@@ -578,19 +677,19 @@ static enum binary_type inspect_binary(const char *filename,
 				ei_data = ELFDATA2LSB;
 		}
 
-		info->machine = ti->machine;
-		info->data = ei_data;
+		if (info) {
+			info->machine = ti->machine;
+			info->data = ei_data;
+		}
 		break;
 	}
 
-	if (elf_hdr_match(region, e_machine, ei_data)) {
+	if (elf_hdr_match(ehdr_buf, e_machine, ei_data)) {
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"%s: BIN_TARGET", __func__);
 		retval = BIN_TARGET;
 	}
 
-_out_munmap:
-	munmap(region, status.st_size);
 _out_close:
 	close_nomap_nolog(fd);
 _out:
@@ -602,9 +701,10 @@ static int prepare_hashbang(
 	char *orig_file,
 	char ***argvp,
 	char ***envpp,
-	const char *exec_policy_name)
+	const char *exec_policy_name,
+	const struct binary_info *info)	/* from inspect_binary() */
 {
-	int argc, fd, c, i, j, n;
+	int argc, c, i, j, n;
 	char ch;
 	char *mapped_interpreter = NULL;
 	char **new_argv = NULL;
@@ -613,17 +713,14 @@ static int prepare_hashbang(
 	char *interp_arg = NULL;
 	char *tmp = NULL, *mapped_binaryname = NULL;
 	int result = 0;
+	scriptinterp_id_t script_id;
 
-	if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
+	/* inspect_binary() has already read the first line */
+	if (!info->hashbang || ((c = strlen(info->hashbang)) < 2)) {
 		/* unexpected error, just run it */
 		return 0;
 	}
-
-	if ((c = read(fd, &hashbang[0], SBOX_MAXPATH - 1)) < 2) {
-		/* again unexpected error, close fd and run it */
-		close_nomap_nolog(fd);
-		return 0;
-	}
+	memcpy(hashbang, info->hashbang, c + 1);
 
 	argc = elem_count(*argvp);
 
@@ -635,7 +732,7 @@ static int prepare_hashbang(
 			|| hashbang[i] == '\t') && i < c; i++)
 		;
 
-	for (n = 0, j = i; i < c; i++) {
+	for (n = 0, j = i; i <= c; i++) {
 		ch = hashbang[i];
 		if (hashbang[i] == 0
 			|| hashbang[i] == ' '
@@ -675,11 +772,25 @@ static int prepare_hashbang(
 	change_environment_variable(
 		*envpp, "__SB2_ORIG_BINARYNAME=", interpreter);
 
+	exec_init_script_interp_id(&script_id, info, exec_policy_name,
+		interpreter, interp_arg, orig_file);
+
 	/* script interpreter mapping in C */
-	exec_policy_handle_t     eph = find_exec_policy_handle(exec_policy_name);
+	exec_policy_handle_t     eph;
 	int c_mapping_result_code;
 	const char *c_new_exec_policy_name = NULL;
-	
+
+	eph = find_exec_policy_handle(exec_policy_name);
+	if (exec_find_cached_script_interpreter(&script_id,
+	    &mapped_interpreter, &c_new_exec_policy_name) == 0) {
+		exec_log_script_interpreter(eph);
+		if (script_id.scriptinterp_flags & RULETREE_SCRIPTINTERP_SET_ARGV0)
+			new_argv[0] = strdup(mapped_interpreter);
+		exec_policy_name = c_new_exec_policy_name;
+		goto interpreter_mapped;
+	}
+
+	exec_begin_script_interpreter_mapping();
 	c_mapping_result_code = exec_map_script_interpreter(eph, exec_policy_name,
 		interpreter, interp_arg, *mapped_file,
 		orig_file, new_argv, &c_new_exec_policy_name, &mapped_interpreter);
@@ -727,10 +838,12 @@ static int prepare_hashbang(
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: <-1> exec denied", __func__);
 		if (mapped_interpreter) free(mapped_interpreter);
 		mapped_interpreter = NULL;
+		free(exec_end_script_interpreter_mapping(NULL));
 		return(-1);
 	default:
                 SB_LOG(SB_LOGLEVEL_ERROR,
                         "%s: Unsupported result %d", __func__, c_mapping_result_code);
+		free(exec_end_script_interpreter_mapping(NULL));
 		return(-1);
 	}
 	exec_policy_name = c_new_exec_policy_name;
@@ -738,8 +851,13 @@ static int prepare_hashbang(
 	if (!mapped_interpreter) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"failed to map script interpreter=%s", interpreter);
+		free(exec_end_script_interpreter_mapping(NULL));
 		return(-1);
 	}
+	exec_cache_script_interpreter(&script_id, (c_mapping_result_code == 0),
+		mapped_interpreter, c_new_exec_policy_name);
+
+    interpreter_mapped:
 
 	/*
 	 * Binaryname (the one expected by the rules) comes still from
@@ -774,22 +892,26 @@ static int prepare_hashbang(
 	return(result);
 }
 
-static char **duplicate_argv(char *const *argv)
+/* Copy-on-write copy of argv[] or envp[]: Only the vector itself is
+ * allocated, the elements are borrowed from the original vector.
+ * This is safe because nothing in the exec subsystem modifies the
+ * strings in place; elements are always replaced by new strings
+ * (see change_environment_variable(), exec preprocessing and
+ * postprocessing), so only the modified entries are ever allocated.
+ * Saves a few hundred small allocations per exec or posix_spawn
+ * with a typical build environment.
+*/
+static char **cow_copy_strvec(char *const *strv)
 {
-	int	argc = elem_count(argv);
-	char	**p;
-	int	i;
-	char	**my_argv;
+	int	n = elem_count(strv);
+	char	**my_strv;
 
-	SB_LOG(SB_LOGLEVEL_NOISE2, "duplicate_argv: argc=%d", argc);
-	my_argv = (char **)calloc(argc + 1, sizeof(char *));
-	for (i = 0, p = (char **)argv; *p; p++) {
-		my_argv[i++] = strdup(*p);
-		SB_LOG(SB_LOGLEVEL_NOISE2, "duplicate_argv: [%d] = '%s'", i-1, my_argv[i-1]);
-	}
-	my_argv[i] = NULL;
+	SB_LOG(SB_LOGLEVEL_NOISE2, "%s: n=%d", __func__, n);
+	my_strv = (char **)calloc(n + 1, sizeof(char *));
+	memcpy(my_strv, strv, n * sizeof(char *));
+	my_strv[n] = NULL;
 
-	return(my_argv);
+	return(my_strv);
 }
 
 static int check_envp_has_ld_preload_and_ld_library_path(
@@ -829,6 +951,10 @@ static int check_envp_has_ld_preload_and_ld_library_path(
  *    restore the __SB2__LD... variables to the real variables.
  *    (If LD_LIBRARY_PATH and LD_PRELOAD are not set,
  *    prepare_exec() will deny the exec.)
+ *
+ * Variables that are relayed as-is are borrowed from the original
+ * vector, only new and replaced variables are allocated here
+ * (see cow_copy_strvec())
 */
 static char **prepare_envp_for_do_exec(const char *orig_file,
 	const char *binaryname, char *const *envp)
@@ -943,9 +1069,9 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 				"restored to %s", sbox_mapping_method);
 	}
 
-	/* allocate new environment. Add 15 extra elements (all may not be
+	/* allocate new environment. Add 16 extra elements (all may not be
 	 * needed always) */
-	my_envp = (char **)calloc(envc + 15, sizeof(char *));
+	my_envp = (char **)calloc(envc + 16, sizeof(char *));
 
 	for (i = 0, p=(char **)envp; *p; p++) {
 		if (strncmp(*p, "__SB2_", strlen("__SB2_")) == 0) {
@@ -953,7 +1079,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 			 * be relayed to the next executable => skip it.
 			 * Such variables include: __SB2_BINARYNAME,
 			 * __SB2_REAL_BINARYNAME, __SB2_ORIG_BINARYNAME,
-			 * __SB2_CHROOT_PATH
+			 * __SB2_CHROOT_PATH, __SB2_VIRTUAL_CWD
 			*/
 			continue;
 		}
@@ -1030,7 +1156,7 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 			}
 			break;
 		}
-		my_envp[i++] = strdup(*p);
+		my_envp[i++] = *p;
 	}
 
 	/* add our session directory */
@@ -1127,6 +1253,17 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 		SB_LOG(SB_LOGLEVEL_NOISE, "Added %s", user_ld_library_path);
 	}
 
+	/* pass the already resolved rule tree state to the new
+	 * process, so that it doesn't have to look it up again */
+	my_envp[i] = sbox_ruletree_handoff_for_exec("__SB2_HANDOFF=",
+		has_sbox_session_mode);
+	if (my_envp[i]) i++;
+
+	/* the CWD stays, and so does the virtual path to it */
+	my_envp[i] = sbox_virtual_cwd_export_for_exec("__SB2_VIRTUAL_CWD=",
+		has_sbox_session_mode);
+	if (my_envp[i]) i++;
+
 	if (sbox_chroot_path) {
 		/* chroot simulation is active, relay the value */
 		if (asprintf(&new_exec_file_var, "__SB2_CHROOT_PATH=%s", sbox_chroot_path) < 0) {
@@ -1141,44 +1278,109 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 	return(my_envp);
 }
 
-/* compare vectors of strings and log if there are any changes.
- * TO BE IMPROVED: a more clever algorithm would be nice, something
- * that would log only the modified parts... now this displays 
- * everything if something was changed, which easily creates 
- * a *lot* of noise if SB_LOGLEVEL_NOISE is enabled.
+/* find an element of "strv" which starts with "key" (first "cmp_len"
+ * characters are compared) and hasn't been matched yet.
+ * The vectors that are compared are mostly in the same order, so the
+ * search starts from "start" (position after the previous match).
 */
-static void compare_and_log_strvec_changes(const char *vecname, 
-	char *const *orig_strv, char *const *new_strv) 
+static int find_unmatched_strvec_elem(char *const *strv, int n,
+	const char *matched, int start, const char *key, size_t cmp_len)
 {
-	char *const *ptr2old = orig_strv;
-	char *const *ptr2new = new_strv;
-	int	strv_modified = 0;
+	int	i;
 
-	while (*ptr2old && *ptr2new) {
-		if (strcmp(*ptr2old, *ptr2new)) {
-			strv_modified = 1;
-			break;
+	for (i = start; i < n; i++)
+		if (!matched[i] && !strncmp(strv[i], key, cmp_len)) return(i);
+	for (i = 0; (i < start) && (i < n); i++)
+		if (!matched[i] && !strncmp(strv[i], key, cmp_len)) return(i);
+	return(-1);
+}
+
+/* compare vectors of strings and log the differences.
+ * Only the modified elements are logged (at NOISE level),
+ * at DEBUG level just a summary is written. No joined strings or
+ * copies of the vectors are created; elements which were relayed
+ * as-is are usually shared with the original vector (see
+ * cow_copy_strvec()), so they are found with a cheap comparison.
+ * - argv[] elements are compared by position
+ * - envp[] elements are compared by variable name
+ * Caller should check that SB_LOGLEVEL_DEBUG is active.
+*/
+static void compare_and_log_strvec_changes(const char *vecname,
+	char *const *orig_strv, char *const *new_strv, int by_name)
+{
+	int	orig_n, new_n, i;
+	int	num_added = 0, num_changed = 0, num_removed = 0;
+	int	log_elems = SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NOISE);
+
+	if (!orig_strv || !new_strv) return;
+
+	orig_n = elem_count(orig_strv);
+	new_n = elem_count(new_strv);
+
+	if (!by_name) {
+		for (i = 0; (i < orig_n) && (i < new_n); i++) {
+			if ((orig_strv[i] == new_strv[i]) ||
+			    !strcmp(orig_strv[i], new_strv[i])) continue;
+			num_changed++;
+			if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s[%d]: '%s' => '%s'", vecname, i,
+				orig_strv[i], new_strv[i]);
 		}
-		ptr2old++, ptr2new++;
-	}
-	if (!strv_modified && (*ptr2old || *ptr2new)) {
-		strv_modified = 1;
-	}
-	if (strv_modified) {
-		SB_LOG(SB_LOGLEVEL_DEBUG, "%s[] was modified", vecname); 
-		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NOISE)) {
-			int	i;
-			for (i = 0, ptr2new = new_strv; 
-			    *ptr2new;
-			    i++, ptr2new++) {
-				SB_LOG(SB_LOGLEVEL_NOISE, 
-					"[%d]='%s'", i,
-					*ptr2new);
+		for (; i < new_n; i++) {
+			num_added++;
+			if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s[%d]: added '%s'", vecname, i, new_strv[i]);
+		}
+		for (; i < orig_n; i++) {
+			num_removed++;
+			if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s[%d]: removed '%s'", vecname, i, orig_strv[i]);
+		}
+	} else {
+		char	*matched = calloc(orig_n + 1, 1);
+		int	next = 0;
+
+		if (!matched) return;
+		for (i = 0; i < new_n; i++) {
+			const char *eq = strchr(new_strv[i], '=');
+			size_t	namelen = eq ? (size_t)(eq - new_strv[i]) + 1 :
+					strlen(new_strv[i]) + 1;
+			int	j;
+
+			j = find_unmatched_strvec_elem(orig_strv, orig_n,
+				matched, next, new_strv[i], namelen);
+			if (j < 0) {
+				num_added++;
+				if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+					"%s: added '%s'", vecname, new_strv[i]);
+				continue;
 			}
+			matched[j] = 1;
+			next = j + 1;
+			if (!eq || (orig_strv[j] == new_strv[i]) ||
+			    !strcmp(orig_strv[j] + namelen,
+				new_strv[i] + namelen)) continue;
+			num_changed++;
+			if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s: '%s' => '%s'", vecname,
+				orig_strv[j], new_strv[i]);
+		}
+		for (i = 0; i < orig_n; i++) {
+			if (matched[i]) continue;
+			num_removed++;
+			if (log_elems) SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s: removed '%s'", vecname, orig_strv[i]);
 		}
+		free(matched);
+	}
+
+	if (num_added || num_changed || num_removed) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s[] was modified: %d added, %d changed, %d removed",
+			vecname, num_added, num_changed, num_removed);
 	} else {
-		SB_LOG(SB_LOGLEVEL_NOISE, 
-			"%s[] was not modified", vecname); 
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s[] was not modified", vecname);
 	}
 }
 
@@ -1209,6 +1411,9 @@ static int strvec_contains_prefix(char *const *strvec,
  * the variable must already exist in the environment;
  * this doesn't do anything if the variable has been
  * removed from environment.
+ * Only used for SB2's own variables, which were allocated by
+ * prepare_envp_for_do_exec() (never borrowed from the caller),
+ * so the old value can be released.
  *
  * - "var_perfix" should contain the variable name + '='
 */
@@ -1422,7 +1627,7 @@ static int prepare_exec(const char *exec_fn_name,
 	
 	my_file = strdup(orig_file);
 
-	my_argv = duplicate_argv(orig_argv);
+	my_argv = cow_copy_strvec(orig_argv);
 
 	if (!file_has_been_mapped) {
 		PROCESSCLOCK(clk2)
@@ -1517,7 +1722,8 @@ static int prepare_exec(const char *exec_fn_name,
 			/* prepare_hashbang() will call prepare_exec()
 			 * recursively */
 			ret = prepare_hashbang(&mapped_file, my_file,
-					&my_argv, &my_envp, exec_policy_name);
+					&my_argv, &my_envp, exec_policy_name,
+					&info);
 			break;
 
 		case BIN_HOST_DYNAMIC:
@@ -1680,6 +1886,7 @@ static int prepare_exec(const char *exec_fn_name,
 	err = errno;
 	STOP_AND_REPORT_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, orig_file);
 	if (info.pt_interp) free(info.pt_interp);
+	if (info.hashbang) free(info.hashbang);
 	errno = err;
 	return(ret);
 }
@@ -1699,7 +1906,6 @@ int do_exec(int *result_errno_ptr,
 		/* just run it, don't worry, be happy! */
 	} else {
 		int	r;
-		char	**my_envp_copy = NULL; /* used only for debug log */
 		char	*tmp, *binaryname;
 		enum binary_type type;
 
@@ -1713,13 +1919,8 @@ int do_exec(int *result_errno_ptr,
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"EXEC/Orig.args: %s : %s", orig_file, buf);
 			free(buf);
-		
-			/* create a copy of intended environment for logging,
-			 * before preprocessing */
-			my_envp_copy = prepare_envp_for_do_exec(orig_file,
-				binaryname, orig_envp);
 		}
-		
+
 		new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
 
 		r = prepare_exec(exec_fn_name, NULL/*exec_policy_name: not yet known*/,
@@ -1728,9 +1929,9 @@ int do_exec(int *result_errno_ptr,
 
 		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_DEBUG)) {
 			int saved_errno = errno;
-			/* find out and log if preprocessing did something */
-			compare_and_log_strvec_changes("argv", orig_argv, new_argv);
-			compare_and_log_strvec_changes("envp", my_envp_copy, new_envp);
+			/* find out and log what preprocessing did */
+			compare_and_log_strvec_changes("argv", orig_argv, new_argv, 0);
+			compare_and_log_strvec_changes("envp", orig_envp, new_envp, 1);
 			errno = saved_errno;
 		}
 
@@ -1784,7 +1985,6 @@ int do_posix_spawn(int *result_errno_ptr,
 		/* just run it, don't worry, be happy! */
 	} else {
 		int	r;
-		char	**my_envp_copy = NULL; /* used only for debug log */
 		char	*tmp, *binaryname;
 		enum binary_type type;
 
@@ -1798,11 +1998,6 @@ int do_posix_spawn(int *result_errno_ptr,
 			SB_LOG(SB_LOGLEVEL_DEBUG,
 				"SPAWN/Orig.args: %s : %s", orig_path, buf);
 			free(buf);
-
-			/* create a copy of intended environment for logging,
-			 * before preprocessing */
-			my_envp_copy = prepare_envp_for_do_exec(orig_path,
-				binaryname, orig_envp);
 		}
 
 		new_envp = prepare_envp_for_do_exec(orig_path, binaryname, orig_envp);
@@ -1813,9 +2008,9 @@ int do_posix_spawn(int *result_errno_ptr,
 
 		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_DEBUG)) {
 			int saved_errno = errno;
-			/* find out and log if preprocessing did something */
-			compare_and_log_strvec_changes("argv", orig_argv, new_argv);
-			compare_and_log_strvec_changes("envp", my_envp_copy, new_envp);
+			/* find out and log what preprocessing did */
+			compare_and_log_strvec_changes("argv", orig_argv, new_argv, 0);
+			compare_and_log_strvec_changes("envp", orig_envp, new_envp, 1);
 			errno = saved_errno;
 		}
 
@@ -1879,8 +2074,8 @@ int sb2show__execve_mods__(
 		NULL, new_file, new_argv, new_envp);
 
 	if (!*new_file) *new_file = strdup(file);
-	if (!*new_argv) *new_argv = duplicate_argv(orig_argv);
-	if (!*new_envp) *new_envp = duplicate_argv(orig_envp);
+	if (!*new_argv) *new_argv = cow_copy_strvec(orig_argv);
+	if (!*new_envp) *new_envp = cow_copy_strvec(orig_envp);
 
 	return(ret);
 }
@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <dirent.h>
 
 #include "rule_tree.h"
 
@@ -64,6 +65,20 @@ typedef struct mapping_results_s {
 	/* set if the C mapping engine failed.
 	*/
 	const char	*mres_errormsg;
+
+	/* Filled by the C mapping engine if mapping succeeded: the rule
+	 * that was used and the virtual path after symlink resolution.
+	 * fdpathdb keeps these for open directories, so that *at()
+	 * calls can be mapped relative to them (see sbox_map_path_at())
+	*/
+	ruletree_object_offset_t	mres_rule_offs;
+	char	*mres_resolved_virtual_path;
+
+	/* set if the path maps to itself and the result (and the
+	 * resolved virtual path) point to the caller's original path
+	 * (see sbox_map_path_if_identity()). Those are not freed
+	 * in that case. */
+	int	mres_result_is_orig_path;
 } mapping_results_t;
 
 /* extern void clear_mapping_results_struct(mapping_results_t *res); */
@@ -83,6 +98,30 @@ extern void sbox_map_path_at(const char *func_name, int dirfd,
 	const char *path, uint32_t flags,
 	mapping_results_t *res, uint32_t classmask);
 
+extern int sbox_identity_prefixes_unavailable;
+extern int sbox_map_path_identity(const char *path, uint32_t classmask,
+	mapping_results_t *res);
+
+/* Used by the wrappers before sbox_map_path(): Absolute paths that the
+ * rules map to themselves (the identity prefix set, which is created
+ * with the rule tree) are returned as-is, without running the mapping
+ * engine and without allocating anything. Only clean paths qualify
+ * (the path is also the resolved virtual path). Returns 1 if "res" was
+ * filled that way, 0 if the path must be mapped normally.
+ * Not used when INFO messages are logged, so that the log is the same.
+*/
+static inline int sbox_map_path_if_identity(const char *path,
+	uint32_t classmask, mapping_results_t *res)
+{
+	if (!path || (*path != '/') || sbox_identity_prefixes_unavailable)
+		return(0);
+	return(sbox_map_path_identity(path, classmask, res));
+}
+
+extern int sbox_subtree_maps_like_dir(const char *func_name,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_virtual_dir, uint32_t classmask);
+
 extern char *sbox_virtual_path_to_abs_virtual_path(
         const char *binary_name,
         const char *func_name,
@@ -107,6 +146,15 @@ extern char *custom_map_abstract_path(
         int fn_class, const char **new_exec_policy_p);
 
 extern char *emumode_map(const char *path);
+
+extern char *sbox_ruletree_handoff_for_exec(const char *prefix,
+	int mode_will_change);
+
+extern void sbox_virtual_cwd_changed(const char *abs_virtual_cwd);
+extern char *sbox_virtual_cwd_for_getcwd(void);
+extern char *sbox_virtual_cwd_export_for_exec(const char *prefix,
+	int mode_will_change);
+extern void sbox_virtual_cwd_import(const char *str);
 #if 0
 extern void sb_push_string_to_lua_stack(char *str);
 #endif
@@ -121,10 +169,22 @@ extern int sb_execve_postprocess(const char *exec_type,
 extern char *scratchbox_reverse_path(
 	const char *func_name, const char *full_path, uint32_t classmask);
 
-extern const char *fdpathdb_find_path(int fd);
-
-extern char *prep_union_dir(const char *dst_path,
-		const char **src_paths, int num_real_dir_entries);
+/* An fdpathdb entry: the virtual path that was used to open the fd,
+ * and the mapping result if the C mapping engine produced it.
+*/
+typedef struct fdpathdb_entry_s {
+	const char	*fpe_path;
+	const char	*fpe_resolved_virtual_path;	/* NULL if not known */
+	const char	*fpe_host_path;			/* NULL if not known */
+	ruletree_object_offset_t	fpe_rule_offs;	/* 0 if not known */
+} fdpathdb_entry_t;
+
+extern char *fdpathdb_find_path(int fd); /* returns an allocated copy */
+extern fdpathdb_entry_t *fdpathdb_get_entry(int fd); /* free() the result */
+
+extern char *union_dir_map_path(ruletree_object_offset_t component_list);
+extern void union_dir_register_stream(DIR *dirp,
+		ruletree_object_offset_t rule_offs);
 
 /* ---- internal constants: ---- */
 
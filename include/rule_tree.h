@@ -42,7 +42,11 @@ typedef struct ruletree_object_hdr_s {
 #define SB2_RULETREE_OBJECT_TYPE_BOOLEAN	9	/* also ruletree_uint32_t */
 #define SB2_RULETREE_OBJECT_TYPE_EXEC_PP_RULE	14	/* ruletree_exec_preprocessing_rule_t */
 #define SB2_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE	15	/* ruletree_exec_policy_selection_rule_t */
+#define SB2_RULETREE_OBJECT_TYPE_SCRIPTINTERP	16	/* ruletree_scriptinterp_t */
 #define SB2_RULETREE_OBJECT_TYPE_NET_RULE	21	/* ruletree_net_rule_t */
+#define SB2_RULETREE_OBJECT_TYPE_RULE_INDEX	22	/* ruletree_rule_index_t */
+#define SB2_RULETREE_OBJECT_TYPE_IDENTITY_PREFIXES 23	/* ruletree_identity_prefixes_t */
+#define SB2_RULETREE_OBJECT_TYPE_INODESTAT_FILTER 24	/* ruletree_inodestat_filter_t */
 
 typedef struct ruletree_hdr_s {
 	ruletree_object_hdr_t	rtree_hdr_objhdr;	/* [0], size 8 */
@@ -58,7 +62,7 @@ typedef struct ruletree_hdr_s {
 	uint32_t		rtree_min_client_socket_fd;	/* for clients */
 } ruletree_hdr_t;
 
-#define RULE_TREE_VERSION	6
+#define RULE_TREE_VERSION	8
 
 /* catalogs are lists of name+value pairs
  * (the value can be a rule, string, or another catalog).
@@ -149,6 +153,22 @@ typedef struct ruletree_inodestat_s {
 	inodesimu_t		rtree_inode_simu;
 } ruletree_inodestat_t;
 
+/* Bloom filter of the keys (dev+ino) of all inodestats, created by
+ * sb2d when the first inodestat is added (catalog "vperm",
+ * "inodestat_filter"). Clients use it to skip the bintree lookup
+ * for inodes that have never had an inodestat. Bits are never
+ * cleared, an inactivated inodestat is still in the filter.
+ * The bitmap (rtree_isf_num_words uint32_t's) follows this header.
+*/
+typedef struct ruletree_inodestat_filter_s {
+	ruletree_object_hdr_t	rtree_isf_objhdr;
+
+	uint32_t		rtree_isf_num_words;
+	uint32_t		rtree_isf_num_keys; /* number of keys added */
+} ruletree_inodestat_filter_t;
+
+#define RULETREE_INODESTAT_FILTER_BITS	(512*1024) /* must be a power of 2 */
+
 /* bit mask simulated_fields: */
 #define RULETREE_INODESTAT_SIM_UID	0x1	/* set when UID simulation is active */
 #define RULETREE_INODESTAT_SIM_GID	0x2	/* set when GID simulation is active */
@@ -156,6 +176,40 @@ typedef struct ruletree_inodestat_s {
 #define RULETREE_INODESTAT_SIM_DEVNODE	0x8	/* set when simulating a blk/chr device */
 #define RULETREE_INODESTAT_SIM_SUIDSGID	0x10	/* set when SUID/SGID simulation is active */
 
+/* Script interpreter cache: Result of mapping the interpreter of
+ * a "#!" script, shared by all processes of the session.
+ * dev+ino are the keys, other fields are used to validate the entry.
+ * The last three fields describe the result; those are checked
+ * against the file system when the entry is used.
+*/
+typedef struct {
+	uint64_t	scriptinterp_dev;	/* script's device; used as key */
+	uint64_t	scriptinterp_ino;	/* script's inode; used as key */
+
+	int64_t		scriptinterp_mtime_sec;	/* script must not have changed */
+	uint32_t	scriptinterp_mtime_nsec;
+	uint64_t	scriptinterp_size;
+
+	uint64_t	scriptinterp_context_hash; /* see exec_map_script_interp.c */
+	uint32_t	scriptinterp_flags;	/* RULETREE_SCRIPTINTERP_* */
+
+	uint64_t	scriptinterp_interp_dev; /* the mapped interpreter */
+	uint64_t	scriptinterp_interp_ino;
+	uint64_t	scriptinterp_symlinks_hash; /* followed symlinks */
+} scriptinterp_id_t;
+
+typedef struct ruletree_scriptinterp_s {
+	ruletree_object_hdr_t	rtree_si_objhdr;
+
+	scriptinterp_id_t		rtree_si_id;
+	ruletree_object_offset_t	rtree_si_mapped_interpreter;	/* string offs. */
+	ruletree_object_offset_t	rtree_si_exec_policy_name;	/* string offs. or 0 */
+	ruletree_object_offset_t	rtree_si_followed_symlinks;	/* string offs. or 0 */
+} ruletree_scriptinterp_t;
+
+/* bit mask scriptinterp_flags: */
+#define RULETREE_SCRIPTINTERP_SET_ARGV0	0x1	/* argv[0] = mapped interpreter */
+
 /* the string header structure is followed by the string itself. */
 typedef struct ruletree_string_hdr_s {
 	ruletree_object_hdr_t	rtree_str_objhdr;
@@ -179,6 +233,61 @@ typedef struct ruletree_uint32_s {
 	uint32_t	rtree_uint32;
 } ruletree_uint32_t;
 
+/* Index of a list of FS rules: A trie of the selector strings,
+ * which gives the rules that may match a path without testing all
+ * rules of the list. Rules that can't be indexed (conditions, etc)
+ * are listed separately and are always tested.
+ * The header is followed by the nodes (rtree_ri_num_nodes, the root
+ * is the first one) and the references (uint32_t, index to the
+ * rule list; sorted in each node).
+*/
+typedef struct ruletree_rule_index_s {
+	ruletree_object_hdr_t		rtree_ri_objhdr;
+
+	ruletree_object_offset_t	rtree_ri_rule_list;	/* the indexed list */
+	uint32_t			rtree_ri_num_nodes;
+	uint32_t			rtree_ri_num_refs;
+	uint32_t			rtree_ri_always_first;	/* index to refs */
+	uint32_t			rtree_ri_always_count;
+} ruletree_rule_index_t;
+
+typedef struct ruletree_rule_index_node_s {
+	uint32_t	rtree_rin_first_child;		/* node index, 0=none */
+	uint32_t	rtree_rin_next_sibling;		/* node index, 0=none */
+	uint32_t	rtree_rin_refs_first;		/* rules with selector */
+	uint32_t	rtree_rin_refs_count;		/*  ending at this node */
+	uint32_t	rtree_rin_char;
+} ruletree_rule_index_node_t;
+
+/* Identity prefix set of a list of FS rules: Paths that are known to
+ * map to themselves without any path resolution (force_orig_path
+ * rules, and use_orig_path rules when the path is the selector itself).
+ * An entry is valid for a function class mask F if
+ *	(rtree_ip_func_class == 0 || (rtree_ip_func_class & F)) &&
+ *	!(rtree_ip_blocked_classes & F)
+ * where "blocked" classes are those of earlier rules that may match
+ * the same paths. The header is followed by the entries.
+*/
+typedef struct ruletree_identity_prefixes_s {
+	ruletree_object_hdr_t		rtree_ips_objhdr;
+
+	ruletree_object_offset_t	rtree_ips_rule_list;
+	uint32_t			rtree_ips_num_entries;
+} ruletree_identity_prefixes_t;
+
+#define SB2_RULETREE_IDENTITY_EXACT	1	/* the selector only */
+#define SB2_RULETREE_IDENTITY_PREFIX	2	/* string prefix */
+#define SB2_RULETREE_IDENTITY_DIR	3	/* the dir. and everything below it */
+
+typedef struct ruletree_identity_prefix_s {
+	ruletree_object_offset_t	rtree_ip_selector_offs;
+	uint32_t			rtree_ip_selector_len;
+	uint32_t			rtree_ip_type;
+	uint32_t			rtree_ip_func_class;
+	uint32_t			rtree_ip_blocked_classes;
+	ruletree_object_offset_t	rtree_ip_rule_offs;
+} ruletree_identity_prefix_t;
+
 /* the three "usual selectors", used in normal rules */
 #define SB2_RULETREE_FSRULE_SELECTOR_PATH		101
 #define SB2_RULETREE_FSRULE_SELECTOR_PREFIX		102
@@ -223,12 +332,34 @@ typedef struct ruletree_net_rule_s {
 	ruletree_object_offset_t	rtree_net_log_msg;	/* string offs. */
 	uint32_t			rtree_net_errno;
 	ruletree_object_offset_t	rtree_net_rules;	/* offset of a list of subrules */
+
+	/* rtree_net_address in binary form, set by
+	 * add_net_rule_to_ruletree() */
+	uint32_t			rtree_net_addr_kind;	/* see below */
+	uint32_t			rtree_net_addr_prefix_len; /* bits */
+	uint8_t				rtree_net_addr_bytes[16]; /* network byte order */
 } ruletree_net_rule_t;
 
 #define SB2_RULETREE_NET_RULETYPE_DENY	0
 #define SB2_RULETREE_NET_RULETYPE_ALLOW	1
 #define SB2_RULETREE_NET_RULETYPE_RULES	2
 
+/* rtree_net_addr_kind: */
+#define SB2_RULETREE_NET_ADDR_STRING	0	/* not parsed, compare strings */
+#define SB2_RULETREE_NET_ADDR_IPV4	1	/* 4 bytes + prefix length */
+#define SB2_RULETREE_NET_ADDR_IPV6	2	/* 16 bytes + prefix length */
+#define SB2_RULETREE_NET_ADDR_INADDR_ANY	3
+#define SB2_RULETREE_NET_ADDR_IN6ADDR_ANY	4
+
+/* Session state inherited from the parent process, see
+ * ruletree_handoff_from_string() */
+typedef struct ruletree_handoff_s {
+	uint64_t			rth_min_mmap_addr;
+	uint32_t			rth_max_size;
+	ruletree_object_offset_t	rth_fwd_rule_list_offs;
+	ruletree_object_offset_t	rth_rev_rule_list_offs;
+} ruletree_handoff_t;
+
 /* ----------- rule_tree.c: ----------- */
 extern int ruletree_to_memory(void); /* 0 if ok, negative if rule tree is not available. */
 
@@ -248,6 +379,14 @@ extern char *ruletree_reverse_path(
 extern int create_ruletree_file(const char *ruletree_path,
 	uint32_t max_size, uint64_t min_mmap_addr, int min_client_socket_fd);
 extern int attach_ruletree(const char *ruletree_path, int keep_open);
+extern const void *ruletree_get_image(size_t *image_size);
+extern int ruletree_load_image(const void *image, size_t image_size);
+
+extern char *ruletree_handoff_to_string(const char *prefix,
+	ruletree_object_offset_t fwd_rule_list_offs,
+	ruletree_object_offset_t rev_rule_list_offs);
+extern int ruletree_handoff_from_string(const char *str);
+extern const ruletree_handoff_t *ruletree_get_handoff(void);
 
 extern void *offset_to_ruletree_object_ptr(ruletree_object_offset_t offs,
 	uint32_t required_type);
@@ -326,6 +465,36 @@ extern ruletree_object_offset_t ruletree_set_inodestat(
 	ruletree_inodestat_handle_t	*handle,
         inodesimu_t      		*istat_struct);
 
+extern int ruletree_inodestat_may_exist(uint64_t dev, uint64_t ino);
+
+/* for ruletree_find_inodestats() */
+typedef struct {
+	uint64_t	rfiq_dev;	/* in: keys */
+	uint64_t	rfiq_ino;
+	void		*rfiq_user;	/* in: not used by the lookup */
+	int		rfiq_found;	/* out: 1 if rfiq_istat was set */
+	inodesimu_t	rfiq_istat;
+	uint64_t	rfiq_key;	/* used internally */
+} ruletree_inodestat_query_t;
+
+extern uint32_t ruletree_find_inodestats(
+	ruletree_inodestat_query_t	*queries,
+	uint32_t			num_queries);
+
+/* script interpreter cache */
+extern int ruletree_find_scriptinterp(
+	const scriptinterp_id_t	*id,
+	scriptinterp_id_t	*cached_id_p,
+	const char		**mapped_interpreter_p,
+	const char		**exec_policy_name_p,
+	const char		**followed_symlinks_p);
+
+extern int ruletree_set_scriptinterp(
+	const scriptinterp_id_t	*id,
+	const char		*mapped_interpreter,
+	const char		*exec_policy_name,
+	const char		*followed_symlinks);
+
 /* ------------ fs mapping rule maintenance routines ------------ */
 extern ruletree_object_offset_t add_rule_to_ruletree(
 	const char *name, int selector_type, const char *selector,
@@ -334,6 +503,10 @@ extern ruletree_object_offset_t add_rule_to_ruletree(
 	ruletree_object_offset_t rule_list_link,
 	int flags, const char *binary_name,
         int func_class, const char *exec_policy_name);
+extern ruletree_object_offset_t create_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs);
+extern ruletree_object_offset_t create_identity_prefixes_to_ruletree(
+	ruletree_object_offset_t rule_list_offs);
 
 /* ------------ exec rule maintenance routines ------------ */
 ruletree_object_offset_t add_exec_preprocessing_rule_to_ruletree(
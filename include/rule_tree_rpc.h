@@ -14,7 +14,13 @@
  *   information to the rule tree.
 */
 
-#define RULETREE_RPC_PROTOCOL_VERSION	2
+#define RULETREE_RPC_PROTOCOL_VERSION	5
+
+/* max.size of the strings in a SETSCRIPTINTERP message */
+#define RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE	2048
+
+/* max.number of inodes in a NEWFILEINFO message */
+#define RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES	32
 
 /* Commands: Client -> server messages */
 typedef struct ruletree_rpc_msg_command_s {
@@ -27,14 +33,34 @@ typedef struct ruletree_rpc_msg_command_s {
 
 		/* for SETFILEINFO */
 		inodesimu_t	rimm_fileinfo;
+
+		/* for SETSCRIPTINTERP */
+		struct {
+			scriptinterp_id_t	rimm_si_id;
+			/* mapped interpreter + '\0' + exec policy name + '\0'
+			 * + followed symlinks + '\0' */
+			char	rimm_si_strings[RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE];
+		} rimm_scriptinterp;
+
+		/* for NEWFILEINFO: complete status of new inodes */
+		struct {
+			uint32_t	rimm_nfi_num_entries;
+			inodesimu_t	rimm_nfi_entries[RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES];
+		} rimm_newfileinfo;
 	} rim_message;
 } ruletree_rpc_msg_command_t;
 
+/* Messages are sent without the unused tail of the union: */
+#define RULETREE_RPC_COMMAND_SIZE(msg_size) \
+	(offsetof(ruletree_rpc_msg_command_t, rim_message) + (msg_size))
+
 #define RULETREE_RPC_MESSAGE_COMMAND__PING	1
 #define RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO	2
 #define RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO	3
 #define RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO	4
 #define RULETREE_RPC_MESSAGE_COMMAND__INIT2		5
+#define RULETREE_RPC_MESSAGE_COMMAND__SETSCRIPTINTERP	6
+#define RULETREE_RPC_MESSAGE_COMMAND__NEWFILEINFO	7
 
 /* Replies: Server -> Client messages */
 typedef struct ruletree_rpc_msg_reply_hdr_s {
@@ -75,4 +101,16 @@ extern void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits);
 extern void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino);
 
+/* write-behind of the status of new files: */
+extern void ruletree_rpc__vperm_new_file(const inodesimu_t *istat, int fd);
+extern void ruletree_rpc__vperm_fd_closed(int fd);
+extern void ruletree_rpc__vperm_flush_new_files(void);
+extern int ruletree_rpc__vperm_find_new_file(uint64_t dev, uint64_t ino,
+	inodesimu_t *istat);
+extern uint32_t ruletree_rpc__vperm_num_new_files(void);
+
+extern void ruletree_rpc__set_script_interpreter(const scriptinterp_id_t *id,
+	const char *mapped_interpreter, const char *exec_policy_name,
+	const char *followed_symlinks);
+
 #endif /* SB2_RULETREE_H__ */
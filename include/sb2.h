@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 /* WARNING!!
  * pthread functions MUST NOT be used directly in the preload library.
@@ -50,6 +51,22 @@ struct sb2context {
 	/* for path mapping logic: */
 	char *host_cwd;
 	char *virtual_reversed_cwd;
+	/* identity of host_cwd when the copy was taken, see
+	 * "Virtual CWD tracking" in pathresolution.c */
+	dev_t host_cwd_dev;
+	ino_t host_cwd_ino;
+	unsigned int virtual_cwd_generation;
+
+	/* set by the rule engine if the result depended on
+	 * environment variables or on existence of files
+	 * (such results must not be cached) */
+	int mapping_result_is_volatile;
+
+	/* host paths of symlinks that were followed while
+	 * track_followed_symlinks was set, each followed by '\n'
+	 * (see the script interpreter cache in exec_map_script_interp.c) */
+	int track_followed_symlinks;
+	char *followed_symlinks;
 };
 
 /* Library interface version string:
@@ -235,6 +252,7 @@ extern void sblog_vprintf_line_to_logfile(const char *file, int line,
 	int level, const char *format, va_list ap);
 extern void sblog_printf_line_to_logfile(const char *file, int line,
 	int level, const char *format,...);
+extern void sblog_exec_trace(const char *file);
 
 extern int sb_loglevel__; /* do not access directly */
 extern int sb_log_initial_pid__; /* current PID will be recorded here
@@ -20,4 +20,7 @@ extern int sb2_map_network_addr(
         int result_addr_buf_len,
         int *result_port);
 
+/* preload/network.c: */
+extern void sockaddr_cache_forget_fd(int fd);
+
 #endif /* SB2_NETWORK_H__ */
@@ -8,6 +8,7 @@
 #ifndef SB2_STAT_H
 #define SB2_STAT_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -23,6 +24,8 @@ extern int real_fstatat64(int dirfd, const char *path, struct stat64 *statbuf, i
 
 extern int i_virtualize_struct_stat(const char *realfnname,
 	struct stat *buf, struct stat64 *buf64);
+extern void i_virtualize_struct_stats(const char *realfnname,
+	uint32_t num_bufs, struct stat **bufs, struct stat64 **bufs64);
 
 extern int sb2_stat_file(const char *path, struct stat *buf, int *result_errno_ptr,
 	int (*statfn_with_ver_ptr)(int ver, const char *filename, struct stat *buf),
@@ -8,9 +8,12 @@
 #ifndef __SB2VPERM_H
 #define __SB2VPERM_H
 
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
 
+#include "rule_tree.h"
+
 extern uid_t vperm_getuid(void);
 extern uid_t vperm_geteuid(void);
 extern uid_t vperm_get_real_euid(void);
@@ -25,4 +28,12 @@ extern int vperm_set_owner_and_group_of_unknown_files(uid_t *uidp, gid_t *gidp);
 
 extern int vperm_simulate_root_fs_permissions(void);
 
+/* inodestat lookups; queued new files (see
+ * ruletree_rpc__vperm_new_file()) are included */
+extern int vperm_find_inodestat(
+	ruletree_inodestat_handle_t *handle, inodesimu_t *istat);
+extern uint32_t vperm_find_inodestats(
+	ruletree_inodestat_query_t *queries, uint32_t num_queries);
+extern uint32_t vperm_num_active_inodestats(void);
+
 #endif
@@ -24,4 +24,7 @@ extern int lua_sb_isprefix(lua_State *l);
 extern int lua_sb_test_path_match(lua_State *l);
 extern int lua_sb_readlink(lua_State *l);
 
+extern void (*sblib_luaif_fs_probe_hook)(const char *fn_name,
+	const char *path, const char *result);
+
 #endif
@@ -439,12 +439,20 @@ for m_index,m_name in pairs(all_modes) do
 		print("-- Added ruleset fwd rules")
 	end
 	ruletree.catalog_set("fs_rules", modename_in_ruletree, ri)
+	-- paths that map to themselves; the preload library
+	-- does not need to run the mapping engine for these.
+	ruletree.catalog_set("fs_rules_identity_prefixes", modename_in_ruletree,
+		ruletree.create_identity_prefixes(ri))
 
 	ri = add_list_of_rules(reverse_fs_mapping_rules, "reverse "..m_name) -- add reverse  rules
 	if debug_messages_enabled then
 		print("-- Added ruleset rev.rules")
 	end
 	ruletree.catalog_set("rev_rules", modename_in_ruletree, ri)
+	-- reverse rules are selected by host paths, which have
+	-- little in common; the index avoids testing all of them.
+	ruletree.catalog_set("rev_rules_index", modename_in_ruletree,
+		ruletree.create_rule_index(ri))
 
 	add_all_exec_policies(modename_in_ruletree)
 end
@@ -26,6 +26,11 @@ ruletree.catalog_set("vperm", "inodestats", 0)
 ruletree.catalog_set("vperm", "num_active_inodestats",
 	ruletree.new_uint32(0))
 
+-- Create the "exec_cache" catalog
+--	exec_cache::script_interpreters is the binary tree of
+--	mapped script interpreters, initially empty.
+ruletree.catalog_set("exec_cache", "script_interpreters", 0)
+
 function do_file(filename)
 	if (debug_messages_enabled) then
 		sblib.log("debug", string.format("Loading '%s'", filename))
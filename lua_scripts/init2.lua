@@ -9,6 +9,19 @@
 session_dir = os.getenv("SBOX_SESSION_DIR")
 debug_messages_enabled = sblib.debug_messages_enabled()
 
+-- init.lua was not executed if sb2d copied the rules
+-- from a rule tree template (sb2d option -C)
+if do_file == nil then
+	function do_file(filename)
+		local f, err = loadfile(filename)
+		if (f == nil) then
+			error("\nError while loading " .. filename .. ": \n"
+				.. err .. "\n")
+		end
+		return f()
+	end
+end
+
 -- Default:
 init2_result = "OK - CPU transparency settings loaded."
 init2_errors = ""
@@ -76,6 +76,13 @@ int lua_sb_log(lua_State *luastate)
 	return 1;
 }
 
+/* Called for every lookup that the Lua code makes to the real file
+ * system; sb2d uses this to find out what the rules depend on
+ * (see sb2d/ruletree_cache.c). result is NULL if readlink failed.
+*/
+void (*sblib_luaif_fs_probe_hook)(const char *fn_name,
+	const char *path, const char *result) = NULL;
+
 /* "sb.path_exists", to be called from lua code
  * returns true if file, directory or symlink exists at the specified real path,
  * false if not.
@@ -91,6 +98,9 @@ int lua_sb_path_exists(lua_State *l)
 		char	*path = strdup(lua_tostring(l, 1));
 		int	result = sb_path_exists(path);
 
+		if (sblib_luaif_fs_probe_hook)
+			(*sblib_luaif_fs_probe_hook)("path_exists", path,
+				result ? "1" : "0");
 		lua_pushboolean(l, result);
 		SB_LOG(SB_LOGLEVEL_DEBUG, "lua_sb_path_exists got %d",
 			result);
@@ -226,10 +236,15 @@ int lua_sb_readlink(lua_State *l)
 
 	path = strdup(lua_tostring(l, 1));
 	if (readlink(path, resolved_path, PATH_MAX) < 0) {
+		if (sblib_luaif_fs_probe_hook)
+			(*sblib_luaif_fs_probe_hook)("readlink", path, NULL);
 		free(path);
 		lua_pushstring(l, NULL);
 		return 1;
 	} else {
+		if (sblib_luaif_fs_probe_hook)
+			(*sblib_luaif_fs_probe_hook)("readlink", path,
+				resolved_path);
 		free(path);
 		lua_pushstring(l, resolved_path);
 		return 1;
@@ -11,13 +11,12 @@
  *
  * This is a very straightforward conversion from Lua; old
  * Lua code is even preserved in the comments below.
- * The downside is that the code is definitely not optimal
- * (e.g. converts addresses to strings and back, just as
- * the practise was with Lua). But a) the code is faster
- * than the Lua implementation was and b) it is easy to
- * optimize now if it turns out to be a problem. Remember
- * that these routines are usually called for connections, not
- * for every TCP packet (see "NETWORKING MODES" in sb2(1))
+ * Address patterns of the rules are parsed when the rules are
+ * added to the rule tree (see add_net_rule_to_ruletree()), and
+ * the address to be tested is parsed once per lookup; string
+ * comparisons are used only for patterns that were not numeric.
+ * Results are cached per process, because e.g. sendto() is
+ * called for every UDP packet (see "NETWORKING MODES" in sb2(1))
 */
 
 #include <lua.h>
@@ -230,6 +229,79 @@ static int test_net_addr_match(
 	return(result);
 }
 
+/* the address that is tested against the rules, in binary form */
+typedef struct {
+	int	na_family;	/* AF_INET, AF_INET6, or 0 if not numeric */
+	uint8_t	na_bytes[16];	/* network byte order */
+} net_addr_t;
+
+static void parse_net_addr(const char *addr_type, const char *address,
+	net_addr_t *na)
+{
+	memset(na, 0, sizeof(*na));
+	if (!addr_type || !address) return;
+	if (!strncmp(addr_type, "ipv4", 4)) {
+		if (inet_pton(AF_INET, address, na->na_bytes) == 1)
+			na->na_family = AF_INET;
+	} else if (!strncmp(addr_type, "ipv6", 4)) {
+		if (inet_pton(AF_INET6, address, na->na_bytes) == 1)
+			na->na_family = AF_INET6;
+	}
+	if (!na->na_family)
+		SB_LOG(SB_LOGLEVEL_DEBUG, "inet_pton(%s addr:%s) FAILED",
+			addr_type, address);
+}
+
+/* Test an address against a prefix. Like the string version did,
+ * the masked address must be equal to the whole pattern. */
+static int addr_matches_prefix(const uint8_t *addr, const uint8_t *prefix,
+	int num_bytes, int prefix_len)
+{
+	int	i;
+
+	for (i = 0; i < num_bytes; i++, prefix_len -= 8) {
+		uint8_t	mask;
+
+		if (prefix_len >= 8) mask = 0xFF;
+		else if (prefix_len > 0) mask = (0xFF << (8 - prefix_len)) & 0xFF;
+		else mask = 0;
+		if ((addr[i] & mask) != prefix[i]) return(0);
+	}
+	return(1);
+}
+
+/* Test an address against a pattern that was parsed when the
+ * rule was created. Returns 1 if matched. */
+static int test_compiled_net_addr_match(
+	const ruletree_net_rule_t *rule,
+	const net_addr_t *na)
+{
+	static const uint8_t	zeroes[16];
+
+	switch (rule->rtree_net_addr_kind) {
+	case SB2_RULETREE_NET_ADDR_IPV4:
+		return((na->na_family == AF_INET) &&
+			addr_matches_prefix(na->na_bytes,
+				rule->rtree_net_addr_bytes, 4,
+				rule->rtree_net_addr_prefix_len));
+	case SB2_RULETREE_NET_ADDR_IPV6:
+		return((na->na_family == AF_INET6) &&
+			addr_matches_prefix(na->na_bytes,
+				rule->rtree_net_addr_bytes, 16,
+				rule->rtree_net_addr_prefix_len));
+	/* INADDR_ANY and IN6ADDR_ANY do *not* mean that any
+	 * address will match: It matches only if the address
+	 * *is* INADDR_ANY/IN6ADDR_ANY, exactly. */
+	case SB2_RULETREE_NET_ADDR_INADDR_ANY:
+		return((na->na_family == AF_INET) &&
+			!memcmp(na->na_bytes, zeroes, 4));
+	case SB2_RULETREE_NET_ADDR_IN6ADDR_ANY:
+		return((na->na_family == AF_INET6) &&
+			!memcmp(na->na_bytes, zeroes, 16));
+	}
+	return(0);
+}
+
 /* Lua:
  *	find_net_rule(netruletable, realfnname, addr_type,
  *	        orig_dst_addr, orig_port, binary_name)
@@ -239,6 +311,7 @@ static ruletree_net_rule_t *find_net_rule(
 	const char *realfnname,
 	const char *addr_type,
 	const char *orig_dst_addr,
+	const net_addr_t *orig_dst_na,
 	unsigned int orig_port,
 	const char *binary_name)
 {
@@ -336,11 +409,19 @@ static ruletree_net_rule_t *find_net_rule(
 		 *          end
 		*/
 		if (rule->rtree_net_address) {
-			const char *addr = offset_to_ruletree_string_ptr(
-				rule->rtree_net_address, NULL);
+			int addr_matches;
+
+			if (rule->rtree_net_addr_kind != SB2_RULETREE_NET_ADDR_STRING) {
+				addr_matches = test_compiled_net_addr_match(
+					rule, orig_dst_na);
+			} else {
+				const char *addr = offset_to_ruletree_string_ptr(
+					rule->rtree_net_address, NULL);
 
-			if (!addr ||
-			    !test_net_addr_match(addr_type, orig_dst_addr, addr)) {
+				addr_matches = addr && test_net_addr_match(
+					addr_type, orig_dst_addr, addr);
+			}
+			if (!addr_matches) {
 				SB_LOG(SB_LOGLEVEL_NOISE,
 					"%s: [%d] addr. does not match", __func__, i);
 				continue;
@@ -357,7 +438,8 @@ static ruletree_net_rule_t *find_net_rule(
 			SB_LOG(SB_LOGLEVEL_NOISE,
 				"%s: [%d] => more rules @%d", __func__, rule->rtree_net_rules);
 			return (find_net_rule(rule->rtree_net_rules, realfnname,
-				addr_type, orig_dst_addr, orig_port, binary_name));
+				addr_type, orig_dst_addr, orig_dst_na,
+				orig_port, binary_name));
 		}
 		
 		/* Lua:
@@ -456,6 +538,128 @@ static int apply_net_rule(
 	return(EPERM);
 }
 
+/* ========== per-process cache of results: ========== */
+
+/* Net rules don't change during a session, and the network mode
+ * is fixed for the lifetime of a process, so the same question
+ * always gets the same answer. Entries that don't fit to the
+ * fixed-size buffers are not cached.
+*/
+#define NET_RESULT_CACHE_SIZE	16
+
+typedef struct {
+	int		nrc_in_use;
+	uint32_t	nrc_hash;
+	int		nrc_orig_port;
+	char		nrc_binary_name[64];
+	char		nrc_fn_name[32];
+	char		nrc_addr_type[16];
+	char		nrc_orig_addr[INET6_ADDRSTRLEN];
+	int		nrc_result;	/* 0 or an errno code */
+	char		nrc_result_addr[INET6_ADDRSTRLEN];
+	int		nrc_result_port;
+} net_result_cache_entry_t;
+
+static net_result_cache_entry_t	net_result_cache[NET_RESULT_CACHE_SIZE];
+static pthread_mutex_t	net_result_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t net_result_hash(const char *binary_name,
+	const char *realfnname, const char *addr_type,
+	const char *orig_dst_addr, int orig_port)
+{
+	const char	*strs[4];
+	uint32_t	h = 2166136261U;	/* FNV-1a */
+	int		i;
+
+	strs[0] = binary_name;
+	strs[1] = realfnname;
+	strs[2] = addr_type;
+	strs[3] = orig_dst_addr;
+	for (i = 0; i < 4; i++) {
+		const unsigned char *cp = (const unsigned char *)strs[i];
+
+		while (*cp) {
+			h ^= *cp++;
+			h *= 16777619U;
+		}
+		h ^= '/';
+		h *= 16777619U;
+	}
+	h ^= (uint32_t)orig_port;
+	h *= 16777619U;
+	return(h);
+}
+
+static int net_result_key_fits(const char *binary_name,
+	const char *realfnname, const char *addr_type,
+	const char *orig_dst_addr)
+{
+	net_result_cache_entry_t *e;
+
+	return((strlen(binary_name) < sizeof(e->nrc_binary_name)) &&
+		(strlen(realfnname) < sizeof(e->nrc_fn_name)) &&
+		(strlen(addr_type) < sizeof(e->nrc_addr_type)) &&
+		(strlen(orig_dst_addr) < sizeof(e->nrc_orig_addr)));
+}
+
+/* returns 1 and fills result_* if the answer was found */
+static int net_result_cache_get(uint32_t hash,
+	const char *binary_name, const char *realfnname,
+	const char *addr_type, const char *orig_dst_addr, int orig_port,
+	int *result, char *result_addr_buf, int result_addr_buf_len,
+	int *result_port)
+{
+	net_result_cache_entry_t *e = &net_result_cache[hash % NET_RESULT_CACHE_SIZE];
+	int	found = 0;
+
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&net_result_cache_mutex);
+	if (e->nrc_in_use && (e->nrc_hash == hash) &&
+	    (e->nrc_orig_port == orig_port) &&
+	    !strcmp(e->nrc_orig_addr, orig_dst_addr) &&
+	    !strcmp(e->nrc_fn_name, realfnname) &&
+	    !strcmp(e->nrc_addr_type, addr_type) &&
+	    !strcmp(e->nrc_binary_name, binary_name)) {
+		*result = e->nrc_result;
+		if (!e->nrc_result) {
+			strncpy(result_addr_buf, e->nrc_result_addr,
+				result_addr_buf_len);
+			*result_port = e->nrc_result_port;
+		}
+		found = 1;
+	}
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&net_result_cache_mutex);
+	return(found);
+}
+
+static void net_result_cache_put(uint32_t hash,
+	const char *binary_name, const char *realfnname,
+	const char *addr_type, const char *orig_dst_addr, int orig_port,
+	int result, const char *result_addr, int result_port)
+{
+	net_result_cache_entry_t *e = &net_result_cache[hash % NET_RESULT_CACHE_SIZE];
+
+	if (!result && (strlen(result_addr) >= sizeof(e->nrc_result_addr)))
+		return;
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&net_result_cache_mutex);
+	e->nrc_hash = hash;
+	e->nrc_orig_port = orig_port;
+	strcpy(e->nrc_binary_name, binary_name);
+	strcpy(e->nrc_fn_name, realfnname);
+	strcpy(e->nrc_addr_type, addr_type);
+	strcpy(e->nrc_orig_addr, orig_dst_addr);
+	e->nrc_result = result;
+	if (!result) {
+		strcpy(e->nrc_result_addr, result_addr);
+		e->nrc_result_port = result_port;
+	}
+	e->nrc_in_use = 1;
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&net_result_cache_mutex);
+}
+
 /* Returns:
  *  - nonzero: value for errno, result_addr_buf and *result_port 
  *    contain unknown values
@@ -477,6 +681,9 @@ int sb2_map_network_addr(
 	const char *v[4];
 	ruletree_object_offset_t	net_rule_list_offs;
 	const char *modename = sbox_network_mode;
+	net_addr_t	orig_dst_na;
+	int		cacheable;
+	uint32_t	hash = 0;
 
 #if 1
 	(void)protocol;
@@ -486,6 +693,20 @@ int sb2_map_network_addr(
 		orig_dst_addr, orig_port, addr_type);
 	SB_LOG(SB_LOGLEVEL_NOISE, "binary_name = '%s', fn=%s", binary_name, realfnname);
 
+	cacheable = binary_name && realfnname && addr_type && orig_dst_addr &&
+		net_result_key_fits(binary_name, realfnname, addr_type, orig_dst_addr);
+	if (cacheable) {
+		hash = net_result_hash(binary_name, realfnname, addr_type,
+			orig_dst_addr, orig_port);
+		if (net_result_cache_get(hash, binary_name, realfnname,
+		    addr_type, orig_dst_addr, orig_port, &result,
+		    result_addr_buf, result_addr_buf_len, result_port)) {
+			SB_LOG(SB_LOGLEVEL_NOISE,
+				"sb2_map_network_addr => %d (cached)", result);
+			return(result);
+		}
+	}
+
 	if (!modename) {
 		modename = ruletree_catalog_get_string("NET_RULES", "#default");
 		if (!modename) {
@@ -503,8 +724,9 @@ int sb2_map_network_addr(
 	net_rule_list_offs = ruletree_catalog_vget(v);
 	SB_LOG(SB_LOGLEVEL_NOISE, "%s: net rules at = %d", __func__, net_rule_list_offs);
 
+	parse_net_addr(addr_type, orig_dst_addr, &orig_dst_na);
 	rule = find_net_rule(net_rule_list_offs, realfnname, addr_type,
-		orig_dst_addr, orig_port, binary_name);
+		orig_dst_addr, &orig_dst_na, orig_port, binary_name);
 
 	result = EPERM; /* default value */
 	if (rule) {
@@ -522,6 +744,10 @@ int sb2_map_network_addr(
 			result);
 	}
 
+	if (cacheable)
+		net_result_cache_put(hash, binary_name, realfnname,
+			addr_type, orig_dst_addr, orig_port,
+			result, result_addr_buf, (result ? 0 : *result_port));
 	return(result);
 }
 
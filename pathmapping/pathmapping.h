@@ -140,6 +140,21 @@ extern char *ruletree_translate_path(
 extern ruletree_object_offset_t ruletree_get_rule_list_offs(
 	int use_fwd_rules, const char **errormsgp);
 
+extern ruletree_object_offset_t ruletree_identity_prefix_match(
+	const char *abs_clean_path, uint32_t fn_class);
+
+extern ruletree_fsrule_t *ruletree_rule_is_same_for_component(
+	const path_mapping_context_t *ctx,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_clean_virtual_path,
+	uint32_t fn_class);
+
+extern int ruletree_rule_covers_subtree(
+	const path_mapping_context_t *ctx,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_clean_virtual_dir,
+	uint32_t fn_classmask);
+
 extern ruletree_object_offset_t ruletree_get_mapping_requirements(
 	ruletree_object_offset_t rule_list_offs,
 	const path_mapping_context_t *ctx,
@@ -179,6 +194,16 @@ extern void sbox_map_path_internal__c_engine(
 	mapping_results_t *res,
 	ruletree_object_offset_t rule_list_offset);
 
+extern int sbox_map_path_at_dir__c_engine(
+	struct sb2context *sb2ctx,
+	const char *binary_name,
+	const char *func_name,
+	const fdpathdb_entry_t *dir,
+	const char *name,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res);
+
 extern char *sbox_reverse_path_internal__c_engine(
         const path_mapping_context_t  *ctx,
         const char *abs_host_path,
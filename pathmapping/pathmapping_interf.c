@@ -234,6 +234,54 @@ void sbox_map_path(
 }
 
 
+/* set when it is known that the rules don't have an identity prefix set */
+int sbox_identity_prefixes_unavailable = 0;
+
+/* Returns true if an absolute path is already clean: no "." or ".."
+ * components, no "//" and no trailing '/' (except in "/"). The path
+ * is used as the resolved virtual path (e.g. the virtual CWD), so
+ * anything that the mapping engine would clean must go there. */
+static int path_is_clean(const char *path)
+{
+	const char *cp = path;
+	size_t	len;
+
+	if (strstr(path, "//")) return(0);
+	len = strlen(path);
+	if ((len > 1) && (path[len-1] == '/')) return(0);
+	while ((cp = strstr(cp, "/.")) != NULL) {
+		cp += 2;
+		if (*cp == '.') cp++;
+		if ((*cp == '/') || (*cp == '\0')) return(0);
+	}
+	return(1);
+}
+
+/* See sbox_map_path_if_identity() in mapping.h */
+int sbox_map_path_identity(
+	const char *path,
+	uint32_t classmask,
+	mapping_results_t *res)
+{
+	ruletree_object_offset_t	rule_offs;
+
+	if (sbox_chroot_path) return(0);
+	/* the mapping engine writes the "pass:" and "disabled(..)"
+	 * lines that sb2-logz reads */
+	if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_INFO)) return(0);
+	if (!path_is_clean(path)) return(0);
+
+	rule_offs = ruletree_identity_prefix_match(path, classmask);
+	if (!rule_offs) return(0);
+
+	res->mres_result_buf = res->mres_result_path = (char *)path;
+	res->mres_resolved_virtual_path = (char *)path;
+	res->mres_result_is_orig_path = 1;
+	res->mres_rule_offs = rule_offs;
+	SB_LOG(SB_LOGLEVEL_NOISE, "%s: '%s' maps to itself", __func__, path);
+	return(1);
+}
+
 void sbox_map_path_at(
 	const char *func_name,
 	int dirfd,
@@ -242,7 +290,7 @@ void sbox_map_path_at(
 	mapping_results_t *res,
 	uint32_t classmask)
 {
-	const char *dirfd_path;
+	fdpathdb_entry_t *dirfd_entry;
 
 	if (!virtual_path) {
 		res->mres_result_buf = res->mres_result_path = NULL;
@@ -250,7 +298,11 @@ void sbox_map_path_at(
 		return;
 	}
         if (*virtual_path == '\0') {
-		goto end;
+		/* AT_EMPTY_PATH: the object is "dirfd" itself,
+		 * nothing to map */
+		res->mres_result_buf = res->mres_result_path = strdup("");
+		res->mres_readonly = 0;
+		return;
 	}
 
 	if ((*virtual_path == '/')
@@ -267,16 +319,31 @@ void sbox_map_path_at(
 	}
 
 	/* relative to something else than CWD */
-	dirfd_path = fdpathdb_find_path(dirfd);
+	dirfd_entry = fdpathdb_get_entry(dirfd);
 
-	if (dirfd_path) {
+	if (dirfd_entry) {
 		/* pathname found */
 		char *virtual_abs_path_at_fd = NULL;
+		struct sb2context *sb2ctx = get_sb2context();
+		int mapped;
 
-		if (asprintf(&virtual_abs_path_at_fd, "%s/%s", dirfd_path, virtual_path) < 0) {
+		/* first try to continue from the directory's mapping */
+		mapped = sbox_map_path_at_dir__c_engine(sb2ctx,
+			(sbox_binary_name ? sbox_binary_name : "UNKNOWN"),
+			func_name, dirfd_entry, virtual_path,
+			flags, classmask, res);
+		release_sb2context(sb2ctx);
+		if (mapped) {
+			free(dirfd_entry);
+			return;
+		}
+
+		if (asprintf(&virtual_abs_path_at_fd, "%s/%s",
+		    dirfd_entry->fpe_path, virtual_path) < 0) {
 			/* asprintf failed */
 			abort();
 		}
+		free(dirfd_entry);
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"Synthetic path for %s(%d,'%s') => '%s'",
 			func_name, dirfd, virtual_path, virtual_abs_path_at_fd);
@@ -290,7 +357,6 @@ void sbox_map_path_at(
 		return;
 	}
 
-end:
 	/* name not found. Can't do much here, log a warning and return
 	 * the original relative path. That will work if we are lucky, but
 	 * not always..  */
@@ -300,6 +366,45 @@ end:
 	res->mres_readonly = 0;
 }
 
+/* Check if all names below a directory are mapped by simply appending
+ * them to the directory's host path (see ruletree_rule_covers_subtree()).
+ * "dir_rule_offs" and "abs_virtual_dir" come from the directory's mapping
+ * result (mres_rule_offs, mres_resolved_virtual_path).
+ * Returns 1 if so; then a directory walker doesn't need to map every name.
+*/
+int sbox_subtree_maps_like_dir(
+	const char *func_name,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_virtual_dir,
+	uint32_t classmask)
+{
+	path_mapping_context_t	ctx;
+	struct sb2context	*sb2ctx;
+	int			result = 0;
+
+	if (!dir_rule_offs || !abs_virtual_dir || (*abs_virtual_dir != '/'))
+		return(0);
+
+	sb2ctx = get_sb2context();
+	if (sb2ctx && !sb2ctx->mapping_disabled && !sbox_chroot_path &&
+	    !getenv("SBOX_DISABLE_MAPPING") && (ruletree_to_memory() >= 0)) {
+		clear_path_mapping_context(&ctx);
+		ctx.pmc_binary_name =
+			(sbox_binary_name ? sbox_binary_name : "UNKNOWN");
+		ctx.pmc_func_name = func_name;
+		ctx.pmc_fn_class = classmask;
+		ctx.pmc_virtual_orig_path = abs_virtual_dir;
+		ctx.pmc_sb2ctx = sb2ctx;
+
+		result = ruletree_rule_covers_subtree(&ctx, dir_rule_offs,
+			abs_virtual_dir, classmask);
+	}
+	if (sb2ctx) release_sb2context(sb2ctx);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %s: %s", __func__, abs_virtual_dir,
+		(result ? "one rule for the subtree" : "map names separately"));
+	return(result);
+}
+
 /* this maps the path and then leaves "rule" and "exec_policy" to the stack, 
  * because exec post-processing needs them
 */
@@ -338,11 +443,14 @@ char *scratchbox_reverse_path(
 
 void	free_mapping_results(mapping_results_t *res)
 {
-	if (res->mres_result_buf) free(res->mres_result_buf);
+	if (res->mres_result_buf && !res->mres_result_is_orig_path)
+		free(res->mres_result_buf);
 	if (res->mres_result_path_was_allocated && res->mres_result_path)
 		free(res->mres_result_path);
 	if (res->mres_virtual_cwd) free(res->mres_virtual_cwd);
 	if (res->mres_allocated_exec_policy_name) free(res->mres_allocated_exec_policy_name);
+	if (res->mres_resolved_virtual_path && !res->mres_result_is_orig_path)
+		free(res->mres_resolved_virtual_path);
 	/* res->mres_error_text is a constant string, and not freed, ever */
 	clear_mapping_results_struct(res);
 }
@@ -354,5 +462,7 @@ void	force_path_to_mapping_result(mapping_results_t *res, const char *path)
 	res->mres_result_path_was_allocated = 0;
 	res->mres_virtual_cwd = NULL;
 	res->mres_errno = 0;
+	res->mres_rule_offs = 0;
+	res->mres_resolved_virtual_path = NULL;
 }
 
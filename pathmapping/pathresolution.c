@@ -74,6 +74,7 @@
 #include <sys/file.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -419,6 +420,32 @@ static ruletree_object_offset_t sb_path_resolution_resolve_symlink(
 	mapping_results_t *resolved_virtual_path_res,
 	int nest_count);
 
+/* Add "host_path" to sb2ctx->followed_symlinks. A result that can't
+ * be recorded is marked volatile, so that it won't be cached. */
+static void record_followed_symlink(struct sb2context *sb2ctx,
+	const char *host_path)
+{
+	size_t	old_len;
+	size_t	len = strlen(host_path);
+	char	*new_list;
+
+	old_len = sb2ctx->followed_symlinks ?
+		strlen(sb2ctx->followed_symlinks) : 0;
+	if (strchr(host_path, '\n') || (old_len + len + 2 > PATH_MAX)) {
+		sb2ctx->mapping_result_is_volatile = 1;
+		return;
+	}
+	new_list = realloc(sb2ctx->followed_symlinks, old_len + len + 2);
+	if (!new_list) {
+		sb2ctx->mapping_result_is_volatile = 1;
+		return;
+	}
+	memcpy(new_list + old_len, host_path, len);
+	new_list[old_len + len] = '\n';
+	new_list[old_len + len + 1] = '\0';
+	sb2ctx->followed_symlinks = new_list;
+}
+
 /* sb_path_resolution():  This is the place where symlinks are followed.
  *
  * Note: For Lua mapping:
@@ -694,6 +721,10 @@ static ruletree_object_offset_t sb_path_resolution(
 				"Path resolution found symlink '%s' "
 				"-> '%s'",
 				prefix_mapping_result_host_path, link_dest);
+			if (ctx->pmc_sb2ctx &&
+			    ctx->pmc_sb2ctx->track_followed_symlinks)
+				record_followed_symlink(ctx->pmc_sb2ctx,
+					prefix_mapping_result_host_path);
 			free(prefix_mapping_result_host_path);
 			prefix_mapping_result_host_path = NULL;
 
@@ -997,6 +1028,281 @@ static int get_and_check_host_cwd(
 	SB_LOG(SB_LOGLEVEL_DEBUG, "host cwd=%s", host_cwd);
 	return(0);
 }
+
+/* ========== Virtual CWD tracking: ========== */
+
+/* The virtual CWD of the process is tracked here, so that relative
+ * paths and getcwd() don't need the reverse mapping rules. It is
+ * updated by the chdir() and fchdir() gates (the virtual path is
+ * known there), inherited from the parent process (see
+ * sbox_virtual_cwd_export_for_exec()), and as the last resort
+ * it is reversed from the host's CWD like before.
+ *
+ * Threads keep their own copy in the sb2context (host_cwd and
+ * virtual_reversed_cwd); vc_generation tells when the copy has
+ * become old. Both are validated against st_dev/st_ino of ".",
+ * so changes that bypass the gates (a raw syscall, or a chdir()
+ * from the other side of a mode change) are noticed, too.
+ *
+ * The lock is only tried, never waited for, by the readers: This
+ * may be entered from a signal handler, and a missed update only
+ * costs a reversing operation.
+*/
+static struct {
+	int		vc_lock;
+	unsigned int	vc_generation;
+	dev_t		vc_dev;
+	ino_t		vc_ino;
+	char		*vc_host_cwd;
+	char		*vc_virtual_cwd;
+} virtual_cwd = { 0, 1, 0, 0, NULL, NULL };
+
+static int virtual_cwd_atfork_registered = 0;
+
+/* A fork() child may inherit the lock from a thread that does
+ * not exist in the child. The state may be half-updated, too, so
+ * it is invalidated (dev+ino won't match any directory) */
+static void virtual_cwd_atfork_child(void)
+{
+	if (virtual_cwd.vc_lock) {
+		virtual_cwd.vc_dev = 0;
+		virtual_cwd.vc_ino = 0;
+		virtual_cwd.vc_generation++;
+		virtual_cwd.vc_lock = 0;
+	}
+}
+
+static int virtual_cwd_trylock(void)
+{
+	return(__atomic_exchange_n(&virtual_cwd.vc_lock, 1,
+		__ATOMIC_ACQUIRE) == 0);
+}
+
+static void virtual_cwd_unlock(void)
+{
+	__atomic_store_n(&virtual_cwd.vc_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Publish a new virtual cwd for all threads (and for exec).
+ * Returns the new generation number, or 0 if it wasn't published */
+static unsigned int set_virtual_cwd(const struct stat64 *dot_statbuf,
+	const char *host_cwd, const char *abs_virtual_cwd)
+{
+	char	*new_host_cwd = strdup(host_cwd);
+	char	*new_virtual_cwd = strdup(abs_virtual_cwd);
+	char	*old_host_cwd;
+	char	*old_virtual_cwd;
+	unsigned int	generation;
+	int	i;
+
+	if (!__atomic_exchange_n(&virtual_cwd_atfork_registered, 1,
+	    __ATOMIC_SEQ_CST))
+		pthread_atfork(NULL, NULL, virtual_cwd_atfork_child);
+
+	for (i = 0; !virtual_cwd_trylock(); i++) {
+		if (i >= 1000) {
+			/* give up; make sure that all threads
+			 * re-validate their copies */
+			__atomic_add_fetch(&virtual_cwd.vc_generation, 1,
+				__ATOMIC_SEQ_CST);
+			free(new_host_cwd);
+			free(new_virtual_cwd);
+			return(0);
+		}
+		sched_yield();
+	}
+	old_host_cwd = virtual_cwd.vc_host_cwd;
+	old_virtual_cwd = virtual_cwd.vc_virtual_cwd;
+	virtual_cwd.vc_dev = dot_statbuf->st_dev;
+	virtual_cwd.vc_ino = dot_statbuf->st_ino;
+	virtual_cwd.vc_host_cwd = new_host_cwd;
+	virtual_cwd.vc_virtual_cwd = new_virtual_cwd;
+	generation = __atomic_add_fetch(&virtual_cwd.vc_generation, 1,
+		__ATOMIC_SEQ_CST);
+	virtual_cwd_unlock();
+
+	if (old_host_cwd) free(old_host_cwd);
+	if (old_virtual_cwd) free(old_virtual_cwd);
+	return(generation);
+}
+
+/* Check that the CWD copy in sb2ctx is still valid; refresh it
+ * from the process-wide state if needed.
+ * Returns 0 if sb2ctx->host_cwd and sb2ctx->virtual_reversed_cwd
+ * can be used (and copies the host cwd to host_cwd), 1 if the CWD
+ * needs to be resolved the hard way, or -1 if "." could not be
+ * stat'ed (dot_statbuf is valid only if the result is >= 0)
+*/
+static int find_virtual_cwd(
+	struct sb2context *sb2ctx,
+	char *host_cwd,
+	size_t host_cwd_size,
+	struct stat64 *dot_statbuf)
+{
+	unsigned int	generation;
+
+	if (real_stat64(".", dot_statbuf) < 0) return(-1);
+
+	generation = __atomic_load_n(&virtual_cwd.vc_generation,
+		__ATOMIC_SEQ_CST);
+	if (!sb2ctx->host_cwd || !sb2ctx->virtual_reversed_cwd ||
+	    (sb2ctx->virtual_cwd_generation != generation) ||
+	    (sb2ctx->host_cwd_dev != dot_statbuf->st_dev) ||
+	    (sb2ctx->host_cwd_ino != dot_statbuf->st_ino)) {
+		int	found = 0;
+
+		if (!virtual_cwd_trylock()) return(1);
+		if (virtual_cwd.vc_virtual_cwd &&
+		    (virtual_cwd.vc_dev == dot_statbuf->st_dev) &&
+		    (virtual_cwd.vc_ino == dot_statbuf->st_ino)) {
+			if (sb2ctx->host_cwd) free(sb2ctx->host_cwd);
+			if (sb2ctx->virtual_reversed_cwd)
+				free(sb2ctx->virtual_reversed_cwd);
+			sb2ctx->host_cwd = strdup(virtual_cwd.vc_host_cwd);
+			sb2ctx->virtual_reversed_cwd =
+				strdup(virtual_cwd.vc_virtual_cwd);
+			sb2ctx->host_cwd_dev = virtual_cwd.vc_dev;
+			sb2ctx->host_cwd_ino = virtual_cwd.vc_ino;
+			sb2ctx->virtual_cwd_generation = virtual_cwd.vc_generation;
+			found = 1;
+		}
+		virtual_cwd_unlock();
+		if (!found) return(1);
+	}
+	if (strlen(sb2ctx->host_cwd) >= host_cwd_size) return(1);
+	strcpy(host_cwd, sb2ctx->host_cwd);
+	return(0);
+}
+
+/* Called after chdir() or fchdir() has succeeded. abs_virtual_cwd
+ * is the resolved virtual path of the new CWD, or NULL if that is
+ * not known (then it will be reversed when needed)
+*/
+void sbox_virtual_cwd_changed(const char *abs_virtual_cwd)
+{
+	char		host_cwd[PATH_MAX + 1];
+	struct stat64	dot_statbuf;
+
+	if (!abs_virtual_cwd || (*abs_virtual_cwd != '/') ||
+	    !getcwd_nomap_nolog(host_cwd, sizeof(host_cwd)) ||
+	    (real_stat64(".", &dot_statbuf) < 0)) {
+		/* the private copies must be validated again */
+		__atomic_add_fetch(&virtual_cwd.vc_generation, 1,
+			__ATOMIC_SEQ_CST);
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: virtual cwd unknown", __func__);
+		return;
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: host cwd=%s, virtual cwd=%s",
+		__func__, host_cwd, abs_virtual_cwd);
+	(void)set_virtual_cwd(&dot_statbuf, host_cwd, abs_virtual_cwd);
+}
+
+/* drop prefix sbox_chroot_path from a virtual path, if the path
+ * is inside the chroot. Returns the new path (path is freed) */
+static char *drop_chroot_prefix_from_path(const char *fn_name, char *path)
+{
+	int	chroot_path_len;
+
+	if (!path || !sbox_chroot_path) return(path);
+
+	/* note that the prefix isn't there always; for example
+	 * chdir does not have to be inside the chroot */
+	chroot_path_len = strlen(sbox_chroot_path);
+	if (!strncmp(path, sbox_chroot_path, chroot_path_len)) {
+		if (path[chroot_path_len] == '/') {
+			char	*new_result;
+
+			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: drop chroot prefix '%s'",
+				fn_name, sbox_chroot_path);
+			new_result = strdup(path+chroot_path_len);
+			free(path);
+			return(new_result);
+		} else if (path[chroot_path_len] == '\0') {
+			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: drop chroot prefix '%s', result=/",
+				fn_name, sbox_chroot_path);
+			free(path);
+			return(strdup("/"));
+		}
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: no chroot prefix in path ('%s')",
+		fn_name, path);
+	return(path);
+}
+
+/* Returns the tracked virtual CWD as getcwd() should see it (an
+ * allocated buffer), or NULL if it isn't known; then the caller
+ * must use the real getcwd() and reverse the result.
+*/
+char *sbox_virtual_cwd_for_getcwd(void)
+{
+	struct sb2context	*sb2ctx;
+	char			host_cwd[PATH_MAX + 1];
+	struct stat64		dot_statbuf;
+	char			*result = NULL;
+
+	sb2ctx = get_sb2context();
+	if (!sb2ctx) return(NULL);
+
+	if (find_virtual_cwd(sb2ctx, host_cwd, sizeof(host_cwd),
+	    &dot_statbuf) == 0) {
+		result = drop_chroot_prefix_from_path(__func__,
+			strdup(sb2ctx->virtual_reversed_cwd));
+	}
+	release_sb2context(sb2ctx);
+	return(result);
+}
+
+/* Create the __SB2_VIRTUAL_CWD variable for an exec'd process:
+ * "<dev>:<ino>:<host_cwd_len>:<host_cwd><virtual_cwd>".
+ * The CWD is not validated here, the new process does that anyway.
+ * Virtual paths depend on the mode, so nothing is relayed
+ * if the mode is going to change.
+*/
+char *sbox_virtual_cwd_export_for_exec(const char *prefix,
+	int mode_will_change)
+{
+	char	*result = NULL;
+
+	if (mode_will_change || !virtual_cwd_trylock()) return(NULL);
+	if (virtual_cwd.vc_virtual_cwd &&
+	    asprintf(&result, "%s%llu:%llu:%u:%s%s", prefix,
+		(unsigned long long)virtual_cwd.vc_dev,
+		(unsigned long long)virtual_cwd.vc_ino,
+		(unsigned int)strlen(virtual_cwd.vc_host_cwd),
+		virtual_cwd.vc_host_cwd, virtual_cwd.vc_virtual_cwd) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"asprintf failed to create %s", prefix);
+		result = NULL;
+	}
+	virtual_cwd_unlock();
+	return(result);
+}
+
+/* Set the virtual CWD from the value that the parent process
+ * relayed in __SB2_VIRTUAL_CWD. Called during initialization. */
+void sbox_virtual_cwd_import(const char *str)
+{
+	unsigned long long	dev, ino;
+	unsigned int		host_cwd_len;
+	int			n = 0;
+	char			*host_cwd;
+	struct stat64		dot_statbuf;
+
+	if ((sscanf(str, "%llu:%llu:%u:%n", &dev, &ino,
+	     &host_cwd_len, &n) != 3) || (n == 0) ||
+	    (strlen(str + n) <= host_cwd_len) ||
+	    (str[n] != '/') || (str[n + host_cwd_len] != '/')) {
+		SB_LOG(SB_LOGLEVEL_NOTICE,
+			"%s: Invalid virtual cwd '%s'", __func__, str);
+		return;
+	}
+	host_cwd = strndup(str + n, host_cwd_len);
+	if (!host_cwd) return;
+	dot_statbuf.st_dev = (dev_t)dev;
+	dot_statbuf.st_ino = (ino_t)ino;
+	(void)set_virtual_cwd(&dot_statbuf, host_cwd, str + n + host_cwd_len);
+	free(host_cwd);
+}
 	
 /* ========== Mapping & path resolution, internal implementation: ========== */
 
@@ -1015,6 +1321,21 @@ static int relative_virtual_path_to_abs_path(
 	struct path_entry	*cwd_entries;
 	int			cwd_flags;
 
+	struct stat64		dot_statbuf;
+	int			found;
+
+	/* first try the tracked virtual cwd; that doesn't even
+	 * need getcwd() */
+	found = find_virtual_cwd(sb2ctx, host_cwd, host_cwd_size,
+		&dot_statbuf);
+	if (found == 0) {
+		virtual_reversed_cwd = sb2ctx->virtual_reversed_cwd;
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"relative_virtual_path_to_abs_path: using tracked cwd=%s (host cwd=%s)",
+			virtual_reversed_cwd, host_cwd);
+		goto have_virtual_cwd;
+	}
+
 	if (get_and_check_host_cwd(host_cwd, host_cwd_size) < 0) {
 		return(-1);
 	}
@@ -1063,6 +1384,15 @@ static int relative_virtual_path_to_abs_path(
 		sb2ctx->host_cwd = strdup(host_cwd);
 		sb2ctx->virtual_reversed_cwd = virtual_reversed_cwd;
 	}
+	if (found > 0) {
+		/* share the result with other threads, and
+		 * use it directly while "." stays the same */
+		sb2ctx->virtual_cwd_generation = set_virtual_cwd(
+			&dot_statbuf, host_cwd, virtual_reversed_cwd);
+		sb2ctx->host_cwd_dev = dot_statbuf.st_dev;
+		sb2ctx->host_cwd_ino = dot_statbuf.st_ino;
+	}
+    have_virtual_cwd:
 	cwd_entries = split_path_to_path_entries(virtual_reversed_cwd, &cwd_flags);
 	/* getcwd() always returns a real path. Assume that the
 	 * reversed path is also real (if it isn't, then the reversing
@@ -1446,6 +1776,15 @@ void sbox_map_path_internal__c_engine(
 				res->mres_errormsg = errormsg;
 				goto forget_mapping;
 			}
+			if (mapping_result) {
+				/* for fdpathdb; the resolved path is
+				 * handed over, not copied */
+				res->mres_rule_offs = ctx.pmc_ruletree_offset;
+				res->mres_resolved_virtual_path =
+					resolved_virtual_path_res.mres_result_buf;
+				resolved_virtual_path_res.mres_result_buf =
+					resolved_virtual_path_res.mres_result_path = NULL;
+			}
 			if (flags & SB2_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT) {
 				if (vperm_geteuid() == 0) {
 					/* simulated root environment, allow writing */
@@ -1513,6 +1852,243 @@ void sbox_map_path_internal__c_engine(
 	return;
 }
 
+/* Map "name" relative to an open directory, incrementally:
+ * "dir" is the fdpathdb entry of the directory; it contains the
+ * resolved virtual path, host path and the rule that was used for
+ * the directory. If "name" is a single component and the same rule
+ * applies to it (see ruletree_rule_is_same_for_component()), the host
+ * path is the directory's host path + "/name": Parent directories
+ * don't need to be resolved again, only the component itself needs to
+ * be checked (if it is a symlink, normal mapping must be used).
+ * Returns 1 if "res" was filled, 0 if the caller must use
+ * normal mapping.
+*/
+int sbox_map_path_at_dir__c_engine(
+	struct sb2context *sb2ctx,
+	const char *binary_name,
+	const char *func_name,
+	const fdpathdb_entry_t *dir,
+	const char *name,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res)
+{
+	path_mapping_context_t	ctx;
+	ruletree_fsrule_t	*rule;
+	char	*virtual_path = NULL;
+	char	*host_path = NULL;
+	int	rule_flags;
+
+	if (!dir->fpe_rule_offs || !dir->fpe_resolved_virtual_path ||
+	    !dir->fpe_host_path) return(0);
+
+	/* must be one clean component */
+	if (!*name || strchr(name, '/') || !strcmp(name, ".") ||
+	    !strcmp(name, "..")) return(0);
+
+	if (!sb2ctx || sb2ctx->mapping_disabled || sbox_chroot_path ||
+	    getenv("SBOX_DISABLE_MAPPING")) return(0);
+
+	if (ruletree_to_memory() < 0) return(0);
+
+	clear_path_mapping_context(&ctx);
+	ctx.pmc_binary_name = binary_name;
+	ctx.pmc_func_name = func_name;
+	ctx.pmc_fn_class = fn_class;
+	ctx.pmc_dont_resolve_final_symlink =
+		flags & SBOX_MAP_PATH_DONT_RESOLVE_FINAL_SYMLINK;
+	ctx.pmc_allow_nonexistent = flags & SBOX_MAP_PATH_ALLOW_NONEXISTENT;
+	ctx.pmc_sb2ctx = sb2ctx;
+
+	if (asprintf(&virtual_path, "%s/%s",
+	    (strcmp(dir->fpe_resolved_virtual_path, "/") ?
+		dir->fpe_resolved_virtual_path : ""), name) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "asprintf failed");
+		return(0);
+	}
+	ctx.pmc_virtual_orig_path = virtual_path;
+
+	rule = ruletree_rule_is_same_for_component(&ctx,
+		dir->fpe_rule_offs, virtual_path, fn_class);
+	if (!rule) {
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"%s: rule differs, full mapping for '%s'",
+			__func__, virtual_path);
+		free(virtual_path);
+		return(0);
+	}
+	rule_flags = rule->rtree_fsr_flags;
+
+	if (asprintf(&host_path, "%s/%s",
+	    (strcmp(dir->fpe_host_path, "/") ? dir->fpe_host_path : ""),
+	    name) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "asprintf failed");
+		free(virtual_path);
+		return(0);
+	}
+
+	/* The component itself: same rules as in sb_path_resolution() */
+	if (!ctx.pmc_dont_resolve_final_symlink &&
+	    !(rule_flags & (SB2_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH |
+			    SB2_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH_UNLESS_CHROOT))) {
+		char	link_dest[PATH_MAX+1];
+		int	link_len;
+
+		link_len = readlink_nomap(host_path, link_dest, PATH_MAX);
+		if ((link_len > 0) || ((errno != EINVAL) && (errno != ENOENT))) {
+			/* a symlink, or an error that needs the full
+			 * resolution logic */
+			SB_LOG(SB_LOGLEVEL_NOISE,
+				"%s: full mapping needed for '%s'",
+				__func__, virtual_path);
+			free(virtual_path);
+			free(host_path);
+			return(0);
+		}
+	}
+
+	if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_INFO)) {
+		/* produce the same log line as the full mapping */
+		char *logged_host_path = clean_and_log_fs_mapping_result(&ctx,
+			virtual_path, SB_LOGLEVEL_INFO, host_path, rule_flags);
+
+		if (logged_host_path) {
+			free(host_path);
+			host_path = logged_host_path;
+		}
+	}
+
+	res->mres_result_buf = res->mres_result_path = host_path;
+	res->mres_rule_offs = dir->fpe_rule_offs;
+	res->mres_resolved_virtual_path = virtual_path;
+	res->mres_exec_policy_name = rule->rtree_fsr_exec_policy_name ?
+		offset_to_ruletree_string_ptr(rule->rtree_fsr_exec_policy_name, NULL) :
+		NULL;
+	if (rule_flags & SB2_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT) {
+		res->mres_readonly = (vperm_geteuid() == 0) ? 0 : 1;
+	} else {
+		res->mres_readonly = (rule_flags & (SB2_MAPPING_RULE_FLAGS_READONLY |
+			SB2_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS) ? 1 : 0);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %s(%s/%s) => '%s'",
+		__func__, func_name, dir->fpe_path, name, host_path);
+	return(1);
+}
+
+/* ========== Cache for reverse mapping results: ========== */
+
+/* Recent host => virtual translations of this process.
+ * The results depend on the path, function class and binary name
+ * (the rule lists don't change during the lifetime of the process).
+ * Volatile results (see struct sb2context) are not cached.
+ * The chroot prefix is dropped after the cache, if needed.
+ * Like the virtual cwd, the lock is only tried, never waited for.
+*/
+#define REVERSE_PATH_CACHE_SIZE	32
+
+typedef struct {
+	uint32_t	rpc_hash;
+	uint32_t	rpc_fn_class;
+	uint32_t	rpc_last_used;
+	char		*rpc_binary_name;
+	char		*rpc_host_path;
+	char		*rpc_virtual_path;
+} reverse_path_cache_entry_t;
+
+static reverse_path_cache_entry_t reverse_path_cache[REVERSE_PATH_CACHE_SIZE];
+static uint32_t reverse_path_cache_clock = 0;
+static int reverse_path_cache_lock = 0;
+
+static uint32_t reverse_path_cache_hash(const char *host_path,
+	const char *binary_name, uint32_t fn_class)
+{
+	uint32_t	h = 2166136261U; /* FNV-1a */
+	const unsigned char *cp;
+
+	for (cp = (const unsigned char *)host_path; *cp; cp++)
+		h = (h ^ *cp) * 16777619U;
+	for (cp = (const unsigned char *)binary_name; *cp; cp++)
+		h = (h ^ *cp) * 16777619U;
+	return(h ^ fn_class);
+}
+
+static reverse_path_cache_entry_t *find_reverse_path_cache_entry(
+	uint32_t hash, const char *host_path,
+	const char *binary_name, uint32_t fn_class)
+{
+	int	i;
+
+	for (i = 0; i < REVERSE_PATH_CACHE_SIZE; i++) {
+		reverse_path_cache_entry_t *ep = &reverse_path_cache[i];
+
+		if (ep->rpc_host_path && (ep->rpc_hash == hash) &&
+		    (ep->rpc_fn_class == fn_class) &&
+		    !strcmp(ep->rpc_host_path, host_path) &&
+		    !strcmp(ep->rpc_binary_name, binary_name))
+			return(ep);
+	}
+	return(NULL);
+}
+
+/* returns an allocated copy of the cached result, or NULL */
+static char *reverse_path_cache_get(uint32_t hash, const char *host_path,
+	const char *binary_name, uint32_t fn_class)
+{
+	reverse_path_cache_entry_t *ep;
+	char	*result = NULL;
+
+	if (__atomic_exchange_n(&reverse_path_cache_lock, 1, __ATOMIC_ACQUIRE))
+		return(NULL);
+	ep = find_reverse_path_cache_entry(hash, host_path, binary_name, fn_class);
+	if (ep) {
+		ep->rpc_last_used = ++reverse_path_cache_clock;
+		result = strdup(ep->rpc_virtual_path);
+	}
+	__atomic_store_n(&reverse_path_cache_lock, 0, __ATOMIC_RELEASE);
+	return(result);
+}
+
+static void reverse_path_cache_put(uint32_t hash, const char *host_path,
+	const char *binary_name, uint32_t fn_class, const char *virtual_path)
+{
+	reverse_path_cache_entry_t *ep;
+	reverse_path_cache_entry_t old;
+	int	i;
+
+	if (__atomic_exchange_n(&reverse_path_cache_lock, 1, __ATOMIC_ACQUIRE))
+		return;
+	if (find_reverse_path_cache_entry(hash, host_path, binary_name, fn_class)) {
+		/* another thread was faster */
+		__atomic_store_n(&reverse_path_cache_lock, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	/* replace the least recently used entry */
+	ep = &reverse_path_cache[0];
+	for (i = 1; (i < REVERSE_PATH_CACHE_SIZE) && ep->rpc_host_path; i++) {
+		if (!reverse_path_cache[i].rpc_host_path ||
+		    (reverse_path_cache[i].rpc_last_used < ep->rpc_last_used))
+			ep = &reverse_path_cache[i];
+	}
+	old = *ep;
+	ep->rpc_hash = hash;
+	ep->rpc_fn_class = fn_class;
+	ep->rpc_last_used = ++reverse_path_cache_clock;
+	ep->rpc_binary_name = strdup(binary_name);
+	ep->rpc_host_path = strdup(host_path);
+	ep->rpc_virtual_path = strdup(virtual_path);
+	if (!ep->rpc_binary_name || !ep->rpc_host_path || !ep->rpc_virtual_path) {
+		if (ep->rpc_binary_name) free(ep->rpc_binary_name);
+		if (ep->rpc_host_path) free(ep->rpc_host_path);
+		if (ep->rpc_virtual_path) free(ep->rpc_virtual_path);
+		ep->rpc_binary_name = ep->rpc_host_path = ep->rpc_virtual_path = NULL;
+	}
+	__atomic_store_n(&reverse_path_cache_lock, 0, __ATOMIC_RELEASE);
+
+	if (old.rpc_binary_name) free(old.rpc_binary_name);
+	if (old.rpc_host_path) free(old.rpc_host_path);
+	if (old.rpc_virtual_path) free(old.rpc_virtual_path);
+}
+
 char *sbox_reverse_path_internal__c_engine(
         const path_mapping_context_t  *ctx,
         const char *abs_host_path,
@@ -1525,6 +2101,9 @@ char *sbox_reverse_path_internal__c_engine(
 	ruletree_object_offset_t	rule_offs = 0;
 	ruletree_object_offset_t	rule_list_offs = 0;
 	const char *errormsg = NULL;
+	const char *binary_name;
+	uint32_t	cache_hash;
+	int	was_volatile = 0;
 
 	if (!abs_host_path) return(NULL);
 
@@ -1534,6 +2113,21 @@ char *sbox_reverse_path_internal__c_engine(
                 return (NULL);
         }
 
+	binary_name = (ctx->pmc_binary_name ? ctx->pmc_binary_name : "");
+	cache_hash = reverse_path_cache_hash(abs_host_path, binary_name,
+		ctx->pmc_fn_class);
+	result_virtual_path = reverse_path_cache_get(cache_hash, abs_host_path,
+		binary_name, ctx->pmc_fn_class);
+	if (result_virtual_path) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: cached result '%s'", __func__,
+			result_virtual_path);
+		goto drop_chroot_prefix;
+	}
+	if (ctx->pmc_sb2ctx) {
+		was_volatile = ctx->pmc_sb2ctx->mapping_result_is_volatile;
+		ctx->pmc_sb2ctx->mapping_result_is_volatile = 0;
+	}
+
 	split_path_to_path_list(abs_host_path,
 		&abs_host_path_for_rule_selection_list);
 
@@ -1581,28 +2175,20 @@ char *sbox_reverse_path_internal__c_engine(
 
 	free_path_list(&abs_host_path_for_rule_selection_list);
 
+	if (ctx->pmc_sb2ctx) {
+		if (result_virtual_path &&
+		    !ctx->pmc_sb2ctx->mapping_result_is_volatile)
+			reverse_path_cache_put(cache_hash, abs_host_path,
+				binary_name, ctx->pmc_fn_class,
+				result_virtual_path);
+		ctx->pmc_sb2ctx->mapping_result_is_volatile |= was_volatile;
+	}
+
+    drop_chroot_prefix:
 	if (drop_chroot_prefix && sbox_chroot_path) {
-		/* try to eliminate chroot prefix from path.
-		 * note that it isn't there always; for example
-		 * chdir does not have to be inside the chroot */
-		int	chroot_path_len = strlen(sbox_chroot_path);
-		if (!strncmp(result_virtual_path, sbox_chroot_path, chroot_path_len)) {
-			if (result_virtual_path[chroot_path_len] == '/') {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: drop chroot prefix '%s'",
-					__func__, sbox_chroot_path);
-				char	*new_result = strdup(result_virtual_path+chroot_path_len);
-				free(result_virtual_path);
-				result_virtual_path = new_result;
-			} else if (result_virtual_path[chroot_path_len] == '\0') {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: drop chroot prefix '%s', result=/",
-					__func__, sbox_chroot_path);
-				free(result_virtual_path);
-				result_virtual_path = strdup("/");
-			} else {
-				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: no chroot prefix in path ('%s')",
-					__func__, result_virtual_path);
-			}
-		}
+		/* try to eliminate chroot prefix from path. */
+		result_virtual_path = drop_chroot_prefix_from_path(
+			__func__, result_virtual_path);
 	}
 
 	return (result_virtual_path);
@@ -173,3 +173,439 @@ ruletree_object_offset_t add_rule_to_ruletree(
 	return(rule_location);
 }
 
+
+/* ---------- Index for a rule list ---------- */
+
+typedef struct {
+	ruletree_rule_index_node_t	node;
+	uint32_t			*refs;	/* temporary list */
+} rule_index_build_node_t;
+
+typedef struct {
+	rule_index_build_node_t	*nodes;
+	uint32_t		num_nodes;
+	uint32_t		max_nodes;
+	uint32_t		num_refs;
+} rule_index_builder_t;
+
+static uint32_t rule_index_new_node(rule_index_builder_t *b, int c)
+{
+	if (b->num_nodes >= b->max_nodes) {
+		uint32_t new_max = (b->max_nodes ? 2 * b->max_nodes : 256);
+		rule_index_build_node_t *new_nodes = realloc(b->nodes,
+			new_max * sizeof(rule_index_build_node_t));
+
+		if (!new_nodes) return(0);
+		b->nodes = new_nodes;
+		b->max_nodes = new_max;
+	}
+	memset(&b->nodes[b->num_nodes], 0, sizeof(rule_index_build_node_t));
+	b->nodes[b->num_nodes].node.rtree_rin_char = (unsigned char)c;
+	return(b->num_nodes++);
+}
+
+/* add a reference to rule #rule_idx; node 0 collects the rules
+ * that must always be tested. Returns 0 if OK */
+static int rule_index_add_ref(rule_index_builder_t *b, uint32_t node_idx,
+	uint32_t rule_idx)
+{
+	rule_index_build_node_t	*np = &b->nodes[node_idx];
+	uint32_t		*new_refs;
+
+	new_refs = realloc(np->refs,
+		(np->node.rtree_rin_refs_count + 1) * sizeof(uint32_t));
+	if (!new_refs) return(-1);
+	np->refs = new_refs;
+	np->refs[np->node.rtree_rin_refs_count++] = rule_idx;
+	b->num_refs++;
+	return(0);
+}
+
+static int rule_index_add_selector(rule_index_builder_t *b,
+	const char *selector, uint32_t rule_idx)
+{
+	uint32_t	node_idx = 0;
+	const unsigned char *cp;
+
+	for (cp = (const unsigned char *)selector; *cp; cp++) {
+		uint32_t	child = b->nodes[node_idx].node.rtree_rin_first_child;
+
+		while (child && (b->nodes[child].node.rtree_rin_char != *cp))
+			child = b->nodes[child].node.rtree_rin_next_sibling;
+		if (!child) {
+			child = rule_index_new_node(b, *cp);
+			if (!child) return(-1);
+			b->nodes[child].node.rtree_rin_next_sibling =
+				b->nodes[node_idx].node.rtree_rin_first_child;
+			b->nodes[node_idx].node.rtree_rin_first_child = child;
+		}
+		node_idx = child;
+	}
+	return(rule_index_add_ref(b, node_idx, rule_idx));
+}
+
+/* Create an index for the rules of a list (see ruletree_rule_index_t).
+ * Returns location of the index, or 0 if it could not be created.
+*/
+ruletree_object_offset_t create_rule_index_to_ruletree(
+	ruletree_object_offset_t rule_list_offs)
+{
+	rule_index_builder_t	b;
+	uint32_t		list_size;
+	uint32_t		i;
+	ruletree_rule_index_t	*ri = NULL;
+	ruletree_rule_index_node_t *nodes;
+	uint32_t		*refs;
+	uint32_t		n_refs;
+	size_t			ri_size;
+	ruletree_object_offset_t location = 0;
+
+	memset(&b, 0, sizeof(b));
+	list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	(void)rule_index_new_node(&b, 0); /* the root */
+	if (b.num_nodes != 1) goto out;
+
+	for (i = 0; i < list_size; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_fsrule_t	*rp;
+		const char		*selector = NULL;
+		int			r;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rp = offset_to_ruletree_fsrule_ptr(rule_offs);
+		if (!rp || (rp->rtree_fsr_selector_type == 0)) continue;
+
+		switch (rp->rtree_fsr_selector_type) {
+		case SB2_RULETREE_FSRULE_SELECTOR_PATH:
+		case SB2_RULETREE_FSRULE_SELECTOR_PREFIX:
+		case SB2_RULETREE_FSRULE_SELECTOR_DIR:
+			selector = offset_to_ruletree_string_ptr(
+				rp->rtree_fsr_selector_offs, NULL);
+			break;
+		}
+		if ((rp->rtree_fsr_condition_type == 0) &&
+		    selector && *selector) {
+			r = rule_index_add_selector(&b, selector, i);
+		} else {
+			r = rule_index_add_ref(&b, 0, i);
+		}
+		if (r < 0) goto out;
+	}
+
+	ri_size = sizeof(ruletree_rule_index_t) +
+		b.num_nodes * sizeof(ruletree_rule_index_node_t) +
+		b.num_refs * sizeof(uint32_t);
+	ri = calloc(1, ri_size);
+	if (!ri) goto out;
+	ri->rtree_ri_rule_list = rule_list_offs;
+	ri->rtree_ri_num_nodes = b.num_nodes;
+	ri->rtree_ri_num_refs = b.num_refs;
+	nodes = (ruletree_rule_index_node_t *)(ri + 1);
+	refs = (uint32_t *)(nodes + b.num_nodes);
+
+	/* the "always" list is in node 0; the rule list
+	 * was scanned in order, so all lists are sorted. */
+	n_refs = 0;
+	for (i = 0; i < b.num_nodes; i++) {
+		rule_index_build_node_t *np = &b.nodes[i];
+		uint32_t		cnt = np->node.rtree_rin_refs_count;
+
+		nodes[i] = np->node;
+		if (cnt) memcpy(refs + n_refs, np->refs, cnt * sizeof(uint32_t));
+		if (i == 0) {
+			ri->rtree_ri_always_first = n_refs;
+			ri->rtree_ri_always_count = cnt;
+			nodes[i].rtree_rin_refs_count = 0;
+		} else {
+			nodes[i].rtree_rin_refs_first = n_refs;
+		}
+		n_refs += cnt;
+	}
+
+	location = append_struct_to_ruletree_file(ri, ri_size,
+		SB2_RULETREE_OBJECT_TYPE_RULE_INDEX);
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Added rule index: list @ %u, %u rules, %u nodes, %u always tested, @ %u",
+		rule_list_offs, list_size, b.num_nodes,
+		ri->rtree_ri_always_count, location);
+
+    out:
+	for (i = 0; i < b.num_nodes; i++)
+		if (b.nodes[i].refs) free(b.nodes[i].refs);
+	if (b.nodes) free(b.nodes);
+	if (ri) free(ri);
+	return(location);
+}
+
+/* ---------- Identity prefix set of a rule list ---------- */
+
+#define IDENTITY_ALL_CLASSES	0xFFFFFFFF
+
+/* an enclosing SUBTREE rule (rules of the subtree are used only
+ * if the path matches all enclosing selectors) */
+typedef struct identity_scope_s {
+	const ruletree_fsrule_t		*is_rule;
+	const char			*is_selector;
+	uint32_t			is_selector_len;
+	const struct identity_scope_s	*is_parent;
+} identity_scope_t;
+
+/* selector and function classes of a rule that has been seen;
+ * it may match before any later rule */
+typedef struct {
+	const char	*ib_selector;
+	uint32_t	ib_selector_len;
+	uint32_t	ib_func_class;
+} identity_blocker_t;
+
+typedef struct {
+	identity_blocker_t		*blockers;
+	uint32_t			num_blockers;
+	uint32_t			max_blockers;
+	ruletree_identity_prefix_t	*entries;
+	uint32_t			num_entries;
+	uint32_t			max_entries;
+	int				all_blocked;
+	int				failed;
+} identity_builder_t;
+
+static void identity_add_blocker(identity_builder_t *b,
+	const char *selector, uint32_t selector_len, uint32_t func_class)
+{
+	if (b->num_blockers >= b->max_blockers) {
+		uint32_t new_max = (b->max_blockers ? 2 * b->max_blockers : 64);
+		identity_blocker_t *new_blockers = realloc(b->blockers,
+			new_max * sizeof(identity_blocker_t));
+
+		if (!new_blockers) {
+			b->failed = 1;
+			return;
+		}
+		b->blockers = new_blockers;
+		b->max_blockers = new_max;
+	}
+	b->blockers[b->num_blockers].ib_selector = selector;
+	b->blockers[b->num_blockers].ib_selector_len = selector_len;
+	b->blockers[b->num_blockers].ib_func_class =
+		(func_class ? func_class : IDENTITY_ALL_CLASSES);
+	b->num_blockers++;
+}
+
+/* Returns true if all paths that "selector" (used as "type")
+ * matches are also matched by the selector of "scope" */
+static int identity_selector_is_within(const char *selector,
+	uint32_t selector_len, uint32_t type, const identity_scope_t *scope)
+{
+	uint32_t	len = scope->is_selector_len;
+
+	if ((selector_len < len) || strncmp(selector, scope->is_selector, len))
+		return(0);
+
+	switch (scope->is_rule->rtree_fsr_selector_type) {
+	case SB2_RULETREE_FSRULE_SELECTOR_PATH:
+		return((type == SB2_RULETREE_IDENTITY_EXACT) &&
+			(selector_len == len));
+	case SB2_RULETREE_FSRULE_SELECTOR_PREFIX:
+		return(1);
+	case SB2_RULETREE_FSRULE_SELECTOR_DIR:
+		if ((len == 1) && (*selector == '/')) return(1);
+		if (selector_len == len)
+			return(type != SB2_RULETREE_IDENTITY_PREFIX);
+		return(selector[len] == '/');
+	}
+	return(0);
+}
+
+static void identity_consider_rule(identity_builder_t *b,
+	ruletree_object_offset_t rule_offs, const ruletree_fsrule_t *rp,
+	const char *selector, uint32_t selector_len,
+	const identity_scope_t *scope)
+{
+	uint32_t	type;
+	uint32_t	func_class = rp->rtree_fsr_func_class;
+	uint32_t	blocked = 0;
+	uint32_t	i;
+	ruletree_identity_prefix_t *ip;
+
+	switch (rp->rtree_fsr_action_type) {
+	case SB2_RULETREE_FSRULE_ACTION_FORCE_ORIG_PATH:
+	case SB2_RULETREE_FSRULE_ACTION_FORCE_ORIG_PATH_UNLESS_CHROOT:
+		/* path resolution stops at the selector; the
+		 * result is the original path for all paths that
+		 * the rule matches. (the wrappers don't use the set
+		 * when chroot is simulated) */
+		switch (rp->rtree_fsr_selector_type) {
+		case SB2_RULETREE_FSRULE_SELECTOR_PATH:
+			type = SB2_RULETREE_IDENTITY_EXACT;
+			break;
+		case SB2_RULETREE_FSRULE_SELECTOR_PREFIX:
+			type = SB2_RULETREE_IDENTITY_PREFIX;
+			break;
+		default:
+			type = SB2_RULETREE_IDENTITY_DIR;
+			break;
+		}
+		break;
+	case SB2_RULETREE_FSRULE_ACTION_USE_ORIG_PATH:
+		/* components after the selector are checked for
+		 * symlinks, so only the selector itself is known
+		 * to map to itself. */
+		type = SB2_RULETREE_IDENTITY_EXACT;
+		break;
+	default:
+		return;
+	}
+	if (rp->rtree_fsr_flags & (SB2_MAPPING_RULE_FLAGS_READONLY |
+	    SB2_MAPPING_RULE_FLAGS_CALL_TRANSLATE_FOR_ALL |
+	    SB2_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT |
+	    SB2_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS))
+		return;
+	if (rp->rtree_fsr_binary_name || rp->rtree_fsr_exec_policy_name)
+		return;
+
+	for (; scope; scope = scope->is_parent) {
+		uint32_t	scope_class = scope->is_rule->rtree_fsr_func_class;
+
+		if (scope->is_rule->rtree_fsr_binary_name) return;
+		if (!identity_selector_is_within(selector, selector_len,
+		    type, scope)) return;
+		if (scope_class) {
+			func_class = (func_class ?
+				(func_class & scope_class) : scope_class);
+			if (!func_class) return;
+		}
+	}
+
+	/* earlier rules win, if they match */
+	for (i = 0; i < b->num_blockers; i++) {
+		const identity_blocker_t *bp = &b->blockers[i];
+		uint32_t len = (bp->ib_selector_len < selector_len ?
+			bp->ib_selector_len : selector_len);
+
+		if (!strncmp(bp->ib_selector, selector, len))
+			blocked |= bp->ib_func_class;
+	}
+	if ((blocked == IDENTITY_ALL_CLASSES) ||
+	    (func_class && !(func_class & ~blocked)))
+		return;
+
+	if (b->num_entries >= b->max_entries) {
+		uint32_t new_max = (b->max_entries ? 2 * b->max_entries : 16);
+		ruletree_identity_prefix_t *new_entries = realloc(b->entries,
+			new_max * sizeof(ruletree_identity_prefix_t));
+
+		if (!new_entries) {
+			b->failed = 1;
+			return;
+		}
+		b->entries = new_entries;
+		b->max_entries = new_max;
+	}
+	ip = &b->entries[b->num_entries++];
+	ip->rtree_ip_selector_offs = rp->rtree_fsr_selector_offs;
+	ip->rtree_ip_selector_len = selector_len;
+	ip->rtree_ip_type = type;
+	ip->rtree_ip_func_class = func_class;
+	ip->rtree_ip_blocked_classes = blocked;
+	ip->rtree_ip_rule_offs = rule_offs;
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Identity prefix '%s' type=%u class=0x%X blocked=0x%X",
+		selector, type, func_class, blocked);
+}
+
+static void identity_scan_rule_list(identity_builder_t *b,
+	ruletree_object_offset_t rule_list_offs,
+	const identity_scope_t *scope)
+{
+	uint32_t	list_size;
+	uint32_t	i;
+
+	list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	for (i = 0; (i < list_size) && !b->all_blocked && !b->failed; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_fsrule_t	*rp;
+		const char		*selector = NULL;
+		uint32_t		selector_len = 0;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rp = offset_to_ruletree_fsrule_ptr(rule_offs);
+		if (!rp || (rp->rtree_fsr_selector_type == 0)) continue;
+
+		switch (rp->rtree_fsr_selector_type) {
+		case SB2_RULETREE_FSRULE_SELECTOR_PATH:
+		case SB2_RULETREE_FSRULE_SELECTOR_PREFIX:
+		case SB2_RULETREE_FSRULE_SELECTOR_DIR:
+			selector = offset_to_ruletree_string_ptr(
+				rp->rtree_fsr_selector_offs, &selector_len);
+			break;
+		}
+		if (rp->rtree_fsr_condition_type || !selector || !*selector) {
+			/* can't tell which paths this rule matches (the
+			 * mapping engine can't handle conditions either);
+			 * nothing after this is known. */
+			b->all_blocked = 1;
+			break;
+		}
+
+		if (rp->rtree_fsr_action_type ==
+		    SB2_RULETREE_FSRULE_ACTION_SUBTREE) {
+			if (rp->rtree_fsr_rule_list_link) {
+				identity_scope_t	sub_scope;
+
+				sub_scope.is_rule = rp;
+				sub_scope.is_selector = selector;
+				sub_scope.is_selector_len = selector_len;
+				sub_scope.is_parent = scope;
+				identity_scan_rule_list(b,
+					rp->rtree_fsr_rule_list_link,
+					&sub_scope);
+			}
+			continue;
+		}
+		identity_consider_rule(b, rule_offs, rp,
+			selector, selector_len, scope);
+		identity_add_blocker(b, selector, selector_len,
+			rp->rtree_fsr_func_class);
+	}
+}
+
+/* Create the identity prefix set of a rule list
+ * (see ruletree_identity_prefixes_t).
+ * Returns location of the set, or 0 if it could not be created.
+*/
+ruletree_object_offset_t create_identity_prefixes_to_ruletree(
+	ruletree_object_offset_t rule_list_offs)
+{
+	identity_builder_t		b;
+	ruletree_identity_prefixes_t	*ips = NULL;
+	size_t				ips_size;
+	ruletree_object_offset_t	location = 0;
+
+	memset(&b, 0, sizeof(b));
+	identity_scan_rule_list(&b, rule_list_offs, NULL);
+	if (b.failed) goto out;
+
+	ips_size = sizeof(ruletree_identity_prefixes_t) +
+		b.num_entries * sizeof(ruletree_identity_prefix_t);
+	ips = calloc(1, ips_size);
+	if (!ips) goto out;
+	ips->rtree_ips_rule_list = rule_list_offs;
+	ips->rtree_ips_num_entries = b.num_entries;
+	if (b.num_entries)
+		memcpy(ips + 1, b.entries,
+			b.num_entries * sizeof(ruletree_identity_prefix_t));
+
+	location = append_struct_to_ruletree_file(ips, ips_size,
+		SB2_RULETREE_OBJECT_TYPE_IDENTITY_PREFIXES);
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Added identity prefix set: list @ %u, %u entries, @ %u",
+		rule_list_offs, b.num_entries, location);
+
+    out:
+	if (b.blockers) free(b.blockers);
+	if (b.entries) free(b.entries);
+	if (ips) free(ips);
+	return(location);
+}
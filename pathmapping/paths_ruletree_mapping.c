@@ -114,6 +114,96 @@ static int ruletree_test_path_match(const char *full_path, size_t full_path_len,
 	return(result);
 }
 
+/* Max. number of candidates that are taken from a rule index;
+ * if there are more, the whole rule list is scanned. */
+#define RULE_INDEX_MAX_CANDIDATES	64
+
+/* Returns the index of a rule list, or NULL if it hasn't been indexed.
+ * Currently only the reverse rules have an index. */
+static const ruletree_rule_index_t *ruletree_get_rule_index(
+	ruletree_object_offset_t rule_list_offs)
+{
+	static ruletree_object_offset_t rev_rule_index_offs = 0;
+	static int	rev_rule_index_checked = 0;
+	const char	*errormsg = NULL;
+	const ruletree_rule_index_t *ri;
+
+	if (rule_list_offs != ruletree_get_rule_list_offs(0, &errormsg))
+		return(NULL);
+
+	if (!rev_rule_index_checked) {
+		const char *modename = sbox_session_mode;
+
+		if (!modename)
+			modename = ruletree_catalog_get_string("MODES", "#default");
+		if (modename)
+			rev_rule_index_offs = ruletree_catalog_get(
+				"rev_rules_index", modename);
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: rev.rule index @%u",
+			__func__, rev_rule_index_offs);
+		rev_rule_index_checked = 1;
+	}
+	if (!rev_rule_index_offs) return(NULL);
+	ri = offset_to_ruletree_object_ptr(rev_rule_index_offs,
+		SB2_RULETREE_OBJECT_TYPE_RULE_INDEX);
+	if (!ri || (ri->rtree_ri_rule_list != rule_list_offs)) return(NULL);
+	return(ri);
+}
+
+static int add_rule_index_candidates(uint32_t *cands, int n,
+	const uint32_t *refs, uint32_t count)
+{
+	uint32_t	k;
+
+	for (k = 0; k < count; k++) {
+		int	j = n;
+
+		if (n >= RULE_INDEX_MAX_CANDIDATES) return(-1);
+		/* keep the candidates in rule list order */
+		while ((j > 0) && (cands[j-1] > refs[k])) {
+			cands[j] = cands[j-1];
+			j--;
+		}
+		cands[j] = refs[k];
+		n++;
+	}
+	return(n);
+}
+
+/* Walk the selector trie along the path and collect rules whose
+ * selector is a prefix of the path. Those (and the rules that are
+ * always tested) are the only ones that may match.
+ * Returns number of candidates, or -1 if there were too many.
+*/
+static int ruletree_rule_index_candidates(
+	const ruletree_rule_index_t *ri,
+	const char *path,
+	uint32_t *cands)
+{
+	const ruletree_rule_index_node_t *nodes =
+		(const ruletree_rule_index_node_t *)(ri + 1);
+	const uint32_t	*refs = (const uint32_t *)(nodes + ri->rtree_ri_num_nodes);
+	uint32_t	node_idx = 0;
+	const unsigned char *cp;
+	int		n;
+
+	n = add_rule_index_candidates(cands, 0,
+		refs + ri->rtree_ri_always_first, ri->rtree_ri_always_count);
+	for (cp = (const unsigned char *)path; *cp && (n >= 0); cp++) {
+		uint32_t	child = nodes[node_idx].rtree_rin_first_child;
+
+		while (child && (child < ri->rtree_ri_num_nodes) &&
+		       (nodes[child].rtree_rin_char != *cp))
+			child = nodes[child].rtree_rin_next_sibling;
+		if (!child || (child >= ri->rtree_ri_num_nodes)) break;
+		node_idx = child;
+		n = add_rule_index_candidates(cands, n,
+			refs + nodes[node_idx].rtree_rin_refs_first,
+			nodes[node_idx].rtree_rin_refs_count);
+	}
+	return(n);
+}
+
 static ruletree_object_offset_t ruletree_find_rule(
         const path_mapping_context_t *ctx,
 	ruletree_object_offset_t rule_list_offs,
@@ -125,6 +215,11 @@ static ruletree_object_offset_t ruletree_find_rule(
 {
 	uint32_t	rule_list_size;
 	uint32_t	i;
+	uint32_t	num_to_test;
+	uint32_t	j;
+	const ruletree_rule_index_t *ri;
+	uint32_t	cands[RULE_INDEX_MAX_CANDIDATES];
+	int		num_cands = -1;
 	PROCESSCLOCK(clk1)
 
 	START_PROCESSCLOCK(SB_LOGLEVEL_INFO, &clk1, "ruletree_find_rule");
@@ -136,10 +231,25 @@ static ruletree_object_offset_t ruletree_find_rule(
 
 	if (rule_list_size == 0) return(0);
 
-	for (i = 0; i < rule_list_size; i++) {
+	/* test only the candidates, if the list has an index */
+	ri = ruletree_get_rule_index(rule_list_offs);
+	if (ri) num_cands = ruletree_rule_index_candidates(ri,
+		virtual_path, cands);
+	if (num_cands >= 0) {
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"ruletree_find_rule: %d candidates from the index",
+			num_cands);
+		num_to_test = num_cands;
+	} else {
+		num_to_test = rule_list_size;
+	}
+
+	for (j = 0; j < num_to_test; j++) {
 		ruletree_fsrule_t	*rp;
 		ruletree_object_offset_t rule_offs;
 
+		i = (num_cands >= 0 ? cands[j] : j);
+		if (i >= rule_list_size) continue;
 		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
 		if (!rule_offs) continue;
 
@@ -231,6 +341,23 @@ ruletree_object_offset_t ruletree_get_rule_list_offs(
 
 	if (!fwd_rule_list_offs || !rev_rule_list_offs) {
 		const char *modename = sbox_session_mode;
+		const ruletree_handoff_t *handoff = ruletree_get_handoff();
+
+		if (handoff && handoff->rth_fwd_rule_list_offs &&
+		    handoff->rth_rev_rule_list_offs &&
+		    offset_to_ruletree_object_ptr(handoff->rth_fwd_rule_list_offs,
+			SB2_RULETREE_OBJECT_TYPE_OBJECTLIST) &&
+		    offset_to_ruletree_object_ptr(handoff->rth_rev_rule_list_offs,
+			SB2_RULETREE_OBJECT_TYPE_OBJECTLIST)) {
+			/* received from the parent process, no need
+			 * to search the catalogs. */
+			fwd_rule_list_offs = handoff->rth_fwd_rule_list_offs;
+			rev_rule_list_offs = handoff->rth_rev_rule_list_offs;
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: rule list locations from handoff: fwd @%d, rev @%d",
+				__func__, fwd_rule_list_offs, rev_rule_list_offs);
+			return(use_fwd_rules ? fwd_rule_list_offs : rev_rule_list_offs);
+		}
 		
 		if (!modename)
 			modename = ruletree_catalog_get_string("MODES", "#default");
@@ -251,6 +378,111 @@ ruletree_object_offset_t ruletree_get_rule_list_offs(
 	return(use_fwd_rules ? fwd_rule_list_offs : rev_rule_list_offs);
 }
 
+/* Create the __SB2_HANDOFF variable for an exec'd process (see
+ * ruletree_handoff_from_string()). Rule list locations depend on
+ * the mode, those are not relayed if the mode is going to change.
+*/
+char *sbox_ruletree_handoff_for_exec(const char *prefix, int mode_will_change)
+{
+	ruletree_object_offset_t	fwd_offs = 0;
+	ruletree_object_offset_t	rev_offs = 0;
+	const char			*errmsg = NULL;
+
+	if (!mode_will_change) {
+		fwd_offs = ruletree_get_rule_list_offs(1, &errmsg);
+		rev_offs = ruletree_get_rule_list_offs(0, &errmsg);
+	}
+	return(ruletree_handoff_to_string(prefix, fwd_offs, rev_offs));
+}
+
+/* Returns the identity prefix set of the forward rules
+ * (see create_identity_prefixes_to_ruletree()), or NULL if there
+ * isn't one. Sets sbox_identity_prefixes_unavailable in that case,
+ * so that the wrappers don't even try again.
+*/
+static const ruletree_identity_prefixes_t *ruletree_get_identity_prefixes(void)
+{
+	static const ruletree_identity_prefixes_t *ips = NULL;
+	static int	ips_checked = 0;
+
+	if (!ips_checked) {
+		const char	*errormsg = NULL;
+		const char	*modename = sbox_session_mode;
+		ruletree_object_offset_t fwd_rule_list_offs;
+		ruletree_object_offset_t ips_offs = 0;
+		const ruletree_identity_prefixes_t *p;
+
+		if (ruletree_to_memory() < 0) return(NULL); /* try later */
+		fwd_rule_list_offs = ruletree_get_rule_list_offs(1, &errormsg);
+
+		if (!modename)
+			modename = ruletree_catalog_get_string("MODES", "#default");
+		if (modename && fwd_rule_list_offs)
+			ips_offs = ruletree_catalog_get(
+				"fs_rules_identity_prefixes", modename);
+		p = offset_to_ruletree_object_ptr(ips_offs,
+			SB2_RULETREE_OBJECT_TYPE_IDENTITY_PREFIXES);
+		if (p && (p->rtree_ips_rule_list == fwd_rule_list_offs) &&
+		    p->rtree_ips_num_entries)
+			ips = p;
+		else
+			sbox_identity_prefixes_unavailable = 1;
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: identity prefixes @%u (%u)",
+			__func__, ips_offs, (ips ? ips->rtree_ips_num_entries : 0));
+		ips_checked = 1;
+	}
+	return(ips);
+}
+
+/* Test if "abs_clean_path" maps to itself when used by a function
+ * of class "fn_class".
+ * Returns the rule, or 0 if the path must be mapped normally.
+*/
+ruletree_object_offset_t ruletree_identity_prefix_match(
+	const char *abs_clean_path, uint32_t fn_class)
+{
+	const ruletree_identity_prefixes_t *ips;
+	const ruletree_identity_prefix_t *ip;
+	size_t		path_len;
+	uint32_t	i;
+
+	ips = ruletree_get_identity_prefixes();
+	if (!ips) return(0);
+
+	path_len = strlen(abs_clean_path);
+	ip = (const ruletree_identity_prefix_t *)(ips + 1);
+	for (i = 0; i < ips->rtree_ips_num_entries; i++, ip++) {
+		const char	*selector;
+		uint32_t	len = ip->rtree_ip_selector_len;
+
+		if (ip->rtree_ip_func_class &&
+		    !(ip->rtree_ip_func_class & fn_class)) continue;
+		if (ip->rtree_ip_blocked_classes & fn_class) continue;
+		if (path_len < len) continue;
+
+		selector = offset_to_ruletree_string_ptr(
+			ip->rtree_ip_selector_offs, NULL);
+		if (!selector || strncmp(abs_clean_path, selector, len))
+			continue;
+
+		switch (ip->rtree_ip_type) {
+		case SB2_RULETREE_IDENTITY_EXACT:
+			if (path_len != len) continue;
+			break;
+		case SB2_RULETREE_IDENTITY_PREFIX:
+			break;
+		case SB2_RULETREE_IDENTITY_DIR:
+			if ((path_len != len) && (len != 1) &&
+			    (abs_clean_path[len] != '/')) continue;
+			break;
+		default:
+			continue;
+		}
+		return(ip->rtree_ip_rule_offs);
+	}
+	return(0);
+}
+
 /* Find the rule and mapping requirements.
  * returns object offset if rule was found, zero if not found.
 */
@@ -305,6 +537,129 @@ ruletree_object_offset_t ruletree_get_mapping_requirements(
 	return (rule_offs); 
 }
 
+/* Check if "abs_clean_virtual_path", which is a directory + one more
+ * component, is mapped by the same rule as the directory was
+ * ("dir_rule_offs") and if that rule's action produces the host path
+ * just by appending the component to the directory's host path. This
+ * is true for the plain prefix-based actions; actions that depend on
+ * the file system, environment or something else are not accepted.
+ * Returns the rule, or NULL if the path must be mapped normally.
+*/
+ruletree_fsrule_t *ruletree_rule_is_same_for_component(
+	const path_mapping_context_t *ctx,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_clean_virtual_path,
+	uint32_t fn_class)
+{
+	ruletree_object_offset_t	rule_list_offs;
+	ruletree_object_offset_t	rule_offs;
+	ruletree_fsrule_t		*rule = NULL;
+	const char			*errormsg = NULL;
+	int				min_path_len;
+
+	rule_list_offs = ruletree_get_rule_list_offs(1/*use_fwd_rules*/, &errormsg);
+	if (!rule_list_offs) return(NULL);
+
+	rule_offs = ruletree_find_rule(ctx, rule_list_offs,
+		abs_clean_virtual_path, strlen(abs_clean_virtual_path),
+		&min_path_len, fn_class, &rule);
+	if (!rule || (rule_offs != dir_rule_offs)) return(NULL);
+
+	switch (rule->rtree_fsr_action_type) {
+	case SB2_RULETREE_FSRULE_ACTION_USE_ORIG_PATH:
+	case SB2_RULETREE_FSRULE_ACTION_FORCE_ORIG_PATH:
+	case SB2_RULETREE_FSRULE_ACTION_FORCE_ORIG_PATH_UNLESS_CHROOT:
+	case SB2_RULETREE_FSRULE_ACTION_MAP_TO:
+		return(rule);
+	case SB2_RULETREE_FSRULE_ACTION_REPLACE_BY:
+		if (rule->rtree_fsr_selector_type != SB2_RULETREE_FSRULE_SELECTOR_PATH)
+			return(rule);
+		break;
+	default:
+		break;
+	}
+	return(NULL);
+}
+
+/* Returns 1 if a rule in the list (or in a subtree of it) has a selector
+ * that is below directory "dir"; such rules may apply to some names
+ * in the directory, even if they don't apply to the directory itself.
+*/
+static int ruletree_has_rules_below_dir(
+	ruletree_object_offset_t rule_list_offs,
+	const char *dir, size_t dir_len)
+{
+	uint32_t	rule_list_size;
+	uint32_t	i;
+
+	rule_list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	for (i = 0; i < rule_list_size; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_fsrule_t	*rp;
+		const char		*selector;
+		uint32_t		selector_len;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rp = offset_to_ruletree_fsrule_ptr(rule_offs);
+		if (!rp || (rp->rtree_fsr_selector_type == 0)) continue;
+
+		selector = offset_to_ruletree_string_ptr(
+			rp->rtree_fsr_selector_offs, &selector_len);
+		if (selector) {
+			if ((dir_len == 1) && (*dir == '/')) {
+				if ((selector_len > 1) && (*selector == '/'))
+					return(1);
+			} else if ((selector_len > dir_len) &&
+			    (selector[dir_len] == '/') &&
+			    !strncmp(selector, dir, dir_len)) {
+				return(1);
+			}
+		}
+		if ((rp->rtree_fsr_action_type == SB2_RULETREE_FSRULE_ACTION_SUBTREE) &&
+		    rp->rtree_fsr_rule_list_link &&
+		    ruletree_has_rules_below_dir(rp->rtree_fsr_rule_list_link,
+			dir, dir_len))
+			return(1);
+	}
+	return(0);
+}
+
+/* Check if everything below directory "abs_clean_virtual_dir" is mapped
+ * by "dir_rule_offs", the rule of the directory itself, in the way that
+ * ruletree_rule_is_same_for_component() accepts: Then a whole subtree
+ * can be walked in the host file system without mapping the names.
+ * The rule must be found for every class in "fn_classmask", and
+ * there must not be other rules for anything below the directory.
+ * Returns 1 if so, 0 if names must be mapped separately.
+*/
+int ruletree_rule_covers_subtree(
+	const path_mapping_context_t *ctx,
+	ruletree_object_offset_t dir_rule_offs,
+	const char *abs_clean_virtual_dir,
+	uint32_t fn_classmask)
+{
+	ruletree_object_offset_t	rule_list_offs;
+	ruletree_fsrule_t		*rule = NULL;
+	const char			*errormsg = NULL;
+	uint32_t			fn_class;
+
+	for (fn_class = 1; fn_class && (fn_class <= fn_classmask); fn_class <<= 1) {
+		if (!(fn_classmask & fn_class)) continue;
+		rule = ruletree_rule_is_same_for_component(ctx, dir_rule_offs,
+			abs_clean_virtual_dir, fn_class);
+		if (!rule) return(0);
+	}
+	/* a "path" selector doesn't apply to names in the directory */
+	if (!rule || (rule->rtree_fsr_selector_type == SB2_RULETREE_FSRULE_SELECTOR_PATH))
+		return(0);
+
+	rule_list_offs = ruletree_get_rule_list_offs(1/*use_fwd_rules*/, &errormsg);
+	if (!rule_list_offs) return(0);
+	return(!ruletree_has_rules_below_dir(rule_list_offs,
+		abs_clean_virtual_dir, strlen(abs_clean_virtual_dir)));
+}
+
 /* returns an allocated buffer */
 static char *ruletree_execute_replace_rule(
 	const char *full_path,
@@ -524,28 +879,9 @@ static char *execute_std_action(
 	case SB2_RULETREE_FSRULE_ACTION_UNION_DIR:
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"execute_std_action: union_dir: %s", abs_clean_virtual_path);
-		{
-			ruletree_object_offset_t union_dir_list_offs = rule_selector->rtree_fsr_rule_list_link;
-			int	num_real_dir_entries;
-			const char	**src_paths = NULL;
-			int	i;
-
-			num_real_dir_entries = ruletree_objectlist_get_list_size(union_dir_list_offs);
-			if (num_real_dir_entries > 0) {
-				src_paths = calloc(num_real_dir_entries, sizeof(char*));
-				for (i = 0; i < num_real_dir_entries; i++) {
-					ruletree_object_offset_t str_offs;
-					str_offs = ruletree_objectlist_get_item(union_dir_list_offs, i);
-					src_paths[i] = offset_to_ruletree_string_ptr(str_offs, NULL);
-					SB_LOG(SB_LOGLEVEL_DEBUG,
-						"execute_std_action: union_dir src_path[%d]: %s", 
-						i, src_paths[i]);
-				}
-				union_dir_result = prep_union_dir(abs_clean_virtual_path,
-						src_paths, num_real_dir_entries);
-			}
-			if (src_paths) free(src_paths);
-		}
+		/* readdir() merges the component directories, see union_dirs.c */
+		union_dir_result = union_dir_map_path(
+			rule_selector->rtree_fsr_rule_list_link);
 		SB_LOG(SB_LOGLEVEL_DEBUG, "union_dir result = '%s'", union_dir_result);
 		return(union_dir_result);
 
@@ -557,6 +893,27 @@ static char *execute_std_action(
 	return(NULL);
 }
 
+/* Result depends on more than the rules and the path (see struct sb2context) */
+static void mark_mapping_result_volatile(const path_mapping_context_t *ctx)
+{
+	if (ctx->pmc_sb2ctx)
+		ctx->pmc_sb2ctx->mapping_result_is_volatile = 1;
+}
+
+static void check_if_std_action_is_volatile(
+	const path_mapping_context_t *ctx,
+	uint32_t action_type)
+{
+	switch (action_type) {
+	case SB2_RULETREE_FSRULE_ACTION_MAP_TO_VALUE_OF_ENV_VAR:
+	case SB2_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
+	case SB2_RULETREE_FSRULE_ACTION_PROCFS:
+	case SB2_RULETREE_FSRULE_ACTION_UNION_DIR:
+		mark_mapping_result_volatile(ctx);
+		break;
+	}
+}
+
 static char *ruletree_execute_conditional_actions(
         const path_mapping_context_t *ctx,
         int result_log_level,
@@ -608,6 +965,14 @@ static char *ruletree_execute_conditional_actions(
 
 				cond_str = offset_to_ruletree_string_ptr(action_cand_p->rtree_fsr_condition_offs, NULL);
 				SB_LOG(SB_LOGLEVEL_NOISE, "Condition test '%s'", cond_str);
+
+				switch (action_cand_p->rtree_fsr_condition_type) {
+				case SB2_RULETREE_FSRULE_CONDITION_IF_ENV_VAR_IS_NOT_EMPTY:
+				case SB2_RULETREE_FSRULE_CONDITION_IF_ENV_VAR_IS_EMPTY:
+				case SB2_RULETREE_FSRULE_CONDITION_IF_EXISTS_IN:
+					mark_mapping_result_volatile(ctx);
+					break;
+				}
 				
 				switch (action_cand_p->rtree_fsr_condition_type) {
 				case SB2_RULETREE_FSRULE_CONDITION_IF_ENV_VAR_IS_NOT_EMPTY:
@@ -694,6 +1059,7 @@ static char *ruletree_execute_conditional_actions(
 
 			switch (action_cand_p->rtree_fsr_action_type) {
 			case SB2_RULETREE_FSRULE_ACTION_IF_EXISTS_THEN_MAP_TO:
+				mark_mapping_result_volatile(ctx);
 				if (if_exists_then_map_to(action_cand_p,
 				     abs_clean_virtual_path, &mapping_result)) {
 					return(mapping_result);
@@ -701,6 +1067,7 @@ static char *ruletree_execute_conditional_actions(
 				break;
 
 			case SB2_RULETREE_FSRULE_ACTION_IF_EXISTS_THEN_REPLACE_BY:
+				mark_mapping_result_volatile(ctx);
 				if (if_exists_then_replace_by(action_cand_p,
 				     rule_selector, abs_clean_virtual_path,
 				     &mapping_result)) {
@@ -718,6 +1085,8 @@ static char *ruletree_execute_conditional_actions(
 			case SB2_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
 			case SB2_RULETREE_FSRULE_ACTION_PROCFS:
 			case SB2_RULETREE_FSRULE_ACTION_UNION_DIR:
+				check_if_std_action_is_volatile(ctx,
+					action_cand_p->rtree_fsr_action_type);
 				return(execute_std_action(rule_selector, action_cand_p,
 					abs_clean_virtual_path, flagsp));
 
@@ -800,6 +1169,7 @@ char *ruletree_translate_path(
 	case SB2_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
 	case SB2_RULETREE_FSRULE_ACTION_PROCFS:
 	case SB2_RULETREE_FSRULE_ACTION_UNION_DIR:
+		check_if_std_action_is_volatile(ctx, rule->rtree_fsr_action_type);
 		host_path = execute_std_action(rule, rule, abs_clean_virtual_path, flagsp);
 		break;
 
@@ -35,6 +35,8 @@
 #include <errno.h>
 #include "libsb2.h"
 #include "exported.h"
+#include "rule_tree.h"
+#include "rule_tree_rpc.h"
 
 /* strchrnul(): Find the first occurrence of C in S or the final NUL byte.
  * This is not present on all systems, so we'll use our own version in sb2.
@@ -123,6 +125,8 @@ int sb_next_execve(const char *file, char *const *argv, char *const *envp)
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "EXEC: i_pid=%d file='%s'",
 		sb_log_initial_pid__, file);
+	sblog_exec_trace(file);
+	ruletree_rpc__vperm_flush_new_files();
 	return next_execve(file, argv, envp);
 }
 
@@ -192,6 +196,8 @@ int sb_next_posix_spawn(pid_t* pid, const char *path,
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "EXEC: i_pid=%d path='%s'",
 		sb_log_initial_pid__, path);
+	sblog_exec_trace(path);
+	ruletree_rpc__vperm_flush_new_files();
 	return next_posix_spawn(pid, path, file_actions, attrp, argv, envp);
 }
 
@@ -729,6 +735,8 @@ FILE *popen_gate(int *result_errno_ptr,
 
 	(void)realfnname;
 	SB_LOG(SB_LOGLEVEL_DEBUG, "popen(%s,%s)", command, type);
+	/* the child is created without fork() handlers */
+	ruletree_rpc__vperm_flush_new_files();
 
 	/* popen() uses our 'environ', so we'll have to make
 	 * temporary changes and restore the values after
@@ -22,65 +22,193 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "libsb2.h"
 #include "exported.h"
+#include "sb2_network.h"
+#include "rule_tree_rpc.h"
+
+/* The DB is lock-free, RCU-style:
+ * - slots are kept in a two-level sparse array; second-level pages
+ *   are allocated on demand and published with compare-and-swap,
+ *   and they are never freed (so lookups never see a stale table;
+ *   the old version realloc'ed the whole table)
+ * - paths are stored in immutable records. Writers publish a new
+ *   record by swapping the slot pointer atomically; the replaced
+ *   record is moved to a "retired" list.
+ * - lookups copy the path while they are registered as active readers
+ *   (fd_path_db_readers). Retired records are freed only when a
+ *   writer sees that there are no active readers, so a concurrent
+ *   close() or dup2() can never free a path that is being copied.
+ * GCC's __atomic builtins are used; all operations are sequentially
+ * consistent, this is not performance critical enough for anything
+ * more subtle.
+ *
+ * In addition to the virtual path, a record may contain the mapping
+ * result of the path (resolved virtual path, host path and the rule);
+ * sbox_map_path_at() uses those to map *at() calls incrementally.
+*/
+typedef struct fd_path_db_record_s {
+	struct fd_path_db_record_s	*fpdb_next_retired;
+	size_t				fpdb_entry_size; /* incl. strings */
+	fdpathdb_entry_t		fpdb_entry;
+	/* strings follow the entry */
+} fd_path_db_record_t;
+
+#define FD_PATH_DB_PAGE_SLOTS	256
+#define FD_PATH_DB_MAX_PAGES	4096	/* => 1M file descriptors */
+
+/* retired records are freed when there are no readers; if the list
+ * grows longer than this, the writer waits for a grace period. */
+#define FD_PATH_DB_MAX_RETIRED	1024
+
+typedef struct fd_path_db_page_s {
+	fd_path_db_record_t	*fpdb_slots[FD_PATH_DB_PAGE_SLOTS];
+} fd_path_db_page_t;
+
+static fd_path_db_page_t *fd_path_db[FD_PATH_DB_MAX_PAGES];
+
+static int fd_path_db_readers = 0;
+static fd_path_db_record_t *fd_path_db_retired = NULL;
+static int fd_path_db_num_retired = 0;
+
+/* fork() copies fd_path_db_readers, but not the threads that were
+ * reading: an atfork handler resets the counter in the child. It is
+ * registered before the first page is created, i.e. before there
+ * can be any readers. */
+static int fd_path_db_atfork_registered = 0;
 
-typedef struct fd_path_db_entry_s {
-	char	*fpdb_path;
-} fd_path_db_entry_t;
+#define FDPATHDB_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
 
-static fd_path_db_entry_t *fd_path_db = NULL;
-static int fd_path_db_slots = 0;
+/* Only the thread that called fork() exists in the child, and
+ * it is not reading */
+static void fdpathdb_atfork_child(void)
+{
+	__atomic_store_n(&fd_path_db_readers, 0, __ATOMIC_SEQ_CST);
+}
 
-static pthread_mutex_t	fd_path_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Returns pointer to the slot of "fd", or NULL if the fd is out of range
+ * or if the page hasn't been allocated and "create" is not set.
+*/
+static fd_path_db_record_t **fdpathdb_slot(int fd, int create)
+{
+	fd_path_db_page_t	*page;
+	int			pagenum;
+
+	if (fd < 0) return(NULL);
+	pagenum = fd / FD_PATH_DB_PAGE_SLOTS;
+	if (pagenum >= FD_PATH_DB_MAX_PAGES) return(NULL);
+
+	page = FDPATHDB_LOAD(&fd_path_db[pagenum]);
+	if (!page) {
+		fd_path_db_page_t	*expected = NULL;
+
+		if (!create) return(NULL);
+		if (!__atomic_exchange_n(&fd_path_db_atfork_registered, 1,
+		    __ATOMIC_SEQ_CST))
+			pthread_atfork(NULL, NULL, fdpathdb_atfork_child);
+		page = calloc(1, sizeof(fd_path_db_page_t));
+		if (!page) return(NULL);
+		if (!__atomic_compare_exchange_n(&fd_path_db[pagenum],
+			&expected, page, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			/* another thread was faster */
+			free(page);
+			page = expected;
+		}
+	}
+	return(&page->fpdb_slots[fd % FD_PATH_DB_PAGE_SLOTS]);
+}
 
-/* Functions to lock/unlock the mutex, if libpthreads is available.
- * If it isn't, this is used in a sigle-threaded program and we can
- * safely live without the mutex.
+/* Free retired records, if no reader can be using them.
+ * Records in the list have already been removed from the slots, so
+ * readers that start after this can't find them anymore.
 */
-static void fdpathdb_mutex_lock(void)
+static void fdpathdb_reclaim_retired(void)
 {
-	if (pthread_library_is_available) {
-		SB_LOG(SB_LOGLEVEL_NOISE2, "Going to lock fd_path_db_mutex");
-		(*pthread_mutex_lock_fnptr)(&fd_path_db_mutex);
-		/* NO logging here! */
+	fd_path_db_record_t	*list, *rec;
+	int			n;
+
+	if (!FDPATHDB_LOAD(&fd_path_db_retired)) return;
+
+	list = __atomic_exchange_n(&fd_path_db_retired, NULL, __ATOMIC_SEQ_CST);
+	if (!list) return;
+
+	if (FDPATHDB_LOAD(&fd_path_db_readers) == 0) {
+		n = 0;
+		while (list) {
+			rec = list;
+			list = rec->fpdb_next_retired;
+			free(rec);
+			n++;
+		}
+		__atomic_sub_fetch(&fd_path_db_num_retired, n, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	/* readers are active, put the records back. */
+	while (list) {
+		rec = list;
+		list = rec->fpdb_next_retired;
+		rec->fpdb_next_retired = FDPATHDB_LOAD(&fd_path_db_retired);
+		while (!__atomic_compare_exchange_n(&fd_path_db_retired,
+			&rec->fpdb_next_retired, rec, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			/* rec->fpdb_next_retired was updated, retry */ ;
 	}
 }
-static void fdpathdb_mutex_unlock(void)
+
+static void fdpathdb_retire_record(fd_path_db_record_t *rec)
 {
-	if (pthread_library_is_available) {
-		/* NO logging here! */
-		(*pthread_mutex_unlock_fnptr)(&fd_path_db_mutex);
-		SB_LOG(SB_LOGLEVEL_NOISE2, "unlocked fd_path_db_mutex");
+	int	spins;
+
+	rec->fpdb_next_retired = FDPATHDB_LOAD(&fd_path_db_retired);
+	while (!__atomic_compare_exchange_n(&fd_path_db_retired,
+		&rec->fpdb_next_retired, rec, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		/* rec->fpdb_next_retired was updated, retry */ ;
+
+	if (__atomic_add_fetch(&fd_path_db_num_retired, 1, __ATOMIC_SEQ_CST) >
+	    FD_PATH_DB_MAX_RETIRED) {
+		/* Readers have been active all the time. Wait for
+		 * a grace period (lookups are short), but not forever */
+		for (spins = 0; (spins < 1000) &&
+		     (FDPATHDB_LOAD(&fd_path_db_readers) != 0); spins++)
+			sched_yield();
 	}
+	fdpathdb_reclaim_retired();
 }
 
-const char *fdpathdb_find_path(int fd)
+/* Returns a copy of the pathname of "fd", or NULL if it is not known.
+ * Caller must free() the result.
+*/
+char *fdpathdb_find_path(int fd)
 {
-	const char *ret = NULL;
-
-	fdpathdb_mutex_lock();
-	{
-		/* NOTE: This is a critical section:
-		 * - Do not return from this block, mutex is locked !!
-		 * - Do not call the logger from this block !!
-		*/
-		if ((fd >= 0) &&
-		    (fd_path_db_slots > fd) &&
-		    fd_path_db[fd].fpdb_path) {
-			ret = fd_path_db[fd].fpdb_path;
-		}
+	fd_path_db_record_t	**slot;
+	char			*ret = NULL;
+
+	slot = fdpathdb_slot(fd, 0);
+	if (slot) {
+		fd_path_db_record_t	*rec;
+
+		/* NOTE: Between these, records can't be freed.
+		 * Do not call the logger from here !! */
+		__atomic_add_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
+		rec = FDPATHDB_LOAD(slot);
+		if (rec) ret = strdup(rec->fpdb_entry.fpe_path);
+		__atomic_sub_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
 	}
-	fdpathdb_mutex_unlock();
 
 	if (ret) {
 		SB_LOG(SB_LOGLEVEL_NOISE,
 			"fdpathdb_find_path: FD %d => '%s'",
-			fd, fd_path_db[fd].fpdb_path);
+			fd, ret);
 	} else {
 		SB_LOG(SB_LOGLEVEL_NOISE,
 			"fdpathdb_find_path: No pathname for FD %d", fd);
@@ -89,11 +217,90 @@ const char *fdpathdb_find_path(int fd)
 	return(ret);
 }
 
+#define FD_PATH_DB_RECORD_SIZE(entry_size) \
+	(offsetof(fd_path_db_record_t, fpdb_entry) + (entry_size))
+
+/* "dst" is a memcpy()'ed copy of "src" (entry and the strings that
+ * follow it): make the string pointers point to dst's strings */
+static void fdpathdb_relocate_entry(fdpathdb_entry_t *dst,
+	const fdpathdb_entry_t *src)
+{
+	char		*dst_base = (char *)dst;
+	const char	*src_base = (const char *)src;
+
+	dst->fpe_path = dst_base + (src->fpe_path - src_base);
+	if (src->fpe_resolved_virtual_path)
+		dst->fpe_resolved_virtual_path = dst_base +
+			(src->fpe_resolved_virtual_path - src_base);
+	if (src->fpe_host_path)
+		dst->fpe_host_path = dst_base +
+			(src->fpe_host_path - src_base);
+}
+
+/* copy the entry (and the strings) of a record to a new buffer */
+static fdpathdb_entry_t *fdpathdb_copy_entry(const fd_path_db_record_t *rec)
+{
+	fdpathdb_entry_t	*ep;
+
+	ep = malloc(rec->fpdb_entry_size);
+	if (!ep) return(NULL);
+	memcpy(ep, &rec->fpdb_entry, rec->fpdb_entry_size);
+	fdpathdb_relocate_entry(ep, &rec->fpdb_entry);
+	return(ep);
+}
+
+/* Returns a copy of the entry of "fd", or NULL if it is not known.
+ * The entry and the strings are allocated as a single buffer;
+ * caller must free() it.
+*/
+fdpathdb_entry_t *fdpathdb_get_entry(int fd)
+{
+	fd_path_db_record_t	**slot;
+	fdpathdb_entry_t	*ret = NULL;
+
+	slot = fdpathdb_slot(fd, 0);
+	if (slot) {
+		fd_path_db_record_t	*rec;
+
+		/* no logging here, see fdpathdb_find_path() */
+		__atomic_add_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
+		rec = FDPATHDB_LOAD(slot);
+		if (rec) ret = fdpathdb_copy_entry(rec);
+		__atomic_sub_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
+	}
+	return(ret);
+}
+
+/* publish "rec" (may be NULL) as the record of "fd" */
+static void fdpathdb_set_record(const char *realfnname, int fd,
+	fd_path_db_record_t *rec)
+{
+	fd_path_db_record_t	**slot;
+	fd_path_db_record_t	*old_rec;
+
+	/* clearing a slot doesn't need to allocate a page */
+	slot = fdpathdb_slot(fd, rec != NULL);
+	if (!slot) {
+		if (rec) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: FD %d out of range for fdpathdb",
+				realfnname, fd);
+			free(rec);
+		}
+		return;
+	}
+
+	old_rec = __atomic_exchange_n(slot, rec, __ATOMIC_SEQ_CST);
+	if (old_rec) fdpathdb_retire_record(old_rec);
+}
+
 static void fdpathdb_register_mapped_path(
 	const char *realfnname, int fd,
-	const char *mapped_path, const char *orig_path)
+	const char *mapped_path, const char *orig_path,
+	const mapping_results_t *res)
 {
 	const char *path = NULL;
+	fd_path_db_record_t	*rec = NULL;
 
 	if (fd < 0) return;
 
@@ -120,46 +327,82 @@ static void fdpathdb_register_mapped_path(
 	SB_LOG(SB_LOGLEVEL_NOISE, "%s: Register %d => '%s'",
 		realfnname, fd, path ? path : "(NULL path)");
 
-	fdpathdb_mutex_lock();
-	{
-		/* NOTE: This is a critical section:
-		 * - Do not return from this block, mutex is locked !!
-		 * - Do not call the logger from this block !!
-		*/
-
-		if (fd_path_db_slots <= fd) {
-			if (fd_path_db) {
-				int slots_after_realloc = fd + 1;
-				int new_slots = slots_after_realloc -
-					fd_path_db_slots;
-
-				/* allocate more slots */
-				fd_path_db = realloc(fd_path_db,
-					slots_after_realloc *
-						sizeof(fd_path_db_entry_t));
-				/* realloc() does not initialize memory;
-				 * clear new slots */
-				memset(fd_path_db + fd_path_db_slots, 0,
-					new_slots * sizeof(fd_path_db_entry_t));
-
-				fd_path_db_slots = slots_after_realloc;
-			} else {
-				/* allocate a new table */
-				fd_path_db_slots = fd + 1;
-				fd_path_db = calloc(fd_path_db_slots,
-					sizeof(fd_path_db_entry_t));
-			}
+	if (path) {
+		size_t	len = strlen(path) + 1;
+		size_t	resolved_len = 0, host_len = 0;
+		size_t	entry_size;
+		char	*cp;
+
+		/* keep the mapping result only if it is complete, and if
+		 * the virtual path didn't depend on chroot simulation */
+		if (res && res->mres_rule_offs &&
+		    res->mres_resolved_virtual_path &&
+		    res->mres_result_buf && (*res->mres_result_buf == '/') &&
+		    !sbox_chroot_path) {
+			resolved_len = strlen(res->mres_resolved_virtual_path) + 1;
+			host_len = strlen(res->mres_result_buf) + 1;
 		}
 
-		if (fd_path_db[fd].fpdb_path) {
-			/* overwriting an old entry */
-			free(fd_path_db[fd].fpdb_path);
-			fd_path_db[fd].fpdb_path = NULL;
+		entry_size = sizeof(fdpathdb_entry_t) +
+			len + resolved_len + host_len;
+		rec = malloc(FD_PATH_DB_RECORD_SIZE(entry_size));
+		if (!rec) return;
+		rec->fpdb_next_retired = NULL;
+		rec->fpdb_entry_size = entry_size;
+		cp = (char *)(&rec->fpdb_entry + 1);
+		memcpy(cp, path, len);
+		rec->fpdb_entry.fpe_path = cp;
+		cp += len;
+		if (resolved_len) {
+			memcpy(cp, res->mres_resolved_virtual_path, resolved_len);
+			rec->fpdb_entry.fpe_resolved_virtual_path = cp;
+			cp += resolved_len;
+			memcpy(cp, res->mres_result_buf, host_len);
+			rec->fpdb_entry.fpe_host_path = cp;
+			rec->fpdb_entry.fpe_rule_offs = res->mres_rule_offs;
+		} else {
+			rec->fpdb_entry.fpe_resolved_virtual_path = NULL;
+			rec->fpdb_entry.fpe_host_path = NULL;
+			rec->fpdb_entry.fpe_rule_offs = 0;
 		}
+	}
 
-		fd_path_db[fd].fpdb_path = path ? strdup(path) : NULL;
+	fdpathdb_set_record(realfnname, fd, rec);
+}
+
+/* dup(), dup2() etc: "newfd" gets a copy of the record of "fd" */
+static void fdpathdb_duplicate_entry(const char *realfnname, int fd, int newfd)
+{
+	fd_path_db_record_t	**slot;
+	fd_path_db_record_t	*rec = NULL;
+
+	if (newfd < 0) return;
+
+	slot = fdpathdb_slot(fd, 0);
+	if (slot) {
+		fd_path_db_record_t	*orig_rec;
+
+		/* no logging here, see fdpathdb_find_path() */
+		__atomic_add_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
+		orig_rec = FDPATHDB_LOAD(slot);
+		if (orig_rec) {
+			rec = malloc(FD_PATH_DB_RECORD_SIZE(
+				orig_rec->fpdb_entry_size));
+			if (rec) {
+				rec->fpdb_next_retired = NULL;
+				rec->fpdb_entry_size = orig_rec->fpdb_entry_size;
+				memcpy(&rec->fpdb_entry, &orig_rec->fpdb_entry,
+					rec->fpdb_entry_size);
+				fdpathdb_relocate_entry(&rec->fpdb_entry,
+					&orig_rec->fpdb_entry);
+			}
+		}
+		__atomic_sub_fetch(&fd_path_db_readers, 1, __ATOMIC_SEQ_CST);
 	}
-	fdpathdb_mutex_unlock();
+
+	SB_LOG(SB_LOGLEVEL_NOISE, "%s: Register %d => '%s' (copy of %d)",
+		realfnname, newfd, rec ? rec->fpdb_entry.fpe_path : "(NULL path)", fd);
+	fdpathdb_set_record(realfnname, newfd, rec);
 }
 
 static void fdpathdb_register_mapping_result(const char *realfnname,
@@ -172,7 +415,7 @@ static void fdpathdb_register_mapping_result(const char *realfnname,
 	if (*pathname == '/') {
 		/* also the original virtual path is absolute */
 		fdpathdb_register_mapped_path(realfnname, ret_fd,
-			res->mres_result_buf, pathname);
+			res->mres_result_buf, pathname, res);
 	} else {
 		/* orig. path is relative. */
 		char	*abs_virtual_path = NULL;
@@ -189,8 +432,14 @@ static void fdpathdb_register_mapping_result(const char *realfnname,
 				" built abs.path '%s'",
 				abs_virtual_path);
 			fdpathdb_register_mapped_path(realfnname, ret_fd,
-				res->mres_result_buf, abs_virtual_path);
+				res->mres_result_buf, abs_virtual_path, res);
 			free(abs_virtual_path);
+		} else if (res->mres_resolved_virtual_path) {
+			/* relative to a dirfd (*at() functions); the
+			 * engine got an absolute virtual path */
+			fdpathdb_register_mapped_path(realfnname, ret_fd,
+				res->mres_result_buf,
+				res->mres_resolved_virtual_path, res);
 		} else {
 			/* virtual path is relative, and it can't
 			 * be converted to absolute. 
@@ -198,7 +447,7 @@ static void fdpathdb_register_mapping_result(const char *realfnname,
 			 * use the mapped path instead.
 			*/
 			fdpathdb_register_mapped_path(realfnname, ret_fd,
-				res->mres_result_buf, pathname);
+				res->mres_result_buf, pathname, NULL);
 		}
 	}
 }
@@ -300,64 +549,58 @@ void __opendir2_postprocess_name(
 	const char *name, int flags)
 {
 	(void)flags;
-	if (ret)
+	if (ret) {
 		fdpathdb_register_mapping_result(realfnname, dirfd(ret), res, name);
+		union_dir_register_stream(ret, res->mres_rule_offs);
+	}
 }
 
 void opendir_postprocess_name(
 	const char *realfnname, DIR *ret, mapping_results_t *res,
 	const char *name)
 {
-	if (ret)
+	if (ret) {
 		fdpathdb_register_mapping_result(realfnname, dirfd(ret), res, name);
+		union_dir_register_stream(ret, res->mres_rule_offs);
+	}
 }
 
 void dup_postprocess_(const char *realfnname, int ret, int fd)
 {
-	const char	*cp = NULL;
-
-	if (ret >= 0) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, ret, cp, cp);
-	}
+	if (ret >= 0)
+		fdpathdb_duplicate_entry(realfnname, fd, ret);
 }
 
 void dup2_postprocess_(const char *realfnname, int ret, int fd, int fd2)
 {
-	const char	*cp = NULL;
-
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		fdpathdb_duplicate_entry(realfnname, fd, fd2);
+		sockaddr_cache_forget_fd(fd2);
+		ruletree_rpc__vperm_fd_closed(fd2);
 	}
 }
 
 void dup3_postprocess_(const char *realfnname, int ret, int fd, int fd2, int flags)
 {
-	const char	*cp = NULL;
-
 	(void)flags;
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		fdpathdb_duplicate_entry(realfnname, fd, fd2);
+		sockaddr_cache_forget_fd(fd2);
+		ruletree_rpc__vperm_fd_closed(fd2);
 	}
 }
 
 void close_postprocess_(const char *realfnname, int ret, int fd)
 {
 	(void)ret;
-	fdpathdb_register_mapped_path(realfnname, fd, NULL, NULL);
+	fdpathdb_register_mapped_path(realfnname, fd, NULL, NULL, NULL);
+	sockaddr_cache_forget_fd(fd);
+	ruletree_rpc__vperm_fd_closed(fd);
 }
 
 void fcntl_postprocess_(const char *realfnname, int ret,
 	int fd, int cmd, void *arg)
 {
-	const char	*cp = NULL;
-
-	(void)cp;
 	(void)arg;
 
 	switch (cmd) {
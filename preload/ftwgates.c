@@ -0,0 +1,771 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * ftw(), nftw() and their 64-bit variants for SB2.
+ *
+ * The C library's own implementations can't be used for walking a
+ * virtual directory tree: Only the starting point could be mapped, and
+ * after that the library would walk the host tree with its internal
+ * functions (the callback would see host paths and host symlinks).
+ *
+ * This walker maps the starting point, and then checks if the whole
+ * subtree is handled by the same, simple rule (no other rules below
+ * the directory, see sbox_subtree_maps_like_dir()). If it is, the
+ * subtree is walked in the host file system: Directories are opened
+ * with openat(), read with getdents64() and the names are stat'ed with
+ * fstatat() relative to the directory. Only symbolic links (unless
+ * FTW_PHYS was used) and names below directories that have other rules
+ * are mapped separately. Names in a directory are the same in the
+ * virtual and host namespaces, so nothing needs to be reverse-mapped.
+ *
+ * N.B. one file descriptor is kept open for each level; "nopenfd"
+ * is not used.
+*/
+
+#include "libsb2.h"
+#include "exported.h"
+#include "sb2_stat.h"
+
+#ifdef HAVE_FTW_H
+
+#include <sys/syscall.h>
+#include <search.h>
+
+/* the stat() result, as the callback wants it */
+typedef union {
+	struct stat	ws_st;
+	struct stat64	ws_st64;
+} walk_stat_t;
+
+/* a path buffer, where names are appended and removed */
+typedef struct {
+	char	*wp_buf;
+	size_t	wp_len;
+	size_t	wp_size;
+} walk_path_t;
+
+typedef struct {
+	const char	*w_realfnname;
+	int		w_flags;	/* FTW_* flags for nftw() */
+	int		w_is_nftw;	/* 0 for ftw(): fewer types */
+	int		w_stat64;
+	union {
+		int (*wf_nftw)(const char *, const struct stat *,
+			int, struct FTW *);
+		int (*wf_nftw64)(const char *, const struct stat64 *,
+			int, struct FTW *);
+		int (*wf_ftw)(const char *, const struct stat *, int);
+		int (*wf_ftw64)(const char *, const struct stat64 *, int);
+	} w_fn;
+	dev_t		w_dev;		/* for FTW_MOUNT */
+	void		*w_visited;	/* tsearch() tree, unless FTW_PHYS */
+	walk_path_t	w_path;		/* path for the callback */
+} walk_t;
+
+typedef struct {
+	dev_t	wv_dev;
+	ino64_t	wv_ino;
+} walk_visited_t;
+
+/* class for mapping: names are both opened and stat'ed */
+#define WALK_CLASSMASK	(SB2_INTERFACE_CLASS_OPEN | SB2_INTERFACE_CLASS_STAT)
+
+static int walk_path_append(walk_path_t *wp, const char *name)
+{
+	size_t	name_len = strlen(name);
+	size_t	needed = wp->wp_len + 1 + name_len + 1;
+
+	if (needed > wp->wp_size) {
+		size_t	new_size = wp->wp_size ? wp->wp_size : PATH_MAX;
+		char	*new_buf;
+
+		while (new_size < needed) new_size *= 2;
+		new_buf = realloc(wp->wp_buf, new_size);
+		if (!new_buf) return(-1);
+		wp->wp_buf = new_buf;
+		wp->wp_size = new_size;
+	}
+	if ((wp->wp_len == 0) || (wp->wp_buf[wp->wp_len - 1] != '/'))
+		wp->wp_buf[wp->wp_len++] = '/';
+	memcpy(wp->wp_buf + wp->wp_len, name, name_len + 1);
+	wp->wp_len += name_len;
+	return(0);
+}
+
+static int walk_path_set(walk_path_t *wp, const char *path)
+{
+	size_t	len = strlen(path);
+
+	if ((len + 1) > wp->wp_size) {
+		char	*new_buf = realloc(wp->wp_buf, len + PATH_MAX);
+
+		if (!new_buf) return(-1);
+		wp->wp_buf = new_buf;
+		wp->wp_size = len + PATH_MAX;
+	}
+	memcpy(wp->wp_buf, path, len + 1);
+	wp->wp_len = len;
+	return(0);
+}
+
+static char *walk_join_path(const char *dir, const char *name)
+{
+	char	*path = NULL;
+
+	if (asprintf(&path, "%s/%s", (strcmp(dir, "/") ? dir : ""), name) < 0)
+		return(NULL);
+	return(path);
+}
+
+#define WALK_ST_MODE(w, sb) \
+	((w)->w_stat64 ? (sb)->ws_st64.st_mode : (sb)->ws_st.st_mode)
+#define WALK_ST_DEV(w, sb) \
+	((w)->w_stat64 ? (sb)->ws_st64.st_dev : (sb)->ws_st.st_dev)
+#define WALK_ST_INO(w, sb) \
+	((w)->w_stat64 ? (ino64_t)(sb)->ws_st64.st_ino : (ino64_t)(sb)->ws_st.st_ino)
+
+/* fstatat() on the host side, and the result is virtualized like
+ * the results of stat() */
+static int walk_stat(walk_t *w, int dirfd, const char *name,
+	int flags, walk_stat_t *sb)
+{
+	int	r;
+
+	if (w->w_stat64) {
+		r = real_fstatat64(dirfd, name, &sb->ws_st64, flags);
+		if (r == 0) i_virtualize_struct_stat(w->w_realfnname,
+			NULL, &sb->ws_st64);
+	} else {
+		r = real_fstatat(dirfd, name, &sb->ws_st, flags);
+		if (r == 0) i_virtualize_struct_stat(w->w_realfnname,
+			&sb->ws_st, NULL);
+	}
+	return(r);
+}
+
+static int walk_call(walk_t *w, walk_stat_t *sb, int typeflag,
+	int base, int level)
+{
+	struct FTW	ftwbuf;
+
+	if (!w->w_is_nftw) {
+		switch (typeflag) {
+		case FTW_SL:	typeflag = FTW_F; break;
+		case FTW_DP:	typeflag = FTW_D; break;
+		case FTW_SLN:	typeflag = FTW_NS; break;
+		}
+		if (w->w_stat64)
+			return((*w->w_fn.wf_ftw64)(w->w_path.wp_buf,
+				&sb->ws_st64, typeflag));
+		return((*w->w_fn.wf_ftw)(w->w_path.wp_buf,
+			&sb->ws_st, typeflag));
+	}
+	ftwbuf.base = base;
+	ftwbuf.level = level;
+	if (w->w_stat64)
+		return((*w->w_fn.wf_nftw64)(w->w_path.wp_buf,
+			&sb->ws_st64, typeflag, &ftwbuf));
+	return((*w->w_fn.wf_nftw)(w->w_path.wp_buf,
+		&sb->ws_st, typeflag, &ftwbuf));
+}
+
+static int compare_visited(const void *a, const void *b)
+{
+	const walk_visited_t	*va = a;
+	const walk_visited_t	*vb = b;
+
+	if (va->wv_dev != vb->wv_dev)
+		return(va->wv_dev < vb->wv_dev ? -1 : 1);
+	if (va->wv_ino != vb->wv_ino)
+		return(va->wv_ino < vb->wv_ino ? -1 : 1);
+	return(0);
+}
+
+/* Returns 1 if the directory has been seen already, otherwise
+ * remembers it and returns 0 */
+static int walk_check_visited(walk_t *w, walk_stat_t *sb)
+{
+	walk_visited_t	key;
+	walk_visited_t	*new_key;
+	void		*node;
+
+	key.wv_dev = WALK_ST_DEV(w, sb);
+	key.wv_ino = WALK_ST_INO(w, sb);
+	if (tfind(&key, &w->w_visited, compare_visited)) return(1);
+
+	new_key = malloc(sizeof(*new_key));
+	if (!new_key) return(0);
+	*new_key = key;
+	node = tsearch(new_key, &w->w_visited, compare_visited);
+	if (!node || (*(walk_visited_t **)node != new_key)) free(new_key);
+	return(0);
+}
+
+/* Add a name to the buffer of walk_read_names() */
+static int walk_add_name(char **namesp, size_t *lenp, size_t *sizep,
+	const char *name)
+{
+	size_t	len;
+
+	if ((name[0] == '.') && ((name[1] == '\0') ||
+	    ((name[1] == '.') && (name[2] == '\0'))))
+		return(0);
+	len = strlen(name) + 1;
+	if ((*lenp + len) > *sizep) {
+		size_t	new_size = (*sizep < 4096) ? 4096 : 2 * *sizep;
+		char	*new_names;
+
+		while (new_size < (*lenp + len)) new_size *= 2;
+		new_names = realloc(*namesp, new_size);
+		if (!new_names) return(-1);
+		*namesp = new_names;
+		*sizep = new_size;
+	}
+	memcpy(*namesp + *lenp, name, len);
+	*lenp += len;
+	return(1);
+}
+
+/* Read all names from a directory; returns them as consecutive
+ * strings in an allocated buffer, and the count to *countp.
+ * "." and ".." are not included. Returns NULL on errors. */
+static char *walk_read_names(int fd, size_t *countp)
+{
+	char	*names = malloc(1);
+	size_t	names_len = 0;
+	size_t	names_size = 1;
+	size_t	count = 0;
+	int	r;
+#ifdef SYS_getdents64
+	struct walk_dirent64 {
+		uint64_t	d_ino;
+		int64_t		d_off;
+		unsigned short	d_reclen;
+		unsigned char	d_type;
+		char		d_name[];
+	} *de;
+	char	dents[32*1024];
+	long	n;
+	long	pos;
+
+	if (!names) return(NULL);
+	while ((n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+		for (pos = 0; pos < n; pos += de->d_reclen) {
+			de = (struct walk_dirent64 *)(dents + pos);
+			r = walk_add_name(&names, &names_len, &names_size,
+				de->d_name);
+			if (r < 0) goto error_out;
+			count += r;
+		}
+	}
+	if (n < 0) goto error_out;
+#else
+	DIR		*dirp;
+	struct dirent64	*de;
+	int		dup_fd = dup(fd);
+
+	if (!names) return(NULL);
+	if ((dup_fd < 0) || !(dirp = fdopendir(dup_fd))) {
+		if (dup_fd >= 0) close(dup_fd);
+		goto error_out;
+	}
+	while ((de = readdir64(dirp)) != NULL) {
+		r = walk_add_name(&names, &names_len, &names_size, de->d_name);
+		if (r < 0) {
+			closedir(dirp);
+			goto error_out;
+		}
+		count += r;
+	}
+	closedir(dirp);
+#endif
+	*countp = count;
+	return(names);
+
+    error_out:
+	free(names);
+	return(NULL);
+}
+
+static int walk_entry(walk_t *w, int dirfd, const char *name,
+	const char *vdir, int single, int base, int level,
+	const mapping_results_t *mapped);
+
+/* Process a directory. "mapped" is NULL if it is opened relative to
+ * "parent_fd", as "name" (a subtree that needs no mapping) */
+static int walk_dir(walk_t *w, int parent_fd, const char *name,
+	const mapping_results_t *mapped, const char *parent_vdir,
+	const char *vdir, int single, walk_stat_t *sb, int base, int level)
+{
+	int	fd;
+	int	r = 0;
+	char	*names;
+	char	*cp;
+	size_t	count;
+	size_t	i;
+	size_t	dir_path_len;
+
+	if (mapped)
+		fd = open_nomap_nolog(mapped->mres_result_path,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else
+		fd = openat_nomap_nolog(parent_fd, name,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == EACCES) {
+			r = walk_call(w, sb, FTW_DNR, base, level);
+			if ((w->w_flags & FTW_ACTIONRETVAL) &&
+			    (r == FTW_SKIP_SUBTREE))
+				r = 0;
+			return(r);
+		}
+		return(-1);
+	}
+
+	if (!(w->w_flags & FTW_DEPTH)) {
+		r = walk_call(w, sb, FTW_D, base, level);
+		if (r) {
+			close(fd);
+			if ((w->w_flags & FTW_ACTIONRETVAL) &&
+			    (r == FTW_SKIP_SUBTREE))
+				return(0);
+			return(r);
+		}
+	}
+
+	names = walk_read_names(fd, &count);
+	if (!names) {
+		close(fd);
+		return(-1);
+	}
+
+	if (w->w_flags & FTW_CHDIR) {
+		if (fchdir_nomap_nolog(fd) < 0) {
+			free(names);
+			close(fd);
+			return(-1);
+		}
+		sbox_virtual_cwd_changed(vdir);
+	}
+
+	dir_path_len = w->w_path.wp_len;
+	for (i = 0, cp = names; i < count; i++, cp += strlen(cp) + 1) {
+		int	child_base;
+
+		if (walk_path_append(&w->w_path, cp) < 0) {
+			errno = ENOMEM;
+			r = -1;
+			break;
+		}
+		child_base = w->w_path.wp_len - strlen(cp);
+		r = walk_entry(w, fd, cp, vdir, single,
+			child_base, level + 1, NULL);
+		w->w_path.wp_len = dir_path_len;
+		w->w_path.wp_buf[dir_path_len] = '\0';
+		if (r) {
+			if ((w->w_flags & FTW_ACTIONRETVAL) &&
+			    (r == FTW_SKIP_SIBLINGS))
+				r = 0;
+			break;
+		}
+	}
+	free(names);
+
+	/* like glibc, the post-order callback is called while the
+	 * directory itself is still the current directory */
+	if ((r == 0) && (w->w_flags & FTW_DEPTH))
+		r = walk_call(w, sb, FTW_DP, base, level);
+
+	if (w->w_flags & FTW_CHDIR) {
+		if ((fchdir_nomap_nolog(parent_fd) < 0) && (r == 0)) r = -1;
+		sbox_virtual_cwd_changed(parent_vdir);
+	}
+	close(fd);
+	return(r);
+}
+
+/* Process one name. If "single" is set, the name is stat'ed relative to
+ * "dirfd" (the parent directory), otherwise it is mapped first.
+ * "mapped" is set only for the starting point.
+*/
+static int walk_entry(walk_t *w, int dirfd, const char *name,
+	const char *vdir, int single, int base, int level,
+	const mapping_results_t *mapped)
+{
+	mapping_results_t	res;
+	walk_stat_t		sb;
+	char			*vpath = NULL;
+	char			*child_vdir = NULL;
+	int			typeflag;
+	int			r = 0;
+	int			phys = w->w_flags & FTW_PHYS;
+
+	clear_mapping_results_struct(&res);
+	if (!mapped) {
+		vpath = walk_join_path(vdir, name);
+		if (!vpath) {
+			errno = ENOMEM;
+			return(-1);
+		}
+		if (!single) {
+			sbox_map_path(w->w_realfnname, vpath,
+				(phys ? SBOX_MAP_PATH_DONT_RESOLVE_FINAL_SYMLINK : 0),
+				&res, WALK_CLASSMASK);
+			mapped = &res;
+		}
+	}
+
+    stat_entry:
+	if (mapped) {
+		if (mapped->mres_result_path) {
+			r = walk_stat(w, AT_FDCWD, mapped->mres_result_path,
+				(phys ? AT_SYMLINK_NOFOLLOW : 0), &sb);
+		} else {
+			errno = ENOENT;
+			r = -1;
+		}
+	} else {
+		r = walk_stat(w, dirfd, name, AT_SYMLINK_NOFOLLOW, &sb);
+	}
+
+	if (r < 0) {
+		typeflag = FTW_NS;
+		if (!phys && (errno == ENOENT)) {
+			/* maybe a symlink that points to nowhere */
+			mapping_results_t	link_res;
+
+			clear_mapping_results_struct(&link_res);
+			sbox_map_path(w->w_realfnname,
+				(vpath ? vpath : w->w_path.wp_buf),
+				SBOX_MAP_PATH_DONT_RESOLVE_FINAL_SYMLINK,
+				&link_res, WALK_CLASSMASK);
+			if (link_res.mres_result_path &&
+			    (walk_stat(w, AT_FDCWD, link_res.mres_result_path,
+				AT_SYMLINK_NOFOLLOW, &sb) == 0) &&
+			    S_ISLNK(WALK_ST_MODE(w, &sb)))
+				typeflag = FTW_SLN;
+			free_mapping_results(&link_res);
+		}
+		if ((level == 0) && (typeflag == FTW_NS)) {
+			/* nothing to report about the starting point */
+			r = -1;
+			goto out;
+		}
+		if (typeflag == FTW_NS) memset(&sb, 0, sizeof(sb));
+	} else if (S_ISLNK(WALK_ST_MODE(w, &sb))) {
+		if (!phys && !mapped) {
+			/* symlinks must be followed in the virtual namespace */
+			sbox_map_path(w->w_realfnname, vpath, 0,
+				&res, WALK_CLASSMASK);
+			mapped = &res;
+			goto stat_entry;
+		}
+		typeflag = FTW_SL;
+	} else if (S_ISDIR(WALK_ST_MODE(w, &sb))) {
+		typeflag = FTW_D;
+	} else {
+		typeflag = FTW_F;
+	}
+
+	if (level == 0) {
+		if (typeflag != FTW_NS) w->w_dev = WALK_ST_DEV(w, &sb);
+	} else if ((w->w_flags & FTW_MOUNT) && (typeflag != FTW_NS) &&
+		   (WALK_ST_DEV(w, &sb) != w->w_dev)) {
+		/* not reported */
+		r = 0;
+		goto out;
+	}
+
+	if (typeflag != FTW_D) {
+		r = walk_call(w, &sb, typeflag, base, level);
+		/* like glibc: there is no subtree to skip, continue */
+		if ((w->w_flags & FTW_ACTIONRETVAL) && (r == FTW_SKIP_SUBTREE))
+			r = 0;
+		goto out;
+	}
+
+	if (!phys && walk_check_visited(w, &sb)) {
+		r = 0;
+		goto out;
+	}
+
+	if (mapped) {
+		int	subtree_single;
+
+		subtree_single = sbox_subtree_maps_like_dir(w->w_realfnname,
+			mapped->mres_rule_offs,
+			mapped->mres_resolved_virtual_path, WALK_CLASSMASK);
+		if (mapped->mres_resolved_virtual_path)
+			child_vdir = strdup(mapped->mres_resolved_virtual_path);
+		else if (vpath)
+			child_vdir = strdup(vpath);
+		if (!child_vdir) {
+			errno = ENOMEM;
+			r = -1;
+			goto out;
+		}
+		r = walk_dir(w, dirfd, name, mapped, vdir, child_vdir,
+			subtree_single, &sb, base, level);
+	} else {
+		r = walk_dir(w, dirfd, name, NULL, vdir, vpath,
+			1, &sb, base, level);
+	}
+
+    out:
+	if (child_vdir) free(child_vdir);
+	if (vpath) free(vpath);
+	free_mapping_results(&res);
+	return(r);
+}
+
+/* Map the starting point. Returns 0 if the tree can be walked here, or
+ * -1 if the real function must be used (with mapped->mres_result_path) */
+static int walk_map_start(walk_t *w, const char *dir,
+	mapping_results_t *mapped)
+{
+	clear_mapping_results_struct(mapped);
+	sbox_map_path(w->w_realfnname, dir,
+		((w->w_flags & FTW_PHYS) ? SBOX_MAP_PATH_DONT_RESOLVE_FINAL_SYMLINK : 0),
+		mapped, WALK_CLASSMASK);
+	if (!mapped->mres_result_path || !mapped->mres_rule_offs ||
+	    !mapped->mres_resolved_virtual_path || sbox_chroot_path)
+		return(-1);
+	return(0);
+}
+
+static int walk_tree(walk_t *w, const char *dir, mapping_results_t *mapped)
+{
+	char	*parent_vdir = NULL;
+	char	*parent_host_dir = NULL;
+	char	*saved_virtual_cwd = NULL;
+	char	*cp;
+	int	parent_fd = AT_FDCWD;
+	int	saved_cwd_fd = -1;
+	int	base;
+	int	r;
+
+	/* the path for the callback: trailing slashes are removed */
+	if (walk_path_set(&w->w_path, dir) < 0) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	while ((w->w_path.wp_len > 1) &&
+	       (w->w_path.wp_buf[w->w_path.wp_len - 1] == '/'))
+		w->w_path.wp_buf[--w->w_path.wp_len] = '\0';
+	cp = strrchr(w->w_path.wp_buf, '/');
+	base = (cp && cp[1]) ? (cp - w->w_path.wp_buf) + 1 : 0;
+
+	/* virtual parent directory of the starting point */
+	parent_vdir = strdup(mapped->mres_resolved_virtual_path);
+	if (!parent_vdir) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	cp = strrchr(parent_vdir, '/');
+	if (cp) {
+		if (cp == parent_vdir) cp[1] = '\0';
+		else *cp = '\0';
+	}
+
+	if (w->w_flags & FTW_CHDIR) {
+		/* the callback is called in the directory that contains
+		 * the name; first go to parent of the starting point.
+		 * The caller's virtual CWD is restored afterwards
+		 * (NULL if it isn't known) */
+		saved_virtual_cwd = sbox_virtual_cwd_for_getcwd();
+		saved_cwd_fd = open_nomap_nolog(".",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		parent_host_dir = strdup(mapped->mres_result_path);
+		if (parent_host_dir) {
+			size_t	len = strlen(parent_host_dir);
+
+			while ((len > 1) && (parent_host_dir[len - 1] == '/'))
+				parent_host_dir[--len] = '\0';
+			cp = strrchr(parent_host_dir, '/');
+			if (!cp) strcpy(parent_host_dir, ".");
+			else if (cp == parent_host_dir) cp[1] = '\0';
+			else *cp = '\0';
+			parent_fd = open_nomap_nolog(parent_host_dir,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		if ((saved_cwd_fd < 0) || (parent_fd < 0) ||
+		    (fchdir_nomap_nolog(parent_fd) < 0)) {
+			r = -1;
+			goto out;
+		}
+		sbox_virtual_cwd_changed(parent_vdir);
+	}
+
+	r = walk_entry(w, parent_fd, mapped->mres_result_path, parent_vdir,
+		0, base, 0, mapped);
+	if ((w->w_flags & FTW_ACTIONRETVAL) &&
+	    ((r == FTW_SKIP_SUBTREE) || (r == FTW_SKIP_SIBLINGS)))
+		r = 0;
+
+    out:
+	if (saved_cwd_fd >= 0) {
+		int	saved_errno = errno;
+
+		if (fchdir_nomap_nolog(saved_cwd_fd) == 0)
+			sbox_virtual_cwd_changed(saved_virtual_cwd);
+		close(saved_cwd_fd);
+		errno = saved_errno;
+	}
+	if (saved_virtual_cwd) free(saved_virtual_cwd);
+	if ((parent_fd >= 0) && (parent_fd != AT_FDCWD)) close(parent_fd);
+	if (parent_host_dir) free(parent_host_dir);
+	free(parent_vdir);
+	return(r);
+}
+
+static void walk_done(walk_t *w)
+{
+	if (w->w_visited) tdestroy(w->w_visited, free);
+	if (w->w_path.wp_buf) free(w->w_path.wp_buf);
+}
+
+static void walk_init(walk_t *w, const char *realfnname,
+	int flags, int is_nftw, int use_stat64)
+{
+	memset(w, 0, sizeof(*w));
+	w->w_realfnname = realfnname;
+	w->w_flags = flags;
+	w->w_is_nftw = is_nftw;
+	w->w_stat64 = use_stat64;
+}
+
+/* ---------- Gates ---------- */
+
+int nftw_gate(
+	int *result_errno_ptr,
+	int (*real_nftw_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat *sb,
+			int flag, struct FTW *s),
+		int nopenfd, int flags),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat *sb,
+		int flag, struct FTW *s),
+	int nopenfd,
+	int flags)
+{
+	walk_t			w;
+	mapping_results_t	mapped;
+	int			ret;
+
+	walk_init(&w, realfnname, flags, 1, 0);
+	w.w_fn.wf_nftw = fn;
+	if (walk_map_start(&w, dir, &mapped) == 0) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = walk_tree(&w, dir, &mapped);
+	} else {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_nftw_ptr)((mapped.mres_result_path ?
+			mapped.mres_result_path : dir), fn, nopenfd, flags);
+	}
+	*result_errno_ptr = errno;
+	free_mapping_results(&mapped);
+	walk_done(&w);
+	return(ret);
+}
+
+#ifdef HAVE_NFTW64
+int nftw64_gate(
+	int *result_errno_ptr,
+	int (*real_nftw64_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat64 *sb,
+			int flag, struct FTW *s),
+		int nopenfd, int flags),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb,
+		int flag, struct FTW *s),
+	int nopenfd,
+	int flags)
+{
+	walk_t			w;
+	mapping_results_t	mapped;
+	int			ret;
+
+	walk_init(&w, realfnname, flags, 1, 1);
+	w.w_fn.wf_nftw64 = fn;
+	if (walk_map_start(&w, dir, &mapped) == 0) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = walk_tree(&w, dir, &mapped);
+	} else {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_nftw64_ptr)((mapped.mres_result_path ?
+			mapped.mres_result_path : dir), fn, nopenfd, flags);
+	}
+	*result_errno_ptr = errno;
+	free_mapping_results(&mapped);
+	walk_done(&w);
+	return(ret);
+}
+#endif
+
+int ftw_gate(
+	int *result_errno_ptr,
+	int (*real_ftw_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat *sb, int flag),
+		int nopenfd),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat *sb, int flag),
+	int nopenfd)
+{
+	walk_t			w;
+	mapping_results_t	mapped;
+	int			ret;
+
+	walk_init(&w, realfnname, 0, 0, 0);
+	w.w_fn.wf_ftw = fn;
+	if (walk_map_start(&w, dir, &mapped) == 0) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = walk_tree(&w, dir, &mapped);
+	} else {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_ftw_ptr)((mapped.mres_result_path ?
+			mapped.mres_result_path : dir), fn, nopenfd);
+	}
+	*result_errno_ptr = errno;
+	free_mapping_results(&mapped);
+	walk_done(&w);
+	return(ret);
+}
+
+#ifdef HAVE_FTW64
+int ftw64_gate(
+	int *result_errno_ptr,
+	int (*real_ftw64_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat64 *sb, int flag),
+		int nopenfd),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb, int flag),
+	int nopenfd)
+{
+	walk_t			w;
+	mapping_results_t	mapped;
+	int			ret;
+
+	walk_init(&w, realfnname, 0, 0, 1);
+	w.w_fn.wf_ftw64 = fn;
+	if (walk_map_start(&w, dir, &mapped) == 0) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = walk_tree(&w, dir, &mapped);
+	} else {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_ftw64_ptr)((mapped.mres_result_path ?
+			mapped.mres_result_path : dir), fn, nopenfd);
+	}
+	*result_errno_ptr = errno;
+	free_mapping_results(&mapped);
+	walk_done(&w);
+	return(ret);
+}
+#endif
+
+#endif /* HAVE_FTW_H */
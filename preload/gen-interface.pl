@@ -39,6 +39,9 @@
 #     the sbox_map_path() function
 #   - "map_at(fdname,varname)" will map function's parameter "varname" using
 #     the sbox_map_path_at() function
+#     (for both: paths that are known to map to themselves are detected
+#     by sbox_map_path_if_identity() first; then the original pointer is
+#     used as the result)
 #   - "hardcode_param(N,name)" will hardcode name of the Nth parameter
 #     to "name" (this is typically needed only if the function definition uses
 #     macros to build the parameter list, instead of specifying names of
@@ -641,7 +644,9 @@ sub process_wrap_or_gate_modifiers {
 
 			$mods->{'path_mapping_code'} .=
 				"\tclear_mapping_results_struct(&res_$new_name);\n".
-				"\tsbox_map_path(__func__, ".
+				"\tif (!sbox_map_path_if_identity($param_to_be_mapped, ".
+					"classmask, &res_$new_name))\n".
+				"\t\tsbox_map_path(__func__, ".
 					"$param_to_be_mapped, ".
 					"$flags, ".
 					"&res_$new_name, classmask);\n".
@@ -696,7 +701,9 @@ sub process_wrap_or_gate_modifiers {
 				"\tmapping_results_t res_$new_name;\n";
 			$mods->{'path_mapping_code'} .=
 				"\tclear_mapping_results_struct(&res_$new_name);\n".
-				"\tsbox_map_path_at(__func__, ".
+				"\tif (!sbox_map_path_if_identity($param_to_be_mapped, ".
+					"classmask, &res_$new_name))\n".
+				"\t\tsbox_map_path_at(__func__, ".
 					"$fd_param, ".
 					"$param_to_be_mapped, ".
 					"$flags, ".
@@ -65,6 +65,9 @@
 
 #include <stdio.h>		/* Needed on stupid SunOS for assert.  */
 
+#include <fcntl.h>		/* SB2 */
+#include "sb2_stat.h"		/* SB2 */
+
 #if !defined _LIBC || !defined GLOB_ONLY_P
 #if defined HAVE_UNISTD_H || defined _LIBC
 # include <unistd.h>
@@ -326,6 +329,7 @@ glob (pattern, flags, errfunc, pglob)
   int meta;
   int dirname_modified;
   glob_t dirs;
+  int marked_in_dir = 0; /* SB2: GLOB_MARK was done by glob_in_dir() */
 
   if (pattern == NULL || pglob == NULL || (flags & ~__GLOB_FLAGS) != 0)
     {
@@ -889,6 +893,9 @@ glob (pattern, flags, errfunc, pglob)
     }
 
   meta = __glob_pattern_type (dirname, !(flags & GLOB_NOESCAPE));
+  /* SB2: from here on, all names come from glob_in_dir(), except
+     the pattern itself if there were no matches.  */
+  marked_in_dir = !(flags & GLOB_ALTDIRFUNC);
   /* meta is 1 if correct glob pattern containing metacharacters.
      If meta has bit (1 << 2) set, it means there was an unterminated
      [ which we handle the same, using fnmatch.  Broken unterminated
@@ -993,6 +1000,7 @@ glob (pattern, flags, errfunc, pglob)
 	{
 	no_matches:
 	  /* No matches.  */
+	  marked_in_dir = 0; /* SB2 */
 	  if (flags & GLOB_NOCHECK)
 	    {
 	      int newcount = pglob->gl_pathc + pglob->gl_offs;
@@ -1088,7 +1096,7 @@ glob (pattern, flags, errfunc, pglob)
 	}
     }
 
-  if (flags & GLOB_MARK)
+  if ((flags & GLOB_MARK) && !marked_in_dir) /* SB2 */
     {
       /* Append slashes to directory names.  */
       size_t i;
@@ -1328,6 +1336,58 @@ link_exists2_p (const char *dir, size_t dirlen, const char *fname,
 # endif
 #endif
 
+#if 1 /* SB2 */
+/* Find out the type of an entry that was read from a directory
+   stream, mapping as few paths as possible: The directory itself
+   was mapped once by opendir(), and "dfd" is the host directory.
+   An entry without d_type is fstatat()'ed relative to "dfd" without
+   mapping.  Only symlinks (and names that are not in the host
+   directory, e.g. entries from other components of union directories)
+   are stat'ed with the mapping stat(), because the target of a symlink
+   is a virtual path.
+   Returns the type of the entry or of the symlink's target as a DT_*
+   value, or DT_UNKNOWN if it does not exist (a dangling symlink).  */
+static int
+glob_entry_type (int dfd, const char *dir, size_t dirlen, const char *fname,
+		 int d_type)
+{
+  struct stat64 host_st;
+  struct_stat64 st64;
+  size_t fnamelen;
+  char *fullname;
+
+  if (d_type == DT_UNKNOWN && dfd >= 0
+      && real_fstatat64 (dfd, fname, &host_st, AT_SYMLINK_NOFOLLOW) == 0)
+    d_type = IFTODT (host_st.st_mode);
+  if (d_type != DT_UNKNOWN && d_type != DT_LNK)
+    return d_type;
+
+  fnamelen = strlen (fname);
+  fullname = (char *) __alloca (dirlen + 1 + fnamelen + 1);
+  mempcpy (mempcpy (mempcpy (fullname, dir, dirlen), "/", 1),
+	   fname, fnamelen + 1);
+  if (__stat64 (fullname, &st64) != 0)
+    return DT_UNKNOWN;
+  return IFTODT (st64.st_mode);
+}
+
+/* Copy NAME to a new string, appending a slash if MARK is set.  */
+static char *
+glob_copy_name (const char *name, size_t len, int mark)
+{
+  char *p = malloc (len + 2);
+
+  if (p != NULL)
+    {
+      char *e = mempcpy (p, name, len);
+      if (mark)
+	*e++ = '/';
+      *e = '\0';
+    }
+  return p;
+}
+#endif
+
 
 /* Like `glob', but PATTERN is a final pathname component,
    and matches are searched for in DIRECTORY.
@@ -1355,6 +1415,9 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
   size_t cur = 0;
   int meta;
   int save;
+  /* SB2: directories are marked here, while their types are known */
+  int mark_dirs = ((flags & (GLOB_MARK | GLOB_ALTDIRFUNC)) == GLOB_MARK);
+  int pattern_is_dir = -1;
 
   init_names.next = NULL;
   init_names.count = INITIAL_COUNT;
@@ -1382,9 +1445,13 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
       if ((__builtin_expect (flags & GLOB_ALTDIRFUNC, 0)
 	   ? (*pglob->gl_stat) (fullname, &st)
 	   : __stat64 (fullname, &st64)) == 0)
-	/* We found this file to be existing.  Now tell the rest
-	   of the function to copy this name into the result.  */
-	flags |= GLOB_NOCHECK;
+	{
+	  /* We found this file to be existing.  Now tell the rest
+	     of the function to copy this name into the result.  */
+	  flags |= GLOB_NOCHECK;
+	  if (mark_dirs) /* SB2 */
+	    pattern_is_dir = S_ISDIR (st64.st_mode);
+	}
     }
   else
     {
@@ -1400,10 +1467,9 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
 	}
       else
 	{
-#ifdef _LIBC
+	  /* SB2: "dfd" is needed by glob_entry_type() */
 	  int dfd = (__builtin_expect (flags & GLOB_ALTDIRFUNC, 0)
 		     ? -1 : dirfd ((DIR *) stream));
-#endif
 	  int fnm_flags = ((!(flags & GLOB_PERIOD) ? FNM_PERIOD : 0)
 			   | ((flags & GLOB_NOESCAPE) ? FNM_NOESCAPE : 0)
 #if defined _AMIGA || defined VMS
@@ -1459,11 +1525,28 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
 
 	      if (fnmatch (pattern, name, fnm_flags) == 0)
 		{
+		  int type = DT_UNKNOWN; /* SB2 */
+
 		  /* If the file we found is a symlink we have to
 		     make sure the target file exists.  */
-		  if (!DIRENT_MIGHT_BE_SYMLINK (d)
-		      || link_exists_p (dfd, directory, dirlen, name, pglob,
-					flags))
+		  if (__builtin_expect (flags & GLOB_ALTDIRFUNC, 0))
+		    {
+		      if (DIRENT_MIGHT_BE_SYMLINK (d)
+			  && !link_exists_p (dfd, directory, dirlen, name,
+					     pglob, flags))
+			continue;
+		    }
+		  else
+		    {
+		      /* SB2: only symlinks are mapped, see
+			 glob_entry_type().  The type also gives the
+			 exact answer for GLOB_ONLYDIR and GLOB_MARK.  */
+		      type = glob_entry_type (dfd, directory, dirlen, name,
+					      d->d_type);
+		      if (type == DT_UNKNOWN
+			  || ((flags & GLOB_ONLYDIR) && type != DT_DIR))
+			continue;
+		    }
 		    {
 		      if (cur == names->count)
 			{
@@ -1484,11 +1567,12 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
 			  cur = 0;
 			}
 		      len = NAMLEN (d);
-		      names->name[cur] = (char *) malloc (len + 1);
+		      /* SB2 */
+		      names->name[cur] = glob_copy_name (name, len,
+						mark_dirs && type == DT_DIR);
 		      if (names->name[cur] == NULL)
 			goto memory_error;
-		      *((char *) mempcpy (names->name[cur++], name, len))
-			= '\0';
+		      cur++;
 		      ++nfound;
 		    }
 		}
@@ -1500,10 +1584,15 @@ glob_in_dir (const char *pattern, const char *directory, int flags,
     {
       size_t len = strlen (pattern);
       nfound = 1;
-      names->name[cur] = (char *) malloc (len + 1);
+      /* SB2 */
+      if (mark_dirs && pattern_is_dir < 0)
+	pattern_is_dir = (glob_entry_type (-1, directory, dirlen, pattern,
+					   DT_UNKNOWN) == DT_DIR);
+      names->name[cur] = glob_copy_name (pattern, len,
+					 mark_dirs && pattern_is_dir > 0);
       if (names->name[cur] == NULL)
 	goto memory_error;
-      *((char *) mempcpy (names->name[cur++], pattern, len)) = '\0';
+      cur++;
     }
 
   int result = GLOB_NOMATCH;
@@ -36,6 +36,7 @@
 #include <signal.h>
 #include "libsb2.h"
 #include "exported.h"
+#include "rule_tree.h"
 
 /* String vector contents to a single string for logging.
  * returns pointer to an allocated buffer, caller should free() it.
@@ -345,6 +346,10 @@ void sb2_initialize_global_variables(void)
 			cp = getenv("__SB2_CHROOT_PATH");
 			if (cp) sbox_chroot_path = strdup(cp);
 		}
+		/* optional; rule tree location etc. from the parent,
+		 * saves some lookups when the rule tree is attached */
+		cp = getenv("__SB2_HANDOFF");
+		if (cp) ruletree_handoff_from_string(cp);
 
 		if (sbox_session_dir) {
 			/* seems that we got it.. */
@@ -352,6 +357,11 @@ void sb2_initialize_global_variables(void)
 			sblog_init();
 			SB_LOG(SB_LOGLEVEL_DEBUG, "global vars initialized from env");
 
+			/* optional; virtual path of the CWD, from
+			 * the parent (validated when it is used) */
+			cp = getenv("__SB2_VIRTUAL_CWD");
+			if (cp) sbox_virtual_cwd_import(cp);
+
 			/* check if the user wants us to SIGTRAP
 			 * during libsb2 initialization.
 			 *
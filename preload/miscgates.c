@@ -33,6 +33,7 @@
 #include "libsb2.h"
 #include "exported.h"
 #include "rule_tree.h"
+#include "rule_tree_rpc.h"
 
 #ifdef HAVE_FTS_H
 /* FIXME: why there was #if !defined(HAVE___OPENDIR2) around fts_open() ???? */
@@ -143,6 +144,79 @@ SB_LOG(SB_LOGLEVEL_DEBUG, "GETCWD: returns '%s'", cwd);
 	return cwd;
 }
 
+int chdir_gate(
+	int *result_errno_ptr,
+	int (*real_chdir_ptr)(const char *path),
+	const char *realfnname,
+	const mapping_results_t *mapped_path)
+{
+	int	res;
+
+	(void)realfnname;
+	errno = *result_errno_ptr; /* restore to orig.value */
+	res = (*real_chdir_ptr)(mapped_path->mres_result_path);
+	*result_errno_ptr = errno;
+	if (res == 0) {
+		/* the virtual path is known now; keep it,
+		 * getcwd() and relative paths need it */
+		sbox_virtual_cwd_changed(mapped_path->mres_resolved_virtual_path);
+	}
+	return(res);
+}
+
+int fchdir_gate(
+	int *result_errno_ptr,
+	int (*real_fchdir_ptr)(int fd),
+	const char *realfnname,
+	int fd)
+{
+	int	res;
+
+	(void)realfnname;
+	errno = *result_errno_ptr; /* restore to orig.value */
+	res = (*real_fchdir_ptr)(fd);
+	*result_errno_ptr = errno;
+	if (res == 0) {
+		fdpathdb_entry_t	*dir_entry = fdpathdb_get_entry(fd);
+
+		sbox_virtual_cwd_changed(dir_entry ?
+			dir_entry->fpe_resolved_virtual_path : NULL);
+		if (dir_entry) free(dir_entry);
+	}
+	return(res);
+}
+
+/* getcwd() from the virtual CWD that libsb2 tracks; no need to
+ * call the real getcwd() and reverse the result. vcwd is freed. */
+static char *getcwd_from_virtual_cwd(int *result_errno_ptr,
+	char *buf, size_t size, char *vcwd)
+{
+	size_t	len = strlen(vcwd) + 1;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "GETCWD: tracked '%s'", vcwd);
+	if (buf == NULL) {
+		/* allocate the buffer, like glibc does */
+		if (size == 0) return(vcwd);
+		if (len <= size) buf = malloc(size);
+		if (!buf) {
+			free(vcwd);
+			*result_errno_ptr = (len > size ? ERANGE : ENOMEM);
+			return(NULL);
+		}
+	} else if (size == 0) {
+		free(vcwd);
+		*result_errno_ptr = EINVAL;
+		return(NULL);
+	} else if (len > size) {
+		free(vcwd);
+		*result_errno_ptr = ERANGE;
+		return(NULL);
+	}
+	memcpy(buf, vcwd, len);
+	free(vcwd);
+	return(buf);
+}
+
 /* #include <unistd.h> */
 char *getcwd_gate (
 	int *result_errno_ptr,
@@ -153,6 +227,10 @@ char *getcwd_gate (
 {
 	char *cwd;
 
+	if ((cwd = sbox_virtual_cwd_for_getcwd()) != NULL)
+		return(getcwd_from_virtual_cwd(result_errno_ptr,
+			buf, size, cwd));
+
 	errno = *result_errno_ptr; /* restore to orig.value */
 	if ((cwd = (*real_getcwd_ptr)(buf, size)) == NULL) {
 		*result_errno_ptr = errno;
@@ -173,6 +251,12 @@ char *__getcwd_chk_gate(
 {
 	char *cwd;
 
+	/* if size > buflen, the real function will fail */
+	if ((size <= buflen) &&
+	    ((cwd = sbox_virtual_cwd_for_getcwd()) != NULL))
+		return(getcwd_from_virtual_cwd(result_errno_ptr,
+			buf, size, cwd));
+
 	errno = *result_errno_ptr; /* restore to orig.value */
 	if ((cwd = (*real___getcwd_chk_ptr)(buf, size, buflen)) == NULL) {
 		*result_errno_ptr = errno;
@@ -595,6 +679,8 @@ void _exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	/* exit() flushes this in the library destructor */
+	ruletree_rpc__vperm_flush_new_files();
 	(real__exit_ptr)(status);
 }
 
@@ -611,6 +697,8 @@ void _Exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	/* exit() flushes this in the library destructor */
+	ruletree_rpc__vperm_flush_new_files();
 	(real__Exit_ptr)(status);
 }
 //void _Exit_gate() __attribute__ ((noreturn));
@@ -42,45 +42,159 @@
 
 typedef struct {
 	socklen_t	mapped_addrlen;
+	int		mapped_dirfd;	/* see map_long_sockaddr_un(), or -1 */
 	union	{
 		struct sockaddr		mapped_sockaddr;
 		struct sockaddr_in	mapped_sockaddr_in;
 		struct sockaddr_in6	mapped_sockaddr_in6;
 		struct sockaddr_un	mapped_sockaddr_un;
 	};
-	char	orig_printable_dst_addr[200];
-	char	mapped_printable_dst_addr[200];
 } mapped_sockaddr_t;
 
+/* Printable form of an address. Used only for logging, so
+ * this is called only if the message will be logged. */
+static void sockaddr_to_printable(const struct sockaddr *sa,
+	char *buf, size_t bufsize)
+{
+	char	a[INET6_ADDRSTRLEN];
+
+	if (!sa) {
+		snprintf(buf, bufsize, "<no address>");
+		return;
+	}
+	switch (sa->sa_family) {
+	case AF_UNIX:
+		if (!*((const struct sockaddr_un *)sa)->sun_path)
+			snprintf(buf, bufsize, "<abstract AF_UNIX address>");
+		else
+			snprintf(buf, bufsize, "AF_UNIX %s",
+				((const struct sockaddr_un *)sa)->sun_path);
+		break;
+	case AF_INET:
+		if (inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr,
+		    a, sizeof(a)))
+			snprintf(buf, bufsize, "AF_INET %s:%d", a,
+				ntohs(((const struct sockaddr_in *)sa)->sin_port));
+		else
+			snprintf(buf, bufsize, "<AF_INET address conversion failed>");
+		break;
+	case AF_INET6:
+		if (inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr,
+		    a, sizeof(a)))
+			snprintf(buf, bufsize, "AF_INET6 [%s]:%d", a,
+				ntohs(((const struct sockaddr_in6 *)sa)->sin6_port));
+		else
+			snprintf(buf, bufsize, "<AF_INET6 address conversion failed>");
+		break;
+	default:
+		snprintf(buf, bufsize,
+			"<Network mapping does not support this AF=%d, uses orig.address>",
+			sa->sa_family);
+		break;
+	}
+}
+
+/* A mapped AF_UNIX path does not fit to sun_path. Open the directory
+ * and refer to the socket through it:
+ * "/proc/self/fd/<dirfd>/<name>". The directory must stay open until
+ * the real function has been called, see release_mapped_sockaddr().
+ * returns 0 if OK, or an errno code. */
+static int map_long_sockaddr_un(
+	const char *realfnname,
+	const char *mapped_path,
+	mapped_sockaddr_t *output_addr)
+{
+	const char	*last_slash = strrchr(mapped_path, '/');
+	char		*dir_path;
+	int		dirfd;
+	int		len;
+
+	if (!last_slash || !last_slash[1]) return(ENAMETOOLONG);
+	if (last_slash == mapped_path) return(ENAMETOOLONG); /* "/name" */
+
+	dir_path = strndup(mapped_path, last_slash - mapped_path);
+	if (!dir_path) return(ENOMEM);
+#ifdef O_PATH
+	dirfd = open_nomap_nolog(dir_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+	dirfd = open_nomap_nolog(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+	free(dir_path);
+	if (dirfd < 0) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: Failed to open the directory of '%s'",
+			realfnname, mapped_path);
+		return(ENAMETOOLONG);
+	}
+
+	len = snprintf(output_addr->mapped_sockaddr_un.sun_path,
+		sizeof(output_addr->mapped_sockaddr_un.sun_path),
+		"/proc/self/fd/%d/%s", dirfd, last_slash + 1);
+	if ((len < 0) ||
+	    ((size_t)len >= sizeof(output_addr->mapped_sockaddr_un.sun_path))) {
+		close_nomap_nolog(dirfd);
+		return(ENAMETOOLONG);
+	}
+	output_addr->mapped_dirfd = dirfd;
+	output_addr->mapped_addrlen =
+		offsetof(struct sockaddr_un, sun_path) + len + 1;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: long AF_UNIX address '%s' => '%s'",
+		realfnname, mapped_path,
+		output_addr->mapped_sockaddr_un.sun_path);
+	return(0);
+}
+
+/* Must be called after the real function has used a mapped address */
+static void release_mapped_sockaddr(mapped_sockaddr_t *mapped_addr)
+{
+	if (mapped_addr->mapped_dirfd >= 0) {
+		close_nomap_nolog(mapped_addr->mapped_dirfd);
+		mapped_addr->mapped_dirfd = -1;
+	}
+}
+
+/* "*cacheable_p" is set if the result may be reused for the same
+ * address: absolute paths, if the mapping did not depend on existence
+ * of files or on symlinks (see mapping_result_is_volatile and
+ * track_followed_symlinks in struct sb2context) */
 static int map_sockaddr_un(
 	const char *realfnname,
 	const struct sockaddr_un *orig_serv_addr_un,
-	mapped_sockaddr_t *output_addr)
+	mapped_sockaddr_t *output_addr,
+	int *cacheable_p)
 {
 	mapping_results_t	res;
 	int result = 0;
+	struct sb2context	*sb2ctx = NULL;
+	int	was_volatile = 0;
 
+	*cacheable_p = 0;
 	if (!*orig_serv_addr_un->sun_path) {
 		/* an "abstract" local domain socket.
 		 * This is a Linux-specific extension */
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: abstract AF_UNIX addr",
 			realfnname);
 		output_addr->mapped_sockaddr_un = *orig_serv_addr_un;
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"<abstract AF_UNIX address>");
-		snprintf(output_addr->mapped_printable_dst_addr,
-			sizeof(output_addr->mapped_printable_dst_addr),
-			"<abstract AF_UNIX address>");
+		*cacheable_p = 1;
 		return(0);
 	}
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: checking AF_UNIX addr '%s'",
 		realfnname, orig_serv_addr_un->sun_path);
 
-	snprintf(output_addr->orig_printable_dst_addr,
-		sizeof(output_addr->orig_printable_dst_addr),
-		"AF_UNIX %s", orig_serv_addr_un->sun_path);
+	if (*orig_serv_addr_un->sun_path == '/') {
+		sb2ctx = get_sb2context();
+		if (sb2ctx->track_followed_symlinks) {
+			/* already tracked by someone else */
+			release_sb2context(sb2ctx);
+			sb2ctx = NULL;
+		} else {
+			was_volatile = sb2ctx->mapping_result_is_volatile;
+			sb2ctx->mapping_result_is_volatile = 0;
+			sb2ctx->track_followed_symlinks = 1;
+			release_sb2context(sb2ctx);
+		}
+	}
 
 	clear_mapping_results_struct(&res);
 	/* FIXME: implement if(pathname_is_readonly!=0)... */
@@ -96,32 +210,40 @@ static int map_sockaddr_un(
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"%s: Failed to map AF_UNIX address '%s'",
 			realfnname, orig_serv_addr_un->sun_path);
-		snprintf(output_addr->mapped_printable_dst_addr,
-			sizeof(output_addr->mapped_printable_dst_addr),
-			"<Failed to map AF_UNIX address>");
 	} else {
 		output_addr->mapped_sockaddr_un = *orig_serv_addr_un;
 		if (sizeof(output_addr->mapped_sockaddr_un.sun_path) <=
 		    strlen(res.mres_result_path)) {
-			result = ENAMETOOLONG;
-			SB_LOG(SB_LOGLEVEL_ERROR,
-				"%s: Mapped AF_UNIX address (%s) is too long",
-				realfnname, res.mres_result_path);
-			snprintf(output_addr->mapped_printable_dst_addr,
-				sizeof(output_addr->mapped_printable_dst_addr),
-				"<Mapped AF_UNIX address is too long>");
+			result = map_long_sockaddr_un(realfnname,
+				res.mres_result_path, output_addr);
+			if (result)
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"%s: Mapped AF_UNIX address (%s) is too long",
+					realfnname, res.mres_result_path);
 		} else {
 			strcpy(output_addr->mapped_sockaddr_un.sun_path,
 				res.mres_result_path);
 			output_addr->mapped_addrlen =
 				offsetof(struct sockaddr_un, sun_path)
 				 + strlen(res.mres_result_path) + 1;
-			snprintf(output_addr->mapped_printable_dst_addr,
-				sizeof(output_addr->mapped_printable_dst_addr),
-				"AF_UNIX %s", res.mres_result_path);
 		}
 	}
 	free_mapping_results(&res);
+
+	if (sb2ctx) {
+		sb2ctx = get_sb2context();
+		*cacheable_p = (result == 0) &&
+			(output_addr->mapped_dirfd < 0) &&
+			!sb2ctx->mapping_result_is_volatile &&
+			!sb2ctx->followed_symlinks;
+		sb2ctx->mapping_result_is_volatile |= was_volatile;
+		sb2ctx->track_followed_symlinks = 0;
+		if (sb2ctx->followed_symlinks) {
+			free(sb2ctx->followed_symlinks);
+			sb2ctx->followed_symlinks = NULL;
+		}
+		release_sb2context(sb2ctx);
+	}
 	return(result);
 }
 
@@ -133,7 +255,7 @@ static int map_sockaddr_in(
 	mapped_sockaddr_t *output_addr,
 	const char *addr_type/* ipv4_{in,out} */)
 {
-	char printable_dst_addr[200];
+	char printable_dst_addr[INET_ADDRSTRLEN];
 
 	if (!orig_sockaddr_in) return(EFAULT);
 
@@ -144,10 +266,6 @@ static int map_sockaddr_in(
 		int mapping_result_code;
 		int mapped_port;
 
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"AF_INET %s:%d", printable_dst_addr,
-			ntohs(orig_sockaddr_in->sin_port));
 		/* Call mapping/filtering code: */
 		*mapped_dst_addr = '\0';
 
@@ -183,10 +301,6 @@ static int map_sockaddr_in(
 				output_addr->mapped_sockaddr_in.sin_port = htons(mapped_port);
 				output_addr->mapped_sockaddr_in.sin_addr = ina;
 				output_addr->mapped_sockaddr.sa_family = AF_INET;
-				
-				snprintf(output_addr->mapped_printable_dst_addr,
-					sizeof(output_addr->mapped_printable_dst_addr),
-					"AF_INET %s:%d", mapped_dst_addr, mapped_port);
 				return(0); /* ok to use this address */
 			case 0: 
 				SB_LOG(SB_LOGLEVEL_ERROR,
@@ -204,17 +318,8 @@ static int map_sockaddr_in(
 				break;
 			}
 			/* allow use of the orig.address because inet_pton() failed */
-			snprintf(output_addr->mapped_printable_dst_addr,
-				sizeof(output_addr->mapped_printable_dst_addr),
-				"%s", output_addr->orig_printable_dst_addr);
 		}
 	} else {
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"<AF_INET address conversion failed>");
-		snprintf(output_addr->mapped_printable_dst_addr,
-			sizeof(output_addr->mapped_printable_dst_addr),
-			"<AF_INET address conversion failed>");
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"%s: failed to convert IPv4 address to string",
 			realfnname);
@@ -234,7 +339,7 @@ static int map_sockaddr_in6(
 	mapped_sockaddr_t *output_addr,
 	const char *addr_type/* ipv6_{in,out} */)
 {
-	char printable_dst_addr[200];
+	char printable_dst_addr[INET6_ADDRSTRLEN];
 
 	if (!orig_sockaddr_in6) return(EFAULT);
 
@@ -245,10 +350,6 @@ static int map_sockaddr_in6(
 		int mapping_result_code;
 		int mapped_port;
 
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"AF_INET6 [%s]:%d", printable_dst_addr,
-			ntohs(orig_sockaddr_in6->sin6_port));
 		/* Call mapping/filtering code: */
 		*mapped_dst_addr = '\0';
 
@@ -284,10 +385,6 @@ static int map_sockaddr_in6(
 				output_addr->mapped_sockaddr_in6.sin6_port = htons(mapped_port);
 				output_addr->mapped_sockaddr_in6.sin6_addr = ina6;
 				output_addr->mapped_sockaddr.sa_family = AF_INET6;
-				
-				snprintf(output_addr->mapped_printable_dst_addr,
-					sizeof(output_addr->mapped_printable_dst_addr),
-					"AF_INET6 [%s]:%d", mapped_dst_addr, mapped_port);
 				return(0); /* ok to use this address */
 			case 0: 
 				SB_LOG(SB_LOGLEVEL_ERROR,
@@ -305,17 +402,8 @@ static int map_sockaddr_in6(
 				break;
 			}
 			/* allow use of the orig.address because inet_pton() failed */
-			snprintf(output_addr->mapped_printable_dst_addr,
-				sizeof(output_addr->mapped_printable_dst_addr),
-				"%s", output_addr->orig_printable_dst_addr);
 		}
 	} else {
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"<AF_INET6 address conversion failed>");
-		snprintf(output_addr->mapped_printable_dst_addr,
-			sizeof(output_addr->mapped_printable_dst_addr),
-			"<AF_INET6 address conversion failed>");
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"%s: failed to convert IPv6 address to string",
 			realfnname);
@@ -333,6 +421,9 @@ static void log_mapped_net_op_result(
 	mapped_sockaddr_t *addr)
 {
 	char *result_str = "OK";
+	char printable_addr[200];
+
+	if (!SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NETWORK)) return;
 
 	if (result_errno) switch (result_errno) {
 	case EADDRNOTAVAIL: result_str = "addr.not available"; break;
@@ -340,8 +431,10 @@ static void log_mapped_net_op_result(
 	case EPERM: result_str = "EPERM"; break;
 	default: result_str = "Failed"; break;
 	}
+	sockaddr_to_printable(&addr->mapped_sockaddr,
+		printable_addr, sizeof(printable_addr));
 	SB_LOG(SB_LOGLEVEL_NETWORK, "%s: %s => %s (%d)",
-		realfnname, addr->mapped_printable_dst_addr,
+		realfnname, printable_addr,
 		result_str, result_errno);
 }
 
@@ -349,19 +442,198 @@ static void log_mapped_net_op_result(
 #define MAP_SOCKADDR_OPERATION_DENIED	(-1) /* ..if operation is denied (errno set) */
 #define MAP_SOCKADDR_MAPPED		(0)  /* ..call the real function with "output_addr" */
 #define MAP_SOCKADDR_USE_ORIG_ADDR	(1)  /* ..not mapped. */
-static int map_sockaddr(
+
+static void log_map_sockaddr_result(
+	const char *realfnname,
+	int mapping_result,
+	int result_errno,
+	const struct sockaddr *input_addr,
+	const mapped_sockaddr_t *output_addr)
+{
+	char	orig_printable_addr[200];
+
+	if (!SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NETWORK)) return;
+
+	sockaddr_to_printable(input_addr,
+		orig_printable_addr, sizeof(orig_printable_addr));
+	switch (mapping_result) {
+	case MAP_SOCKADDR_OPERATION_DENIED:
+		SB_LOG(SB_LOGLEVEL_NETWORK,
+			"%s: denied (%s), errno=%d",
+			realfnname, orig_printable_addr, result_errno);
+		break;
+	case MAP_SOCKADDR_MAPPED:
+		if (input_addr->sa_family != AF_UNIX) {
+			char	mapped_printable_addr[200];
+
+			sockaddr_to_printable(&output_addr->mapped_sockaddr,
+				mapped_printable_addr,
+				sizeof(mapped_printable_addr));
+			if (strcmp(orig_printable_addr, mapped_printable_addr)) {
+				SB_LOG(SB_LOGLEVEL_NETWORK,
+					"%s: allowed, address changed "
+					"(orig.addr=%s, new addr=%s)", realfnname,
+					orig_printable_addr, mapped_printable_addr);
+			} else {
+				SB_LOG(SB_LOGLEVEL_NETWORK,
+					"%s: allowed (%s)", realfnname,
+					orig_printable_addr);
+			}
+		}
+		break;
+	}
+}
+
+/* ---------- per-socket cache of mapped addresses ---------- */
+
+/* sendto() and sendmsg() on datagram sockets usually send to the
+ * same few addresses again and again (e.g. syslog, D-Bus); mapping
+ * results are remembered per socket, until the socket is closed.
+ * AF_UNIX paths are mapped like file names; those results are cached
+ * only for absolute paths, and only if the mapping did not depend on
+ * existence of files or on symlinks (see map_sockaddr_un()).
+*/
+#define SOCKADDR_CACHE_SIZE	16
+
+typedef struct {
+	int			sac_fd;		/* -1 if not in use */
+	const char		*sac_realfnname;
+	const char		*sac_direction;
+	socklen_t		sac_orig_addrlen;
+	struct sockaddr_storage	sac_orig_addr;
+	int			sac_mapping_result;	/* MAP_SOCKADDR_* */
+	int			sac_errno;
+	mapped_sockaddr_t	sac_mapped_addr;
+} sockaddr_cache_entry_t;
+
+static sockaddr_cache_entry_t	sockaddr_cache[SOCKADDR_CACHE_SIZE];
+static int			sockaddr_cache_initialized = 0;
+static int			sockaddr_cache_num_entries = 0;
+static pthread_mutex_t		sockaddr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_sockaddr_cache(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&sockaddr_cache_mutex);
+}
+
+static void unlock_sockaddr_cache(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&sockaddr_cache_mutex);
+}
+
+static sockaddr_cache_entry_t *sockaddr_cache_slot(
+	int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	const unsigned char *cp = (const unsigned char *)addr;
+	uint32_t	h = 2166136261U ^ (uint32_t)fd;	/* FNV-1a */
+	socklen_t	i;
+
+	for (i = 0; i < addrlen; i++) {
+		h ^= cp[i];
+		h *= 16777619U;
+	}
+	return(&sockaddr_cache[h % SOCKADDR_CACHE_SIZE]);
+}
+
+/* returns 1 if found; then the results have been copied */
+static int sockaddr_cache_get(
+	int fd,
+	const char *realfnname,
+	const char *direction,
+	const struct sockaddr *input_addr,
+	socklen_t input_addrlen,
+	int *mapping_result,
+	int *result_errno,
+	mapped_sockaddr_t *output_addr)
+{
+	sockaddr_cache_entry_t	*e;
+	int			found = 0;
+
+	if (!sockaddr_cache_num_entries) return(0);
+	e = sockaddr_cache_slot(fd, input_addr, input_addrlen);
+	lock_sockaddr_cache();
+	if ((e->sac_fd == fd) &&
+	    (e->sac_orig_addrlen == input_addrlen) &&
+	    !strcmp(e->sac_realfnname, realfnname) &&
+	    !strcmp(e->sac_direction, direction) &&
+	    !memcmp(&e->sac_orig_addr, input_addr, input_addrlen)) {
+		*mapping_result = e->sac_mapping_result;
+		*result_errno = e->sac_errno;
+		*output_addr = e->sac_mapped_addr;
+		found = 1;
+	}
+	unlock_sockaddr_cache();
+	return(found);
+}
+
+static void sockaddr_cache_put(
+	int fd,
+	const char *realfnname,
+	const char *direction,
+	const struct sockaddr *input_addr,
+	socklen_t input_addrlen,
+	int mapping_result,
+	int result_errno,
+	const mapped_sockaddr_t *output_addr)
+{
+	sockaddr_cache_entry_t	*e;
+
+	if (input_addrlen > sizeof(e->sac_orig_addr)) return;
+	e = sockaddr_cache_slot(fd, input_addr, input_addrlen);
+	lock_sockaddr_cache();
+	if (!sockaddr_cache_initialized) {
+		int	i;
+
+		for (i = 0; i < SOCKADDR_CACHE_SIZE; i++)
+			sockaddr_cache[i].sac_fd = -1;
+		sockaddr_cache_initialized = 1;
+	}
+	if (e->sac_fd < 0) sockaddr_cache_num_entries++;
+	e->sac_fd = fd;
+	e->sac_realfnname = realfnname;
+	e->sac_direction = direction;
+	e->sac_orig_addrlen = input_addrlen;
+	memcpy(&e->sac_orig_addr, input_addr, input_addrlen);
+	e->sac_mapping_result = mapping_result;
+	e->sac_errno = result_errno;
+	e->sac_mapped_addr = *output_addr;
+	unlock_sockaddr_cache();
+}
+
+/* Called when "fd" is closed or replaced (see fdpathdb.c) */
+void sockaddr_cache_forget_fd(int fd)
+{
+	int	i;
+
+	if (!sockaddr_cache_num_entries) return;
+	lock_sockaddr_cache();
+	for (i = 0; i < SOCKADDR_CACHE_SIZE; i++) {
+		if (sockaddr_cache[i].sac_fd == fd) {
+			sockaddr_cache[i].sac_fd = -1;
+			sockaddr_cache_num_entries--;
+		}
+	}
+	unlock_sockaddr_cache();
+}
+
+/* "*cacheable_p" is cleared if the result must not be cached */
+static int map_sockaddr_uncached(
 	int *result_errno_ptr,
 	const char *realfnname,
 	const struct sockaddr *input_addr,
 	socklen_t input_addrlen,
 	mapped_sockaddr_t *output_addr,
-	const char *direction) /* "in" or "out", uset to build
-				* e.g. "ipv4_in", "ipv4_out",.. */
+	const char *direction,
+	int *cacheable_p)
 {
 	int	inet_mapping_result;
 	char	addr_type[100];
+	int	un_cacheable;
 
 	memset(output_addr, 0, sizeof(*output_addr));
+	output_addr->mapped_dirfd = -1;
 	if (input_addr) {
 		switch (input_addr->sa_family) {
 		case AF_UNIX:
@@ -369,14 +641,11 @@ static int map_sockaddr(
 
 			inet_mapping_result = map_sockaddr_un(realfnname,
 				(const struct sockaddr_un*)input_addr,
-				output_addr);
+				output_addr, &un_cacheable);
+			if (!un_cacheable) *cacheable_p = 0;
 			if (inet_mapping_result != 0) {
 				/* return error */
 				*result_errno_ptr = inet_mapping_result;
-				SB_LOG(SB_LOGLEVEL_NETWORK,
-					"%s: denied (%s), errno=%d",
-					realfnname, output_addr->orig_printable_dst_addr,
-					inet_mapping_result);
 				return(MAP_SOCKADDR_OPERATION_DENIED);
 			}
 			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: orig addr.len=%d, mapped_addrlen=%d",
@@ -398,20 +667,9 @@ static int map_sockaddr(
 			goto check_inet_mapping_result;
 
 		default:
-			snprintf(output_addr->orig_printable_dst_addr,
-				sizeof(output_addr->orig_printable_dst_addr),
-				"<Network mapping does not support this AF=%d, uses orig.address>",
-				input_addr->sa_family);
 			break;
 		}
-	} else {
-		snprintf(output_addr->orig_printable_dst_addr,
-			sizeof(output_addr->orig_printable_dst_addr),
-			"<no address>");
 	}
-	snprintf(output_addr->mapped_printable_dst_addr,
-		sizeof(output_addr->mapped_printable_dst_addr),
-		"%s", output_addr->orig_printable_dst_addr);
 	return(MAP_SOCKADDR_USE_ORIG_ADDR);
 
     check_inet_mapping_result:
@@ -419,25 +677,50 @@ static int map_sockaddr(
 	if (inet_mapping_result != 0) {
 		/* return error */
 		*result_errno_ptr = inet_mapping_result;
-		SB_LOG(SB_LOGLEVEL_NETWORK,
-			"%s: denied (%s), errno=%d",
-			realfnname, output_addr->orig_printable_dst_addr,
-			inet_mapping_result);
 		return(MAP_SOCKADDR_OPERATION_DENIED);
 	}
-	if (strcmp(output_addr->orig_printable_dst_addr,
-	    output_addr->mapped_printable_dst_addr)) {
-		SB_LOG(SB_LOGLEVEL_NETWORK,
-			"%s: allowed, address changed "
-			"(orig.addr=%s, new addr=%s)", realfnname,
-			output_addr->orig_printable_dst_addr,
-			output_addr->mapped_printable_dst_addr);
+	return(MAP_SOCKADDR_MAPPED);
+}
+
+/* "sockfd" is used for caching the result; use -1 for
+ * operations that are not repeated for the same address */
+static int map_sockaddr(
+	int *result_errno_ptr,
+	const char *realfnname,
+	int sockfd,
+	const struct sockaddr *input_addr,
+	socklen_t input_addrlen,
+	mapped_sockaddr_t *output_addr,
+	const char *direction) /* "in" or "out", uset to build
+				* e.g. "ipv4_in", "ipv4_out",.. */
+{
+	int	mapping_result;
+	int	result_errno = *result_errno_ptr;
+	int	cacheable = (sockfd >= 0) && input_addr &&
+			(input_addrlen >= sizeof(sa_family_t)) &&
+			((input_addr->sa_family == AF_INET) ||
+			 (input_addr->sa_family == AF_INET6) ||
+			 (input_addr->sa_family == AF_UNIX));
+
+	if (cacheable && sockaddr_cache_get(sockfd, realfnname, direction,
+	    input_addr, input_addrlen, &mapping_result, &result_errno,
+	    output_addr)) {
+		SB_LOG(SB_LOGLEVEL_NOISE, "%s: cached result for fd %d",
+			realfnname, sockfd);
 	} else {
-		SB_LOG(SB_LOGLEVEL_NETWORK,
-			"%s: allowed (%s)", realfnname,
-			output_addr->orig_printable_dst_addr);
+		mapping_result = map_sockaddr_uncached(&result_errno,
+			realfnname, input_addr, input_addrlen,
+			output_addr, direction, &cacheable);
+		if (cacheable)
+			sockaddr_cache_put(sockfd, realfnname, direction,
+				input_addr, input_addrlen, mapping_result,
+				result_errno, output_addr);
 	}
-	return(MAP_SOCKADDR_MAPPED);
+	if (mapping_result == MAP_SOCKADDR_OPERATION_DENIED)
+		*result_errno_ptr = result_errno;
+	log_map_sockaddr_result(realfnname, mapping_result, result_errno,
+		input_addr, output_addr);
+	return(mapping_result);
 }
 
 /* ---------- Socket API ---------- */
@@ -454,7 +737,7 @@ int bind_gate(
 	int			result;
 	mapped_sockaddr_t	mapped_addr;
 
-	switch (map_sockaddr(result_errno_ptr, realfnname,
+	switch (map_sockaddr(result_errno_ptr, realfnname, -1,
 		my_addr, addrlen, &mapped_addr, "in")) {
 	case MAP_SOCKADDR_OPERATION_DENIED:
 		return (-1);
@@ -466,6 +749,7 @@ int bind_gate(
 		*result_errno_ptr = errno;
 		log_mapped_net_op_result(realfnname, (result?errno:0),
 			&mapped_addr);
+		release_mapped_sockaddr(&mapped_addr);
 		return(result);
 	case MAP_SOCKADDR_USE_ORIG_ADDR:
 		break;
@@ -492,7 +776,7 @@ int connect_gate(
 	int			result;
 	mapped_sockaddr_t	mapped_addr;
 
-	switch (map_sockaddr(result_errno_ptr, realfnname,
+	switch (map_sockaddr(result_errno_ptr, realfnname, -1,
 		serv_addr, addrlen, &mapped_addr, "out")) {
 	case MAP_SOCKADDR_OPERATION_DENIED:
 		return (-1);
@@ -504,6 +788,7 @@ int connect_gate(
 		*result_errno_ptr = errno;
 		log_mapped_net_op_result(realfnname, (result?errno:0),
 			&mapped_addr);
+		release_mapped_sockaddr(&mapped_addr);
 		return(result);
 	case MAP_SOCKADDR_USE_ORIG_ADDR:
 		break;
@@ -536,7 +821,7 @@ ssize_t sendto_gate(
 	/* FIXME: If the socket is connected (SOCK_STREAM, SOCK_SEQPACKET)
 	 * "to" is ignored and we should not try to map it. */
 
-	switch (map_sockaddr(result_errno_ptr, realfnname,
+	switch (map_sockaddr(result_errno_ptr, realfnname, s,
 		to, tolen, &mapped_addr, "out")) {
 	case MAP_SOCKADDR_OPERATION_DENIED:
 		return (-1);
@@ -549,6 +834,7 @@ ssize_t sendto_gate(
 		*result_errno_ptr = errno;
 		log_mapped_net_op_result(realfnname, (result==-1?errno:0),
 			&mapped_addr);
+		release_mapped_sockaddr(&mapped_addr);
 		return(result);
 	case MAP_SOCKADDR_USE_ORIG_ADDR:
 		break;
@@ -581,7 +867,7 @@ ssize_t sendmsg_gate(
 		mapped_sockaddr_t	mapped_addr;
 		struct msghdr		msg2 = *msg;
 
-		switch (map_sockaddr(result_errno_ptr, realfnname,
+		switch (map_sockaddr(result_errno_ptr, realfnname, s,
 			to, msg->msg_namelen, &mapped_addr, "out")) {
 		case MAP_SOCKADDR_OPERATION_DENIED:
 			return (-1);
@@ -593,6 +879,7 @@ ssize_t sendmsg_gate(
 			*result_errno_ptr = errno;
 			log_mapped_net_op_result(realfnname, (result==-1?errno:0),
 				&mapped_addr);
+			release_mapped_sockaddr(&mapped_addr);
 			return(result);
 		case MAP_SOCKADDR_USE_ORIG_ADDR:
 			break;
@@ -608,6 +895,103 @@ ssize_t sendmsg_gate(
 	return(result);
 }
 
+/* sendmmsg() sends a batch in groups of this size, with the copies
+ * of headers and addresses in the stack. recvmmsg() allocates
+ * memory only for larger batches. */
+#define MMSG_BATCH_SIZE	16
+
+#ifdef HAVE_SENDMMSG
+int sendmmsg_gate(
+	int *result_errno_ptr,
+	int (*real_sendmmsg_ptr)(int s, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags),
+        const char *realfnname,
+	int s,
+	struct mmsghdr *msgvec,
+	unsigned int vlen,
+	int flags)
+{
+	struct mmsghdr		msgs2[MMSG_BATCH_SIZE];
+	mapped_sockaddr_t	mapped_addrs[MMSG_BATCH_SIZE];
+	unsigned int		num_sent = 0;
+
+	/* FIXME: see the comment about connected sockets in sendto_gate() */
+
+	if (!msgvec || !vlen) {
+		int	result;
+
+		errno = *result_errno_ptr; /* restore to orig.value */
+		result = (*real_sendmmsg_ptr)(s, msgvec, vlen, flags);
+		*result_errno_ptr = errno;
+		return(result);
+	}
+
+	/* Map the destinations of a group of messages, then send the
+	 * group with one call. The destinations of datagrams in a batch
+	 * are usually the same few addresses, so most of them come
+	 * from the per-socket cache (see map_sockaddr()). Like the real
+	 * function, stop at the first message that can not be sent. */
+	while (num_sent < vlen) {
+		unsigned int	n = vlen - num_sent;
+		unsigned int	num_ok;
+		unsigned int	i;
+		int		denied = 0;
+		int		result;
+
+		if (n > MMSG_BATCH_SIZE) n = MMSG_BATCH_SIZE;
+		for (num_ok = 0; num_ok < n; num_ok++) {
+			struct mmsghdr	*m = &msgvec[num_sent + num_ok];
+
+			msgs2[num_ok] = *m;
+			if (!m->msg_hdr.msg_name) continue;
+			switch (map_sockaddr(result_errno_ptr, realfnname, s,
+				(struct sockaddr*)m->msg_hdr.msg_name,
+				m->msg_hdr.msg_namelen,
+				&mapped_addrs[num_ok], "out")) {
+			case MAP_SOCKADDR_OPERATION_DENIED:
+				denied = 1;
+				break;
+			case MAP_SOCKADDR_MAPPED:
+				msgs2[num_ok].msg_hdr.msg_name =
+					&mapped_addrs[num_ok].mapped_sockaddr;
+				msgs2[num_ok].msg_hdr.msg_namelen =
+					mapped_addrs[num_ok].mapped_addrlen;
+				break;
+			default:
+				break;
+			}
+			if (denied) break;
+		}
+		if (num_ok == 0) {
+			/* the first one was denied, errno has been set */
+			if (num_sent > 0) break;
+			return(-1);
+		}
+
+		errno = *result_errno_ptr; /* restore to orig.value */
+		result = (*real_sendmmsg_ptr)(s, msgs2, num_ok, flags);
+		*result_errno_ptr = errno;
+		for (i = 0; i < num_ok; i++) {
+			if (msgs2[i].msg_hdr.msg_name == &mapped_addrs[i].mapped_sockaddr)
+				release_mapped_sockaddr(&mapped_addrs[i]);
+		}
+		if (result < 0) {
+			if (num_sent > 0) break;
+			return(result);
+		}
+		for (i = 0; i < (unsigned int)result; i++) {
+			msgvec[num_sent + i].msg_len = msgs2[i].msg_len;
+			if (msgs2[i].msg_hdr.msg_name != msgvec[num_sent + i].msg_hdr.msg_name)
+				log_mapped_net_op_result(realfnname, 0,
+					&mapped_addrs[i]);
+		}
+		num_sent += result;
+		if (((unsigned int)result < num_ok) || denied) break;
+	}
+	return((int)num_sent);
+}
+#endif
+
 static void reverse_sockaddr_un(
 	const char *realfnname,
 	struct sockaddr *from,
@@ -643,6 +1027,17 @@ static void reverse_sockaddr_un(
 		return;
 	}
 
+	if ((orig_from_size <= offsetof(struct sockaddr_un, sun_path)) ||
+	    !memchr(from_un->sun_path, '\0',
+		(*fromlen < orig_from_size ? *fromlen : orig_from_size) -
+		offsetof(struct sockaddr_un, sun_path))) {
+		/* truncated by the kernel; the path is not complete */
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			 "%s: truncated AF_UNIX address, not reversed",
+			 realfnname);
+		return;
+	}
+
 	/* a non-abstract unix domain socket address, reverse it */
 	sbox_path = scratchbox_reverse_path(realfnname, from_un->sun_path,
 			SB2_INTERFACE_CLASS_SOCKADDR);
@@ -739,6 +1134,95 @@ ssize_t recvmsg_gate(
 	return (res);
 }
 
+#ifdef HAVE_RECVMMSG
+int recvmmsg_gate(
+	int *result_errno_ptr,
+	int (*real_recvmmsg_ptr)(int s, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, struct timespec *timeout),
+        const char *realfnname,
+	int s,
+	struct mmsghdr *msgvec,
+	unsigned int vlen,
+	int flags,
+	struct timespec *timeout)
+{
+	int		res;
+	socklen_t	orig_from_sizes_buf[MMSG_BATCH_SIZE];
+	socklen_t	*orig_from_sizes = orig_from_sizes_buf;
+	int		prev_valid = 0;
+	struct sockaddr_storage	prev_orig_addr;
+	socklen_t	prev_orig_addrlen = 0;
+	socklen_t	prev_orig_from_size = 0;
+	struct sockaddr_storage	prev_reversed_addr;
+	socklen_t	prev_reversed_addrlen = 0;
+	unsigned int	i;
+
+	if (msgvec && (vlen > MMSG_BATCH_SIZE)) {
+		orig_from_sizes = malloc(vlen * sizeof(socklen_t));
+		if (!orig_from_sizes) {
+			*result_errno_ptr = ENOMEM;
+			return(-1);
+		}
+	}
+	if (msgvec) {
+		for (i = 0; i < vlen; i++)
+			orig_from_sizes[i] = msgvec[i].msg_hdr.msg_namelen;
+	}
+
+	errno = *result_errno_ptr; /* restore to orig.value */
+	res = (*real_recvmmsg_ptr)(s, msgvec, vlen, flags, timeout);
+	*result_errno_ptr = errno;
+
+	/* Reverse the AF_UNIX source addresses. Consecutive datagrams
+	 * often come from the same sender; the previous result is
+	 * reused for those. Truncated addresses (longer than the
+	 * caller's buffer) are not compared or remembered. */
+	for (i = 0; msgvec && (res > 0) && (i < (unsigned int)res); i++) {
+		struct msghdr	*mh = &msgvec[i].msg_hdr;
+		socklen_t	addrlen = mh->msg_namelen;
+
+		if (!mh->msg_name || (orig_from_sizes[i] < 1) ||
+		    (((struct sockaddr*)mh->msg_name)->sa_family != AF_UNIX)) {
+			/* nothing to reverse */
+			continue;
+		}
+		if (addrlen > orig_from_sizes[i]) {
+			reverse_sockaddr_un(realfnname, mh->msg_name,
+				orig_from_sizes[i], &(mh->msg_namelen));
+			continue;
+		}
+		if (prev_valid && (addrlen == prev_orig_addrlen) &&
+		    (orig_from_sizes[i] == prev_orig_from_size) &&
+		    !memcmp(mh->msg_name, &prev_orig_addr, addrlen)) {
+			SB_LOG(SB_LOGLEVEL_NOISE2,
+				 "%s: same sender as the previous one", realfnname);
+			memcpy(mh->msg_name, &prev_reversed_addr,
+				prev_reversed_addrlen);
+			mh->msg_namelen = prev_reversed_addrlen;
+			continue;
+		}
+
+		prev_valid = 0;
+		if (addrlen <= sizeof(prev_orig_addr))
+			memcpy(&prev_orig_addr, mh->msg_name, addrlen);
+		reverse_sockaddr_un(realfnname, mh->msg_name,
+			orig_from_sizes[i], &(mh->msg_namelen));
+		if ((addrlen <= sizeof(prev_orig_addr)) &&
+		    (mh->msg_namelen <= orig_from_sizes[i]) &&
+		    (mh->msg_namelen <= sizeof(prev_reversed_addr))) {
+			prev_orig_addrlen = addrlen;
+			prev_orig_from_size = orig_from_sizes[i];
+			prev_reversed_addrlen = mh->msg_namelen;
+			memcpy(&prev_reversed_addr, mh->msg_name,
+				prev_reversed_addrlen);
+			prev_valid = 1;
+		}
+	}
+	if (orig_from_sizes != orig_from_sizes_buf) free(orig_from_sizes);
+	return (res);
+}
+#endif
+
 int accept_gate(
 	int *result_errno_ptr,
 	int (*real_accept_ptr)(int sockfd,
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #ifdef _GNU_SOURCE
 #undef _GNU_SOURCE
@@ -41,94 +42,138 @@
 #include "libsb2.h"
 #include "exported.h"
 
-#define BLOCK_SIZE (4*1024)
-
-/*
- * We use dynamic buffer because size of the files in procfs
- * cannot been checked by stat() or lseek()
- * Note that caller must free a buffer if the function returns
- * other than zero.
+/* Files in procfs can't be sized by stat() or lseek(). The buffer is
+ * reserved with mmap() and is usually large enough for the whole
+ * environment (limited by ARG_MAX at exec), so a single read fills it;
+ * pages that are not touched cost nothing. ARG_MAX follows the stack
+ * limit, so the initial size is capped; the buffer grows if needed.
+ * Returns the number of bytes read, 0 on errors. If the result is
+ * nonzero, the caller must munmap(*buffer, *bufsize).
 */
-static size_t read_procfs_file_to_buffer(const char *path, char **buffer)
-{
-	int fd;
-	char *buf;
-	ssize_t rc = 0, total = 0;
-	size_t count = BLOCK_SIZE;
+#define PROCFS_BUFFER_MIN_SIZE	(128*1024)
+#define PROCFS_BUFFER_MAX_INITIAL_SIZE	(4*1024*1024)
 
+static size_t read_procfs_file_to_buffer(const char *path,
+	char **buffer, size_t *bufsize)
+{
+	int	fd;
+	char	*buf;
+	size_t	size;
+	long	arg_max = sysconf(_SC_ARG_MAX);
+	ssize_t	rc;
+	size_t	total = 0;
+
+	if (arg_max < PROCFS_BUFFER_MIN_SIZE)
+		size = PROCFS_BUFFER_MIN_SIZE;
+	else if (arg_max > PROCFS_BUFFER_MAX_INITIAL_SIZE)
+		size = PROCFS_BUFFER_MAX_INITIAL_SIZE;
+	else
+		size = (size_t)arg_max;
+	size++;
 	fd = open_nomap(path, O_RDONLY);
 	if (fd < 0) {
 		return(0);
 	}
 
-	buf = malloc(count);
-	if (!buf) {
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "%s: mmap(%lu) failed, errno=%d",
+			__func__, (unsigned long)size, errno);
 		close(fd);
 		return(0);
 	}
 
-	for (;;) {
-		rc = read(fd, buf + total, BLOCK_SIZE);
+	while (1) {
+		if (total == size) {
+			char	*new_buf;
+
+			new_buf = mremap(buf, size, size * 2, MREMAP_MAYMOVE);
+			if (new_buf == MAP_FAILED) {
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"%s: mremap(%lu) failed, errno=%d",
+					__func__, (unsigned long)size * 2, errno);
+				munmap(buf, size);
+				close(fd);
+				return(0);
+			}
+			buf = new_buf;
+			size *= 2;
+		}
+		rc = read(fd, buf + total, size - total);
 		if (rc == 0) {
 			/* eof */
 			break;
 		}
 		if (rc < 0) {
-			if (errno == EINTR) {
+			if (errno == EINTR)
 				continue;
-			} else {
-				free(buf);
-				close(fd);
-				return(0);
-			}
-		}
-
-		if (rc == BLOCK_SIZE) {
-			count += BLOCK_SIZE;
-			buf = realloc(buf, count);
-			if (!buf) {
-				close(fd);
-				return(0);
-			}
+			munmap(buf, size);
+			close(fd);
+			return(0);
 		}
 		total += rc;
 	}
 
 	close(fd);
+	if (total == 0) {
+		munmap(buf, size);
+		return(0);
+	}
 	*buffer = buf;
-
-	return (total);
+	*bufsize = size;
+	return(total);
 }
 
-/* different environment varibles are `\0`separated */
-static const char *read_env_variable(
+/* Returns an allocated copy of the value of environment variable "name".
+ * Different environment varibles are `\0`separated */
+static char *read_env_value(
 	const char *name, const char *buf, size_t len)
 {
-        size_t name_len = strlen(name);
-        size_t l, i = 0;
-
-        while (i < len) {
-                l = strlen(buf + i);
-                if (l > 0) {
-                        if (strncmp(buf + i, name, name_len) == 0) {
-				return(strdup(buf + i));
-                        }
-                }
-                i += l + 1;
-        }
-        return(NULL);
+	size_t name_len = strlen(name);
+	size_t l, i = 0;
+
+	while (i < len) {
+		l = strnlen(buf + i, len - i);
+		if ((l > name_len) && (buf[i + name_len] == '=') &&
+		    !strncmp(buf + i, name, name_len)) {
+			return(strndup(buf + i + name_len + 1,
+				l - name_len - 1));
+		}
+		i += l + 1;
+	}
+	return(NULL);
 }
 
-/* name=value'\0' */
-static const char *read_env_value(const char *env)
+/* Returns the start time of a process (field 22 of /proc/<pid>/stat),
+ * or 0 if it is not available. (pid,start time) identifies a process,
+ * even if the pid is reused.
+*/
+static unsigned long long read_process_start_time(const char *pid_path)
 {
-	const char *cp;
-
-	if (env == NULL) return(NULL);
-
-	cp = strchr(env, '=');
-	if (cp) return(cp + 1);
-	return(NULL);
+	char	pathbuf[PATH_MAX + sizeof("/stat")];
+	char	statbuf[1024];
+	int	fd;
+	ssize_t	len;
+	char	*cp;
+	int	field;
+
+	(void)snprintf(pathbuf, sizeof(pathbuf), "%s/stat", pid_path);
+	fd = open_nomap(pathbuf, O_RDONLY);
+	if (fd < 0) return(0);
+	len = read(fd, statbuf, sizeof(statbuf) - 1);
+	close(fd);
+	if (len <= 0) return(0);
+	statbuf[len] = '\0';
+
+	/* the command name (field 2) may contain spaces and parens */
+	cp = strrchr(statbuf, ')');
+	if (!cp) return(0);
+	for (field = 2; field < 22; field++) {
+		cp = strchr(cp + 1, ' ');
+		if (!cp) return(0);
+	}
+	return(strtoull(cp + 1, NULL, 10));
 }
 
 /* check (and create if it doesn't exits) the symlink which is used to
@@ -212,7 +257,7 @@ static char *select_exe_path_for_sb2(
 		/* lua mapping is disabled at this point, need to enable it */
 		enable_mapping(sb2if);
 		/* calculate host real path */
-		rp = canonicalize_file_name(real_binary_name);
+		rp = canonicalize_file_name(orig_binary_name);
 		disable_mapping(sb2if);
 		release_sb2context(sb2if);
 
@@ -240,6 +285,48 @@ static char *select_exe_path_for_sb2(
 	return(NULL);
 }
 
+/* Returns the replacement for an "exe" link (full_path) if the real
+ * link doesn't point to exe_path_inside_sb2, or NULL if the real link
+ * can be used. exe_path_inside_sb2 is freed.
+*/
+static char *map_exe_link(const char *full_path,
+	char *exe_path_inside_sb2, pid_t pid)
+{
+	char	pathbuf[PATH_MAX];
+	char	link_dest[PATH_MAX+1];
+	int	link_len;
+
+	/* check if the real link is OK: */
+	link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
+	if (link_len > 0) {
+		link_dest[link_len] = '\0';
+		if (!strcmp(exe_path_inside_sb2, link_dest)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"procfs_mapping: real link is ok (%s,%s)",
+				full_path, link_dest);
+			free(exe_path_inside_sb2);
+			return(NULL);
+		}
+	}
+	/* must create a replacement: */
+	if (symlink_for_exe_path(
+	    pathbuf, sizeof(pathbuf), exe_path_inside_sb2, pid)) {
+		free(exe_path_inside_sb2);
+		return(strdup(pathbuf));
+	}
+	/* oops, failed to create the replacement.
+	 * must use the real link, it points to wrong place.. */
+	free(exe_path_inside_sb2);
+	return(NULL);
+}
+
+/* The result for this process is computed once (a forked child has
+ * the same exe). procfs_exe_link_is_ok marks results where the real
+ * link can be used.
+*/
+static char procfs_exe_link_is_ok[] = "";
+static char *my_exe_mapping = NULL;
+
 static char *procfs_mapping_request_for_my_files(
 	const char *full_path, const char *base_path)
 {
@@ -247,108 +334,152 @@ static char *procfs_mapping_request_for_my_files(
 		full_path);
 
 	if (!strcmp(base_path,"exe")) {
-		const char *exe_path_inside_sb2;
-		char	pathbuf[PATH_MAX];
-		char    link_dest[PATH_MAX+1];
-		int	link_len;
-
-                exe_path_inside_sb2 = select_exe_path_for_sb2(
-			sbox_orig_binary_name, sbox_real_binary_name);
+		char	*exe_path_inside_sb2;
+		char	*result;
+		char	*cached = __atomic_load_n(&my_exe_mapping, __ATOMIC_ACQUIRE);
+		char	*expected = NULL;
+
+		if (!cached) {
+			exe_path_inside_sb2 = select_exe_path_for_sb2(
+				sbox_orig_binary_name, sbox_real_binary_name);
+			result = exe_path_inside_sb2 ?
+				map_exe_link(full_path, exe_path_inside_sb2,
+					getpid()) : NULL;
+			cached = result ? result : procfs_exe_link_is_ok;
+			if (!__atomic_compare_exchange_n(&my_exe_mapping,
+			    &expected, cached, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				/* another thread was faster */
+				if (result) free(result);
+				cached = expected;
+			}
+		}
+		if (cached == procfs_exe_link_is_ok) return(NULL);
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"procfs_mapping_request_for_my_files: => %s", cached);
+		return(strdup(cached));
+	}
+	return(NULL);
+}
 
-                if (!exe_path_inside_sb2) return(NULL);
+/* Results for other processes, identified by (pid, start time).
+ * Protected by a lock; if the lock is busy, the cache is just skipped.
+*/
+#define PROCFS_EXE_CACHE_SIZE	8
+
+static struct procfs_exe_cache_entry {
+	pid_t			pec_pid;
+	unsigned long long	pec_start_time;
+	char			*pec_result; /* or procfs_exe_link_is_ok */
+} procfs_exe_cache[PROCFS_EXE_CACHE_SIZE];
+static int procfs_exe_cache_lock = 0;
+static unsigned int procfs_exe_cache_next = 0;
+
+/* Returns 1 and sets *resultp (an allocated copy, or NULL if the real link
+ * can be used) if found from the cache, 0 if not found. */
+static int procfs_exe_cache_get(pid_t pid, unsigned long long start_time,
+	char **resultp)
+{
+	int	i;
+	int	found = 0;
 
-		/* check if the real link is OK: */
-		link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
-		if ((link_len > 0) &&
-		    !strcmp(exe_path_inside_sb2, link_dest)) {
-			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"procfs_mapping_request_for_my_files:"
-				" real link is ok (%s,%s)",
-				full_path, link_dest);
-			free((void*)exe_path_inside_sb2);
-			return(NULL);
-		}
-		/* must create a replacement: */
-		if (symlink_for_exe_path(
-		    pathbuf, sizeof(pathbuf), exe_path_inside_sb2, getpid())) {
-			free((void*)exe_path_inside_sb2);
-			return(strdup(pathbuf));
+	if (__atomic_exchange_n(&procfs_exe_cache_lock, 1, __ATOMIC_ACQUIRE))
+		return(0);
+	for (i = 0; i < PROCFS_EXE_CACHE_SIZE; i++) {
+		struct procfs_exe_cache_entry *pec = &procfs_exe_cache[i];
+
+		if (pec->pec_result && (pec->pec_pid == pid) &&
+		    (pec->pec_start_time == start_time)) {
+			*resultp = (pec->pec_result == procfs_exe_link_is_ok) ?
+				NULL : strdup(pec->pec_result);
+			found = 1;
+			break;
 		}
-		/* oops, failed to create the replacement.
-		 * must use the real link, it points to wrong place.. */
-		free((void*)exe_path_inside_sb2);
-		return(NULL);
 	}
-	return(NULL);
+	__atomic_store_n(&procfs_exe_cache_lock, 0, __ATOMIC_RELEASE);
+	return(found);
+}
+
+static void procfs_exe_cache_put(pid_t pid, unsigned long long start_time,
+	const char *result)
+{
+	struct procfs_exe_cache_entry *pec;
+	char	*new_result = result ? strdup(result) : procfs_exe_link_is_ok;
+	char	*old_result;
+
+	if (!new_result) return;
+	if (__atomic_exchange_n(&procfs_exe_cache_lock, 1, __ATOMIC_ACQUIRE)) {
+		if (result) free(new_result);
+		return;
+	}
+	pec = &procfs_exe_cache[procfs_exe_cache_next];
+	procfs_exe_cache_next = (procfs_exe_cache_next + 1) %
+		PROCFS_EXE_CACHE_SIZE;
+	old_result = pec->pec_result;
+	pec->pec_pid = pid;
+	pec->pec_start_time = start_time;
+	pec->pec_result = new_result;
+	__atomic_store_n(&procfs_exe_cache_lock, 0, __ATOMIC_RELEASE);
+
+	if (old_result && (old_result != procfs_exe_link_is_ok))
+		free(old_result);
 }
 
 static char *procfs_mapping_request_for_other_files(
-        const char *full_path, const char *base_path, const char *pid_path, pid_t pid)
+	const char *full_path, const char *base_path, const char *pid_path, pid_t pid)
 {
-        SB_LOG(SB_LOGLEVEL_DEBUG, "procfs_mapping_request_for_other_files(%s)",
-	       full_path);
-
-        if (!strcmp(base_path,"exe")) {
-                const char *exe_path_inside_sb2;
-                char    *buffer;
-                char    pathbuf[PATH_MAX];
-                char    link_dest[PATH_MAX+1];
-                int     link_len;
-                size_t  len;
-                const char *orig_binary_name;
-                const char *real_binary_name;
-
-                /* Check the process environment to find out is this 
+	SB_LOG(SB_LOGLEVEL_DEBUG, "procfs_mapping_request_for_other_files(%s)",
+		full_path);
+
+	if (!strcmp(base_path,"exe")) {
+		char	*exe_path_inside_sb2;
+		char	*buffer;
+		size_t	bufsize;
+		char	pathbuf[PATH_MAX];
+		size_t	len;
+		char	*orig_binary_name;
+		char	*real_binary_name;
+		char	*result;
+		unsigned long long start_time;
+
+		start_time = read_process_start_time(pid_path);
+		if (start_time &&
+		    procfs_exe_cache_get(pid, start_time, &result)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"procfs_mapping_request_for_other_files:"
+				" cached => %s", result ? result : "(real link)");
+			return(result);
+		}
+
+		/* Check the process environment to find out is this 
 		 * runned under sb2 
 		 */
-                (void)snprintf(pathbuf, sizeof(pathbuf), "%s/environ",
-			       pid_path);
-                len = read_procfs_file_to_buffer(pathbuf, &buffer);
-                if (len == 0) {
-                        return(NULL);
-                }
-
-                orig_binary_name = read_env_variable("__SB2_ORIG_BINARYNAME",
-                                                  buffer, len);
-                real_binary_name = read_env_variable("__SB2_REAL_BINARYNAME",
-                                                  buffer, len);
+		(void)snprintf(pathbuf, sizeof(pathbuf), "%s/environ",
+			pid_path);
+		len = read_procfs_file_to_buffer(pathbuf, &buffer, &bufsize);
+		if (len == 0) {
+			return(NULL);
+		}
 
-		/* we don't need buffer anymore */
-		free((void*)buffer);
+		orig_binary_name = read_env_value("__SB2_ORIG_BINARYNAME",
+			buffer, len);
+		real_binary_name = read_env_value("__SB2_REAL_BINARYNAME",
+			buffer, len);
 
-		orig_binary_name = read_env_value(orig_binary_name);
-		real_binary_name = read_env_value(real_binary_name);
+		/* we don't need buffer anymore */
+		munmap(buffer, bufsize);
 
-                exe_path_inside_sb2 = select_exe_path_for_sb2(
+		exe_path_inside_sb2 = select_exe_path_for_sb2(
 			orig_binary_name, real_binary_name);
-		
-                /* this is not under runned binary */
-                if (!exe_path_inside_sb2) {
-                        return(NULL);
-                }
-
-                /* check if the real link is OK: */
-                link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
-                if ((link_len > 0) &&
-                    !strcmp(exe_path_inside_sb2, link_dest)) {
-                        SB_LOG(SB_LOGLEVEL_DEBUG,
-			       "procfs_mapping_request_for_other_files:"
-			       " real link is ok (%s,%s)",
-			       full_path, link_dest);
-			free((void*)exe_path_inside_sb2);
-			return(NULL);
-		}
-		/* must create a replacement: */
-		if (symlink_for_exe_path(
-		    pathbuf, sizeof(pathbuf), exe_path_inside_sb2, pid)) {
-			free((void*)exe_path_inside_sb2);
-			return(strdup(pathbuf));
-		}
-		/* oops, failed to create the replacement.
-                 * must use the real link, it points to wrong place.. 
-		 */
-		free((void*)exe_path_inside_sb2);
-		return(NULL);
+		if (orig_binary_name) free(orig_binary_name);
+		if (real_binary_name) free(real_binary_name);
+
+		/* if this is not under sb2, the real link is used */
+		result = exe_path_inside_sb2 ?
+			map_exe_link(full_path, exe_path_inside_sb2, pid) : NULL;
+		if (start_time)
+			procfs_exe_cache_put(pid, start_time, result);
+		return(result);
 	}
 	return(NULL);
 }
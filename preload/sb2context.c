@@ -33,6 +33,7 @@
 #include "mapping.h"
 #include "sb2.h"
 #include "rule_tree.h"
+#include "rule_tree_rpc.h"
 #include "sb2_network.h"
 #include "sb2_vperm.h"
 #include "libsb2.h"
@@ -211,6 +212,19 @@ void sb2_preload_library_constructor(void)
 	SB_LOG(SB_LOGLEVEL_DEBUG, "sb2_preload_library_constructor: done");
 }
 
+/* Preload library destructor: Send the status of new files
+ * to sb2d before the process exits (see rule_tree_rpc_client.c)
+*/
+#ifndef SB2_TESTER
+#ifdef __GNUC__
+void sb2_preload_library_destructor(void) __attribute((destructor));
+#endif
+#endif /* SB2_TESTER */
+void sb2_preload_library_destructor(void)
+{
+	ruletree_rpc__vperm_flush_new_files();
+}
+
 /* Return the library interface version string (used to be Lua/C if.vrs,
  * but it is still needed even if Lua is gone)
  * Note that this function is exported from libsb2.so (for sb2-show etc): */
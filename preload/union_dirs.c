@@ -12,139 +12,697 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
-
-#ifdef _GNU_SOURCE
-#undef _GNU_SOURCE
-#include <string.h>
-#include <libgen.h>
-#define _GNU_SOURCE
-#else
 #include <string.h>
-#include <libgen.h>
-#endif
-
-#include <limits.h>
-#include <sys/param.h>
-#include <sys/file.h>
-#include <assert.h>
 
 #include "mapping.h"
 #include "sb2.h"
 #include "rule_tree.h"
 #include "libsb2.h"
 #include "exported.h"
+#include "sb2_stat.h"
 
 
-/* returns an allocated string */
-/* FIXME: This should be somewhere else! it does not belong to this file. */
-char *prep_union_dir(const char *dst_path, const char **src_paths, int num_real_dir_entries)
-{
-	DIR *d = NULL;
-	struct dirent *de;
-	int count = 0;
-	int i;
-	char *udir_name;
-	char *cp;
-	int slash_count = 0;
-	char *mod_dst_path = NULL;
-	char *result_path;
-
-	if (num_real_dir_entries < 1) goto error_out;
-
-	SB_LOG(SB_LOGLEVEL_DEBUG,
-		"prep_union_dir: dst=%s #%d source directories",
-		dst_path, num_real_dir_entries);
-
-	/* add number of slashes to the path. this makes it possible
-	 * to have union directories that have other union directories
-	 * as subdirectories (because the names in the directories
-	 * always refer to ordinary, empty files).
-	*/
-	mod_dst_path = strdup(dst_path);
-	cp = mod_dst_path;
-	while(*cp) {
-		if (*cp == '/') slash_count++;
-		cp++;
-	}
-	if (asprintf(&udir_name, "%s/uniondirs/%d", sbox_session_dir, slash_count) < 0)
-		goto asprint_failed_error_out;
-	SB_LOG(SB_LOGLEVEL_DEBUG, "prep_union_dir: mkdir(%s)", udir_name);
-	mkdir_nomap_nolog(udir_name, 0700);
-	free(udir_name);
-	
-	/* this is same as mkdir -p, effectively */
-	cp = mod_dst_path;
-	while(*cp == '/') *cp++ = '@'; /* replace leading slashes */
-	do {
-		if(cp && *cp) {
-			cp = strchr(cp, '/');
-			if (cp) *cp = '\0'; /* temporarily terminate the string here */
-		}
-		if (asprintf(&udir_name, "%s/uniondirs/%d/%s",
-			 sbox_session_dir, slash_count, mod_dst_path) < 0)
-				goto asprint_failed_error_out;
-		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: mkdir(%s)", udir_name);
-		mkdir_nomap_nolog(udir_name, 0700);
-		free(udir_name);
-		if (cp) *cp++ = '/'; /* restore the slash, if there is more */
-	} while(cp);
+/* Union directories: A directory which contains the names from all
+ * component directories of a rule (SB2_RULETREE_FSRULE_ACTION_UNION_DIR).
+ *
+ * The path of an union directory is mapped to the first component
+ * directory that exists, so stat() etc. see that directory. When an
+ * union directory is opened with opendir() or fdopendir(), the DIR
+ * handle is registered here, and the readdir() family returns a merged
+ * view of all component directories instead of the contents of the
+ * first one: The names are read when the first entry is requested
+ * (and again after rewinddir()), sorted, and duplicates are dropped so
+ * that the entry from the first component wins. Nothing is written to
+ * the session directory, and memory is needed only while the
+ * directory is open.
+ *
+ * scandir() uses glibc's internal readdir, so it is implemented here
+ * for union directories, too.
+ *
+ * N.B. getdents() is not virtualized; it returns the first component.
+*/
 
-	for (i = 0; i < num_real_dir_entries; i++) {
-		const char *src_path = src_paths[i];
+#ifdef HAVE_READDIR64
+typedef struct dirent64 component_dirent_t;
+#define readdir_component(d) readdir64_nomap_nolog(d)
+#else
+typedef struct dirent component_dirent_t;
+#define readdir_component(d) readdir_nomap_nolog(d)
+#endif
 
-		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: src dir '%s'", src_path);
+typedef struct union_dir_entry_s {
+	char		*ude_name;
+	uint64_t	ude_ino;
+	unsigned char	ude_type;
+	uint32_t	ude_component;
+} union_dir_entry_t;
 
-		if ( (d = opendir_nomap_nolog(src_path)) == NULL )
-			continue;
+typedef struct union_dir_stream_s {
+	struct union_dir_stream_s	*uds_next;
+	DIR				*uds_dirp;
+	ruletree_object_offset_t	uds_component_list;
+
+	union_dir_entry_t	*uds_entries;	/* NULL if not read yet */
+	long			uds_num_entries;
+	long			uds_pos;
+
+	/* readdir() results */
+	struct dirent		uds_dirent;
+#ifdef HAVE_READDIR64
+	struct dirent64		uds_dirent64;
+#endif
+} union_dir_stream_t;
+
+/* All open union directories. The list is short (usually empty),
+ * and protected by a mutex; union_dir_num_streams makes it possible
+ * to skip the lookup when nothing is registered.
+*/
+static union_dir_stream_t *union_dir_streams = NULL;
+static pthread_mutex_t union_dir_streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int union_dir_num_streams = 0;
+
+static void lock_union_dir_streams(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&union_dir_streams_mutex);
+}
 
+static void unlock_union_dir_streams(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&union_dir_streams_mutex);
+}
+
+static const char *union_dir_component(
+	ruletree_object_offset_t component_list, uint32_t n)
+{
+	ruletree_object_offset_t str_offs;
+
+	str_offs = ruletree_objectlist_get_item(component_list, n);
+	if (!str_offs) return(NULL);
+	return(offset_to_ruletree_string_ptr(str_offs, NULL));
+}
+
+/* Map an union directory: Returns an allocated copy of the path of the
+ * first component directory that exists, or the first component if
+ * none of them exists (the caller will then get ENOENT from it).
+*/
+char *union_dir_map_path(ruletree_object_offset_t component_list)
+{
+	uint32_t	num_components;
+	uint32_t	i;
+	const char	*first_component = NULL;
+
+	num_components = ruletree_objectlist_get_list_size(component_list);
+	for (i = 0; i < num_components; i++) {
+		const char	*src_path = union_dir_component(component_list, i);
+		struct stat64	statbuf;
+
+		if (!src_path) continue;
 		SB_LOG(SB_LOGLEVEL_DEBUG,
-			"prep_union_dir: opened src dir '%s'", src_path);
+			"union_dir_map_path: src_path[%u]: %s", i, src_path);
+		if (!first_component) first_component = src_path;
+		if ((real_stat64(src_path, &statbuf) == 0) &&
+		    S_ISDIR(statbuf.st_mode))
+			return(strdup(src_path));
+	}
+	return(first_component ? strdup(first_component) : NULL);
+}
+
+/* Returns the component list if "rule_offs" is an union directory rule,
+ * or 0 if not */
+static ruletree_object_offset_t union_dir_component_list(
+	ruletree_object_offset_t rule_offs)
+{
+	ruletree_fsrule_t	*rule;
+
+	if (!rule_offs) return(0);
+	rule = offset_to_ruletree_fsrule_ptr(rule_offs);
+	if (!rule ||
+	    (rule->rtree_fsr_action_type != SB2_RULETREE_FSRULE_ACTION_UNION_DIR))
+		return(0);
+	return(rule->rtree_fsr_rule_list_link);
+}
+
+/* Called after a directory has been opened. Registers the stream if
+ * the mapping rule was an union directory rule.
+*/
+void union_dir_register_stream(DIR *dirp, ruletree_object_offset_t rule_offs)
+{
+	ruletree_object_offset_t	component_list;
+	union_dir_stream_t	*uds;
 
-		while ( (de = readdir(d)) != NULL) { /* get one dirent at a time */
-			int fd;
-			char *tmp_name;
+	if (!dirp) return;
+	component_list = union_dir_component_list(rule_offs);
+	if (!component_list) return;
 
-			if (de->d_name[0] == '.') {
-				if (de->d_name[1] == '\0') continue;
-				if ((de->d_name[1] == '.') &&
-				    (de->d_name[2] == '\0')) continue;
+	uds = calloc(1, sizeof(*uds));
+	if (!uds) return;
+	uds->uds_dirp = dirp;
+	uds->uds_component_list = component_list;
+
+	lock_union_dir_streams();
+	uds->uds_next = union_dir_streams;
+	union_dir_streams = uds;
+	__atomic_add_fetch(&union_dir_num_streams, 1, __ATOMIC_RELEASE);
+	unlock_union_dir_streams();
+	SB_LOG(SB_LOGLEVEL_DEBUG, "union_dir_register_stream: %p", (void*)dirp);
+}
+
+/* Find the union directory state of an open directory. If "unlink" is
+ * set, the state is removed from the list (and must be freed by
+ * the caller). Returns NULL if dirp is not an union directory.
+*/
+static union_dir_stream_t *find_union_dir_stream(DIR *dirp, int unlink)
+{
+	union_dir_stream_t	**udsp;
+	union_dir_stream_t	*uds = NULL;
+
+	if (__atomic_load_n(&union_dir_num_streams, __ATOMIC_ACQUIRE) == 0)
+		return(NULL);
+	lock_union_dir_streams();
+	for (udsp = &union_dir_streams; *udsp; udsp = &(*udsp)->uds_next) {
+		if ((*udsp)->uds_dirp == dirp) {
+			uds = *udsp;
+			if (unlink) {
+				*udsp = uds->uds_next;
+				__atomic_sub_fetch(&union_dir_num_streams, 1,
+					__ATOMIC_RELEASE);
 			}
-			if (asprintf(&tmp_name, "%s/uniondirs/%d/%s/%s",
-				sbox_session_dir, slash_count,
-				mod_dst_path, de->d_name) < 0) {
-					closedir(d);
-					goto asprint_failed_error_out;
-				}
-			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"prep_union_dir: tmp=%s", tmp_name);
+			break;
+		}
+	}
+	unlock_union_dir_streams();
+	return(uds);
+}
+
+static void free_union_dir_entries(union_dir_stream_t *uds)
+{
+	long	i;
+
+	if (uds->uds_entries) {
+		for (i = 0; i < uds->uds_num_entries; i++)
+			free(uds->uds_entries[i].ude_name);
+		free(uds->uds_entries);
+	}
+	uds->uds_entries = NULL;
+	uds->uds_num_entries = 0;
+}
+
+static int compare_union_dir_entries(const void *a, const void *b)
+{
+	const union_dir_entry_t	*ea = a;
+	const union_dir_entry_t	*eb = b;
+	int	r = strcmp(ea->ude_name, eb->ude_name);
+
+	if (r) return(r);
+	/* same name: the earlier component first */
+	return((ea->ude_component > eb->ude_component) -
+		(ea->ude_component < eb->ude_component));
+}
+
+/* Read names from all component directories to memory.
+ * Returns 0 if OK, -1 if out of memory.
+*/
+static int load_union_dir_entries(union_dir_stream_t *uds)
+{
+	uint32_t	num_components;
+	uint32_t	c;
+	long		max_entries = 0;
+	long		n = 0;
+	long		i;
+	union_dir_entry_t	*entries = NULL;
 
-			fd = creat_nomap(tmp_name, 0644);
+	num_components = ruletree_objectlist_get_list_size(uds->uds_component_list);
+	for (c = 0; c < num_components; c++) {
+		const char		*src_path;
+		DIR			*d;
+		component_dirent_t	*de;
+
+		src_path = union_dir_component(uds->uds_component_list, c);
+		if (!src_path) continue;
+		if ((d = opendir_nomap_nolog(src_path)) == NULL) {
 			SB_LOG(SB_LOGLEVEL_DEBUG,
-				"prep_union_dir: fd=%d", fd);
-			close(fd);
+				"union_dir: can't open '%s'", src_path);
+			continue;
+		}
+		while ((de = readdir_component(d)) != NULL) {
+			if (n >= max_entries) {
+				union_dir_entry_t *new_entries;
+
+				max_entries = max_entries ? 2 * max_entries : 64;
+				new_entries = realloc(entries,
+					max_entries * sizeof(*entries));
+				if (!new_entries) goto out_of_memory;
+				entries = new_entries;
+			}
+			entries[n].ude_name = strdup(de->d_name);
+			if (!entries[n].ude_name) goto out_of_memory;
+			entries[n].ude_ino = de->d_ino;
+			entries[n].ude_type = de->d_type;
+			entries[n].ude_component = c;
+			n++;
+		}
+		closedir_nomap_nolog(d);
+		continue;
+
+	    out_of_memory:
+		closedir_nomap_nolog(d);
+		for (i = 0; i < n; i++) free(entries[i].ude_name);
+		if (entries) free(entries);
+		SB_LOG(SB_LOGLEVEL_ERROR, "union_dir: out of memory");
+		return(-1);
+	}
+
+	if (n > 1) {
+		long	kept = 1;
 
-			free(tmp_name);
-			count++;
+		qsort(entries, n, sizeof(*entries), compare_union_dir_entries);
+		for (i = 1; i < n; i++) {
+			if (!strcmp(entries[i].ude_name,
+			    entries[kept-1].ude_name)) {
+				free(entries[i].ude_name);
+			} else {
+				entries[kept++] = entries[i];
+			}
 		}
-		closedir(d);
+		n = kept;
 	}
-	if (!count) goto error_out;
+	uds->uds_entries = entries;
+	uds->uds_num_entries = n;
+	if (uds->uds_pos > n) uds->uds_pos = n;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "union_dir: %ld names from %u directories",
+		n, num_components);
+	return(0);
+}
+
+/* Returns the next entry, or NULL at the end of the directory */
+static union_dir_entry_t *next_union_dir_entry(union_dir_stream_t *uds)
+{
+	if (!uds->uds_entries && load_union_dir_entries(uds) < 0)
+		return(NULL);
+	if (uds->uds_pos >= uds->uds_num_entries)
+		return(NULL);
+	return(&uds->uds_entries[uds->uds_pos++]);
+}
+
+static void union_dir_entry_to_dirent(union_dir_stream_t *uds,
+	const union_dir_entry_t *ude, struct dirent *de)
+{
+	size_t	len = strlen(ude->ude_name);
+
+	if (len >= sizeof(de->d_name)) len = sizeof(de->d_name) - 1;
+	de->d_ino = ude->ude_ino;
+	de->d_off = uds->uds_pos;
+	de->d_reclen = sizeof(*de);
+	de->d_type = ude->ude_type;
+	memcpy(de->d_name, ude->ude_name, len);
+	de->d_name[len] = '\0';
+}
 
-	if (asprintf(&result_path, "%s/uniondirs/%d/%s",
-		sbox_session_dir, slash_count, mod_dst_path) < 0)
-			goto asprint_failed_error_out;
-	free(mod_dst_path);
-	return result_path;
+#ifdef HAVE_READDIR64
+static void union_dir_entry_to_dirent64(union_dir_stream_t *uds,
+	const union_dir_entry_t *ude, struct dirent64 *de)
+{
+	size_t	len = strlen(ude->ude_name);
 
-    asprint_failed_error_out:
-	SB_LOG(SB_LOGLEVEL_ERROR, "asprintf failed to allocate memory");
-    error_out:
-	if(mod_dst_path) free(mod_dst_path);
-	return NULL;
+	if (len >= sizeof(de->d_name)) len = sizeof(de->d_name) - 1;
+	de->d_ino = ude->ude_ino;
+	de->d_off = uds->uds_pos;
+	de->d_reclen = sizeof(*de);
+	de->d_type = ude->ude_type;
+	memcpy(de->d_name, ude->ude_name, len);
+	de->d_name[len] = '\0';
 }
+#endif
+
+/* Add an entry to a scandir() result list. Returns 0 if OK,
+ * -1 if out of memory */
+static int add_to_namelist(void ***namelistp, size_t *num_p, size_t *max_p,
+	const void *de, size_t de_size)
+{
+	void	*copy;
 
+	if (*num_p >= *max_p) {
+		void	**new_list;
+		size_t	new_max = *max_p ? 2 * *max_p : 32;
+
+		new_list = realloc(*namelistp, new_max * sizeof(void *));
+		if (!new_list) return(-1);
+		*namelistp = new_list;
+		*max_p = new_max;
+	}
+	copy = malloc(de_size);
+	if (!copy) return(-1);
+	memcpy(copy, de, de_size);
+	(*namelistp)[(*num_p)++] = copy;
+	return(0);
+}
+
+static void free_namelist(void **namelist, size_t num)
+{
+	size_t	i;
+
+	for (i = 0; i < num; i++) free(namelist[i]);
+	if (namelist) free(namelist);
+}
+
+/* Returns the component list if scandir() of "mapped_dir" must read
+ * an union directory, 0 if the real scandir() can be used. */
+static ruletree_object_offset_t scandir_union_dir_components(
+	const mapping_results_t *mapped_dir)
+{
+	ruletree_object_offset_t	component_list;
+	struct stat64	statbuf;
+
+	component_list = union_dir_component_list(mapped_dir->mres_rule_offs);
+	if (!component_list || !mapped_dir->mres_result_path) return(0);
+	/* errors come from the real function */
+	if ((real_stat64(mapped_dir->mres_result_path, &statbuf) < 0) ||
+	    !S_ISDIR(statbuf.st_mode))
+		return(0);
+	return(component_list);
+}
+
+/* ---------- Gates ---------- */
+
+#ifdef HAVE_FDOPENDIR
+DIR *fdopendir_gate(
+	int *result_errno_ptr,
+	DIR *(*real_fdopendir_ptr)(int fd),
+	const char *realfnname,
+	int fd)
+{
+	DIR	*ret;
+
+	(void)realfnname;
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_fdopendir_ptr)(fd);
+	*result_errno_ptr = errno;
+	if (ret) {
+		fdpathdb_entry_t	*dir_entry = fdpathdb_get_entry(fd);
+
+		if (dir_entry) {
+			union_dir_register_stream(ret, dir_entry->fpe_rule_offs);
+			free(dir_entry);
+		}
+	}
+	return(ret);
+}
+#endif
+
+int closedir_gate(
+	int *result_errno_ptr,
+	int (*real_closedir_ptr)(DIR *dirp),
+	const char *realfnname,
+	DIR *dirp)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 1);
+	int	ret;
+
+	(void)realfnname;
+	if (uds) {
+		free_union_dir_entries(uds);
+		free(uds);
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_closedir_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+struct dirent *readdir_gate(
+	int *result_errno_ptr,
+	struct dirent *(*real_readdir_ptr)(DIR *dirp),
+	const char *realfnname,
+	DIR *dirp)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+	union_dir_entry_t	*ude;
+	struct dirent		*ret;
+
+	(void)realfnname;
+	if (uds) {
+		ude = next_union_dir_entry(uds);
+		if (!ude) return(NULL);
+		union_dir_entry_to_dirent(uds, ude, &uds->uds_dirent);
+		return(&uds->uds_dirent);
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_readdir_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+int readdir_r_gate(
+	int *result_errno_ptr,
+	int (*real_readdir_r_ptr)(DIR *dirp, struct dirent *entry,
+		struct dirent **result),
+	const char *realfnname,
+	DIR *dirp,
+	struct dirent *entry,
+	struct dirent **result)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+	union_dir_entry_t	*ude;
+	int	ret;
+
+	(void)realfnname;
+	if (uds) {
+		ude = next_union_dir_entry(uds);
+		if (!ude) {
+			*result = NULL;
+			return(0);
+		}
+		union_dir_entry_to_dirent(uds, ude, entry);
+		*result = entry;
+		return(0);
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_readdir_r_ptr)(dirp, entry, result);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+#ifdef HAVE_READDIR64
+struct dirent64 *readdir64_gate(
+	int *result_errno_ptr,
+	struct dirent64 *(*real_readdir64_ptr)(DIR *dirp),
+	const char *realfnname,
+	DIR *dirp)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+	union_dir_entry_t	*ude;
+	struct dirent64		*ret;
+
+	(void)realfnname;
+	if (uds) {
+		ude = next_union_dir_entry(uds);
+		if (!ude) return(NULL);
+		union_dir_entry_to_dirent64(uds, ude, &uds->uds_dirent64);
+		return(&uds->uds_dirent64);
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_readdir64_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+int readdir64_r_gate(
+	int *result_errno_ptr,
+	int (*real_readdir64_r_ptr)(DIR *dirp, struct dirent64 *entry,
+		struct dirent64 **result),
+	const char *realfnname,
+	DIR *dirp,
+	struct dirent64 *entry,
+	struct dirent64 **result)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+	union_dir_entry_t	*ude;
+	int	ret;
+
+	(void)realfnname;
+	if (uds) {
+		ude = next_union_dir_entry(uds);
+		if (!ude) {
+			*result = NULL;
+			return(0);
+		}
+		union_dir_entry_to_dirent64(uds, ude, entry);
+		*result = entry;
+		return(0);
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_readdir64_r_ptr)(dirp, entry, result);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+#endif
+
+void rewinddir_gate(
+	int *result_errno_ptr,
+	void (*real_rewinddir_ptr)(DIR *dirp),
+	const char *realfnname,
+	DIR *dirp)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+
+	(void)realfnname;
+	if (uds) {
+		/* names will be read again from the component dirs */
+		free_union_dir_entries(uds);
+		uds->uds_pos = 0;
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	(*real_rewinddir_ptr)(dirp);
+	*result_errno_ptr = errno;
+}
+
+long telldir_gate(
+	int *result_errno_ptr,
+	long (*real_telldir_ptr)(DIR *dirp),
+	const char *realfnname,
+	DIR *dirp)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+	long	ret;
+
+	(void)realfnname;
+	if (uds) return(uds->uds_pos);
+	errno = *result_errno_ptr; /* restore to orig.value */
+	ret = (*real_telldir_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+void seekdir_gate(
+	int *result_errno_ptr,
+	void (*real_seekdir_ptr)(DIR *dirp, long loc),
+	const char *realfnname,
+	DIR *dirp,
+	long loc)
+{
+	union_dir_stream_t	*uds = find_union_dir_stream(dirp, 0);
+
+	(void)realfnname;
+	if (uds) {
+		if (loc < 0) loc = 0;
+		if (uds->uds_entries && (loc > uds->uds_num_entries))
+			loc = uds->uds_num_entries;
+		uds->uds_pos = loc;
+		return;
+	}
+	errno = *result_errno_ptr; /* restore to orig.value */
+	(*real_seekdir_ptr)(dirp, loc);
+	*result_errno_ptr = errno;
+}
+
+#ifdef HAVE_LINUX_SCANDIR
+int scandir_gate(
+	int *result_errno_ptr,
+	int (*real_scandir_ptr)(const char *dir, struct dirent ***namelist,
+		int(*filter)(const struct dirent *),
+		int(*compar)(scandir_arg_t *, scandir_arg_t *)),
+	const char *realfnname,
+	const mapping_results_t *mapped_dir,
+	struct dirent ***namelist,
+	int(*filter)(const struct dirent *),
+	int(*compar)(scandir_arg_t *, scandir_arg_t *))
+{
+	union_dir_stream_t	uds;
+	union_dir_entry_t	*ude;
+	void	**list = NULL;
+	size_t	num = 0;
+	size_t	max = 0;
+	int	ret;
+
+	(void)realfnname;
+	memset(&uds, 0, sizeof(uds));
+	uds.uds_component_list = scandir_union_dir_components(mapped_dir);
+	if (!uds.uds_component_list) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_scandir_ptr)(mapped_dir->mres_result_path,
+			namelist, filter, compar);
+		*result_errno_ptr = errno;
+		return(ret);
+	}
+
+	if (load_union_dir_entries(&uds) < 0) goto out_of_memory;
+	while ((ude = next_union_dir_entry(&uds)) != NULL) {
+		union_dir_entry_to_dirent(&uds, ude, &uds.uds_dirent);
+		if (filter && !(*filter)(&uds.uds_dirent)) continue;
+		if (add_to_namelist(&list, &num, &max,
+		    &uds.uds_dirent, sizeof(uds.uds_dirent)) < 0)
+			goto out_of_memory;
+	}
+	free_union_dir_entries(&uds);
+	if (compar && (num > 1))
+		qsort(list, num, sizeof(*list),
+			(int (*)(const void *, const void *))compar);
+	*namelist = (struct dirent **)list;
+	return((int)num);
+
+    out_of_memory:
+	free_union_dir_entries(&uds);
+	free_namelist(list, num);
+	*result_errno_ptr = ENOMEM;
+	return(-1);
+}
+#endif
+
+#ifdef HAVE_SCANDIR64
+int scandir64_gate(
+	int *result_errno_ptr,
+	int (*real_scandir64_ptr)(const char *dir, struct dirent64 ***namelist,
+		int(*filter)(const struct dirent64 *),
+		int(*compar)(scandir64_arg_t *, scandir64_arg_t *)),
+	const char *realfnname,
+	const mapping_results_t *mapped_dir,
+	struct dirent64 ***namelist,
+	int(*filter)(const struct dirent64 *),
+	int(*compar)(scandir64_arg_t *, scandir64_arg_t *))
+{
+	union_dir_stream_t	uds;
+	union_dir_entry_t	*ude;
+	void	**list = NULL;
+	size_t	num = 0;
+	size_t	max = 0;
+	int	ret;
+
+	(void)realfnname;
+	memset(&uds, 0, sizeof(uds));
+	uds.uds_component_list = scandir_union_dir_components(mapped_dir);
+	if (!uds.uds_component_list) {
+		errno = *result_errno_ptr; /* restore to orig.value */
+		ret = (*real_scandir64_ptr)(mapped_dir->mres_result_path,
+			namelist, filter, compar);
+		*result_errno_ptr = errno;
+		return(ret);
+	}
+
+	if (load_union_dir_entries(&uds) < 0) goto out_of_memory;
+	while ((ude = next_union_dir_entry(&uds)) != NULL) {
+		union_dir_entry_to_dirent64(&uds, ude, &uds.uds_dirent64);
+		if (filter && !(*filter)(&uds.uds_dirent64)) continue;
+		if (add_to_namelist(&list, &num, &max,
+		    &uds.uds_dirent64, sizeof(uds.uds_dirent64)) < 0)
+			goto out_of_memory;
+	}
+	free_union_dir_entries(&uds);
+	if (compar && (num > 1))
+		qsort(list, num, sizeof(*list),
+			(int (*)(const void *, const void *))compar);
+	*namelist = (struct dirent64 **)list;
+	return((int)num);
+
+    out_of_memory:
+	free_union_dir_entries(&uds);
+	free_namelist(list, num);
+	*result_errno_ptr = ENOMEM;
+	return(-1);
+}
+#endif
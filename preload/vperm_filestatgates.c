@@ -29,6 +29,10 @@
 #include "rule_tree.h"
 #include "rule_tree_rpc.h"
 
+#ifdef HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
+
 static int get_stat_for_fxxat64(
 	const char *realfnname,
 	int dirfd,
@@ -56,7 +60,7 @@ static void vperm_clear_all_if_virtualized(
 	inodesimu_t			istat_struct;
 
 	ruletree_init_inodestat_handle(&handle, statbuf->st_dev, statbuf->st_ino);
-	if (ruletree_find_inodestat(&handle, &istat_struct) == 0) {
+	if (vperm_find_inodestat(&handle, &istat_struct) == 0) {
 		/* vperms exist for this inode */
 		if (istat_struct.inodesimu_active_fields != 0) {
 			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: clear dev=%llu ino=%llu", 
@@ -254,6 +258,72 @@ int __fxstatat64_gate(int *result_errno_ptr,
 	return(res);
 }
 
+#ifdef HAVE_STATX
+/* ======================= statx() ======================= */
+
+/* the fields of struct statx that can be virtualized */
+#define STATX_VPERM_FIELDS (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID)
+
+int statx_gate(int *result_errno_ptr,
+	int (*real_statx_ptr)(int dirfd, const char *pathname, int flags, unsigned int mask, struct statx *statxbuf),
+	const char *realfnname,
+	int dirfd,
+	const mapping_results_t *mapped_pathname,
+	int flags,
+	unsigned int mask,
+	struct statx *statxbuf)
+{
+	int		res;
+	int		virtualize;
+	struct stat64	buf64;
+
+	/* The caller tells which fields it needs. If none of
+	 * them can be virtualized, don't look for the inodestat
+	 * at all. Otherwise the inode number is needed, too. */
+	virtualize = ((mask & STATX_VPERM_FIELDS) != 0);
+
+	errno = *result_errno_ptr; /* restore to orig.value */
+	res = (*real_statx_ptr)(dirfd, mapped_pathname->mres_result_path,
+		flags, (virtualize ? (mask | STATX_INO) : mask), statxbuf);
+	if (res < 0) {
+		*result_errno_ptr = errno;
+		return(res);
+	}
+	if (!virtualize) return(res);
+	if (!(statxbuf->stx_mask & STATX_INO)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: no inode number, can't virtualize",
+			realfnname);
+		return(res);
+	}
+
+	memset(&buf64, 0, sizeof(buf64));
+	buf64.st_dev = makedev(statxbuf->stx_dev_major, statxbuf->stx_dev_minor);
+	buf64.st_ino = statxbuf->stx_ino;
+	buf64.st_mode = statxbuf->stx_mode;
+	buf64.st_uid = statxbuf->stx_uid;
+	buf64.st_gid = statxbuf->stx_gid;
+	buf64.st_rdev = makedev(statxbuf->stx_rdev_major, statxbuf->stx_rdev_minor);
+
+	if (i_virtualize_struct_stat(realfnname, NULL, &buf64) > 0) {
+		/* copy back only what statx() reported */
+		if (statxbuf->stx_mask & STATX_UID)
+			statxbuf->stx_uid = buf64.st_uid;
+		if (statxbuf->stx_mask & STATX_GID)
+			statxbuf->stx_gid = buf64.st_gid;
+		if (statxbuf->stx_mask & STATX_MODE)
+			statxbuf->stx_mode = (statxbuf->stx_mode & S_IFMT) |
+				(buf64.st_mode & ~S_IFMT);
+		if (statxbuf->stx_mask & STATX_TYPE) {
+			statxbuf->stx_mode = (statxbuf->stx_mode & ~S_IFMT) |
+				(buf64.st_mode & S_IFMT);
+			statxbuf->stx_rdev_major = major(buf64.st_rdev);
+			statxbuf->stx_rdev_minor = minor(buf64.st_rdev);
+		}
+	}
+	return(res);
+}
+#endif
+
 /* ======================= chown() variants ======================= */
 
 static void vperm_chown(
@@ -308,7 +378,7 @@ int fchownat_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			/* there are active vperm inodestat nodes */
 			if (get_stat_for_fxxat64(realfnname, dirfd, mapped_filename, flags, &statbuf) == 0) {
 				/* since the real function succeeds, vperm_chown() will now
@@ -351,7 +421,7 @@ int chown_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			/* there are active vperm inodestat nodes */
 			if (real_stat64(mapped_filename->mres_result_path, &statbuf) == 0) {
 				/* since the real function succeeds, vperm_chown() will now
@@ -392,7 +462,7 @@ int lchown_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			/* there are active vperm inodestat nodes */
 			if (real_lstat64(mapped_filename->mres_result_path, &statbuf) == 0) {
 				/* since the real function succeeds, vperm_chown() will now
@@ -433,7 +503,7 @@ int fchown_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			/* there are active vperm inodestat nodes */
 			if (real_fstat64(fd, &statbuf) == 0) {
 				/* since the real function succeeds, vperm_chown() will now
@@ -495,7 +565,7 @@ static int vperm_chmod_if_simulated_device(
 	inodesimu_t			istat_struct;
 
 	ruletree_init_inodestat_handle(&handle, statbuf->st_dev, statbuf->st_ino);
-	if (ruletree_find_inodestat(&handle, &istat_struct) == 0) {
+	if (vperm_find_inodestat(&handle, &istat_struct) == 0) {
 		/* vperms exist for this inode */
 		if (istat_struct.inodesimu_active_fields & RULETREE_INODESTAT_SIM_DEVNODE) {
 			/* A simulated device; never set real mode for this,
@@ -536,7 +606,7 @@ static void vperm_chmod_prepare(
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %s", __func__, realfnname);
 
 	/* A simulated device => don't change real mode at all.*/
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		if (vperm_stat_for_chmod(realfnname, fd, mapped_filename, flags, buf) == 0) {
 			*has_stat = 1;
 			if (vperm_chmod_if_simulated_device(realfnname, buf, mode,
@@ -614,7 +684,7 @@ static int vperm_chmod_done_update_state(
 	if (suid_sgid_bits ||
 	    forced_owner_rights ||
 	    ((res < 0) && ( e == EPERM)) ||
-	    ((res == 0) && (get_vperm_num_active_inodestats() > 0))) {
+	    ((res == 0) && (vperm_num_active_inodestats() > 0))) {
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: set vperms", __func__);
 
 		if (vperm_stat_for_chmod(realfnname, fd, mapped_filename, flags, &statbuf) == 0) {
@@ -819,7 +889,7 @@ int __xmknod_gate(int *result_errno_ptr,
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: real fn: ok", __func__);
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			struct stat64 statbuf;
 			/* there are active vperm inodestat nodes */
 			if (real_stat64(mapped_filename->mres_result_path, &statbuf) == 0) {
@@ -860,7 +930,7 @@ int __xmknodat_gate(int *result_errno_ptr,
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: real fn: ok", __func__);
 		/* OK, success. */
 		/* If this inode has been virtualized, update DB */
-		if (get_vperm_num_active_inodestats() > 0) {
+		if (vperm_num_active_inodestats() > 0) {
 			struct stat64 statbuf;
 			/* there are active vperm inodestat nodes */
 			if (get_stat_for_fxxat64(realfnname, dirfd, mapped_filename, 0, &statbuf) == 0) {
@@ -897,7 +967,7 @@ int unlink_gate(int *result_errno_ptr,
 	int res;
 
 	/* If this inode has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (real_stat64(mapped_filename->mres_result_path, &statbuf) == 0) {
 			has_stat = 1;
@@ -928,7 +998,7 @@ int remove_gate(int *result_errno_ptr,
 	int res;
 
 	/* If this inode has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (real_stat64(mapped_filename->mres_result_path, &statbuf) == 0) {
 			has_stat = 1;
@@ -960,7 +1030,7 @@ int rmdir_gate(int *result_errno_ptr,
 	int res;
 
 	/* If this inode has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (real_stat64(mapped_filename->mres_result_path, &statbuf) == 0) {
 			has_stat = 1;
@@ -993,7 +1063,7 @@ int unlinkat_gate(int *result_errno_ptr,
 	int res;
 
 	/* If this inode has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (get_stat_for_fxxat64(realfnname, dirfd, mapped_filename, 0, &statbuf) == 0) {
 			has_stat = 1;
@@ -1016,18 +1086,66 @@ int unlinkat_gate(int *result_errno_ptr,
 
 /* ======================= mkdir() variants ======================= */
 
+/* Set simulated owner and group of a new file.
+ * If the file was created by open(), "new_fd" is the file descriptor
+ * and the status of the new inode is queued until it is closed
+ * (see ruletree_rpc__vperm_new_file()); nothing is sent
+ * if stat() would show the same owner and group without an entry.
+*/
 static void vperm_set_owner_and_group(
 	int dirfd,
 	const char *realfnname,
-	const mapping_results_t *mapped_pathname)
+	const mapping_results_t *mapped_pathname,
+	int new_fd)
 {
 	struct stat64 statbuf;
+	ruletree_inodestat_handle_t	handle;
+	inodesimu_t	istat_struct;
+	uid_t	owner = vperm_geteuid();
+	gid_t	group = vperm_getegid();
+	uid_t	shown_uid;
+	gid_t	shown_gid;
 
-	if (real_fstatat64(dirfd, mapped_pathname->mres_result_path, &statbuf, 0) == 0) {
-		vperm_chown(realfnname, &statbuf, vperm_geteuid(), vperm_getegid());
-	} else {
+	if (real_fstatat64(dirfd, mapped_pathname->mres_result_path, &statbuf, 0) < 0) {
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: stat failed", realfnname);
+		return;
+	}
+
+	/* owner and group that stat() shows for a file without an entry */
+	if (!vperm_set_owner_and_group_of_unknown_files(&shown_uid, &shown_gid)) {
+		shown_uid = statbuf.st_uid;
+		shown_gid = statbuf.st_gid;
+	}
+
+	memset(&istat_struct, 0, sizeof(istat_struct));
+	istat_struct.inodesimu_dev = statbuf.st_dev;
+	istat_struct.inodesimu_ino = statbuf.st_ino;
+	if (shown_uid != owner) {
+		istat_struct.inodesimu_uid = owner;
+		istat_struct.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_UID;
+	}
+	if (shown_gid != group) {
+		istat_struct.inodesimu_gid = group;
+		istat_struct.inodesimu_active_fields |= RULETREE_INODESTAT_SIM_GID;
 	}
+
+	if (istat_struct.inodesimu_active_fields == 0) {
+		inodesimu_t	old_istat;
+
+		/* the inode number may have been used by a removed file */
+		ruletree_init_inodestat_handle(&handle, statbuf.st_dev, statbuf.st_ino);
+		if ((vperm_num_active_inodestats() == 0) ||
+		    (vperm_find_inodestat(&handle, &old_istat) < 0) ||
+		    (old_istat.inodesimu_active_fields == 0)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: owner and group of new file are %d.%d, nothing to set",
+				realfnname, (int)owner, (int)group);
+			return;
+		}
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: new file, owner %d, group %d",
+		realfnname, (int)owner, (int)group);
+	ruletree_rpc__vperm_new_file(&istat_struct, new_fd);
 }
 
 static void vperm_mkdir_prepare(
@@ -1096,7 +1214,7 @@ int mkdir_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* directory was created */
 		if (vperm_uid_or_gid_virtualization_is_active())
-			vperm_set_owner_and_group(AT_FDCWD, realfnname, mapped_pathname);
+			vperm_set_owner_and_group(AT_FDCWD, realfnname, mapped_pathname, -1);
 		if (forced_owner_rights)
 			vperm_mkdir_finalize(realfnname, AT_FDCWD, mapped_pathname, mode, forced_owner_rights);
 	} else {
@@ -1123,7 +1241,7 @@ int mkdirat_gate(int *result_errno_ptr,
 	if (res == 0) {
 		/* directory was created */
 		if (vperm_uid_or_gid_virtualization_is_active())
-			vperm_set_owner_and_group(dirfd, realfnname, mapped_pathname);
+			vperm_set_owner_and_group(dirfd, realfnname, mapped_pathname, -1);
 		if (forced_owner_rights)
 			vperm_mkdir_finalize(realfnname, dirfd, mapped_pathname, mode, forced_owner_rights);
 	} else {
@@ -1215,6 +1333,41 @@ static int vperm_multiopen(
 	return(-1);
 }
 
+/* How vperm_do_open() finds out if the file was created (the simulated
+ * owner must be set only for new files):
+*/
+#define VPERM_OPEN_CAN_NOT_CREATE	0 /* no O_CREAT, no "w" or "a" */
+#define VPERM_OPEN_EXCLUSIVE		1 /* O_CREAT|O_EXCL: new if opened */
+#define VPERM_OPEN_PROBE		2 /* try O_EXCL first, then without O_CREAT */
+#define VPERM_OPEN_STAT_FIRST		3 /* stat the target before opening */
+
+static int vperm_open_create_method(
+	int (*open_2va_ptr)(const char *pathname, int flags, ...),
+	int (*open_3va_ptr)(int dirfd, const char *pathname, int flags, ...),
+	int (*creat_ptr)(const char *pathname, mode_t mode),
+	const char *file_mode,
+	int flags)
+{
+	/* creat() can't be told to use O_EXCL, and a failed
+	 * freopen() would close the stream; fopen() could use "x",
+	 * but then it would be impossible to see if a dangling symlink
+	 * was followed. */
+	if (creat_ptr) return(VPERM_OPEN_STAT_FIRST);
+	if (file_mode) {
+		if ((*file_mode == 'w') || (*file_mode == 'a'))
+			return(VPERM_OPEN_STAT_FIRST);
+		return(VPERM_OPEN_CAN_NOT_CREATE);
+	}
+	if (!(flags & O_CREAT)) return(VPERM_OPEN_CAN_NOT_CREATE);
+	if (flags & O_EXCL) return(VPERM_OPEN_EXCLUSIVE);
+	/* without a write access mode, the open without O_CREAT
+	 * would succeed for a directory; O_CREAT makes that EISDIR */
+	if ((open_2va_ptr || open_3va_ptr) &&
+	    ((flags & O_ACCMODE) != O_RDONLY))
+		return(VPERM_OPEN_PROBE);
+	return(VPERM_OPEN_STAT_FIRST);
+}
+
 static int vperm_do_open(
 	int *result_errno_ptr,
 	const char *realfnname,
@@ -1235,33 +1388,81 @@ static int vperm_do_open(
 {
 	int res_fd = -1;
 	int open_errno = 0;
-	int target_exists_beforehand = 0;
+	int file_was_created = 0;
+	int orig_stat_valid = 0;
 	int uid_or_gid_is_virtual = 0;
+	int create_method = VPERM_OPEN_CAN_NOT_CREATE;
 	struct stat64 orig_stat;
 
-	/* prepare. */
+	/* prepare. The target is not stat'ed beforehand if that
+	 * can be avoided; most opens don't create anything. */
 	uid_or_gid_is_virtual = vperm_uid_or_gid_virtualization_is_active();
 	if (uid_or_gid_is_virtual) {
-		if (real_fstatat64(dirfd, mapped_pathname->mres_result_path, &orig_stat, 0) == 0) {
-			target_exists_beforehand = 1;
+		create_method = vperm_open_create_method(open_2va_ptr,
+			open_3va_ptr, creat_ptr, file_mode, flags);
+		if (create_method == VPERM_OPEN_STAT_FIRST) {
+			if (real_fstatat64(dirfd, mapped_pathname->mres_result_path, &orig_stat, 0) == 0)
+				orig_stat_valid = 1;
 		}
 	}
 
 	/* try to open it */
-	res_fd = vperm_multiopen(1, realfnname,
-		open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr, creat_ptr,
-		fopen_ptr, freopen_ptr, file_ptr, file_mode,
-		dirfd, mapped_pathname->mres_result_path, flags, modebits);
+	if (create_method == VPERM_OPEN_PROBE) {
+		/* the file is new if it can be created exclusively,
+		 * and it did exist if it can be opened without O_CREAT.
+		 * If neither works (it was removed in between, or it
+		 * is a dangling symlink, which O_EXCL refuses to follow),
+		 * open it as requested and assume that it was created. */
+		res_fd = vperm_multiopen(1, realfnname,
+			open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr, creat_ptr,
+			fopen_ptr, freopen_ptr, file_ptr, file_mode,
+			dirfd, mapped_pathname->mres_result_path,
+			flags | O_EXCL, modebits);
+		if (res_fd >= 0) {
+			file_was_created = 1;
+		} else if (errno == EEXIST) {
+			res_fd = vperm_multiopen(0, realfnname,
+				open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr, creat_ptr,
+				fopen_ptr, freopen_ptr, file_ptr, file_mode,
+				dirfd, mapped_pathname->mres_result_path,
+				flags & ~O_CREAT, modebits);
+			if ((res_fd < 0) && (errno == ENOENT)) {
+				res_fd = vperm_multiopen(0, realfnname,
+					open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr, creat_ptr,
+					fopen_ptr, freopen_ptr, file_ptr, file_mode,
+					dirfd, mapped_pathname->mres_result_path,
+					flags, modebits);
+				if (res_fd >= 0) file_was_created = 1;
+			}
+		}
+	} else {
+		res_fd = vperm_multiopen(1, realfnname,
+			open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr, creat_ptr,
+			fopen_ptr, freopen_ptr, file_ptr, file_mode,
+			dirfd, mapped_pathname->mres_result_path, flags, modebits);
+		if (res_fd >= 0) {
+			if (create_method == VPERM_OPEN_EXCLUSIVE)
+				file_was_created = 1;
+			else if (create_method == VPERM_OPEN_STAT_FIRST)
+				file_was_created = !orig_stat_valid;
+		}
+	}
 	open_errno = errno;
 
 	if (res_fd < 0) {
 		/* open failed. If running as simulated root,
 		 * try tricks.. */
 		if (uid_or_gid_is_virtual &&
+		    ((open_errno == EACCES) || (open_errno == EPERM)) &&
 		    (vperm_geteuid() == 0) &&
             	    vperm_simulate_root_fs_permissions()) {
-			/* simulated root user. */
-			if (target_exists_beforehand &&
+			/* simulated root user. The target hasn't been
+			 * stat'ed yet, if the open didn't need that. */
+			if (!orig_stat_valid &&
+			    (real_fstatat64(dirfd, mapped_pathname->mres_result_path, &orig_stat, 0) == 0))
+				orig_stat_valid = 1;
+
+			if (orig_stat_valid &&
 			    S_ISREG(orig_stat.st_mode)) {
 				/* file exist, but can not be opened.
 				 * try if it was a matter of insufficient
@@ -1274,49 +1475,44 @@ static int vperm_do_open(
 				SB_LOG(SB_LOGLEVEL_DEBUG, "%s: open failed, simulated 'root', errno=%d (%s)",
 					realfnname, open_errno, mapped_pathname->mres_result_path);
 
-				switch (open_errno) {
-				case EACCES:
-				case EPERM:
-					accmode = flags & O_ACCMODE;
-					need_w = (accmode != O_RDONLY);
-					real_euid = vperm_get_real_euid();
-					if (real_euid == orig_stat.st_uid) {
-						int tmpmode = orig_stat.st_mode |
-							(need_w ? (S_IRUSR | S_IWUSR) : S_IRUSR);
-						/* owner matches, temporarily change the mode..
-						 * Warning: race conditions are possible here,
-						 * but this can't be done atomically. */
-						SB_LOG(SB_LOGLEVEL_DEBUG, "%s: trying to temporarily change "
-							"the mode to 0%o (orig.mode=0%o)",
-							realfnname, tmpmode, orig_stat.st_mode);
-
-						if (fchmodat_nomap_nolog(dirfd,
-							mapped_pathname->mres_result_path, tmpmode, 0) == 0) {
-							/* NO LOGGING IN THIS BLOCK. TRY TO BE QUICK. */
-							/* mode was set to tmpmode.
-							 * try again; if it won't open now,
-							 * we just can't do it. */
-							res_fd = vperm_multiopen(0, realfnname,
-								open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr,
-								creat_ptr,  fopen_ptr, freopen_ptr, file_ptr, file_mode,
-								dirfd, mapped_pathname->mres_result_path,
-								flags, modebits);
-							open_errno = errno;
-							/* Hopefully the file is open now.
-							 * in any case restore orig. mode */
-							fchmodat_nomap_nolog(dirfd,
-								mapped_pathname->mres_result_path,
-								orig_stat.st_mode, 0);
-						}
-						if (res_fd < 0) {
-							SB_LOG(SB_LOGLEVEL_DEBUG, "%s: failed to open it for 'root'",
-								realfnname);
-						} else {
-							SB_LOG(SB_LOGLEVEL_DEBUG, "%s: file is now open, fd=%d",
-								realfnname, res_fd);
-						}
+				accmode = flags & O_ACCMODE;
+				need_w = (accmode != O_RDONLY);
+				real_euid = vperm_get_real_euid();
+				if (real_euid == orig_stat.st_uid) {
+					int tmpmode = orig_stat.st_mode |
+						(need_w ? (S_IRUSR | S_IWUSR) : S_IRUSR);
+					/* owner matches, temporarily change the mode..
+					 * Warning: race conditions are possible here,
+					 * but this can't be done atomically. */
+					SB_LOG(SB_LOGLEVEL_DEBUG, "%s: trying to temporarily change "
+						"the mode to 0%o (orig.mode=0%o)",
+						realfnname, tmpmode, orig_stat.st_mode);
+
+					if (fchmodat_nomap_nolog(dirfd,
+						mapped_pathname->mres_result_path, tmpmode, 0) == 0) {
+						/* NO LOGGING IN THIS BLOCK. TRY TO BE QUICK. */
+						/* mode was set to tmpmode.
+						 * try again; if it won't open now,
+						 * we just can't do it. */
+						res_fd = vperm_multiopen(0, realfnname,
+							open_2_ptr, open_2va_ptr, openat_3_ptr, open_3va_ptr,
+							creat_ptr,  fopen_ptr, freopen_ptr, file_ptr, file_mode,
+							dirfd, mapped_pathname->mres_result_path,
+							flags, modebits);
+						open_errno = errno;
+						/* Hopefully the file is open now.
+						 * in any case restore orig. mode */
+						fchmodat_nomap_nolog(dirfd,
+							mapped_pathname->mres_result_path,
+							orig_stat.st_mode, 0);
+					}
+					if (res_fd < 0) {
+						SB_LOG(SB_LOGLEVEL_DEBUG, "%s: failed to open it for 'root'",
+							realfnname);
+					} else {
+						SB_LOG(SB_LOGLEVEL_DEBUG, "%s: file is now open, fd=%d",
+							realfnname, res_fd);
 					}
-					break;
 				}
 			} else {
 				/* the file did not exist, or not a regular file. */
@@ -1329,16 +1525,16 @@ static int vperm_do_open(
 			}
 		}
 	} else {
-		if (uid_or_gid_is_virtual &&
-		    (target_exists_beforehand==0)) {
+		if (uid_or_gid_is_virtual && file_was_created) {
 			/* file was created */
 			SB_LOG(SB_LOGLEVEL_DEBUG, "%s: created file, setting simulated UID and GID (%s)",
 				realfnname, mapped_pathname->mres_result_path);
-			vperm_set_owner_and_group(dirfd, realfnname, mapped_pathname);
+			vperm_set_owner_and_group(dirfd, realfnname, mapped_pathname,
+				(file_ptr ? -1 : res_fd));
 		}
 	}
 	if (res_fd < 0) {
-		*result_errno_ptr = errno;
+		*result_errno_ptr = open_errno;
 	}
 	return (res_fd);
 }
@@ -1607,7 +1803,7 @@ int rename_gate(int *result_errno_ptr,
 	int res;
 
 	/* If newpath has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (real_lstat64(mapped_newpath->mres_result_path, &statbuf) == 0) {
 			has_stat = 1;
@@ -1646,7 +1842,7 @@ int renameat_gate(int *result_errno_ptr,
 	int res;
 
 	/* If newpath has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (get_stat_for_fxxat64(realfnname, newdirfd, mapped_newpath, AT_SYMLINK_NOFOLLOW, &statbuf) == 0) {
 			has_stat = 1;
@@ -1687,7 +1883,7 @@ int renameat2_gate(int *result_errno_ptr,
 	int res;
 
 	/* If newpath has been virtualized, be prepared to update DB */
-	if (get_vperm_num_active_inodestats() > 0) {
+	if (vperm_num_active_inodestats() > 0) {
 		/* there are active vperm inodestat nodes */
 		if (get_stat_for_fxxat64(realfnname, newdirfd, mapped_newpath, AT_SYMLINK_NOFOLLOW, &statbuf) == 0) {
 			has_stat = 1;
@@ -1744,13 +1940,38 @@ FTSENT *fts_children_gate(int *result_errno_ptr,
 	res = (*real_fts_children_ptr)(ftsp, options);
 
 	/* FIXME: check the "options" condition from glibc */
-	if (res && (options != FTS_NAMEONLY) && (get_vperm_num_active_inodestats() > 0)) {
-		FTSENT *fep = res;
-		while (fep) {
-			if (fep->fts_statp)
-				i_virtualize_struct_stat(realfnname, fep->fts_statp, NULL);
-			fep = fep->fts_link;
+	if (res && (options != FTS_NAMEONLY) && (vperm_num_active_inodestats() > 0)) {
+		/* all entries of the directory at once */
+		struct stat	*statps_buf[64];
+		struct stat	**statps = statps_buf;
+		uint32_t	num_statps = 0;
+		uint32_t	max_statps = sizeof(statps_buf)/sizeof(statps_buf[0]);
+		FTSENT *fep;
+
+		for (fep = res; fep; fep = fep->fts_link) {
+			if (!fep->fts_statp) continue;
+			if (num_statps >= max_statps) {
+				struct stat **new_statps = NULL;
+
+				if (statps == statps_buf) {
+					new_statps = malloc(2 * max_statps * sizeof(*statps));
+					if (new_statps)
+						memcpy(new_statps, statps_buf, sizeof(statps_buf));
+				} else {
+					new_statps = realloc(statps, 2 * max_statps * sizeof(*statps));
+				}
+				if (!new_statps) {
+					/* the rest one at a time */
+					i_virtualize_struct_stat(realfnname, fep->fts_statp, NULL);
+					continue;
+				}
+				statps = new_statps;
+				max_statps *= 2;
+			}
+			statps[num_statps++] = fep->fts_statp;
 		}
+		i_virtualize_struct_stats(realfnname, num_statps, statps, NULL);
+		if (statps != statps_buf) free(statps);
 	} else if (res==NULL) {
 		*result_errno_ptr = errno;
 	}
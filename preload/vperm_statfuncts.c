@@ -7,12 +7,14 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "sb2.h"
 #include "sb2_stat.h"
 #include "sb2_vperm.h"
 
 #include "rule_tree.h"
+#include "rule_tree_rpc.h"
 #include "libsb2.h"
 #include "exported.h"
 
@@ -113,31 +115,26 @@ int real_fstat64(int fd, struct stat64 *statbuf)
 	return(r);
 }
 
-/* return 0 if not modified, positive if something was virtualized.
- * only one of {buf,buf64} should be set; set the other one to NULL */
-int i_virtualize_struct_stat(
+/* Set the simulated fields of a stat structure, "istat_in_db" is the
+ * inodestat of the inode or NULL if there isn't one.
+ * return 0 if not modified, positive if something was virtualized. */
+static int virtualize_struct_stat_from(
 	const char *realfnname,
 	struct stat *buf,
-	struct stat64 *buf64)
+	struct stat64 *buf64,
+	const inodesimu_t *istat_in_db_p)
 {
 	int				res = 0;
-	ruletree_inodestat_handle_t	handle;
 	inodesimu_t      		istat_in_db;
 	uid_t				uf_uid;
 	gid_t				uf_gid;
 
-	ruletree_clear_inodestat_handle(&handle);
-	if (buf) {
-		ruletree_init_inodestat_handle(&handle, buf->st_dev, buf->st_ino);
-	} else {
-		ruletree_init_inodestat_handle(&handle, buf64->st_dev, buf64->st_ino);
-	}
-
-	if ((get_vperm_num_active_inodestats() > 0) &&
-	    (ruletree_find_inodestat(&handle, &istat_in_db) == 0)) {
+	if (istat_in_db_p) {
 		int set_uid_gid_of_unknown = vperm_set_owner_and_group_of_unknown_files(
 			&uf_uid, &uf_gid);
 
+		istat_in_db = *istat_in_db_p;
+
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s/%s: inodestats struct found:", realfnname, __func__);
 		if (istat_in_db.inodesimu_active_fields &
 			RULETREE_INODESTAT_SIM_UID) {
@@ -233,6 +230,141 @@ int i_virtualize_struct_stat(
 	return(res);
 }
 
+/* Find the status of an inode; the queue of new files is checked
+ * before the rule tree, and the rule tree only if the inodestat filter
+ * doesn't rule it out */
+int vperm_find_inodestat(
+	ruletree_inodestat_handle_t *handle, inodesimu_t *istat)
+{
+	if (ruletree_rpc__vperm_find_new_file(handle->rfh_dev,
+	    handle->rfh_ino, istat) == 0)
+		return(0);
+	if (!ruletree_inodestat_may_exist(handle->rfh_dev, handle->rfh_ino))
+		return(-1);
+	return(ruletree_find_inodestat(handle, istat));
+}
+
+/* Like vperm_find_inodestat(), for several inodes.
+ * The queries are reordered. Returns number of inodestats found.
+*/
+uint32_t vperm_find_inodestats(
+	ruletree_inodestat_query_t *queries, uint32_t num_queries)
+{
+	uint32_t	i;
+	uint32_t	num_tree_queries = 0;
+	uint32_t	found = 0;
+
+	/* queries which need the tree are moved to the beginning */
+	for (i = 0; i < num_queries; i++) {
+		ruletree_inodestat_query_t	*q = &queries[i];
+
+		q->rfiq_found = 0;
+		if (ruletree_rpc__vperm_find_new_file(q->rfiq_dev,
+		    q->rfiq_ino, &q->rfiq_istat) == 0) {
+			q->rfiq_found = 1;
+			found++;
+			continue;
+		}
+		if (!ruletree_inodestat_may_exist(q->rfiq_dev, q->rfiq_ino))
+			continue;
+		if (i != num_tree_queries) {
+			ruletree_inodestat_query_t	tmp = *q;
+
+			*q = queries[num_tree_queries];
+			queries[num_tree_queries] = tmp;
+		}
+		num_tree_queries++;
+	}
+	if (num_tree_queries)
+		found += ruletree_find_inodestats(queries, num_tree_queries);
+	return(found);
+}
+
+/* Number of active inodestats, including the queued ones (used to
+ * skip lookups when nothing is being simulated) */
+uint32_t vperm_num_active_inodestats(void)
+{
+	return(get_vperm_num_active_inodestats() +
+		ruletree_rpc__vperm_num_new_files());
+}
+
+/* return 0 if not modified, positive if something was virtualized.
+ * only one of {buf,buf64} should be set; set the other one to NULL */
+int i_virtualize_struct_stat(
+	const char *realfnname,
+	struct stat *buf,
+	struct stat64 *buf64)
+{
+	ruletree_inodestat_handle_t	handle;
+	inodesimu_t      		istat_in_db;
+
+	ruletree_clear_inodestat_handle(&handle);
+	if (buf) {
+		ruletree_init_inodestat_handle(&handle, buf->st_dev, buf->st_ino);
+	} else {
+		ruletree_init_inodestat_handle(&handle, buf64->st_dev, buf64->st_ino);
+	}
+
+	if ((vperm_num_active_inodestats() > 0) &&
+	    (vperm_find_inodestat(&handle, &istat_in_db) == 0))
+		return(virtualize_struct_stat_from(realfnname, buf, buf64,
+			&istat_in_db));
+	return(virtualize_struct_stat_from(realfnname, buf, buf64, NULL));
+}
+
+/* Virtualize several stat structures (e.g. the results of
+ * fts_children()). The inodestats are looked up in one pass over
+ * the inodestat tree instead of one lookup per structure.
+ * only one of {bufs,bufs64} should be set; set the other one to NULL */
+void i_virtualize_struct_stats(
+	const char *realfnname,
+	uint32_t num_bufs,
+	struct stat **bufs,
+	struct stat64 **bufs64)
+{
+	ruletree_inodestat_query_t	queries_buf[64];
+	ruletree_inodestat_query_t	*queries = queries_buf;
+	uint32_t			i;
+
+	if (num_bufs == 0) return;
+	if (vperm_num_active_inodestats() == 0) {
+		for (i = 0; i < num_bufs; i++)
+			virtualize_struct_stat_from(realfnname,
+				(bufs ? bufs[i] : NULL),
+				(bufs64 ? bufs64[i] : NULL), NULL);
+		return;
+	}
+	if (num_bufs > sizeof(queries_buf)/sizeof(queries_buf[0])) {
+		queries = malloc(num_bufs * sizeof(ruletree_inodestat_query_t));
+		if (!queries) {
+			for (i = 0; i < num_bufs; i++)
+				i_virtualize_struct_stat(realfnname,
+					(bufs ? bufs[i] : NULL),
+					(bufs64 ? bufs64[i] : NULL));
+			return;
+		}
+	}
+	for (i = 0; i < num_bufs; i++) {
+		if (bufs) {
+			queries[i].rfiq_dev = bufs[i]->st_dev;
+			queries[i].rfiq_ino = bufs[i]->st_ino;
+			queries[i].rfiq_user = bufs[i];
+		} else {
+			queries[i].rfiq_dev = bufs64[i]->st_dev;
+			queries[i].rfiq_ino = bufs64[i]->st_ino;
+			queries[i].rfiq_user = bufs64[i];
+		}
+	}
+	vperm_find_inodestats(queries, num_bufs);
+	for (i = 0; i < num_bufs; i++) {
+		virtualize_struct_stat_from(realfnname,
+			(bufs ? (struct stat *)queries[i].rfiq_user : NULL),
+			(bufs64 ? (struct stat64 *)queries[i].rfiq_user : NULL),
+			(queries[i].rfiq_found ? &queries[i].rfiq_istat : NULL));
+	}
+	if (queries != queries_buf) free(queries);
+}
+
 int sb2_stat_file(const char *path, struct stat *buf, int *result_errno_ptr,
 	int (*statfn_with_ver_ptr)(int ver, const char *filename, struct stat *buf),
 	int ver,
@@ -28,6 +28,8 @@
 #include <sys/param.h>
 #include <sys/file.h>
 #include <assert.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -49,6 +51,11 @@ static struct ruletree_cxt_s {
 	ruletree_hdr_t	*rtree_ruletree_hdr_p;
 } ruletree_ctx = { NULL, -1, 0, NULL };
 
+/* state that was handed over by the parent process, see
+ * ruletree_handoff_from_string() */
+static ruletree_handoff_t ruletree_handoff;
+static int ruletree_handoff_valid = 0;
+
 /* =================== Rule tree primitives. =================== */
 
 size_t ruletree_get_file_size(void)
@@ -133,7 +140,9 @@ static int mmap_ruletree(ruletree_hdr_t *hdr)
 		PROT_READ | PROT_WRITE, MAP_SHARED,
 		ruletree_ctx.rtree_ruletree_fd, 0);
 
-	if (!ruletree_ctx.rtree_ruletree_ptr) {
+	if (!ruletree_ctx.rtree_ruletree_ptr ||
+	    (ruletree_ctx.rtree_ruletree_ptr == MAP_FAILED)) {
+		ruletree_ctx.rtree_ruletree_ptr = NULL;
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"Failed to mmap() ruletree");
 		return(-1);
@@ -193,6 +202,59 @@ int create_ruletree_file(const char *ruletree_path,
 	return(0);
 }
 
+/* For the server: return the current image of the rule tree
+ * (the header and all objects), and its size in *image_size */
+const void *ruletree_get_image(size_t *image_size)
+{
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(NULL);
+	*image_size = ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size;
+	return(ruletree_ctx.rtree_ruletree_ptr);
+}
+
+/* For the server: fill a rule tree which was just created by
+ * create_ruletree_file() with a copy of an image from
+ * ruletree_get_image(). The image must have been created with
+ * the same parameters. Returns 0 if OK.
+*/
+int ruletree_load_image(const void *image, size_t image_size)
+{
+	const ruletree_hdr_t	*ihdr = image;
+	ruletree_hdr_t		*hp = ruletree_ctx.rtree_ruletree_hdr_p;
+	size_t			body_size;
+
+	if (!hp || (ruletree_ctx.rtree_ruletree_fd < 0)) return(-1);
+	if (hp->rtree_file_size != sizeof(ruletree_hdr_t)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: rule tree is not empty", __func__);
+		return(-1);
+	}
+	if ((image_size <= sizeof(ruletree_hdr_t)) ||
+	    (image_size > hp->rtree_max_size) ||
+	    (ihdr->rtree_hdr_objhdr.rtree_obj_magic != SB2_RULETREE_MAGIC) ||
+	    (ihdr->rtree_version != RULE_TREE_VERSION) ||
+	    (ihdr->rtree_file_size != image_size) ||
+	    (ihdr->rtree_max_size != hp->rtree_max_size) ||
+	    (ihdr->rtree_min_mmap_addr != hp->rtree_min_mmap_addr) ||
+	    (ihdr->rtree_min_client_socket_fd != hp->rtree_min_client_socket_fd)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"%s: image doesn't match the rule tree", __func__);
+		return(-1);
+	}
+
+	body_size = image_size - sizeof(ruletree_hdr_t);
+	if (pwrite(ruletree_ctx.rtree_ruletree_fd,
+	    (const char *)image + sizeof(ruletree_hdr_t), body_size,
+	    sizeof(ruletree_hdr_t)) != (ssize_t)body_size) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"%s: Failed to write %u bytes to the rule tree",
+			__func__, (unsigned)body_size);
+		return(-1);
+	}
+	hp->rtree_hdr_root_catalog = ihdr->rtree_hdr_root_catalog;
+	hp->rtree_file_size = image_size;
+	return(0);
+}
+
 int ruletree_get_min_client_socket_fd(void)
 {
 	if (ruletree_ctx.rtree_ruletree_hdr_p)
@@ -200,6 +262,41 @@ int ruletree_get_min_client_socket_fd(void)
 	return(0);
 }
 
+/* Attach using the header values that were received from the parent
+ * process, without reading the header first. The header is verified
+ * after mmap(); returns -1 if it doesn't match (caller should then
+ * fall back to the normal way)
+*/
+static int attach_ruletree_with_handoff(void)
+{
+	ruletree_hdr_t	hdr;
+	ruletree_hdr_t	*hp;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.rtree_min_mmap_addr = ruletree_handoff.rth_min_mmap_addr;
+	hdr.rtree_max_size = ruletree_handoff.rth_max_size;
+
+	if (mmap_ruletree(&hdr) == 0) {
+		hp = ruletree_ctx.rtree_ruletree_hdr_p;
+		if ((hp->rtree_version == RULE_TREE_VERSION) &&
+		    (hp->rtree_max_size == hdr.rtree_max_size) &&
+		    (hp->rtree_min_mmap_addr == hdr.rtree_min_mmap_addr)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"%s: attached without reading the header",
+				__func__);
+			return(0);
+		}
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: handoff doesn't match, ignored",
+		__func__);
+	if (ruletree_ctx.rtree_ruletree_ptr)
+		munmap(ruletree_ctx.rtree_ruletree_ptr, hdr.rtree_max_size);
+	ruletree_ctx.rtree_ruletree_ptr = NULL;
+	ruletree_ctx.rtree_ruletree_hdr_p = NULL;
+	ruletree_handoff_valid = 0;
+	return(-1);
+}
+
 /* For clients:
  * Attach the rule tree = map it to our memoryspace.
  * returns -1 if error, 0 if attached
@@ -216,7 +313,10 @@ int attach_ruletree(const char *ruletree_path, int keep_open)
 
 	if (open_ruletree_file(0/*create_if_it_doesnt_exist*/) < 0) return(-1);
 
-	if (read(ruletree_ctx.rtree_ruletree_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	if (ruletree_handoff_valid && (attach_ruletree_with_handoff() == 0))
+		goto attached;
+
+	if (pread(ruletree_ctx.rtree_ruletree_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"Illegal ruletree file size or format");
 		return(-1);
@@ -224,13 +324,13 @@ int attach_ruletree(const char *ruletree_path, int keep_open)
 	if (hdr.rtree_version != RULE_TREE_VERSION) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
 			"Fatal: ruletree version mismatch: Got %d, expected %d",
-			ruletree_ctx.rtree_ruletree_hdr_p->rtree_version,
-			RULE_TREE_VERSION);
+			hdr.rtree_version, RULE_TREE_VERSION);
 		exit(44);
 	}
 
 	if (mmap_ruletree(&hdr) < 0) return(-1);
 
+    attached:
 	if (!keep_open) {
 		close(ruletree_ctx.rtree_ruletree_fd);
 		ruletree_ctx.rtree_ruletree_fd = -1;
@@ -241,6 +341,69 @@ int attach_ruletree(const char *ruletree_path, int keep_open)
 	return(0);
 }
 
+/* =================== handoff to exec'd processes =================== */
+
+/* Everything that a new process would otherwise need to look up from
+ * the rule tree during startup is passed to it in one environment
+ * variable (__SB2_HANDOFF, see sb_exec.c). The format is
+ *   "<version>,<min_mmap_addr>,<max_size>,<fwd_rules>,<rev_rules>"
+ * with all numbers in hex. Rule list offsets are zero if unknown.
+*/
+#define RULETREE_HANDOFF_VERSION	1
+
+char *ruletree_handoff_to_string(const char *prefix,
+	ruletree_object_offset_t fwd_rule_list_offs,
+	ruletree_object_offset_t rev_rule_list_offs)
+{
+	ruletree_hdr_t	*hp = ruletree_ctx.rtree_ruletree_hdr_p;
+	char		*buf = NULL;
+
+	if (!hp) return(NULL);
+	if (asprintf(&buf, "%s%x,%llx,%x,%x,%x", prefix ? prefix : "",
+		RULETREE_HANDOFF_VERSION,
+		(unsigned long long)hp->rtree_min_mmap_addr,
+		hp->rtree_max_size,
+		fwd_rule_list_offs, rev_rule_list_offs) < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"asprintf failed to create rule tree handoff");
+		return(NULL);
+	}
+	return(buf);
+}
+
+/* Called during initialization of the process; the logger may not be
+ * available yet, so this must not log anything. Returns 0 if the
+ * string was accepted. */
+int ruletree_handoff_from_string(const char *str)
+{
+	ruletree_handoff_t	h;
+	unsigned long		vrs;
+	char			*cp;
+
+	if (!str || !*str) return(-1);
+
+	vrs = strtoul(str, &cp, 16);
+	if ((vrs != RULETREE_HANDOFF_VERSION) || (*cp++ != ',')) return(-1);
+	h.rth_min_mmap_addr = strtoull(cp, &cp, 16);
+	if (*cp++ != ',') return(-1);
+	h.rth_max_size = strtoul(cp, &cp, 16);
+	if (*cp++ != ',') return(-1);
+	h.rth_fwd_rule_list_offs = strtoul(cp, &cp, 16);
+	if (*cp++ != ',') return(-1);
+	h.rth_rev_rule_list_offs = strtoul(cp, &cp, 16);
+	if (*cp || !h.rth_max_size) return(-1);
+
+	ruletree_handoff = h;
+	ruletree_handoff_valid = 1;
+	return(0);
+}
+
+/* returns NULL if nothing was received, or if it was rejected */
+const ruletree_handoff_t *ruletree_get_handoff(void)
+{
+	return(ruletree_handoff_valid ? &ruletree_handoff : NULL);
+}
+
 /* =================== ints and booleans =================== */
 
 static uint32_t *ruletree_get_pointer_to_uint32_or_boolean(
@@ -641,6 +804,95 @@ static uint64_t ino_to_key(uint64_t ino)
 }
 
 static ruletree_object_offset_t	inodestats_bintree_root = 0;
+static ruletree_inodestat_filter_t	*inodestat_filter = NULL;
+
+/* the two bits of a key in the inodestat filter */
+static void inodestat_filter_bits(uint64_t dev, uint64_t ino,
+	uint32_t *bit1, uint32_t *bit2)
+{
+	uint64_t	h;
+
+	h = (ino * 0x9E3779B97F4A7C15ULL) ^ (dev * 0xC2B2AE3D27D4EB4FULL);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	*bit1 = (uint32_t)h & (RULETREE_INODESTAT_FILTER_BITS - 1);
+	*bit2 = (uint32_t)(h >> 32) & (RULETREE_INODESTAT_FILTER_BITS - 1);
+}
+
+static ruletree_inodestat_filter_t *get_inodestat_filter(void)
+{
+	ruletree_object_offset_t	offs;
+	ruletree_inodestat_filter_t	*fp;
+
+	if (inodestat_filter) return(inodestat_filter);
+	offs = ruletree_catalog_get("vperm", "inodestat_filter");
+	if (!offs) return(NULL);
+	fp = offset_to_ruletree_object_ptr(offs,
+		SB2_RULETREE_OBJECT_TYPE_INODESTAT_FILTER);
+	if (fp && (fp->rtree_isf_num_words * 32 == RULETREE_INODESTAT_FILTER_BITS))
+		inodestat_filter = fp;
+	return(inodestat_filter);
+}
+
+/* Create the filter. Only sb2d may call this, before the first
+ * inodestat is added. */
+static void create_inodestat_filter(void)
+{
+	ruletree_inodestat_filter_t	*fp;
+	size_t				size;
+	ruletree_object_offset_t	offs;
+
+	size = sizeof(ruletree_inodestat_filter_t) +
+		RULETREE_INODESTAT_FILTER_BITS / 8;
+	fp = calloc(1, size);
+	if (!fp) return;
+	fp->rtree_isf_num_words = RULETREE_INODESTAT_FILTER_BITS / 32;
+	offs = append_struct_to_ruletree_file(fp, size,
+		SB2_RULETREE_OBJECT_TYPE_INODESTAT_FILTER);
+	free(fp);
+	if (offs) ruletree_catalog_set("vperm", "inodestat_filter", offs);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Created inodestat filter @%u", offs);
+}
+
+/* The bits must be visible before the bintree node that is linked
+ * after this; the fence orders them before that store. Readers use
+ * acquire loads. */
+static void add_to_inodestat_filter(uint64_t dev, uint64_t ino)
+{
+	ruletree_inodestat_filter_t	*fp = get_inodestat_filter();
+	uint32_t			*words;
+	uint32_t			bit1, bit2;
+
+	if (!fp) return;
+	words = (uint32_t *)(fp + 1);
+	inodestat_filter_bits(dev, ino, &bit1, &bit2);
+	__atomic_fetch_or(&words[bit1 / 32], 1U << (bit1 % 32), __ATOMIC_RELEASE);
+	__atomic_fetch_or(&words[bit2 / 32], 1U << (bit2 % 32), __ATOMIC_RELEASE);
+	fp->rtree_isf_num_keys++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Fast check for clients, before ruletree_find_inodestat():
+ * Returns 0 if an inodestat has never been set for the inode,
+ * 1 if it may have been (or if there is no filter).
+*/
+int ruletree_inodestat_may_exist(uint64_t dev, uint64_t ino)
+{
+	ruletree_inodestat_filter_t	*fp;
+	uint32_t			*words;
+	uint32_t			bit1, bit2;
+
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+	fp = get_inodestat_filter();
+	if (!fp) return(1);
+	words = (uint32_t *)(fp + 1);
+	inodestat_filter_bits(dev, ino, &bit1, &bit2);
+	return(((__atomic_load_n(&words[bit1 / 32], __ATOMIC_ACQUIRE) &
+		 (1U << (bit1 % 32))) != 0) &&
+	       ((__atomic_load_n(&words[bit2 / 32], __ATOMIC_ACQUIRE) &
+		 (1U << (bit2 % 32))) != 0));
+}
 
 /* in: "handle" contains the keys
  * out: istat_struct has been filled, if a matching node was found.
@@ -688,6 +940,104 @@ int ruletree_find_inodestat(
 	return(0);
 }
 
+static int compare_inodestat_queries(const void *a, const void *b)
+{
+	const ruletree_inodestat_query_t	*qa = a;
+	const ruletree_inodestat_query_t	*qb = b;
+
+	if (qa->rfiq_key != qb->rfiq_key)
+		return(qa->rfiq_key < qb->rfiq_key ? -1 : 1);
+	if (qa->rfiq_dev != qb->rfiq_dev)
+		return(qa->rfiq_dev < qb->rfiq_dev ? -1 : 1);
+	return(0);
+}
+
+/* "q" is sorted and contains "n" queries that can be found
+ * from the subtree at "node_offs" only. Returns number of matches. */
+static uint32_t find_inodestats_in_subtree(
+	ruletree_object_offset_t	node_offs,
+	ruletree_inodestat_query_t	*q,
+	uint32_t			n)
+{
+	uint32_t	found = 0;
+
+	while (node_offs && (n > 0)) {
+		ruletree_bintree_t	*bintrp;
+		ruletree_inodestat_t	*fsptr;
+		uint32_t		lo, hi, i;
+
+		bintrp = offset_to_ruletree_object_ptr(node_offs,
+				SB2_RULETREE_OBJECT_TYPE_BINTREE);
+		if (!bintrp) break;
+
+		/* q[0..lo) are less than this node */
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if ((q[mid].rfiq_key < bintrp->rtree_bt_key1) ||
+			    ((q[mid].rfiq_key == bintrp->rtree_bt_key1) &&
+			     (q[mid].rfiq_dev < bintrp->rtree_bt_key2)))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* same inode may have been asked more than once */
+		fsptr = NULL;
+		for (i = lo; (i < n) &&
+		     (q[i].rfiq_key == bintrp->rtree_bt_key1) &&
+		     (q[i].rfiq_dev == bintrp->rtree_bt_key2); i++) {
+			if (!fsptr) {
+				fsptr = offset_to_ruletree_object_ptr(
+					bintrp->rtree_bt_value,
+					SB2_RULETREE_OBJECT_TYPE_INODESTAT);
+				if (!fsptr) continue;
+			}
+			q[i].rfiq_istat = fsptr->rtree_inode_simu;
+			q[i].rfiq_found = 1;
+			found++;
+		}
+
+		if (lo > 0)
+			found += find_inodestats_in_subtree(
+				bintrp->rtree_bt_link_less, q, lo);
+		q += i;
+		n -= i;
+		node_offs = bintrp->rtree_bt_link_more;
+	}
+	return(found);
+}
+
+/* Find inodestats of several inodes with one pass over the
+ * binary tree: The queries are sorted, and every node is
+ * visited at most once, with the queries that may be in its subtree.
+ * The queries are reordered. Returns number of inodestats found.
+*/
+uint32_t ruletree_find_inodestats(
+	ruletree_inodestat_query_t	*queries,
+	uint32_t			num_queries)
+{
+	uint32_t	i;
+
+	for (i = 0; i < num_queries; i++) {
+		queries[i].rfiq_found = 0;
+		queries[i].rfiq_key = ino_to_key(queries[i].rfiq_ino);
+	}
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+
+	if (!inodestats_bintree_root) {
+		inodestats_bintree_root = ruletree_catalog_get(
+			"vperm", "inodestats");
+		if (!inodestats_bintree_root) return(0);
+	}
+	if (num_queries > 1)
+		qsort(queries, num_queries, sizeof(ruletree_inodestat_query_t),
+			compare_inodestat_queries);
+	return(find_inodestats_in_subtree(inodestats_bintree_root,
+		queries, num_queries));
+}
+
 /* set/add a inodestat structure to the binary tree.
  * ruletree_find_inodestat() must be called beforehand to 
  * fill "handle" (unless adding the very first node)
@@ -731,6 +1081,10 @@ ruletree_object_offset_t ruletree_set_inodestat(
 
 		SB_LOG(SB_LOGLEVEL_NOISE,
 			"ruletree_set_inodestat: add to tree");
+		/* the key must be in the filter before the
+		 * node can be found from the tree */
+		if (!get_inodestat_filter()) create_inodestat_filter();
+		add_to_inodestat_filter(handle->rfh_dev, handle->rfh_ino);
 		handle->rfh_offs = ruletree_create_inodestat(istat_struct);
 		bt_root = ruletree_add_to_bintree_entry(handle->rfh_offs,
 			ino_to_key(handle->rfh_ino), handle->rfh_dev,
@@ -741,6 +1095,191 @@ ruletree_object_offset_t ruletree_set_inodestat(
 	}
 }
 
+/* =================== script interpreter cache =================== */
+
+static ruletree_object_offset_t	scriptinterp_bintree_root = 0;
+
+static ruletree_bintree_t *find_scriptinterp_node(
+	const scriptinterp_id_t		*id,
+	ruletree_object_offset_t	*last_visited_node,
+	int				*last_result)
+{
+	ruletree_object_offset_t	node_offs;
+
+	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
+
+	if (!scriptinterp_bintree_root) {
+		scriptinterp_bintree_root = ruletree_catalog_get(
+			"exec_cache", "script_interpreters");
+		if (!scriptinterp_bintree_root) return(NULL);
+	}
+	node_offs = ruletree_find_bintree_entry(
+		ino_to_key(id->scriptinterp_ino), id->scriptinterp_dev,
+		scriptinterp_bintree_root, last_visited_node, last_result);
+	if (!node_offs) return(NULL);
+	return(offset_to_ruletree_object_ptr(node_offs,
+		SB2_RULETREE_OBJECT_TYPE_BINTREE));
+}
+
+/* Find a cached script interpreter. Returns 0 if a valid entry
+ * was found (the key and validation fields of "id" must match),
+ * negative if not. The stored id is copied to *cached_id_p; the
+ * caller must check the fields that describe the result.
+ * The returned strings point to the rule tree and are never freed.
+*/
+int ruletree_find_scriptinterp(
+	const scriptinterp_id_t	*id,
+	scriptinterp_id_t	*cached_id_p,
+	const char		**mapped_interpreter_p,
+	const char		**exec_policy_name_p,
+	const char		**followed_symlinks_p)
+{
+	ruletree_bintree_t	*bintrp;
+	ruletree_scriptinterp_t	*sip;
+	const char		*mapped_interpreter;
+
+	bintrp = find_scriptinterp_node(id, NULL, NULL);
+	if (!bintrp) return(-1);
+
+	sip = offset_to_ruletree_object_ptr(bintrp->rtree_bt_value,
+			SB2_RULETREE_OBJECT_TYPE_SCRIPTINTERP);
+	if (!sip) return(-1);
+	*cached_id_p = sip->rtree_si_id;
+
+	if ((cached_id_p->scriptinterp_mtime_sec != id->scriptinterp_mtime_sec) ||
+	    (cached_id_p->scriptinterp_mtime_nsec != id->scriptinterp_mtime_nsec) ||
+	    (cached_id_p->scriptinterp_size != id->scriptinterp_size) ||
+	    (cached_id_p->scriptinterp_context_hash != id->scriptinterp_context_hash)) {
+		SB_LOG(SB_LOGLEVEL_NOISE,
+			"ruletree_find_scriptinterp: stale entry (dev=%lld,ino=%lld)",
+			(long long)id->scriptinterp_dev,
+			(long long)id->scriptinterp_ino);
+		return(-1);
+	}
+	mapped_interpreter = offset_to_ruletree_string_ptr(
+		sip->rtree_si_mapped_interpreter, NULL);
+	if (!mapped_interpreter) return(-1);
+
+	*mapped_interpreter_p = mapped_interpreter;
+	*exec_policy_name_p = sip->rtree_si_exec_policy_name ?
+		offset_to_ruletree_string_ptr(sip->rtree_si_exec_policy_name, NULL) :
+		NULL;
+	*followed_symlinks_p = sip->rtree_si_followed_symlinks ?
+		offset_to_ruletree_string_ptr(sip->rtree_si_followed_symlinks, NULL) :
+		NULL;
+	return(0);
+}
+
+/* returns offset of "str" if the string at "offs" is equal to it, 0 if not */
+static ruletree_object_offset_t reuse_scriptinterp_string(
+	ruletree_object_offset_t	offs,
+	const char			*str)
+{
+	const char	*old_str;
+
+	if (!offs || !str || !*str) return(0);
+	old_str = offset_to_ruletree_string_ptr(offs, NULL);
+	if (old_str && !strcmp(old_str, str)) return(offs);
+	return(0);
+}
+
+/* Add or replace a cached script interpreter. Only sb2d may call this.
+ * If the existing entry has the same result, only the id is updated
+ * in place (the result is the same for both ids, so readers can't
+ * get a wrong answer even if they see a partially updated id).
+ * Otherwise a new entry is created (reusing strings that did not
+ * change), and the bintree node is then pointed to it, so that
+ * readers always see a consistent result.
+ * returns 0 if OK, negative on errors. */
+int ruletree_set_scriptinterp(
+	const scriptinterp_id_t	*id,
+	const char		*mapped_interpreter,
+	const char		*exec_policy_name,
+	const char		*followed_symlinks)
+{
+	ruletree_scriptinterp_t		new_entry;
+	ruletree_scriptinterp_t		*old_sip = NULL;
+	ruletree_object_offset_t	entry_location;
+	ruletree_object_offset_t	last_visited_node = 0;
+	int				last_result = 0;
+	ruletree_bintree_t		*bintrp;
+	ruletree_object_offset_t	bt_root;
+
+	SB_LOG(SB_LOGLEVEL_NOISE,
+		"ruletree_set_scriptinterp (dev=%lld,ino=%lld) => '%s'",
+			(long long)id->scriptinterp_dev,
+			(long long)id->scriptinterp_ino,
+			mapped_interpreter);
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(-1);
+	if (ruletree_ctx.rtree_ruletree_fd < 0) return(-1);
+
+	memset(&new_entry, 0, sizeof(new_entry));
+	bintrp = find_scriptinterp_node(id, NULL, NULL);
+	if (bintrp) {
+		old_sip = offset_to_ruletree_object_ptr(bintrp->rtree_bt_value,
+			SB2_RULETREE_OBJECT_TYPE_SCRIPTINTERP);
+	}
+	if (old_sip) {
+		new_entry.rtree_si_mapped_interpreter = reuse_scriptinterp_string(
+			old_sip->rtree_si_mapped_interpreter, mapped_interpreter);
+		new_entry.rtree_si_exec_policy_name = reuse_scriptinterp_string(
+			old_sip->rtree_si_exec_policy_name, exec_policy_name);
+		new_entry.rtree_si_followed_symlinks = reuse_scriptinterp_string(
+			old_sip->rtree_si_followed_symlinks, followed_symlinks);
+
+		if (new_entry.rtree_si_mapped_interpreter &&
+		    (new_entry.rtree_si_exec_policy_name ==
+			old_sip->rtree_si_exec_policy_name) &&
+		    (new_entry.rtree_si_followed_symlinks ==
+			old_sip->rtree_si_followed_symlinks) &&
+		    (old_sip->rtree_si_id.scriptinterp_flags == id->scriptinterp_flags)) {
+			/* Same result. */
+			old_sip->rtree_si_id = *id;
+			return(0);
+		}
+	}
+
+	/* This is only a cache; leave the last quarter of the
+	 * file for the inodestats. */
+	if (ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size >
+	    ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size -
+	    ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size / 4) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"ruletree_set_scriptinterp: rule tree is almost full");
+		return(-1);
+	}
+
+	new_entry.rtree_si_id = *id;
+	if (!new_entry.rtree_si_mapped_interpreter)
+		new_entry.rtree_si_mapped_interpreter =
+			append_string_to_ruletree_file(mapped_interpreter);
+	if (!new_entry.rtree_si_mapped_interpreter) return(-1);
+	if (!new_entry.rtree_si_exec_policy_name &&
+	    exec_policy_name && *exec_policy_name)
+		new_entry.rtree_si_exec_policy_name =
+			append_string_to_ruletree_file(exec_policy_name);
+	if (!new_entry.rtree_si_followed_symlinks &&
+	    followed_symlinks && *followed_symlinks)
+		new_entry.rtree_si_followed_symlinks =
+			append_string_to_ruletree_file(followed_symlinks);
+	entry_location = append_struct_to_ruletree_file(&new_entry, sizeof(new_entry),
+		SB2_RULETREE_OBJECT_TYPE_SCRIPTINTERP);
+	if (!entry_location) return(-1);
+
+	bintrp = find_scriptinterp_node(id, &last_visited_node, &last_result);
+	if (bintrp) {
+		/* Node is already in the tree. Replace the value */
+		bintrp->rtree_bt_value = entry_location;
+		return(0);
+	}
+	bt_root = ruletree_add_to_bintree_entry(entry_location,
+		ino_to_key(id->scriptinterp_ino), id->scriptinterp_dev,
+		last_visited_node, last_result);
+	if (bt_root)
+		ruletree_catalog_set("exec_cache", "script_interpreters", bt_root);
+	return(0);
+}
+
 /* =================== catalogs =================== */
 
 static ruletree_object_offset_t ruletree_create_catalog_entry(
@@ -1226,12 +1765,74 @@ ruletree_exec_preprocessing_rule_t *offset_to_exec_preprocessing_rule_ptr(int lo
 
 /* =================== Net rules =================== */
 
+/* Parse the address pattern of a net rule once, here, instead
+ * of every time when the rule is tested (see network/net_rules.c).
+ * Patterns that can't be parsed are left to be compared as strings.
+*/
+static void compile_net_rule_address(ruletree_net_rule_t *rule)
+{
+	const char	*pattern = NULL;
+	const char	*slash;
+	char		addrbuf[INET6_ADDRSTRLEN + 1];
+	size_t		len;
+	int		family;
+	int		max_bits;
+	int		prefix_len;
+
+	rule->rtree_net_addr_kind = SB2_RULETREE_NET_ADDR_STRING;
+	rule->rtree_net_addr_prefix_len = 0;
+	memset(rule->rtree_net_addr_bytes, 0, sizeof(rule->rtree_net_addr_bytes));
+
+	if (rule->rtree_net_address)
+		pattern = offset_to_ruletree_string_ptr(rule->rtree_net_address, NULL);
+	if (!pattern) return;
+
+	if (!strcmp(pattern, "INADDR_ANY")) {
+		rule->rtree_net_addr_kind = SB2_RULETREE_NET_ADDR_INADDR_ANY;
+		return;
+	}
+	if (!strcmp(pattern, "IN6ADDR_ANY")) {
+		rule->rtree_net_addr_kind = SB2_RULETREE_NET_ADDR_IN6ADDR_ANY;
+		return;
+	}
+
+	if (strchr(pattern, ':')) {
+		family = AF_INET6;
+		max_bits = 128;
+	} else {
+		family = AF_INET;
+		max_bits = 32;
+	}
+	slash = strchr(pattern, '/');
+	if (slash) {
+		prefix_len = atoi(slash + 1);
+		/* "/0" has never matched anything; keep it that way */
+		if ((prefix_len <= 0) || (prefix_len > max_bits)) return;
+		len = slash - pattern;
+	} else {
+		prefix_len = max_bits;
+		len = strlen(pattern);
+	}
+	if (len >= sizeof(addrbuf)) return;
+	memcpy(addrbuf, pattern, len);
+	addrbuf[len] = '\0';
+	if (inet_pton(family, addrbuf, rule->rtree_net_addr_bytes) != 1) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: '%s' is not numeric",
+			__func__, pattern);
+		return;
+	}
+	rule->rtree_net_addr_kind = (family == AF_INET ?
+		SB2_RULETREE_NET_ADDR_IPV4 : SB2_RULETREE_NET_ADDR_IPV6);
+	rule->rtree_net_addr_prefix_len = prefix_len;
+}
+
 ruletree_object_offset_t add_net_rule_to_ruletree(
         ruletree_net_rule_t     *rule)
 {
 	ruletree_object_offset_t rule_location = 0;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: ", __func__);
+	compile_net_rule_address(rule);
 	rule_location = append_struct_to_ruletree_file(rule, sizeof(*rule),
                 SB2_RULETREE_OBJECT_TYPE_NET_RULE);
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: done, @%u", __func__, rule_location);
@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -189,8 +190,9 @@ static int create_client_socket(void)
 */
 static pthread_mutex_t	client_socket_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int send_command_receive_reply(
+static int send_sized_command_receive_reply(
 	ruletree_rpc_msg_command_t	*command,
+	size_t				command_size,
 	ruletree_rpc_msg_reply_t	*reply)
 {
 	ssize_t	sent_msg_size;
@@ -229,7 +231,7 @@ static int send_command_receive_reply(
 
 	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
 	/* FIXME: fill serial */
-	sent_msg_size = sendto_nomap_nolog(client_socket, command, sizeof(*command), 0,
+	sent_msg_size = sendto_nomap_nolog(client_socket, command, command_size, 0,
 		(struct sockaddr*)&server_address, server_addr_len);
 	if (sent_msg_size < 0) {
 		switch (errno) {
@@ -274,6 +276,15 @@ static int send_command_receive_reply(
 	return(-1);
 }
 
+/* for all messages which use the default-sized union member */
+static int send_command_receive_reply(
+	ruletree_rpc_msg_command_t	*command,
+	ruletree_rpc_msg_reply_t	*reply)
+{
+	return(send_sized_command_receive_reply(command,
+		RULETREE_RPC_COMMAND_SIZE(sizeof(inodesimu_t)), reply));
+}
+
 void ruletree_rpc__ping(void)
 {
 	ruletree_rpc_msg_command_t	command;
@@ -329,24 +340,232 @@ char *sb2__ruletree_rpc__init2__(void)
 	return(ruletree_rpc__init2());
 }
 
+/* ---------- Write-behind of the status of new files ----------
+ *
+ * The simulated owner and group of every file created with simulated
+ * UID/GID used to be registered to sb2d with a synchronous RPC.
+ * Now the status of new inodes is collected here and sent to sb2d
+ * in batches (a NEWFILEINFO entry replaces the status of an inode
+ * completely). Later changes to a queued inode (chown(), chmod(),
+ * unlink() etc.) are applied to the queued entry, and inodestat lookups
+ * of this process see the queue, so the results of stat() don't
+ * change inside this process. Other processes see the status after
+ * the queue has been flushed: when it is full, when a file descriptor
+ * of a queued file is closed, before fork(), exec and posix_spawn(),
+ * and when the process exits. Files that were not created by open()
+ * (mkdir(), mknod(), fopen()...) are sent immediately, so that the
+ * status is never lost for longer than the file is kept open.
+*/
+static inodesimu_t	new_files[RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES];
+static int		new_files_fd[RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES];
+static uint32_t		num_new_files = 0;
+static int		new_files_atfork_registered = 0;
+static pthread_mutex_t	new_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_new_files(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&new_files_mutex);
+}
+
+static void unlock_new_files(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&new_files_mutex);
+}
+
+/* returns index of a queued inode, or -1. Called with the lock held */
+static int find_new_file(uint64_t dev, uint64_t ino)
+{
+	uint32_t	i;
+
+	for (i = 0; i < num_new_files; i++) {
+		if ((new_files[i].inodesimu_ino == ino) &&
+		    (new_files[i].inodesimu_dev == dev))
+			return((int)i);
+	}
+	return(-1);
+}
+
+/* send the queue to sb2d. Called with the lock held */
+static void flush_new_files_locked(void)
+{
+	ruletree_rpc_msg_command_t	command;
+	ruletree_rpc_msg_reply_t	reply;
+
+	if (num_new_files == 0) return;
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"ruletree_rpc: Sending status of %u new files", num_new_files);
+	memset(&command, 0, sizeof(command));
+	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__NEWFILEINFO;
+	command.rim_message.rimm_newfileinfo.rimm_nfi_num_entries = num_new_files;
+	memcpy(command.rim_message.rimm_newfileinfo.rimm_nfi_entries,
+		new_files, num_new_files * sizeof(inodesimu_t));
+	num_new_files = 0;
+	send_sized_command_receive_reply(&command,
+		offsetof(ruletree_rpc_msg_command_t,
+			rim_message.rimm_newfileinfo.rimm_nfi_entries) +
+		command.rim_message.rimm_newfileinfo.rimm_nfi_num_entries *
+			sizeof(inodesimu_t), &reply);
+}
+
+void ruletree_rpc__vperm_flush_new_files(void)
+{
+	if (num_new_files == 0) return;
+	lock_new_files();
+	flush_new_files_locked();
+	unlock_new_files();
+}
+
+static void flush_new_files_before_fork(void)
+{
+	ruletree_rpc__vperm_flush_new_files();
+}
+
+/* Queue the complete simulated status of a new inode. "fd" is
+ * the file descriptor that was opened when the file was created,
+ * or -1 if there isn't one; then the status is sent now. */
+void ruletree_rpc__vperm_new_file(const inodesimu_t *istat, int fd)
+{
+	int	i;
+
+	lock_new_files();
+	if (!new_files_atfork_registered) {
+		/* the child must not get a copy of the queue */
+		pthread_atfork(flush_new_files_before_fork, NULL, NULL);
+		new_files_atfork_registered = 1;
+	}
+	i = find_new_file(istat->inodesimu_dev, istat->inodesimu_ino);
+	if (i < 0) {
+		if (num_new_files >= RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES)
+			flush_new_files_locked();
+		i = (int)num_new_files++;
+	}
+	new_files[i] = *istat;
+	new_files_fd[i] = fd;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: dev=%llu ino=%llu fields=0x%X fd=%d (%u queued)",
+		__func__, (unsigned long long)istat->inodesimu_dev,
+		(unsigned long long)istat->inodesimu_ino,
+		istat->inodesimu_active_fields, fd, num_new_files);
+	if (fd < 0) flush_new_files_locked();
+	unlock_new_files();
+}
+
+/* Called after close(fd): flush the queue if "fd" belonged to a
+ * queued file */
+void ruletree_rpc__vperm_fd_closed(int fd)
+{
+	uint32_t	i;
+
+	if (num_new_files == 0) return;
+	lock_new_files();
+	for (i = 0; i < num_new_files; i++) {
+		if (new_files_fd[i] == fd) {
+			flush_new_files_locked();
+			break;
+		}
+	}
+	unlock_new_files();
+}
+
+/* Apply a SETFILEINFO, RELEASEFILEINFO or CLEARFILEINFO command
+ * to a queued inode, like sb2d would apply it to an existing
+ * inodestat entry. Returns 1 if the inode was in the queue.
+*/
+static int apply_to_new_file(const ruletree_rpc_msg_command_t *command)
+{
+	const inodesimu_t	*chg = &command->rim_message.rimm_fileinfo;
+	inodesimu_t		*ip;
+	int			i;
+
+	if (num_new_files == 0) return(0);
+	lock_new_files();
+	i = find_new_file(chg->inodesimu_dev, chg->inodesimu_ino);
+	if (i < 0) {
+		unlock_new_files();
+		return(0);
+	}
+	ip = &new_files[i];
+	switch (command->rimc_message_type) {
+	case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+		if (chg->inodesimu_active_fields & RULETREE_INODESTAT_SIM_UID)
+			ip->inodesimu_uid = chg->inodesimu_uid;
+		if (chg->inodesimu_active_fields & RULETREE_INODESTAT_SIM_GID)
+			ip->inodesimu_gid = chg->inodesimu_gid;
+		if (chg->inodesimu_active_fields &
+		    (RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID)) {
+			ip->inodesimu_mode = chg->inodesimu_mode;
+			ip->inodesimu_suidsgid = chg->inodesimu_suidsgid;
+			ip->inodesimu_active_fields &=
+				~(RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID);
+			ip->inodesimu_active_fields |= RULETREE_INODESTAT_SIM_MODE;
+		}
+		if (chg->inodesimu_active_fields & RULETREE_INODESTAT_SIM_DEVNODE) {
+			ip->inodesimu_devmode = chg->inodesimu_devmode;
+			ip->inodesimu_rdev = chg->inodesimu_rdev;
+		}
+		ip->inodesimu_active_fields |= chg->inodesimu_active_fields;
+		break;
+	case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+		ip->inodesimu_active_fields &= ~(chg->inodesimu_active_fields &
+			(RULETREE_INODESTAT_SIM_UID | RULETREE_INODESTAT_SIM_GID |
+			 RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_DEVNODE));
+		break;
+	case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+		ip->inodesimu_active_fields = 0;
+		break;
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: queued inode updated, fields=0x%X",
+		__func__, ip->inodesimu_active_fields);
+	unlock_new_files();
+	return(1);
+}
+
+/* Copy the status of a queued inode to "istat".
+ * Returns 0 if found, -1 if the inode is not in the queue */
+int ruletree_rpc__vperm_find_new_file(uint64_t dev, uint64_t ino,
+	inodesimu_t *istat)
+{
+	int	i;
+
+	if (num_new_files == 0) return(-1);
+	lock_new_files();
+	i = find_new_file(dev, ino);
+	if (i >= 0) *istat = new_files[i];
+	unlock_new_files();
+	return(i >= 0 ? 0 : -1);
+}
+
+uint32_t ruletree_rpc__vperm_num_new_files(void)
+{
+	return(num_new_files);
+}
+
+/* for SETFILEINFO, RELEASEFILEINFO and CLEARFILEINFO */
+static void send_fileinfo_command(ruletree_rpc_msg_command_t *command)
+{
+	ruletree_rpc_msg_reply_t	reply;
+
+	if (apply_to_new_file(command)) return;
+	send_command_receive_reply(command, &reply);
+}
+
 /* clear vperm info completely. */
 void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO;
 	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
 	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
 	int set_uid, uint32_t uid, int set_gid, uint32_t gid)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	if (set_uid) 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: uid=%d", __func__, uid);
@@ -361,14 +580,13 @@ void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
 		(set_gid ? RULETREE_INODESTAT_SIM_GID : 0);
 	command.rim_message.rimm_fileinfo.inodesimu_uid = uid;
 	command.rim_message.rimm_fileinfo.inodesimu_gid = gid;
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	int release_uid, int release_gid)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	SB_LOG(SB_LOGLEVEL_DEBUG, "%s: %s %s", __func__,
 		(release_uid?"rel.uid":""), (release_gid?"rel.gid":""));
@@ -379,14 +597,13 @@ void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
 		(release_uid ? RULETREE_INODESTAT_SIM_UID : 0) |
 		(release_gid ? RULETREE_INODESTAT_SIM_GID : 0);
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
@@ -405,13 +622,12 @@ void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 		command.rim_message.rimm_fileinfo.inodesimu_active_fields |=
 			RULETREE_INODESTAT_SIM_SUIDSGID;
 	}
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO;
@@ -419,14 +635,13 @@ void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
 	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
 	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
 		RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID;
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
         mode_t mode, uint64_t rdev)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
@@ -437,7 +652,38 @@ void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
 	command.rim_message.rimm_fileinfo.inodesimu_mode = mode & (~S_IFMT);
 	command.rim_message.rimm_fileinfo.inodesimu_devmode = mode & S_IFMT;
 	command.rim_message.rimm_fileinfo.inodesimu_rdev = rdev;
-	send_command_receive_reply(&command, &reply);
+	send_fileinfo_command(&command);
 }
 
 
+
+/* add a mapped script interpreter to the cache */
+void ruletree_rpc__set_script_interpreter(const scriptinterp_id_t *id,
+	const char *mapped_interpreter, const char *exec_policy_name,
+	const char *followed_symlinks)
+{
+	ruletree_rpc_msg_command_t	command;
+	ruletree_rpc_msg_reply_t	reply;
+	size_t	mi_len = strlen(mapped_interpreter) + 1;
+	size_t	ep_len = (exec_policy_name ? strlen(exec_policy_name) : 0) + 1;
+	size_t	fs_len = (followed_symlinks ? strlen(followed_symlinks) : 0) + 1;
+	char	*cp;
+
+	if (mi_len + ep_len + fs_len > RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s: too long, not cached (%s)",
+			__func__, mapped_interpreter);
+		return;
+	}
+	memset(&command, 0, sizeof(command));
+	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETSCRIPTINTERP;
+	command.rim_message.rimm_scriptinterp.rimm_si_id = *id;
+	cp = command.rim_message.rimm_scriptinterp.rimm_si_strings;
+	memcpy(cp, mapped_interpreter, mi_len);
+	if (exec_policy_name) memcpy(cp + mi_len, exec_policy_name, ep_len);
+	if (followed_symlinks)
+		memcpy(cp + mi_len + ep_len, followed_symlinks, fs_len);
+	send_sized_command_receive_reply(&command,
+		offsetof(ruletree_rpc_msg_command_t,
+			rim_message.rimm_scriptinterp.rimm_si_strings) +
+		mi_len + ep_len + fs_len, &reply);
+}
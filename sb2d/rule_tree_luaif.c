@@ -98,6 +98,40 @@ static int lua_sb_add_rule_to_ruletree(lua_State *l)
 	return 1;
 }
 
+/* ruletree.create_rule_index(rule_list_offs)
+*/
+static int lua_sb_create_rule_index(lua_State *l)
+{
+	int				n = lua_gettop(l);
+	ruletree_object_offset_t	index_offs = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t	list_offs = lua_tointeger(l, 1);
+		index_offs = create_rule_index_to_ruletree(list_offs);
+	}
+	SB_LOG(SB_LOGLEVEL_NOISE,
+		"lua_sb_create_rule_index => %d", index_offs);
+	lua_pushnumber(l, index_offs);
+	return 1;
+}
+
+/* ruletree.create_identity_prefixes(rule_list_offs)
+*/
+static int lua_sb_create_identity_prefixes(lua_State *l)
+{
+	int				n = lua_gettop(l);
+	ruletree_object_offset_t	ips_offs = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t	list_offs = lua_tointeger(l, 1);
+		ips_offs = create_identity_prefixes_to_ruletree(list_offs);
+	}
+	SB_LOG(SB_LOGLEVEL_NOISE,
+		"lua_sb_create_identity_prefixes => %d", ips_offs);
+	lua_pushnumber(l, ips_offs);
+	return 1;
+}
+
 /* ruletree.add_exec_preprocessing_rule_to_ruletree(...)
 */
 static int lua_sb_add_exec_preprocessing_rule_to_ruletree(lua_State *l)
@@ -523,6 +557,8 @@ static const luaL_Reg reg[] =
 
 	/* FS rules */
 	{"add_rule_to_ruletree",	lua_sb_add_rule_to_ruletree},
+	{"create_rule_index",		lua_sb_create_rule_index},
+	{"create_identity_prefixes",	lua_sb_create_identity_prefixes},
 
 	/* exec rules */
 	{"add_exec_preprocessing_rule_to_ruletree",	lua_sb_add_exec_preprocessing_rule_to_ruletree},
@@ -0,0 +1,796 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* Rule tree templates for sb2d.
+ *
+ * Building the rule tree (init.lua) is the most expensive part of
+ * session startup. If sb2d is started with "-C cache_dir", the result
+ * is saved to cache_dir as a template, and later sessions with
+ * identical inputs just copy the template to their RuleTree.bin.
+ *
+ * Templates are keyed by a hash of everything the rules are built from:
+ * the Lua scripts and rule files of the session directory, the
+ * environment variables that init.lua uses and sb2d's own parameters.
+ * Lookups that the Lua code makes to the real file system
+ * (sblib.path_exists(), sblib.readlink()) can't be part of the key;
+ * those are recorded to the template and repeated before it is used.
+ * External commands (os.execute(), io.popen()) can't be repeated
+ * like that, so no template is saved if the scripts run any.
+ *
+ * Names of the session directory are embedded to many strings in the
+ * rule tree. Session directories are created by mktemp(1) from a
+ * fixed-length template, so a template is relocated by replacing the
+ * old name by the new one, which has the same length (the length is
+ * part of the key). Rule indexes store the selectors character by
+ * character and are rebuilt after relocation.
+ *
+ * Files that init.lua writes to the session directory are stored to
+ * the template, too, and restored to new sessions.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sb2_server.h"
+
+#define RT_TEMPLATE_MAGIC	"SB2RTT01"
+
+/* max.depth of directories that are scanned for input files */
+#define RT_TEMPLATE_MAX_DEPTH	8
+
+typedef struct {
+	char		rtt_magic[8];
+	uint64_t	rtt_key;
+	uint32_t	rtt_session_dir_len;
+	uint32_t	rtt_num_records;
+	uint32_t	rtt_image_size;
+	uint32_t	rtt_reserved;
+} rt_template_hdr_t;
+
+/* The header is followed by the session dir name of the session that
+ * created the template, then the records, then the rule tree image. */
+typedef struct {
+	uint32_t	rtr_type;
+	uint32_t	rtr_name_len;
+	uint32_t	rtr_data_len;
+	uint32_t	rtr_mode;
+} rt_template_rec_t;
+
+#define RT_REC_PATH_EXISTS	1	/* sblib.path_exists() was true */
+#define RT_REC_PATH_MISSING	2	/* ..was false */
+#define RT_REC_READLINK		3	/* sblib.readlink(), data=result */
+#define RT_REC_READLINK_FAILED	4
+#define RT_REC_FILE		5	/* file created by init.lua */
+
+typedef struct {
+	int	rp_type;
+	char	*rp_path;
+	char	*rp_result;
+} rt_probe_t;
+
+static struct {
+	char		*rtc_cache_dir;
+	const char	*rtc_session_dir;
+	size_t		rtc_session_dir_len;
+	uint64_t	rtc_key;
+	char		*rtc_template_path;
+
+	rt_probe_t	*rtc_probes;
+	uint32_t	rtc_num_probes;
+	uint32_t	rtc_max_probes;
+
+	/* name of the first external command function that
+	 * was called by the Lua scripts, or NULL */
+	const char	*rtc_external_command_fn;
+
+	/* files that existed in the output directories before
+	 * init.lua was executed; sorted */
+	char		**rtc_old_files;
+	uint32_t	rtc_num_old_files;
+} rtc;
+
+/* Directories where init.lua creates files (relative to session dir) */
+static const char *rt_output_dirs[] = {
+	"", "rules_auto", "rev_rules", NULL
+};
+
+/* Inputs in the session directory */
+static const char *rt_input_paths[] = {
+	"sb2-session.conf", "exec_config.lua",
+	"lua_scripts", "rule_lib", "modes", "rules", "rules_auto",
+	"exec_rules", "net_rules", NULL
+};
+
+/* Environment variables that are used by the Lua scripts */
+static const char *rt_input_env_vars[] = {
+	"SB2_ALL_MODES", "SB2_ALL_NET_MODES", "SB2_DEFAULT_NETWORK_MODE",
+	"SSH_AUTH_SOCK", "SAILFISH_SDK_SRC1_MOUNT_POINT", "HOME", NULL
+};
+
+/* ---------- Key ---------- */
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char *cp = p;
+
+	while (n-- > 0) {
+		h ^= *cp++;
+		h *= 0x100000001b3ULL;
+	}
+	return(h);
+}
+
+static uint64_t hash_string(uint64_t h, const char *str)
+{
+	if (!str) return(hash_bytes(h, "\377", 1)); /* not set */
+	return(hash_bytes(h, str, strlen(str) + 1));
+}
+
+/* hash contents of a file, the session dir name is left out */
+static uint64_t hash_file(uint64_t h, const char *path)
+{
+	int	fd;
+	char	*buf = NULL;
+	struct stat st;
+	char	*cp, *end, *sd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return(hash_string(h, "<missing>"));
+	if ((fstat(fd, &st) < 0) || !(buf = malloc(st.st_size + 1)) ||
+	    (read(fd, buf, st.st_size) != st.st_size)) {
+		close(fd);
+		free(buf);
+		return(hash_string(h, "<unreadable>"));
+	}
+	close(fd);
+
+	cp = buf;
+	end = buf + st.st_size;
+	while ((sd = memmem(cp, end - cp, rtc.rtc_session_dir,
+			rtc.rtc_session_dir_len)) != NULL) {
+		h = hash_bytes(h, cp, sd - cp);
+		h = hash_string(h, "<session_dir>");
+		cp = sd + rtc.rtc_session_dir_len;
+	}
+	h = hash_bytes(h, cp, end - cp);
+	h = hash_string(h, "<eof>");
+	free(buf);
+	return(h);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return(strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/* read names of a directory, sorted. Returns number of names. */
+static int read_dir_names(const char *dirpath, char ***namesp)
+{
+	DIR		*d;
+	struct dirent	*de;
+	char		**names = NULL;
+	int		num = 0, max = 0;
+
+	*namesp = NULL;
+	if (!(d = opendir(dirpath))) return(0);
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (num >= max) {
+			char **new_names;
+
+			max = (max ? 2 * max : 32);
+			new_names = realloc(names, max * sizeof(char *));
+			if (!new_names) break;
+			names = new_names;
+		}
+		names[num++] = strdup(de->d_name);
+	}
+	closedir(d);
+	if (num > 0) qsort(names, num, sizeof(char *), compare_strings);
+	*namesp = names;
+	return(num);
+}
+
+static void free_names(char **names, int num)
+{
+	while (num-- > 0) free(names[num]);
+	free(names);
+}
+
+static uint64_t hash_input_path(uint64_t h, const char *relpath, int depth)
+{
+	char		*path = NULL;
+	struct stat	st;
+
+	if (asprintf(&path, "%s/%s", rtc.rtc_session_dir, relpath) < 0)
+		return(hash_string(h, "<error>"));
+
+	h = hash_string(h, relpath);
+	if (stat(path, &st) < 0) {
+		h = hash_string(h, "<missing>");
+	} else if (S_ISREG(st.st_mode)) {
+		h = hash_file(h, path);
+	} else if (S_ISDIR(st.st_mode) && (depth < RT_TEMPLATE_MAX_DEPTH)) {
+		char	**names;
+		int	num, i;
+
+		num = read_dir_names(path, &names);
+		for (i = 0; i < num; i++) {
+			char *subpath = NULL;
+
+			if (asprintf(&subpath, "%s/%s", relpath, names[i]) < 0)
+				continue;
+			h = hash_input_path(h, subpath, depth + 1);
+			free(subpath);
+		}
+		free_names(names, num);
+	}
+	free(path);
+	return(h);
+}
+
+static uint64_t compute_key(const ruletree_hdr_t *hdr)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+	struct stat	st;
+	uint32_t	n;
+	const char	**cpp;
+	char		*sbrules = NULL;
+
+	h = hash_string(h, RT_TEMPLATE_MAGIC);
+	h = hash_string(h, SB2D_LUA_C_INTERFACE_VERSION);
+	h = hash_bytes(h, &hdr->rtree_version, sizeof(hdr->rtree_version));
+	h = hash_bytes(h, &hdr->rtree_max_size, sizeof(hdr->rtree_max_size));
+	h = hash_bytes(h, &hdr->rtree_min_mmap_addr,
+		sizeof(hdr->rtree_min_mmap_addr));
+	h = hash_bytes(h, &hdr->rtree_min_client_socket_fd,
+		sizeof(hdr->rtree_min_client_socket_fd));
+	n = rtc.rtc_session_dir_len;
+	h = hash_bytes(h, &n, sizeof(n));
+
+	/* a rebuilt sb2d may build a different tree */
+	if (stat("/proc/self/exe", &st) == 0) {
+		h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+		h = hash_bytes(h, &st.st_mtime, sizeof(st.st_mtime));
+	}
+
+	for (cpp = rt_input_env_vars; *cpp; cpp++) {
+		h = hash_string(h, *cpp);
+		h = hash_string(h, getenv(*cpp));
+	}
+	for (cpp = rt_input_paths; *cpp; cpp++)
+		h = hash_input_path(h, *cpp, 0);
+
+	/* user's own rules, see rule_lib/fs_rules/user_rules.lua */
+	if (getenv("HOME") &&
+	    (asprintf(&sbrules, "%s/.sbrules", getenv("HOME")) >= 0)) {
+		h = hash_file(h, sbrules);
+		free(sbrules);
+	}
+	return(h);
+}
+
+/* ---------- Files created by init.lua ---------- */
+
+/* add regular files of the output directories to *names */
+static int list_output_files(char ***namesp)
+{
+	char		**names = NULL;
+	int		num = 0;
+	const char	**dpp;
+
+	for (dpp = rt_output_dirs; *dpp; dpp++) {
+		char	*dirpath = NULL;
+		char	**dnames;
+		int	dnum, i;
+		char	**new_names;
+
+		if (asprintf(&dirpath, "%s/%s", rtc.rtc_session_dir, *dpp) < 0)
+			continue;
+		dnum = read_dir_names(dirpath, &dnames);
+		new_names = realloc(names, (num + dnum + 1) * sizeof(char *));
+		if (!new_names) {
+			free_names(dnames, dnum);
+			free(dirpath);
+			continue;
+		}
+		names = new_names;
+		for (i = 0; i < dnum; i++) {
+			char		*relpath = NULL;
+			char		*path = NULL;
+			struct stat	st;
+
+			if ((asprintf(&relpath, "%s%s%s", *dpp, (**dpp ? "/" : ""),
+				dnames[i]) >= 0) &&
+			    (asprintf(&path, "%s/%s", rtc.rtc_session_dir,
+				relpath) >= 0) &&
+			    (lstat(path, &st) == 0) && S_ISREG(st.st_mode) &&
+			    strcmp(relpath, "RuleTree.bin")) {
+				names[num++] = relpath;
+				relpath = NULL;
+			}
+			free(relpath);
+			free(path);
+		}
+		free_names(dnames, dnum);
+		free(dirpath);
+	}
+	if (num > 0) qsort(names, num, sizeof(char *), compare_strings);
+	*namesp = names;
+	return(num);
+}
+
+/* ---------- Probes ---------- */
+
+static int is_readlink_probe(int type)
+{
+	return((type == RT_REC_READLINK) || (type == RT_REC_READLINK_FAILED));
+}
+
+static void record_fs_probe(const char *fn_name, const char *path,
+	const char *result)
+{
+	uint32_t	i;
+	int		type;
+
+	/* contents of the session dir are covered by the key */
+	if (!strncmp(path, rtc.rtc_session_dir, rtc.rtc_session_dir_len) &&
+	    ((path[rtc.rtc_session_dir_len] == '/') ||
+	     (path[rtc.rtc_session_dir_len] == '\0')))
+		return;
+
+	if (!strcmp(fn_name, "path_exists")) {
+		type = (result && !strcmp(result, "1")) ?
+			RT_REC_PATH_EXISTS : RT_REC_PATH_MISSING;
+	} else {
+		type = result ? RT_REC_READLINK : RT_REC_READLINK_FAILED;
+	}
+
+	for (i = 0; i < rtc.rtc_num_probes; i++) {
+		if ((is_readlink_probe(rtc.rtc_probes[i].rp_type) ==
+		     is_readlink_probe(type)) &&
+		    !strcmp(rtc.rtc_probes[i].rp_path, path))
+			return; /* the first result is what counted */
+	}
+	if (rtc.rtc_num_probes >= rtc.rtc_max_probes) {
+		uint32_t	new_max = (rtc.rtc_max_probes ?
+					2 * rtc.rtc_max_probes : 64);
+		rt_probe_t	*new_probes = realloc(rtc.rtc_probes,
+					new_max * sizeof(rt_probe_t));
+
+		if (!new_probes) return;
+		rtc.rtc_probes = new_probes;
+		rtc.rtc_max_probes = new_max;
+	}
+	rtc.rtc_probes[rtc.rtc_num_probes].rp_type = type;
+	rtc.rtc_probes[rtc.rtc_num_probes].rp_path = strdup(path);
+	rtc.rtc_probes[rtc.rtc_num_probes].rp_result =
+		(type == RT_REC_READLINK) ? strdup(result) : NULL;
+	rtc.rtc_num_probes++;
+}
+
+/* returns nonzero if the probe still gives the same result */
+static int probe_is_valid(int type, const char *path,
+	const char *data, uint32_t data_len)
+{
+	char	buf[PATH_MAX + 1];
+	ssize_t	len;
+
+	switch (type) {
+	case RT_REC_PATH_EXISTS:
+		return(sb_path_exists(path));
+	case RT_REC_PATH_MISSING:
+		return(!sb_path_exists(path));
+	case RT_REC_READLINK:
+		len = readlink(path, buf, PATH_MAX);
+		return((len >= 0) && ((uint32_t)len == data_len) &&
+			!memcmp(buf, data, len));
+	case RT_REC_READLINK_FAILED:
+		return(readlink(path, buf, PATH_MAX) < 0);
+	}
+	return(0);
+}
+
+/* ---------- Public routines ---------- */
+
+/* Replacement for os.execute() and io.popen(): the result depends
+ * on things that are not part of the key, so the rule tree
+ * can't be saved. Upvalues: the original function and its name. */
+static int lua_external_command_wrapper(lua_State *l)
+{
+	if (rtc.rtc_template_path && !rtc.rtc_external_command_fn) {
+		rtc.rtc_external_command_fn =
+			lua_tostring(l, lua_upvalueindex(2));
+		SB_LOG(SB_LOGLEVEL_INFO,
+			"Rules run an external command (%s), "
+			"the rule tree won't be saved as a template",
+			rtc.rtc_external_command_fn);
+	}
+	lua_pushvalue(l, lua_upvalueindex(1));
+	lua_insert(l, 1);
+	lua_call(l, lua_gettop(l) - 1, LUA_MULTRET);
+	return(lua_gettop(l));
+}
+
+static void wrap_lua_function(lua_State *l, const char *libname,
+	const char *fn_name, const char *full_name)
+{
+	lua_getglobal(l, libname);
+	if (lua_istable(l, -1)) {
+		lua_getfield(l, -1, fn_name);
+		if (lua_isfunction(l, -1)) {
+			lua_pushstring(l, full_name);
+			lua_pushcclosure(l, lua_external_command_wrapper, 2);
+			lua_setfield(l, -2, fn_name);
+		} else {
+			lua_pop(l, 1);
+		}
+	}
+	lua_pop(l, 1);
+}
+
+/* Called when a Lua state has been created for init.lua */
+void ruletree_cache_bind_lua(lua_State *l)
+{
+	if (!rtc.rtc_template_path) return;
+	wrap_lua_function(l, "os", "execute", "os.execute");
+	wrap_lua_function(l, "io", "popen", "io.popen");
+}
+
+/* Prepare for using the cache: compute the key and start recording
+ * what the Lua scripts look up. Returns 0 if OK.
+*/
+int ruletree_cache_prepare(const char *cache_dir, const char *session_dir)
+{
+	const ruletree_hdr_t	*hdr;
+	size_t			size;
+
+	hdr = ruletree_get_image(&size);
+	if (!hdr || !cache_dir || !*cache_dir || !session_dir) return(-1);
+
+	rtc.rtc_cache_dir = strdup(cache_dir);
+	rtc.rtc_session_dir = session_dir;
+	rtc.rtc_session_dir_len = strlen(session_dir);
+	rtc.rtc_key = compute_key(hdr);
+	if (asprintf(&rtc.rtc_template_path, "%s/ruletree-%016llx.bin",
+	    cache_dir, (unsigned long long)rtc.rtc_key) < 0) {
+		rtc.rtc_template_path = NULL;
+		return(-1);
+	}
+	rtc.rtc_num_old_files = list_output_files(&rtc.rtc_old_files);
+	sblib_luaif_fs_probe_hook = record_fs_probe;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Rule tree template: %s",
+		rtc.rtc_template_path);
+	return(0);
+}
+
+/* replace all occurrences of old session dir by the new one */
+static void relocate_buffer(char *buf, size_t size, const char *old_sd)
+{
+	char	*cp = buf;
+	char	*end = buf + size;
+
+	while ((cp = memmem(cp, end - cp, old_sd,
+			rtc.rtc_session_dir_len)) != NULL) {
+		memcpy(cp, rtc.rtc_session_dir, rtc.rtc_session_dir_len);
+		cp += rtc.rtc_session_dir_len;
+	}
+}
+
+static int restore_file(const char *relpath, const char *data,
+	uint32_t data_len, mode_t mode)
+{
+	char	*path = NULL;
+	int	fd;
+	int	r = -1;
+
+	if (strstr(relpath, "..") ||
+	    (asprintf(&path, "%s/%s", rtc.rtc_session_dir, relpath) < 0))
+		return(-1);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 0777);
+	if (fd >= 0) {
+		if (write(fd, data, data_len) == (ssize_t)data_len) r = 0;
+		close(fd);
+	}
+	free(path);
+	return(r);
+}
+
+/* rule indexes contain the selectors as a tree of characters,
+ * build new ones after the strings have been relocated. */
+static void rebuild_rule_indexes(void)
+{
+	ruletree_object_offset_t	entry_offs;
+
+	entry_offs = ruletree_catalog_find_value_from_catalog(0,
+		"rev_rules_index");
+	while (entry_offs) {
+		ruletree_catalog_entry_t	*ep;
+		ruletree_rule_index_t		*ri;
+
+		ep = offset_to_ruletree_object_ptr(entry_offs,
+			SB2_RULETREE_OBJECT_TYPE_CATALOG);
+		if (!ep) break;
+		ri = offset_to_ruletree_object_ptr(ep->rtree_cat_value_offs,
+			SB2_RULETREE_OBJECT_TYPE_RULE_INDEX);
+		if (ri) {
+			ruletree_object_offset_t new_index;
+
+			new_index = create_rule_index_to_ruletree(
+				ri->rtree_ri_rule_list);
+			/* ep is still valid, the file is mmap'ed
+			 * with the maximum size */
+			ep->rtree_cat_value_offs = new_index;
+		}
+		entry_offs = ep->rtree_cat_next_entry_offs;
+	}
+}
+
+/* Fill the rule tree from a template, if a valid one exists.
+ * Returns 0 if the rule tree is ready, -1 if init.lua must be used.
+*/
+int ruletree_cache_load(void)
+{
+	int			fd;
+	struct stat		st;
+	char			*buf = NULL;
+	const rt_template_hdr_t	*th;
+	char			*cp, *end;
+	const char		*old_sd;
+	uint32_t		i;
+	int			result = -1;
+
+	if (!rtc.rtc_template_path) return(-1);
+
+	fd = open(rtc.rtc_template_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_INFO, "No rule tree template (%s)",
+			rtc.rtc_template_path);
+		return(-1);
+	}
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < (off_t)sizeof(rt_template_hdr_t)) ||
+	    !(buf = malloc(st.st_size)) ||
+	    (read(fd, buf, st.st_size) != st.st_size)) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "Failed to read %s",
+			rtc.rtc_template_path);
+		goto out;
+	}
+	th = (const rt_template_hdr_t *)buf;
+	end = buf + st.st_size;
+	if (memcmp(th->rtt_magic, RT_TEMPLATE_MAGIC, sizeof(th->rtt_magic)) ||
+	    (th->rtt_key != rtc.rtc_key) ||
+	    (th->rtt_session_dir_len != rtc.rtc_session_dir_len) ||
+	    (sizeof(*th) + th->rtt_session_dir_len +
+	     (uint64_t)th->rtt_image_size > (uint64_t)st.st_size)) {
+		SB_LOG(SB_LOGLEVEL_INFO, "Rule tree template %s doesn't match",
+			rtc.rtc_template_path);
+		goto out;
+	}
+	old_sd = buf + sizeof(*th);
+	cp = buf + sizeof(*th) + th->rtt_session_dir_len;
+
+	/* first pass: check that the probes still give
+	 * the same results */
+	for (i = 0; i < th->rtt_num_records; i++) {
+		rt_template_rec_t	rec;
+		char			*name;
+
+		if ((size_t)(end - cp) < sizeof(rec)) goto broken;
+		memcpy(&rec, cp, sizeof(rec));
+		cp += sizeof(rec);
+		if ((uint64_t)rec.rtr_name_len + rec.rtr_data_len + 1 >
+		    (uint64_t)(end - cp)) goto broken;
+		name = cp;
+		if (name[rec.rtr_name_len] != '\0') goto broken;
+		if ((rec.rtr_type != RT_REC_FILE) &&
+		    !probe_is_valid(rec.rtr_type, name,
+			name + rec.rtr_name_len + 1, rec.rtr_data_len)) {
+			SB_LOG(SB_LOGLEVEL_INFO,
+				"Rule tree template is out of date (%s)",
+				name);
+			goto out;
+		}
+		cp += rec.rtr_name_len + 1 + rec.rtr_data_len;
+	}
+	if ((size_t)(end - cp) != th->rtt_image_size) goto broken;
+
+	/* second pass: relocate and restore the files. */
+	relocate_buffer(cp, th->rtt_image_size, old_sd);
+	cp = buf + sizeof(*th) + th->rtt_session_dir_len;
+	for (i = 0; i < th->rtt_num_records; i++) {
+		rt_template_rec_t	rec;
+		char			*name;
+
+		memcpy(&rec, cp, sizeof(rec));
+		cp += sizeof(rec);
+		name = cp;
+		cp += rec.rtr_name_len + 1;
+		if (rec.rtr_type == RT_REC_FILE) {
+			relocate_buffer(cp, rec.rtr_data_len, old_sd);
+			if (restore_file(name, cp, rec.rtr_data_len,
+			    rec.rtr_mode) < 0) {
+				SB_LOG(SB_LOGLEVEL_ERROR,
+					"Failed to restore %s from template",
+					name);
+				goto out;
+			}
+		}
+		cp += rec.rtr_data_len;
+	}
+
+	if (ruletree_load_image(cp, th->rtt_image_size) < 0) goto out;
+	rebuild_rule_indexes();
+
+	sblib_luaif_fs_probe_hook = NULL;
+	SB_LOG(SB_LOGLEVEL_INFO, "Rule tree copied from template %s",
+		rtc.rtc_template_path);
+	result = 0;
+	goto out;
+
+    broken:
+	SB_LOG(SB_LOGLEVEL_ERROR, "Rule tree template %s is broken",
+		rtc.rtc_template_path);
+    out:
+	close(fd);
+	free(buf);
+	return(result);
+}
+
+static int write_record(int fd, int type, const char *name,
+	const char *data, uint32_t data_len, mode_t mode)
+{
+	rt_template_rec_t	rec;
+
+	rec.rtr_type = type;
+	rec.rtr_name_len = strlen(name);
+	rec.rtr_data_len = data_len;
+	rec.rtr_mode = mode;
+	if ((write(fd, &rec, sizeof(rec)) != sizeof(rec)) ||
+	    (write(fd, name, rec.rtr_name_len + 1) !=
+		(ssize_t)rec.rtr_name_len + 1) ||
+	    (data_len && (write(fd, data, data_len) != (ssize_t)data_len)))
+		return(-1);
+	return(0);
+}
+
+/* returns number of records written, -1 if failed */
+static int write_output_files(int fd)
+{
+	char	**names;
+	int	num, i;
+	int	num_written = 0;
+
+	num = list_output_files(&names);
+	for (i = 0; i < num; i++) {
+		char		*path = NULL;
+		char		*data = NULL;
+		struct stat	st;
+		int		ffd = -1;
+
+		if (bsearch(&names[i], rtc.rtc_old_files, rtc.rtc_num_old_files,
+		    sizeof(char *), compare_strings))
+			continue;
+		if ((asprintf(&path, "%s/%s", rtc.rtc_session_dir,
+			names[i]) < 0) ||
+		    ((ffd = open(path, O_RDONLY | O_CLOEXEC)) < 0) ||
+		    (fstat(ffd, &st) < 0) ||
+		    !(data = malloc(st.st_size + 1)) ||
+		    (read(ffd, data, st.st_size) != st.st_size) ||
+		    (write_record(fd, RT_REC_FILE, names[i], data,
+			st.st_size, st.st_mode) < 0)) {
+			num_written = -1;
+		} else if (num_written >= 0) {
+			num_written++;
+		}
+		if (ffd >= 0) close(ffd);
+		free(data);
+		free(path);
+		if (num_written < 0) break;
+	}
+	free_names(names, num);
+	return(num_written);
+}
+
+/* Save the rule tree (built by init.lua) as a template.
+ * Errors are logged, but otherwise ignored.
+*/
+void ruletree_cache_save(void)
+{
+	rt_template_hdr_t	th;
+	const void		*image;
+	size_t			image_size;
+	char			*tmp_path = NULL;
+	int			fd;
+	uint32_t		i;
+	int			num_files;
+
+	sblib_luaif_fs_probe_hook = NULL;
+	if (!rtc.rtc_template_path) return;
+	if (rtc.rtc_external_command_fn) {
+		SB_LOG(SB_LOGLEVEL_NOTICE,
+			"Rule tree not saved to template: rules used %s",
+			rtc.rtc_external_command_fn);
+		return;
+	}
+	image = ruletree_get_image(&image_size);
+	if (!image) return;
+
+	if ((mkdir(rtc.rtc_cache_dir, 0700) < 0) && (errno != EEXIST)) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"Failed to create rule tree cache directory %s",
+			rtc.rtc_cache_dir);
+		return;
+	}
+	/* write to a temporary file and rename, concurrent
+	 * sessions may be doing the same. */
+	if (asprintf(&tmp_path, "%s.%d.tmp", rtc.rtc_template_path,
+	    (int)getpid()) < 0) return;
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "Failed to create %s", tmp_path);
+		free(tmp_path);
+		return;
+	}
+
+	/* the header is rewritten when the number of records is known */
+	memset(&th, 0, sizeof(th));
+	if ((write(fd, &th, sizeof(th)) != sizeof(th)) ||
+	    (write(fd, rtc.rtc_session_dir, rtc.rtc_session_dir_len) !=
+		(ssize_t)rtc.rtc_session_dir_len))
+		goto failed;
+
+	for (i = 0; i < rtc.rtc_num_probes; i++) {
+		rt_probe_t	*p = &rtc.rtc_probes[i];
+
+		if (write_record(fd, p->rp_type, p->rp_path, p->rp_result,
+		    (p->rp_result ? strlen(p->rp_result) : 0), 0) < 0)
+			goto failed;
+	}
+	if ((num_files = write_output_files(fd)) < 0) goto failed;
+	if (write(fd, image, image_size) != (ssize_t)image_size) goto failed;
+
+	memcpy(th.rtt_magic, RT_TEMPLATE_MAGIC, sizeof(th.rtt_magic));
+	th.rtt_key = rtc.rtc_key;
+	th.rtt_session_dir_len = rtc.rtc_session_dir_len;
+	th.rtt_num_records = rtc.rtc_num_probes + num_files;
+	th.rtt_image_size = image_size;
+	if (pwrite(fd, &th, sizeof(th), 0) != sizeof(th)) goto failed;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto failed;
+	}
+	if (rename(tmp_path, rtc.rtc_template_path) < 0) {
+		fd = -1;
+		goto failed;
+	}
+	SB_LOG(SB_LOGLEVEL_INFO,
+		"Rule tree saved to template %s (%u probes, %d files)",
+		rtc.rtc_template_path, rtc.rtc_num_probes, num_files);
+	free(tmp_path);
+	return;
+
+    failed:
+	SB_LOG(SB_LOGLEVEL_ERROR, "Failed to write rule tree template %s",
+		tmp_path);
+	if (fd >= 0) close(fd);
+	unlink(tmp_path);
+	free(tmp_path);
+}
@@ -206,6 +206,96 @@ static void ruletree_cmd_releasefileinfo(
 	}
 }
 
+/* NEWFILEINFO: the status of new inodes, queued by a client.
+ * Each entry replaces the status of an inode completely.
+*/
+static void ruletree_cmd_newfileinfo(
+	ruletree_rpc_msg_command_t *command,
+	ruletree_rpc_msg_reply_t *reply)
+{
+	uint32_t	num_entries;
+	uint32_t	i;
+
+	num_entries = command->rim_message.rimm_newfileinfo.rimm_nfi_num_entries;
+	if (num_entries > RULETREE_RPC_NEWFILEINFO_MAX_ENTRIES) {
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	for (i = 0; i < num_entries; i++) {
+		inodesimu_t			*new_istat;
+		inodesimu_t			istat_in_db;
+		ruletree_inodestat_handle_t	handle;
+		uint32_t			prev_active_fields = 0;
+
+		new_istat = &command->rim_message.rimm_newfileinfo.rimm_nfi_entries[i];
+		SB_LOG(SB_LOGLEVEL_DEBUG, "newfileinfo dev=%lld ino=%lld fields=0x%X",
+			(long long)new_istat->inodesimu_dev,
+			(long long)new_istat->inodesimu_ino,
+			new_istat->inodesimu_active_fields);
+
+		ruletree_init_inodestat_handle(&handle,
+			new_istat->inodesimu_dev, new_istat->inodesimu_ino);
+		if (ruletree_find_inodestat(&handle, &istat_in_db) < 0) {
+			/* not found. Nothing to do if nothing is simulated */
+			if (new_istat->inodesimu_active_fields == 0) continue;
+		} else {
+			prev_active_fields = istat_in_db.inodesimu_active_fields;
+		}
+		ruletree_set_inodestat(&handle, new_istat);
+		/* FIXME ###################### Check return value */
+
+		if ((prev_active_fields == 0) &&
+		    (new_istat->inodesimu_active_fields != 0))
+			inc_vperm_num_active_inodestats();
+		else if ((prev_active_fields != 0) &&
+		    (new_istat->inodesimu_active_fields == 0))
+			dec_vperm_num_active_inodestats();
+	}
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+}
+
+static void ruletree_cmd_setscriptinterp(
+	ruletree_rpc_msg_command_t *command,
+	ruletree_rpc_msg_reply_t *reply)
+{
+	char	*strings = command->rim_message.rimm_scriptinterp.rimm_si_strings;
+	const char	*mapped_interpreter;
+	const char	*exec_policy_name;
+	const char	*followed_symlinks;
+	size_t	mi_len;
+	size_t	ep_len;
+
+	/* all strings must be inside the buffer */
+	strings[RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE - 1] = '\0';
+	mapped_interpreter = strings;
+	mi_len = strlen(mapped_interpreter);
+	if (mi_len + 1 >= RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE) {
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	exec_policy_name = strings + mi_len + 1;
+	ep_len = strlen(exec_policy_name);
+	if (mi_len + 1 + ep_len + 1 >= RULETREE_RPC_SCRIPTINTERP_MAX_STR_SIZE) {
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	followed_symlinks = exec_policy_name + ep_len + 1;
+
+	SB_LOG(SB_LOGLEVEL_DEBUG, "setscriptinterp dev=%lld ino=%lld '%s' '%s'",
+		(long long)command->rim_message.rimm_scriptinterp.rimm_si_id.scriptinterp_dev,
+		(long long)command->rim_message.rimm_scriptinterp.rimm_si_id.scriptinterp_ino,
+		mapped_interpreter, exec_policy_name);
+
+	if ((*mapped_interpreter != '/') ||
+	    (ruletree_set_scriptinterp(
+		&command->rim_message.rimm_scriptinterp.rimm_si_id,
+		mapped_interpreter, exec_policy_name, followed_symlinks) < 0)) {
+		reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__FAILED;
+		return;
+	}
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__OK;
+}
+
 static void ruletree_cmd_init2(ruletree_rpc_msg_reply_t *reply)
 {
 	char *result;
@@ -263,6 +353,14 @@ void ruletree_server(void)
 					ruletree_cmd_clearfileinfo(&command,&reply);
 					break;
 
+				case RULETREE_RPC_MESSAGE_COMMAND__SETSCRIPTINTERP:
+					ruletree_cmd_setscriptinterp(&command,&reply);
+					break;
+
+				case RULETREE_RPC_MESSAGE_COMMAND__NEWFILEINFO:
+					ruletree_cmd_newfileinfo(&command,&reply);
+					break;
+
 				default:
 					reply.hdr.rimr_message_type =
 						RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
@@ -16,6 +16,12 @@
 
 extern char *execute_init2_script(void);
 
+/* ruletree_cache.c */
+extern int ruletree_cache_prepare(const char *cache_dir, const char *session_dir);
+extern int ruletree_cache_load(void);
+extern void ruletree_cache_save(void);
+extern void ruletree_cache_bind_lua(lua_State *l);
+
 extern void create_server_socket(void);
 extern void ruletree_server(void);
 
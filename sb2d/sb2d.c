@@ -135,6 +135,21 @@ static char *read_string_variable_from_lua(const char *name)
 	return(result);
 }
 
+/* create the Lua state; the rules are added by init.lua */
+static void create_lua_state(void)
+{
+	sb2d_lua = luaL_newstate();
+	lua_atpanic(sb2d_lua, sb2_lua_panic);
+
+	luaL_openlibs(sb2d_lua);
+#if 0
+	lua_bind_sb_functions(sb2d_lua); /* register our sb_ functions */
+#endif
+	lua_bind_ruletree_functions(sb2d_lua); /* register our ruletree_ functions */
+	lua_bind_sblib_functions(sb2d_lua); /* register our sblib.* functions */
+	ruletree_cache_bind_lua(sb2d_lua); /* watch for external commands */
+}
+
 static void initialize_lua(void)
 {
 	char *main_lua_script = NULL;
@@ -149,15 +164,7 @@ static void initialize_lua(void)
 		
 	SB_LOG(SB_LOGLEVEL_INFO, "Loading '%s'", main_lua_script);
 
-	sb2d_lua = luaL_newstate();
-	lua_atpanic(sb2d_lua, sb2_lua_panic);
-
-	luaL_openlibs(sb2d_lua);
-#if 0
-	lua_bind_sb_functions(sb2d_lua); /* register our sb_ functions */
-#endif
-	lua_bind_ruletree_functions(sb2d_lua); /* register our ruletree_ functions */
-	lua_bind_sblib_functions(sb2d_lua); /* register our sblib.* functions */
+	create_lua_state();
 
 	load_and_execute_lua_file(main_lua_script);
 
@@ -237,6 +244,7 @@ int main(int argc, char *argv[])
 	uint32_t max_size = 16*1024*1024; /* default 16MB */
 	uint64_t min_mmap_addr = 0;
 	int	min_client_socket_fd = 279;
+	char	*ruletree_cache_dir = NULL;
 
 	progname = argv[0];
 
@@ -251,7 +259,7 @@ int main(int argc, char *argv[])
 	assert(sizeof(uint32_t) >= sizeof(gid_t));
 	assert(sizeof(uint32_t) >= sizeof(mode_t));
 
-	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:C:")) != -1) {
 		switch (opt) {
 		case 'd':
 			debug_level = strdup(optarg);
@@ -280,6 +288,9 @@ int main(int argc, char *argv[])
 		case 'F':
 			min_client_socket_fd = parse_num(optarg);
 			break;
+		case 'C':
+			ruletree_cache_dir = strdup(optarg);
+			break;
 		default:
 			fprintf(stderr, "Illegal option\n");
 			exit(1);
@@ -315,7 +326,16 @@ int main(int argc, char *argv[])
 	}
 	SB_LOG(SB_LOGLEVEL_DEBUG, "Rule tree file opened & mapped to memory");
 
-	initialize_lua();
+	if (ruletree_cache_dir &&
+	    (ruletree_cache_prepare(ruletree_cache_dir, sbox_session_dir) == 0) &&
+	    (ruletree_cache_load() == 0)) {
+		/* rules came from the template; init2.lua
+		 * still needs Lua. */
+		create_lua_state();
+	} else {
+		initialize_lua();
+		if (ruletree_cache_dir) ruletree_cache_save();
+	}
 
 	/* ----- Server ----- */
 	if (start_server) {
@@ -26,9 +26,17 @@
  * of sb2: sb2-monitor/sb2-exitreport notices if errors or warnings have
  * been generated during the session, and sb2-logz can be used to generate
  * summaries.
+ *
+ * Additionally, process starts and execs can be recorded to a binary
+ * exec trace file (environment variable "SBOX_EXEC_TRACEFILE").
+ * That is independent of the log level; each event is one fixed-size
+ * record, written with a single write(), so there is no formatting
+ * cost. sb2-logz reads it with option -T, as a cheaper alternative
+ * to parsing the "Starting" and "EXEC" lines from the log.
 */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -74,6 +82,36 @@
 
 #define LOGFILE_NAME_BUFSIZE 512
 
+/* -------- Binary exec trace records.
+ * NOTE: This format is read by the log postprocessor script "sb2-logz"
+ *       (see read_exec_trace_file() there). Do not change without
+ *       making a corresponding change to the script!
+ * Records are in host byte order, strings are NUL-padded.
+*/
+#define EXEC_TRACE_MAGIC	0x54324253	/* "SB2T" */
+#define EXEC_TRACE_VERSION	1
+
+#define EXEC_TRACE_EVENT_START	1	/* process started (logger initialized) */
+#define EXEC_TRACE_EVENT_EXEC	2	/* about to call execve()/posix_spawn() */
+
+#define EXEC_TRACE_NAME_MAXLEN	256
+#define EXEC_TRACE_POLICY_MAXLEN 64
+
+struct exec_trace_record_s {
+	uint32_t	etr_magic;
+	uint16_t	etr_version;
+	uint16_t	etr_event;
+	int32_t		etr_pid;
+	int32_t		etr_ppid;
+	int32_t		etr_i_pid;	/* PID when the logger was initialized */
+	uint32_t	etr_tstamp_sec;
+	uint32_t	etr_tstamp_msec;
+	char		etr_binary_name[LOG_BINARYNAME_MAXLEN];
+	/* START: sbox_exec_name, EXEC: the file to be executed */
+	char		etr_exec_name[EXEC_TRACE_NAME_MAXLEN];
+	char		etr_exec_policy[EXEC_TRACE_POLICY_MAXLEN];
+};
+
 /* ===================== Internal state variables =====================
  *
  * N.B. no mutex protecting concurrent writing to these variables.
@@ -86,11 +124,13 @@ static struct sb_log_state_s {
 	int		sbl_simple_format;
 	char		sbl_binary_name[LOG_BINARYNAME_MAXLEN];
 	char		sbl_logfile[LOGFILE_NAME_BUFSIZE];
+	char		sbl_exec_tracefile[LOGFILE_NAME_BUFSIZE];
 } sb_log_state = {
 	.sbl_print_file_and_line = 0,
 	.sbl_simple_format = 0,
 	.sbl_binary_name = {0},
 	.sbl_logfile = {0},
+	.sbl_exec_tracefile = {0},
 };
 
 /* ===================== public variables ===================== */
@@ -154,6 +194,47 @@ static void write_to_logfile(const char *msg, int msglen)
 	}
 }
 
+/* Append one record to the exec trace file. Same open-write-close
+ * strategy as write_to_logfile(); O_APPEND makes sure that records
+ * from concurrent processes are not mixed.
+*/
+static void write_exec_trace_record(int event, const char *exec_name)
+{
+	struct exec_trace_record_s	rec;
+	struct timeval			now;
+	int				fd;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.etr_magic = EXEC_TRACE_MAGIC;
+	rec.etr_version = EXEC_TRACE_VERSION;
+	rec.etr_event = event;
+	rec.etr_pid = getpid();
+	rec.etr_ppid = getppid();
+	rec.etr_i_pid = sb_log_initial_pid__ ? sb_log_initial_pid__ : rec.etr_pid;
+	if (gettimeofday(&now, (struct timezone *)NULL) == 0) {
+		rec.etr_tstamp_sec = now.tv_sec;
+		rec.etr_tstamp_msec = now.tv_usec / 1000;
+	}
+	memcpy(rec.etr_binary_name, sb_log_state.sbl_binary_name,
+		sizeof(rec.etr_binary_name));
+	if (exec_name)
+		strncpy(rec.etr_exec_name, exec_name,
+			sizeof(rec.etr_exec_name) - 1);
+	if (sbox_active_exec_policy_name)
+		strncpy(rec.etr_exec_policy, sbox_active_exec_policy_name,
+			sizeof(rec.etr_exec_policy) - 1);
+
+	if ((fd = open_nomap_nolog(sb_log_state.sbl_exec_tracefile,
+			O_APPEND | O_WRONLY | O_CREAT,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP
+			| S_IROTH | S_IWOTH)) >= 0) {
+		int r; /* needed to get around some unnecessary warnings from gcc*/
+		r = write(fd, &rec, sizeof(rec));
+		(void)r;
+		close_nomap_nolog(fd);
+	}
+}
+
 /* ===================== public functions ===================== */
 
 int sblog_level_name_to_number(const char *level_str)
@@ -248,6 +329,14 @@ void sblog_init_level_logfile_format(const char *opt_level, const char *opt_logf
 			sb_loglevel__ = SB_LOGLEVEL_NONE;
 		}
 
+		filename = getenv("SBOX_EXEC_TRACEFILE");
+		if (filename && *filename)
+			snprintf(sb_log_state.sbl_exec_tracefile,
+				sizeof(sb_log_state.sbl_exec_tracefile),
+				"%s", filename);
+		else
+			sb_log_state.sbl_exec_tracefile[0] = '\0';
+
 		format_str = opt_format ? opt_format : getenv("SBOX_MAPPING_LOGFORMAT");
 		if (format_str) {
 			if (!strcmp(format_str,"simple")) {
@@ -273,9 +362,24 @@ void sblog_init_level_logfile_format(const char *opt_level, const char *opt_logf
 				sbox_mapping_method : "");
 
 		sb_log_initial_pid__ = getpid();
+
+		if (sb_log_state.sbl_exec_tracefile[0])
+			write_exec_trace_record(EXEC_TRACE_EVENT_START,
+				sbox_exec_name);
 	}
 }
 
+/* Record an exec to the binary exec trace, if it is active.
+ * This is the binary counterpart of the "EXEC: i_pid=" log line.
+*/
+void sblog_exec_trace(const char *file)
+{
+	if (sb_loglevel__ == SB_LOGLEVEL_uninitialized) sblog_init();
+
+	if (sb_log_state.sbl_exec_tracefile[0])
+		write_exec_trace_record(EXEC_TRACE_EVENT_EXEC, file);
+}
+
 void sblog_init(void)
 {
 	sblog_init_level_logfile_format(NULL,NULL,NULL);
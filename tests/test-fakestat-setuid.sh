@@ -0,0 +1,31 @@
+# Fakeroot: files created after setuid() are owned by the new uid
+set -e
+CODE=setuidtest
+uid=`id -u`
+gid=`id -g`
+cat > $CODE.c <<'EOF'
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int main(int argc, char **argv) {
+    struct stat st;
+    uid_t uid = atoi(argv[1]);
+    gid_t gid = atoi(argv[2]);
+    int fd;
+    if (setgid(gid) || setuid(uid)) return 1;
+    fd = open(argv[3], O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) return 1;
+    /* both while the file is open and after close() */
+    if (stat(argv[3], &st) || st.st_uid != uid || st.st_gid != gid) return 2;
+    close(fd);
+    if (stat(argv[3], &st) || st.st_uid != uid || st.st_gid != gid) return 3;
+    return 0;
+}
+EOF
+gcc $CODE.c -o $CODE
+fakeroot /bin/sh -s <<EOF
+./$CODE $uid $gid setuid-file
+[ \`stat -c%u setuid-file\` = $uid ]
+EOF
@@ -0,0 +1,65 @@
+# File descriptors work in a forked child of a threaded program
+set -e
+CODE=forkfdtest
+cat > $CODE.c <<'EOF'
+#include <pthread.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static volatile int stop = 0;
+
+/* opendir-like load: open a directory, then a file relative to it */
+static void *opener(void *data) {
+    int n = (int)(long)data;
+    while (!stop && n-- > 0) {
+        int dfd = open(".", O_RDONLY | O_DIRECTORY);
+        int fd;
+        if (dfd < 0) return (void *)1;
+        fd = openat(dfd, "forkfdtest.c", O_RDONLY);
+        if (fd < 0) return (void *)1;
+        close(fd);
+        close(dfd);
+    }
+    return NULL;
+}
+
+static int run_threads(int loops) {
+    pthread_t thd[4];
+    void *ret;
+    int i, failed = 0;
+    for (i = 0; i < 4; i++)
+        if (pthread_create(&thd[i], NULL, opener, (void *)(long)loops))
+            return 1;
+    for (i = 0; i < 4; i++) {
+        pthread_join(thd[i], &ret);
+        if (ret) failed = 1;
+    }
+    return failed;
+}
+
+int main() {
+    pthread_t thd[4];
+    int i, status, failed = 0;
+    for (i = 0; i < 4; i++)
+        pthread_create(&thd[i], NULL, opener, (void *)100000L);
+    for (i = 0; i < 4; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* thousands of closes; must not stall */
+            alarm(30);
+            _exit(run_threads(5000));
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+            !WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    }
+    stop = 1;
+    for (i = 0; i < 4; i++)
+        pthread_join(thd[i], NULL);
+    return failed;
+}
+EOF
+gcc $CODE.c -lpthread -o $CODE
+./$CODE
@@ -0,0 +1,23 @@
+# getcwd() returns a clean path after chdir() to an unclean one
+set -e
+CODE=getcwdtest
+cat > $CODE.c <<'EOF'
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    char buf[4096];
+    if (chdir(argv[1]) || !getcwd(buf, sizeof(buf))) return 1;
+    if (strcmp(buf, argv[2])) {
+        printf("chdir(%s): getcwd() = %s\n", argv[1], buf);
+        return 1;
+    }
+    return 0;
+}
+EOF
+gcc $CODE.c -o $CODE
+./$CODE /tmp/ /tmp
+./$CODE //tmp /tmp
+./$CODE /tmp//. /tmp
+./$CODE / /
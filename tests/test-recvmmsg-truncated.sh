@@ -0,0 +1,61 @@
+# recvmmsg() doesn't overflow a short source address buffer
+set -e
+CODE=recvmmsgtest
+cat > $CODE.c <<'EOF'
+#define _GNU_SOURCE
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NAMELEN (offsetof(struct sockaddr_un, sun_path) + 4)
+
+static struct {
+    char name[NAMELEN];
+    char canary[sizeof(struct sockaddr_un)];
+} names[2];
+
+int main() {
+    struct sockaddr_un rx = { AF_UNIX }, tx = { AF_UNIX };
+    struct mmsghdr msgs[2];
+    char buf[2][16];
+    struct iovec iov[2];
+    int r, s, i;
+
+    strcpy(rx.sun_path, "recvmmsg-rx");
+    strcpy(tx.sun_path, "recvmmsg-sender-with-a-long-name");
+    unlink(rx.sun_path);
+    unlink(tx.sun_path);
+    r = socket(AF_UNIX, SOCK_DGRAM, 0);
+    s = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (bind(r, (struct sockaddr *)&rx, sizeof(rx)) ||
+        bind(s, (struct sockaddr *)&tx, sizeof(tx)))
+        return 1;
+    for (i = 0; i < 2; i++)
+        if (sendto(s, "x", 1, 0, (struct sockaddr *)&rx, sizeof(rx)) != 1)
+            return 1;
+
+    memset(names, 0x55, sizeof(names));
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 2; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = sizeof(buf[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = names[i].name;
+        msgs[i].msg_hdr.msg_namelen = NAMELEN;
+    }
+    if (recvmmsg(r, msgs, 2, 0, NULL) != 2) return 1;
+    for (i = 0; i < 2; i++) {
+        size_t j;
+        for (j = 0; j < sizeof(names[i].canary); j++)
+            if (names[i].canary[j] != 0x55) return 2;
+    }
+    unlink(rx.sun_path);
+    unlink(tx.sun_path);
+    return 0;
+}
+EOF
+gcc $CODE.c -o $CODE
+./$CODE
@@ -441,6 +441,12 @@ static void dump_net_rules(ruletree_object_offset_t offs, int indent)
 		print_indent(indent + 1);
 		printf("address = '%s'\n",
 			offset_to_ruletree_string_ptr(rule->rtree_net_address, NULL));
+		if (rule->rtree_net_addr_kind != SB2_RULETREE_NET_ADDR_STRING) {
+			print_indent(indent + 1);
+			printf("address kind = %u, prefix length = %u\n",
+				rule->rtree_net_addr_kind,
+				rule->rtree_net_addr_prefix_len);
+		}
 	}
 	if (rule->rtree_net_port) {
 		print_indent(indent + 1);
@@ -629,6 +635,50 @@ static void print_ruletree_object_type(ruletree_object_offset_t obj_offs)
 		case SB2_RULETREE_OBJECT_TYPE_BINTREE:
 			printf("BINTREE");
 			break;
+		case SB2_RULETREE_OBJECT_TYPE_RULE_INDEX:
+			{
+				ruletree_rule_index_t *rip;
+
+				rip = (ruletree_rule_index_t*)hdr;
+				printf("RULE_INDEX: list @%u, nodes=%u refs=%u always=%u",
+					rip->rtree_ri_rule_list,
+					rip->rtree_ri_num_nodes,
+					rip->rtree_ri_num_refs,
+					rip->rtree_ri_always_count);
+			}
+			break;
+		case SB2_RULETREE_OBJECT_TYPE_IDENTITY_PREFIXES:
+			{
+				ruletree_identity_prefixes_t *ipsp;
+				ruletree_identity_prefix_t *ip;
+				uint32_t i;
+
+				ipsp = (ruletree_identity_prefixes_t*)hdr;
+				printf("IDENTITY_PREFIXES: list @%u, entries=%u",
+					ipsp->rtree_ips_rule_list,
+					ipsp->rtree_ips_num_entries);
+				ip = (ruletree_identity_prefix_t*)(ipsp + 1);
+				for (i = 0; i < ipsp->rtree_ips_num_entries; i++, ip++) {
+					const char *sel = offset_to_ruletree_string_ptr(
+						ip->rtree_ip_selector_offs, NULL);
+					printf("\n\t'%s' type=%u class=0x%X blocked=0x%X rule @%u",
+						(sel ? sel : ""), ip->rtree_ip_type,
+						ip->rtree_ip_func_class,
+						ip->rtree_ip_blocked_classes,
+						ip->rtree_ip_rule_offs);
+				}
+			}
+			break;
+		case SB2_RULETREE_OBJECT_TYPE_INODESTAT_FILTER:
+			{
+				ruletree_inodestat_filter_t *fp;
+
+				fp = (ruletree_inodestat_filter_t*)hdr;
+				printf("INODESTAT_FILTER: %u bits, %u keys",
+					fp->rtree_isf_num_words * 32,
+					fp->rtree_isf_num_keys);
+			}
+			break;
 		case SB2_RULETREE_OBJECT_TYPE_INODESTAT:
 			{
 				ruletree_inodestat_t *fsp;